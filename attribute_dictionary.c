@@ -0,0 +1,170 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include "attribute_dictionary.h"
+
+static uint32_t hash_value(const uint8_t *value, size_t length)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+    {
+        h ^= value[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// find the slot holding the value or the empty slot where it belongs
+static uint32_t *find_slot(const attribute_dictionary_t *dictionary, uint32_t *slots, unsigned int slot_count,
+                           const uint8_t *value, size_t length)
+{
+    unsigned int mask = slot_count - 1;
+    unsigned int i = hash_value(value, length) & mask;
+
+    while (slots[i] != 0)
+    {
+        const attribute_dictionary_entry_t *entry = &dictionary->entries[slots[i] - 1];
+        if (entry->length == length && memcmp(dictionary->data + entry->offset, value, length) == 0) break;
+
+        i = (i + 1) & mask;
+    }
+
+    return &slots[i];
+}
+
+static int rebuild_slots(attribute_dictionary_t *dictionary, unsigned int slot_count)
+{
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    for (unsigned int i = 0; i < dictionary->count; ++i)
+    {
+        const attribute_dictionary_entry_t *entry = &dictionary->entries[i];
+        *find_slot(dictionary, slots, slot_count, dictionary->data + entry->offset, entry->length) = i + 1;
+    }
+
+    free(dictionary->slots);
+    dictionary->slots = slots;
+    dictionary->slot_count = slot_count;
+
+    return HAL_OK;
+}
+
+void attribute_dictionary_init(attribute_dictionary_t *dictionary)
+{
+    memset(dictionary, 0, sizeof(attribute_dictionary_t));
+}
+
+void attribute_dictionary_free(attribute_dictionary_t *dictionary)
+{
+    if (dictionary == NULL) return;
+
+    free(dictionary->entries);
+    free(dictionary->data);
+    free(dictionary->slots);
+    attribute_dictionary_init(dictionary);
+}
+
+int attribute_dictionary_accepts(const hal_pkey_attribute_t *attribute)
+{
+    return attribute->length != HAL_PKEY_ATTRIBUTE_NIL &&
+           attribute->length <= ATTRIBUTE_DICTIONARY_MAX_VALUE;
+}
+
+int attribute_dictionary_add(attribute_dictionary_t *dictionary, const uint8_t *value, size_t length,
+                             uint32_t *id)
+{
+    if (dictionary == NULL || (value == NULL && length > 0) || id == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // keep the hash set at most half full
+    if ((dictionary->count + 1) * 2 > dictionary->slot_count)
+    {
+        unsigned int slot_count = (dictionary->slot_count == 0) ? 256 : dictionary->slot_count * 2;
+        if (rebuild_slots(dictionary, slot_count) != HAL_OK) return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    uint32_t *slot = find_slot(dictionary, dictionary->slots, dictionary->slot_count, value, length);
+    if (*slot != 0)
+    {
+        *id = *slot - 1;
+        return HAL_OK;
+    }
+
+    if (dictionary->count == dictionary->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (dictionary->capacity == 0) ? 64 : dictionary->capacity * 2;
+        attribute_dictionary_entry_t *new_entries = realloc(dictionary->entries,
+                                                            new_capacity * sizeof(attribute_dictionary_entry_t));
+        if (new_entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        dictionary->entries = new_entries;
+        dictionary->capacity = new_capacity;
+    }
+
+    if (dictionary->data_capacity - dictionary->data_len < length)
+    {
+        size_t new_capacity = (dictionary->data_capacity == 0) ? 4096 : dictionary->data_capacity * 2;
+        while (new_capacity - dictionary->data_len < length) new_capacity *= 2;
+
+        uint8_t *new_data = realloc(dictionary->data, new_capacity);
+        if (new_data == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        dictionary->data = new_data;
+        dictionary->data_capacity = new_capacity;
+    }
+
+    attribute_dictionary_entry_t *entry = &dictionary->entries[dictionary->count];
+    entry->offset = (uint32_t)dictionary->data_len;
+    entry->length = (uint32_t)length;
+
+    if (length > 0) memcpy(dictionary->data + dictionary->data_len, value, length);
+    dictionary->data_len += length;
+
+    *id = dictionary->count;
+    *slot = ++dictionary->count;
+
+    return HAL_OK;
+}
+
+const uint8_t *attribute_dictionary_get(const attribute_dictionary_t *dictionary, uint32_t id,
+                                        size_t *length)
+{
+    if (dictionary == NULL || id >= dictionary->count) return NULL;
+
+    *length = dictionary->entries[id].length;
+
+    // empty values still need a pointer
+    return (dictionary->data != NULL) ? dictionary->data + dictionary->entries[id].offset
+                                      : (const uint8_t *)"";
+}
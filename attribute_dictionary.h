@@ -0,0 +1,82 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ATTRIBUTE_DICTIONARY_H
+#define ATTRIBUTE_DICTIONARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hal.h>
+
+// Attribute values that many keys share, like CKA_EC_PARAMS, the public
+// exponent and the boolean flags, are stored once in a binary bundle and
+// referred to by their position in the dictionary. Values are kept in
+// one buffer and found again with an open-addressing hash set.
+#define ATTRIBUTE_DICTIONARY_MAX_VALUE 64
+
+typedef struct
+{
+    uint32_t offset;    // into data
+    uint32_t length;
+} attribute_dictionary_entry_t;
+
+typedef struct
+{
+    attribute_dictionary_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+
+    uint8_t *data;
+    size_t data_len;
+    size_t data_capacity;
+
+    // hash set slots hold an index into entries plus one. zero marks an empty slot
+    uint32_t *slots;
+    unsigned int slot_count;
+} attribute_dictionary_t;
+
+void attribute_dictionary_init(attribute_dictionary_t *dictionary);
+void attribute_dictionary_free(attribute_dictionary_t *dictionary);
+
+// the writer only puts short values in the dictionary. Longer ones, like
+// moduli, are rarely shared
+int attribute_dictionary_accepts(const hal_pkey_attribute_t *attribute);
+
+// get the id of the value, adding it if it's new
+int attribute_dictionary_add(attribute_dictionary_t *dictionary, const uint8_t *value, size_t length,
+                             uint32_t *id);
+
+// NULL if there's no value with the id. The value is only valid until the
+// next add
+const uint8_t *attribute_dictionary_get(const attribute_dictionary_t *dictionary, uint32_t id,
+                                        size_t *length);
+
+#endif
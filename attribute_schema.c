@@ -0,0 +1,181 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <string.h>
+
+#define CK_PTR                                          *
+#define CK_DEFINE_FUNCTION(returnType, name)            returnType name
+#define CK_DECLARE_FUNCTION(returnType, name)           returnType name
+#define CK_DECLARE_FUNCTION_POINTER(returnType, name)   returnType (* name)
+#define CK_CALLBACK_FUNCTION(returnType, name)          returnType (* name)
+#ifndef NULL_PTR
+#define NULL_PTR                                        NULL
+#endif
+
+#include "pkcs11t.h"
+
+#include "attribute_schema.h"
+
+typedef struct
+{
+    uint32_t type;
+    attribute_schema_type_t schema_type;
+} attribute_schema_entry_t;
+
+static const attribute_schema_entry_t attribute_schema[] =
+{
+    { CKA_CLASS,                        ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_TOKEN,                        ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_PRIVATE,                      ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_CERTIFICATE_TYPE,             ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_TRUSTED,                      ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_CERTIFICATE_CATEGORY,         ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_JAVA_MIDP_SECURITY_DOMAIN,    ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_KEY_TYPE,                     ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_SENSITIVE,                    ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_ENCRYPT,                      ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_DECRYPT,                      ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_WRAP,                         ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_UNWRAP,                       ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_SIGN,                         ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_SIGN_RECOVER,                 ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_VERIFY,                       ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_VERIFY_RECOVER,               ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_DERIVE,                       ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_MODULUS_BITS,                 ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_PRIME_BITS,                   ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_SUBPRIME_BITS,                ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_VALUE_BITS,                   ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_VALUE_LEN,                    ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_EXTRACTABLE,                  ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_LOCAL,                        ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_NEVER_EXTRACTABLE,            ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_ALWAYS_SENSITIVE,             ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_KEY_GEN_MECHANISM,            ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_MODIFIABLE,                   ATTRIBUTE_SCHEMA_BOOL },
+#ifdef CKA_COPYABLE
+    { CKA_COPYABLE,                     ATTRIBUTE_SCHEMA_BOOL },
+#endif
+#ifdef CKA_DESTROYABLE
+    { CKA_DESTROYABLE,                  ATTRIBUTE_SCHEMA_BOOL },
+#endif
+    { CKA_ALWAYS_AUTHENTICATE,          ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_WRAP_WITH_TRUSTED,            ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_HW_FEATURE_TYPE,              ATTRIBUTE_SCHEMA_ULONG },
+    { CKA_RESET_ON_INIT,                ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_HAS_RESET,                    ATTRIBUTE_SCHEMA_BOOL },
+    { CKA_MECHANISM_TYPE,               ATTRIBUTE_SCHEMA_ULONG },
+};
+
+attribute_schema_type_t attribute_schema_type(uint32_t type)
+{
+    // short enough that a search isn't worth sorting it
+    for (unsigned i = 0; i < sizeof(attribute_schema)/sizeof(attribute_schema_entry_t); ++i)
+    {
+        if (attribute_schema[i].type == type) return attribute_schema[i].schema_type;
+    }
+
+    return ATTRIBUTE_SCHEMA_BYTES;
+}
+
+int attribute_schema_to_number(const hal_pkey_attribute_t *attribute, uint64_t *number)
+{
+    if (attribute->length == HAL_PKEY_ATTRIBUTE_NIL) return 0;
+
+    switch (attribute_schema_type(attribute->type))
+    {
+        case ATTRIBUTE_SCHEMA_BOOL:
+            // anything but 0 or 1 keeps its exact byte, which a number can't
+            if (attribute->length != sizeof(CK_BBOOL) || attribute->value[0] > 1) return 0;
+
+            *number = attribute->value[0];
+            return 1;
+
+        case ATTRIBUTE_SCHEMA_ULONG:
+            // the device may have been set up from a machine with a different CK_ULONG
+            if (attribute->length == sizeof(uint32_t))
+            {
+                uint32_t value;
+                memcpy(&value, attribute->value, sizeof(value));
+                *number = value;
+                return 1;
+            }
+            else if (attribute->length == sizeof(uint64_t))
+            {
+                uint64_t value;
+                memcpy(&value, attribute->value, sizeof(value));
+                *number = value;
+                return 1;
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+int attribute_schema_from_number(dks_arena_t *arena, uint32_t type, uint64_t number,
+                                 hal_pkey_attribute_t *attribute)
+{
+    attribute->type = type;
+
+    switch (attribute_schema_type(type))
+    {
+        case ATTRIBUTE_SCHEMA_BOOL:
+        {
+            if (number > 1) return HAL_ERROR_BAD_ARGUMENTS;
+
+            CK_BBOOL *value = dks_arena_alloc(arena, sizeof(CK_BBOOL));
+            if (value == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+            *value = (CK_BBOOL)number;
+            attribute->value = (const uint8_t *)value;
+            attribute->length = sizeof(CK_BBOOL);
+            return HAL_OK;
+        }
+
+        case ATTRIBUTE_SCHEMA_ULONG:
+        {
+            if (number > (CK_ULONG)-1) return HAL_ERROR_BAD_ARGUMENTS;
+
+            CK_ULONG *value = dks_arena_alloc(arena, sizeof(CK_ULONG));
+            if (value == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+            *value = (CK_ULONG)number;
+            attribute->value = (const uint8_t *)value;
+            attribute->length = sizeof(CK_ULONG);
+            return HAL_OK;
+        }
+
+        default:
+            // byte strings aren't written as numbers
+            return HAL_ERROR_BAD_ARGUMENTS;
+    }
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ATTRIBUTE_SCHEMA_H
+#define ATTRIBUTE_SCHEMA_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+#include "dks_arena.h"
+
+// The PKCS #11 types of the attributes that export bundles write as
+// numbers. Everything else is a byte string. Attribute values are stored
+// on the device the way the PKCS #11 library passed them, so a CK_ULONG is
+// as big as it is on the machine that set it. Bundles hold the number
+// instead, and import turns it back into this machine's CK_ULONG.
+typedef enum
+{
+    ATTRIBUTE_SCHEMA_BYTES = 0,
+    ATTRIBUTE_SCHEMA_BOOL = 1,      // CK_BBOOL
+    ATTRIBUTE_SCHEMA_ULONG = 2      // CK_ULONG
+} attribute_schema_type_t;
+
+attribute_schema_type_t attribute_schema_type(uint32_t type);
+
+// returns 1 and sets number if the attribute is a bool or ulong that has
+// the size of one, and a bool is 0 or 1. Otherwise it's written as bytes
+int attribute_schema_to_number(const hal_pkey_attribute_t *attribute, uint64_t *number);
+
+// set the value of a bool or ulong attribute. The value comes from the arena
+int attribute_schema_from_number(dks_arena_t *arena, uint32_t type, uint64_t number,
+                                 hal_pkey_attribute_t *attribute);
+
+#endif
@@ -0,0 +1,639 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "djson.h"
+
+#include "backup_store.h"
+#include "bundle_reader.h"
+#include "cryptech_device.h"
+
+#define dks_json_throw(a) { rval = a; goto finished; }
+
+#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+
+// Internal Functions ---------------------------------------------------
+static int compare_refs(const void *a, const void *b)
+{
+    return memcmp(&((const backup_store_ref_t *)a)->uuid,
+                  &((const backup_store_ref_t *)b)->uuid,
+                  sizeof(hal_uuid_t));
+}
+
+static int compare_attributes(const void *a, const void *b)
+{
+    uint32_t type_a = (*(const hal_pkey_attribute_t * const *)a)->type;
+    uint32_t type_b = (*(const hal_pkey_attribute_t * const *)b)->type;
+
+    return (type_a > type_b) - (type_a < type_b);
+}
+
+static uint8_t *put_tlv(uint8_t *p, uint32_t tag, uint32_t length, const void *value)
+{
+    uint32_t le_tag = htole32(tag);
+    uint32_t le_length = htole32(length);
+
+    memcpy(p, &le_tag, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &le_length, sizeof(uint32_t));
+    p += sizeof(bundle_tlv_t);
+
+    if (value != NULL) memcpy(p, value, length);
+
+    return p + ((value != NULL) ? length : 0);
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(p, &value, sizeof(value));
+
+    return p + sizeof(value);
+}
+
+// The canonical encoding of a key record. The same key always encodes to the
+// same bytes, whatever order the device returned its attributes in.
+// Attributes are stored as they are, without the typed numbers and the
+// dictionary of a binary bundle, so an object can be decoded on its own
+static int encode_record(const bundle_record_t *record, uint8_t **data, size_t *data_len)
+{
+    const hal_pkey_attribute_t **attributes = NULL;
+
+    size_t len = sizeof(bundle_tlv_t) + sizeof(hal_uuid_t) +
+                 sizeof(bundle_tlv_t) + sizeof(uint32_t) +
+                 sizeof(bundle_tlv_t) + sizeof(uint32_t);
+
+    if (record->has_fingerprint) len += sizeof(bundle_tlv_t) + KEY_FINGERPRINT_LEN;
+    if (record->pkcs8 != NULL) len += sizeof(bundle_tlv_t) + record->pkcs8_len;
+    if (record->kek != NULL) len += sizeof(bundle_tlv_t) + record->kek_len;
+    if (record->spki != NULL) len += sizeof(bundle_tlv_t) + record->spki_len;
+
+    if (record->attributes_len > 0)
+    {
+        attributes = malloc(record->attributes_len * sizeof(hal_pkey_attribute_t *));
+        if (attributes == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        attributes[i] = &record->attributes[i];
+
+        len += sizeof(bundle_tlv_t) + sizeof(uint32_t);
+        if (record->attributes[i].length != HAL_PKEY_ATTRIBUTE_NIL) len += record->attributes[i].length;
+    }
+
+    if (record->attributes_len > 0)
+    {
+        qsort(attributes, record->attributes_len, sizeof(hal_pkey_attribute_t *), compare_attributes);
+    }
+
+    uint8_t *p = malloc(len);
+    if (p == NULL)
+    {
+        free(attributes);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+    *data = p;
+    *data_len = len;
+
+    p = put_tlv(p, BUNDLE_FIELD_UUID, sizeof(hal_uuid_t), &record->uuid);
+    p = put_u32(put_tlv(p, BUNDLE_FIELD_KEY_TYPE, sizeof(uint32_t), NULL), record->key_type);
+    p = put_u32(put_tlv(p, BUNDLE_FIELD_FLAGS, sizeof(uint32_t), NULL), record->flags);
+
+    if (record->has_fingerprint) p = put_tlv(p, BUNDLE_FIELD_FINGERPRINT, KEY_FINGERPRINT_LEN, record->fingerprint);
+    if (record->pkcs8 != NULL) p = put_tlv(p, BUNDLE_FIELD_PKCS8, record->pkcs8_len, record->pkcs8);
+    if (record->kek != NULL) p = put_tlv(p, BUNDLE_FIELD_KEK, record->kek_len, record->kek);
+    if (record->spki != NULL) p = put_tlv(p, BUNDLE_FIELD_SPKI, record->spki_len, record->spki);
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        const hal_pkey_attribute_t *attr = attributes[i];
+
+        if (attr->length == HAL_PKEY_ATTRIBUTE_NIL)
+        {
+            p = put_u32(put_tlv(p, BUNDLE_FIELD_ATTRIBUTE_NIL, sizeof(uint32_t), NULL), attr->type);
+        }
+        else
+        {
+            p = put_u32(put_tlv(p, BUNDLE_FIELD_ATTRIBUTE, sizeof(uint32_t) + attr->length, NULL), attr->type);
+            if (attr->length > 0) memcpy(p, attr->value, attr->length);
+            p += attr->length;
+        }
+    }
+
+    free(attributes);
+
+    return HAL_OK;
+}
+
+// objects/ab/cdef...
+static char *object_path(const char *store, const uint8_t *object, char *buffer, size_t buffer_len)
+{
+    char name[KEY_FINGERPRINT_STRING_LEN];
+    fingerprint_to_string(object, name);
+
+    int len = snprintf(buffer, buffer_len, "%s/%s/%.2s/%s", store, BACKUP_STORE_OBJECTS, name, &name[2]);
+    if (len < 0 || (size_t)len >= buffer_len) return NULL;
+
+    return buffer;
+}
+
+static int make_folder(const char *path)
+{
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return HAL_ERROR_IO_OS_ERROR;
+
+    return HAL_OK;
+}
+
+static int parse_ref(backup_store_run_t *run, diamond_json_ptr_t *json_ptr)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    int has_uuid = 0;
+    int has_object = 0;
+
+    hal_uuid_t uuid;
+    uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+    uint8_t object[BACKUP_STORE_DIGEST_LEN];
+    int has_fingerprint = 0;
+
+    diamond_json_type_t json_type;
+    dks_json_check(djson_goto_next_element(json_ptr));
+    dks_json_check(djson_get_type_current(json_ptr, &json_type));
+
+    while (json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *name, *value;
+        dks_json_check(djson_get_name_current(json_ptr, &name));
+
+        if (json_type != DJSON_TYPE_String) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        dks_json_check(djson_get_string_value_current(json_ptr, &value));
+
+        if (strcmp(name, "uuid") == 0)
+        {
+            uuid = string_to_uuid(value);
+            has_uuid = 1;
+        }
+        else if (strcmp(name, "fingerprint") == 0)
+        {
+            has_fingerprint = string_to_fingerprint(value, fingerprint);
+        }
+        else if (strcmp(name, "object") == 0)
+        {
+            has_object = string_to_fingerprint(value, object);
+        }
+        else if (strcmp(name, "comment") != 0)
+        {
+            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+
+        dks_json_check(djson_pass(json_ptr));
+
+        dks_json_check(djson_get_type_current(json_ptr, &json_type));
+    }
+
+    if (!has_uuid || !has_object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+    rval = backup_store_run_add(run, &uuid, has_fingerprint ? fingerprint : NULL, object);
+
+finished:
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+void backup_store_run_init(backup_store_run_t *run)
+{
+    memset(run, 0, sizeof(backup_store_run_t));
+}
+
+void backup_store_run_free(backup_store_run_t *run)
+{
+    if (run == NULL) return;
+
+    free(run->refs);
+    backup_store_run_init(run);
+}
+
+int backup_store_run_add(backup_store_run_t *run, const hal_uuid_t *uuid, const uint8_t *fingerprint,
+                         const uint8_t *object)
+{
+    if (run == NULL || uuid == NULL || object == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (run->count == run->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (run->capacity == 0) ? 64 : run->capacity * 2;
+        backup_store_ref_t *new_refs = realloc(run->refs, new_capacity * sizeof(backup_store_ref_t));
+        if (new_refs == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        run->refs = new_refs;
+        run->capacity = new_capacity;
+    }
+
+    backup_store_ref_t *ref = &run->refs[run->count++];
+    memset(ref, 0, sizeof(backup_store_ref_t));
+    memcpy(&ref->uuid, uuid, sizeof(hal_uuid_t));
+    memcpy(ref->object, object, BACKUP_STORE_DIGEST_LEN);
+
+    if (fingerprint != NULL)
+    {
+        memcpy(ref->fingerprint, fingerprint, KEY_FINGERPRINT_LEN);
+        ref->has_fingerprint = 1;
+    }
+
+    return HAL_OK;
+}
+
+int backup_store_run_save(const backup_store_run_t *run, FILE *fp)
+{
+    if (run == NULL || fp == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char uuid_buffer[40];
+    char fingerprint_buffer[KEY_FINGERPRINT_STRING_LEN];
+    char object_buffer[KEY_FINGERPRINT_STRING_LEN];
+
+    fprintf(fp, "{\r\n    \"store_run\": 1,\r\n");
+    fprintf(fp, "    \"comment\": \"Diamond Key Security backup store run. The keys are in the store's objects folder.\",\r\n");
+    fprintf(fp, "    \"kekek_uuid\": \"%s\",\r\n", uuid_to_string(run->kekek_uuid, uuid_buffer));
+    fprintf(fp, "    \"keys\": [");
+
+    for (unsigned int i = 0; i < run->count; ++i)
+    {
+        const backup_store_ref_t *ref = &run->refs[i];
+
+        fprintf(fp, "%s\r\n        { \"uuid\": \"%s\", ", (i > 0) ? "," : "", uuid_to_string(ref->uuid, uuid_buffer));
+        if (ref->has_fingerprint)
+        {
+            fprintf(fp, "\"fingerprint\": \"%s\", ", fingerprint_to_string(ref->fingerprint, fingerprint_buffer));
+        }
+        fprintf(fp, "\"object\": \"%s\" }", fingerprint_to_string(ref->object, object_buffer));
+    }
+
+    fprintf(fp, "\r\n    ]\r\n}\r\n");
+
+    return ferror(fp) ? HAL_ERROR_IO_OS_ERROR : HAL_OK;
+}
+
+int backup_store_run_is_manifest(const char *path)
+{
+    char start[64];
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    size_t len = fread(start, 1, sizeof(start) - 1, fp);
+    fclose(fp);
+
+    start[len] = 0;
+    return start[0] == '{' && strstr(start, "\"store_run\"") != NULL;
+}
+
+int backup_store_run_load(const char *path, backup_store_run_t *run)
+{
+    if (path == NULL || run == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    backup_store_run_init(run);
+
+    if (!backup_store_run_is_manifest(path)) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char *json = djson_loadfile(path);
+    if (json == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+
+    char kekek_uuid_buffer[40], *json_search_ptr = json;
+    char *kekek_uuid_s = djson_find_element("kekek_uuid", kekek_uuid_buffer, 40, &json_search_ptr);
+    if (kekek_uuid_s == NULL) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    run->kekek_uuid = string_to_uuid(kekek_uuid_s);
+
+    dks_json_check(djson_start_parser(json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    dks_json_check(djson_parse_until(&json_ptr, "keys", DJSON_TYPE_Array));
+
+    while (1)
+    {
+        diamond_json_type_t json_type;
+        dks_json_check(djson_goto_next_element(&json_ptr));
+        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+
+        if (json_type == DJSON_TYPE_ArrayEnd) break;
+        if (json_type != DJSON_TYPE_Object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+        rval = parse_ref(run, &json_ptr);
+        if (rval != HAL_OK) goto finished;
+    }
+
+    qsort(run->refs, run->count, sizeof(backup_store_ref_t), compare_refs);
+
+finished:
+    free(json);
+    if (rval != HAL_OK) backup_store_run_free(run);
+
+    return rval;
+}
+
+const backup_store_ref_t *backup_store_run_find(const backup_store_run_t *run, const hal_uuid_t *uuid)
+{
+    if (run == NULL || uuid == NULL || run->count == 0) return NULL;
+
+    backup_store_ref_t key;
+    memcpy(&key.uuid, uuid, sizeof(hal_uuid_t));
+
+    return bsearch(&key, run->refs, run->count, sizeof(backup_store_ref_t), compare_refs);
+}
+
+char *backup_store_of_run(const char *run_path, char *buffer, size_t buffer_len)
+{
+    const char *folder_end = strrchr(run_path, '/');
+    int len;
+
+    if (folder_end == NULL) len = snprintf(buffer, buffer_len, "..");
+    else len = snprintf(buffer, buffer_len, "%.*s/..", (int)(folder_end - run_path), run_path);
+
+    if (len < 0 || (size_t)len >= buffer_len) return NULL;
+
+    return buffer;
+}
+
+int backup_store_create(const char *store)
+{
+    if (store == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char path[4096];
+    int rval;
+
+    if ((rval = make_folder(store)) != HAL_OK) return rval;
+
+    snprintf(path, sizeof(path), "%s/%s", store, BACKUP_STORE_OBJECTS);
+    if ((rval = make_folder(path)) != HAL_OK) return rval;
+
+    snprintf(path, sizeof(path), "%s/%s", store, BACKUP_STORE_RUNS);
+    return make_folder(path);
+}
+
+int backup_store_new_run_path(const char *store, char *buffer, size_t buffer_len)
+{
+    if (store == NULL || buffer == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char name[32];
+    time_t now = time(NULL);
+    strftime(name, sizeof(name), "%Y%m%dT%H%M%SZ", gmtime(&now));
+
+    // names sort by time. A second run in the same second gets a suffix
+    for (unsigned i = 0; i < 100; ++i)
+    {
+        int len = (i == 0) ? snprintf(buffer, buffer_len, "%s/%s/%s.json", store, BACKUP_STORE_RUNS, name)
+                           : snprintf(buffer, buffer_len, "%s/%s/%s-%02u.json", store, BACKUP_STORE_RUNS, name, i);
+        if (len < 0 || (size_t)len >= buffer_len) return HAL_ERROR_RESULT_TOO_LONG;
+
+        if (access(buffer, F_OK) != 0) return HAL_OK;
+    }
+
+    return HAL_ERROR_IO_OS_ERROR;
+}
+
+int backup_store_latest_run(const char *store, char *buffer, size_t buffer_len)
+{
+    if (store == NULL || buffer == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", store, BACKUP_STORE_RUNS);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) return HAL_ERROR_KEY_NOT_FOUND;
+
+    char latest[256];
+    latest[0] = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || len >= sizeof(latest) || strcmp(&entry->d_name[len - 5], ".json") != 0) continue;
+
+        if (strcmp(entry->d_name, latest) > 0) strcpy(latest, entry->d_name);
+    }
+    closedir(dir);
+
+    if (latest[0] == 0) return HAL_ERROR_KEY_NOT_FOUND;
+
+    int len = snprintf(buffer, buffer_len, "%s/%s", path, latest);
+    if (len < 0 || (size_t)len >= buffer_len) return HAL_ERROR_RESULT_TOO_LONG;
+
+    return HAL_OK;
+}
+
+int backup_store_put(const char *store, const bundle_record_t *record, uint8_t *object, int *written)
+{
+    if (store == NULL || record == NULL || object == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int dummy;
+    if (written == NULL) written = &dummy;
+    *written = 0;
+
+    uint8_t *data;
+    size_t data_len;
+    int rval = encode_record(record, &data, &data_len);
+    if (rval != HAL_OK) return rval;
+
+    SHA256(data, data_len, object);
+
+    char path[4096];
+    char temp_path[4096 + 8];
+    if (object_path(store, object, path, sizeof(path)) == NULL)
+    {
+        free(data);
+        return HAL_ERROR_RESULT_TOO_LONG;
+    }
+
+    // the same record has already been saved
+    if (access(path, F_OK) == 0)
+    {
+        free(data);
+        return HAL_OK;
+    }
+
+    // objects/ab
+    char *name = strrchr(path, '/');
+    *name = 0;
+    rval = make_folder(path);
+    *name = '/';
+
+    // write the object under a temporary name so a partial object is never seen
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *fp = (rval == HAL_OK) ? fopen(temp_path, "wb") : NULL;
+    if (fp == NULL)
+    {
+        free(data);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    if (fwrite(data, 1, data_len, fp) != data_len) rval = HAL_ERROR_IO_OS_ERROR;
+    if (fclose(fp) != 0) rval = HAL_ERROR_IO_OS_ERROR;
+
+    if (rval == HAL_OK && rename(temp_path, path) != 0) rval = HAL_ERROR_IO_OS_ERROR;
+    if (rval != HAL_OK) unlink(temp_path);
+
+    free(data);
+
+    if (rval == HAL_OK) *written = 1;
+
+    return rval;
+}
+
+int backup_store_get(const char *store, const uint8_t *object, dks_arena_t *arena, bundle_record_t *record)
+{
+    if (store == NULL || object == NULL || arena == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char path[4096];
+    if (object_path(store, object, path, sizeof(path)) == NULL) return HAL_ERROR_RESULT_TOO_LONG;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return HAL_ERROR_KEY_NOT_FOUND;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size <= 0 || st.st_size > UINT32_MAX)
+    {
+        fclose(fp);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    uint8_t *data = dks_arena_alloc(arena, st.st_size);
+    if (data == NULL)
+    {
+        fclose(fp);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    size_t read = fread(data, 1, st.st_size, fp);
+    fclose(fp);
+    if (read != (size_t)st.st_size) return HAL_ERROR_IO_OS_ERROR;
+
+    // the name is the digest of the contents
+    uint8_t digest[BACKUP_STORE_DIGEST_LEN];
+    SHA256(data, read, digest);
+    if (memcmp(digest, object, BACKUP_STORE_DIGEST_LEN) != 0) return HAL_ERROR_KEYSTORE_BAD_CRC;
+
+    return bundle_record_decode(arena, data, (uint32_t)read, record);
+}
+
+int backup_store_writer_start(backup_store_writer_t *writer, const char *store, const char *previous_run,
+                              const hal_uuid_t *kekek_uuid)
+{
+    if (writer == NULL || store == NULL || kekek_uuid == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(writer, 0, sizeof(backup_store_writer_t));
+    writer->store = store;
+    backup_store_run_init(&writer->previous);
+    backup_store_run_init(&writer->run);
+    writer->run.kekek_uuid = *kekek_uuid;
+
+    int rval = backup_store_create(store);
+    if (rval != HAL_OK || previous_run == NULL) return rval;
+
+    if ((rval = backup_store_run_load(previous_run, &writer->previous)) != HAL_OK) return rval;
+
+    // the objects of the previous run can only be used with the same KEKEK
+    if (memcmp(&writer->previous.kekek_uuid, kekek_uuid, sizeof(hal_uuid_t)) != 0)
+    {
+        cryptech_report("\r\nThe previous run used a different KEKEK.\r\n");
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    return HAL_OK;
+}
+
+int backup_store_writer_add(backup_store_writer_t *writer, const bundle_record_t *record)
+{
+    if (writer == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    uint8_t object[BACKUP_STORE_DIGEST_LEN];
+    int written;
+    int rval;
+
+    switch (record->type)
+    {
+        case BUNDLE_RECORD_KEY:
+            if ((rval = backup_store_put(writer->store, record, object, &written)) != HAL_OK) return rval;
+            if (written) ++writer->objects_written;
+
+            return backup_store_run_add(&writer->run, &record->uuid,
+                                        record->has_fingerprint ? record->fingerprint : NULL, object);
+
+        case BUNDLE_RECORD_UNCHANGED:
+        {
+            const backup_store_ref_t *ref = backup_store_run_find(&writer->previous, &record->uuid);
+            if (ref == NULL) return HAL_ERROR_KEY_NOT_FOUND;
+
+            return backup_store_run_add(&writer->run, &ref->uuid, ref->has_fingerprint ? ref->fingerprint : NULL,
+                                        ref->object);
+        }
+
+        default:
+            // a run lists every key, so removed keys are simply left out
+            return HAL_OK;
+    }
+}
+
+int backup_store_writer_finish(backup_store_writer_t *writer, FILE *fp)
+{
+    if (writer == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int rval = backup_store_run_save(&writer->run, fp);
+
+    if (rval == HAL_OK)
+    {
+        cryptech_report("%u keys in the run, %u new objects written to '%s'.\r\n",
+                        writer->run.count, writer->objects_written, writer->store);
+    }
+
+    return rval;
+}
+
+void backup_store_writer_free(backup_store_writer_t *writer)
+{
+    if (writer == NULL) return;
+
+    backup_store_run_free(&writer->previous);
+    backup_store_run_free(&writer->run);
+}
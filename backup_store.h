@@ -0,0 +1,126 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef BACKUP_STORE_H
+#define BACKUP_STORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <hal.h>
+
+#include "bundle.h"
+#include "dks_arena.h"
+#include "key_fingerprint.h"
+
+// A backup store keeps many exports of the same device in one folder. Every
+// key record is written once to objects/ab/cdef..., named by the SHA-256
+// digest of its canonical encoding: the fields of a binary key record in a
+// fixed order with the attributes sorted by type. Each export adds a small
+// run manifest to runs/ that refers to the objects of its keys:
+//
+// { "store_run": 1, "comment": "...", "kekek_uuid": "...",
+//   "keys": [ { "uuid": "...", "fingerprint": "...", "object": "..." }, ... ] }
+//
+// Keys that haven't changed since the last run are not exported again. Their
+// objects are taken from the last run, so a run of a stable keystore only
+// writes its manifest.
+#define BACKUP_STORE_DIGEST_LEN     32
+#define BACKUP_STORE_OBJECTS        "objects"
+#define BACKUP_STORE_RUNS           "runs"
+
+typedef struct
+{
+    hal_uuid_t uuid;
+    int has_fingerprint;
+    uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+    uint8_t object[BACKUP_STORE_DIGEST_LEN];
+} backup_store_ref_t;
+
+typedef struct
+{
+    hal_uuid_t kekek_uuid;
+    backup_store_ref_t *refs;
+    unsigned int count;
+    unsigned int capacity;
+} backup_store_run_t;
+
+void backup_store_run_init(backup_store_run_t *run);
+void backup_store_run_free(backup_store_run_t *run);
+
+int backup_store_run_add(backup_store_run_t *run, const hal_uuid_t *uuid, const uint8_t *fingerprint,
+                         const uint8_t *object);
+int backup_store_run_save(const backup_store_run_t *run, FILE *fp);
+
+// the refs of a loaded run are sorted by UUID
+int backup_store_run_load(const char *path, backup_store_run_t *run);
+int backup_store_run_is_manifest(const char *path);
+const backup_store_ref_t *backup_store_run_find(const backup_store_run_t *run, const hal_uuid_t *uuid);
+
+// the store of a run manifest is the folder above the manifest's folder
+char *backup_store_of_run(const char *run_path, char *buffer, size_t buffer_len);
+
+// create the store's folders if they don't exist
+int backup_store_create(const char *store);
+
+// the path for a new run manifest, named after the current time
+int backup_store_new_run_path(const char *store, char *buffer, size_t buffer_len);
+
+// the newest run manifest. HAL_ERROR_KEY_NOT_FOUND when the store is empty
+int backup_store_latest_run(const char *store, char *buffer, size_t buffer_len);
+
+// write a key record to the store unless it's already there. *written
+// says which happened
+int backup_store_put(const char *store, const bundle_record_t *record, uint8_t *object, int *written);
+
+// read a key record after checking it against its name. The record points
+// into memory from the arena
+int backup_store_get(const char *store, const uint8_t *object, dks_arena_t *arena, bundle_record_t *record);
+
+// Adds the records of an export to a store. Key records are written as
+// objects. Unchanged keys refer to the object from the previous run
+typedef struct
+{
+    const char *store;
+    backup_store_run_t previous;
+    backup_store_run_t run;
+    unsigned int objects_written;
+} backup_store_writer_t;
+
+// previous_run is NULL for the first run
+int backup_store_writer_start(backup_store_writer_t *writer, const char *store, const char *previous_run,
+                              const hal_uuid_t *kekek_uuid);
+int backup_store_writer_add(backup_store_writer_t *writer, const bundle_record_t *record);
+
+// write the run manifest to fp
+int backup_store_writer_finish(backup_store_writer_t *writer, FILE *fp);
+void backup_store_writer_free(backup_store_writer_t *writer);
+
+#endif
@@ -0,0 +1,164 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <hal.h>
+
+#include "key_fingerprint.h"
+
+// An export bundle holds the KEKEK that the keys were wrapped with and one
+// record per key. It's either the JSON format used by CrypTech's
+// cryptech_backup, or a binary format that holds the same information
+// without base64 and can be read in place through mmap.
+typedef enum
+{
+    BUNDLE_FORMAT_JSON = 0,
+    BUNDLE_FORMAT_BINARY = 1
+} bundle_format_t;
+
+// Binary format ---------------------------------------------------------
+// The file starts with a bundle_file_header_t. It's followed by records
+// that each start with a bundle_tlv_t, and ends with an index record and a
+// bundle_file_footer_t that points to it. A key record's value is itself
+// a list of TLV fields. Integers are little endian.
+#define BUNDLE_MAGIC                "DKSBNDL1"
+#define BUNDLE_INDEX_MAGIC          "DKSBIDX1"
+#define BUNDLE_VERSION              3   // 2 added the attribute dictionary, 3 typed attributes
+
+// bundle_file_header_t flags
+#define BUNDLE_FLAG_INCREMENTAL     0x00000001
+
+// records
+#define BUNDLE_TAG_DEVICE_INDEX     0x0001
+#define BUNDLE_TAG_KEKEK_PUBKEY     0x0002
+#define BUNDLE_TAG_KEKEK_SALT       0x0003  // a software KEKEK. See soft_kekek.h
+#define BUNDLE_TAG_KEKEK_PKCS8      0x0004
+#define BUNDLE_TAG_KEY              0x0010
+#define BUNDLE_TAG_UNCHANGED        0x0011
+#define BUNDLE_TAG_REMOVED          0x0012
+#define BUNDLE_TAG_DICTIONARY       0x0013  // uint32_t count, then a uint32_t length and value for each
+#define BUNDLE_TAG_INDEX            0x0020
+
+// fields in a key record
+#define BUNDLE_FIELD_UUID           0x0001
+#define BUNDLE_FIELD_FLAGS          0x0002
+#define BUNDLE_FIELD_FINGERPRINT    0x0003
+#define BUNDLE_FIELD_PKCS8          0x0004
+#define BUNDLE_FIELD_KEK            0x0005
+#define BUNDLE_FIELD_SPKI           0x0006
+#define BUNDLE_FIELD_ATTRIBUTE      0x0007  // uint32_t type followed by the value
+#define BUNDLE_FIELD_ATTRIBUTE_NIL  0x0008  // uint32_t type of an attribute to delete
+#define BUNDLE_FIELD_KEY_TYPE       0x0009
+#define BUNDLE_FIELD_ATTRIBUTE_REF  0x000A  // uint32_t type followed by the uint32_t dictionary id
+#define BUNDLE_FIELD_ATTRIBUTE_BOOL 0x000B  // uint32_t type followed by a uint8_t 0 or 1
+#define BUNDLE_FIELD_ATTRIBUTE_ULONG 0x000C // uint32_t type followed by a uint64_t
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_len;
+    uint32_t flags;
+    hal_uuid_t kekek_uuid;
+} bundle_file_header_t;
+
+typedef struct
+{
+    uint32_t tag;
+    uint32_t length;
+} bundle_tlv_t;
+
+typedef struct
+{
+    hal_uuid_t uuid;
+    uint64_t offset;    // offset of the key record's bundle_tlv_t
+    uint32_t length;    // length of the record including the bundle_tlv_t
+    uint32_t reserved;
+} bundle_index_entry_t;
+
+typedef struct
+{
+    uint64_t index_offset;
+    char magic[8];
+} bundle_file_footer_t;
+
+// Common ----------------------------------------------------------------
+#define BUNDLE_MAX_ATTRIBUTES       128
+
+typedef struct
+{
+    hal_uuid_t kekek_uuid;
+    int device_index;
+    int incremental;    // the bundle lists the unchanged and removed keys
+    const uint8_t *kekek_pubkey;
+    size_t kekek_pubkey_len;
+
+    // a software KEKEK has its encrypted private key in the bundle, and no
+    // kekek_uuid. NULL when the KEKEK is on an HSM
+    const uint8_t *kekek_salt;
+    size_t kekek_salt_len;
+    const uint8_t *kekek_pkcs8;
+    size_t kekek_pkcs8_len;
+} bundle_header_t;
+
+typedef enum
+{
+    BUNDLE_RECORD_KEY = 0,          // an exported key
+    BUNDLE_RECORD_UNCHANGED = 1,    // a key that an incremental export skipped
+    BUNDLE_RECORD_REMOVED = 2       // a key that's no longer on the device
+} bundle_record_type_t;
+
+typedef struct
+{
+    bundle_record_type_t type;
+    hal_uuid_t uuid;
+    hal_key_type_t key_type;    // HAL_KEY_TYPE_NONE when the bundle doesn't say
+    hal_key_flags_t flags;
+    int has_fingerprint;
+    uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+
+    // private keys have pkcs8 and kek. public keys have spki
+    const uint8_t *pkcs8;
+    size_t pkcs8_len;
+    const uint8_t *kek;
+    size_t kek_len;
+    const uint8_t *spki;
+    size_t spki_len;
+
+    hal_pkey_attribute_t *attributes;
+    unsigned attributes_len;
+} bundle_record_t;
+
+#endif
@@ -0,0 +1,1246 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libs/base64.c/base64.h"
+#include "djson.h"
+
+#include "attribute_dictionary.h"
+#include "attribute_schema.h"
+#include "bundle_reader.h"
+#include "cryptech_device.h"
+#include "dks_arena.h"
+#include "key_index.h"
+
+#define dks_json_throw(a) { rval = a; goto finished; }
+
+#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+
+struct bundle_reader
+{
+    bundle_format_t format;
+    bundle_header_t header;
+
+    // memory for the current record
+    dks_arena_t arena;
+
+    // shared attribute values. Loaded when the bundle is opened
+    attribute_dictionary_t dictionary;
+
+    // the file as it is on disk. Records are read from here in binary bundles
+    uint8_t *map;
+    size_t map_len;
+    size_t records_start;
+    size_t records_end;
+    size_t pos;
+
+    // binary
+    const uint8_t *index;
+    uint32_t index_count;
+
+    // a streamed binary bundle. The TLV that ended the header records is
+    // kept until the first call to next
+    FILE *stream;
+    uint8_t stream_tlv[sizeof(bundle_tlv_t)];
+    int stream_tlv_pending;
+    int stream_done;
+
+    // JSON
+    char *json;
+    size_t json_map_len;
+    uint8_t *kekek_pubkey;
+    uint8_t *kekek_salt;
+    uint8_t *kekek_pkcs8;
+    int section;
+    int section_started;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+};
+
+// Binary format --------------------------------------------------------
+static uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+// read the TLV at *pos. It must end before end
+static int read_tlv(const uint8_t *data, size_t end, size_t *pos,
+                    uint32_t *tag, const uint8_t **value, uint32_t *length)
+{
+    if (*pos > end || end - *pos < sizeof(bundle_tlv_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *tag = get_u32(data + *pos);
+    *length = get_u32(data + *pos + sizeof(uint32_t));
+    *pos += sizeof(bundle_tlv_t);
+
+    if (end - *pos < *length) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *value = data + *pos;
+    *pos += *length;
+
+    return HAL_OK;
+}
+
+static int binary_parse_key(dks_arena_t *arena, const attribute_dictionary_t *dictionary,
+                            const uint8_t *data, uint32_t data_len, bundle_record_t *record)
+{
+    uint32_t tag, length;
+    const uint8_t *value;
+    size_t pos;
+    int has_uuid = 0;
+
+    memset(record, 0, sizeof(bundle_record_t));
+    record->type = BUNDLE_RECORD_KEY;
+
+    // count the attributes so the array can be allocated
+    unsigned attributes_max = 0;
+    for (pos = 0; pos < data_len; )
+    {
+        if (read_tlv(data, data_len, &pos, &tag, &value, &length) != HAL_OK) return HAL_ERROR_BAD_ARGUMENTS;
+        if (tag == BUNDLE_FIELD_ATTRIBUTE || tag == BUNDLE_FIELD_ATTRIBUTE_NIL ||
+            tag == BUNDLE_FIELD_ATTRIBUTE_REF || tag == BUNDLE_FIELD_ATTRIBUTE_BOOL ||
+            tag == BUNDLE_FIELD_ATTRIBUTE_ULONG) ++attributes_max;
+    }
+
+    if (attributes_max > 0)
+    {
+        record->attributes = dks_arena_alloc(arena, attributes_max * sizeof(hal_pkey_attribute_t));
+        if (record->attributes == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    for (pos = 0; pos < data_len; )
+    {
+        read_tlv(data, data_len, &pos, &tag, &value, &length);
+
+        switch (tag)
+        {
+            case BUNDLE_FIELD_UUID:
+                if (length != sizeof(hal_uuid_t)) return HAL_ERROR_BAD_ARGUMENTS;
+                memcpy(&record->uuid, value, sizeof(hal_uuid_t));
+                has_uuid = 1;
+                break;
+            case BUNDLE_FIELD_FLAGS:
+                if (length != sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+                record->flags = get_u32(value);
+                break;
+            case BUNDLE_FIELD_KEY_TYPE:
+                if (length != sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+                record->key_type = (hal_key_type_t)get_u32(value);
+                break;
+            case BUNDLE_FIELD_FINGERPRINT:
+                if (length != KEY_FINGERPRINT_LEN) return HAL_ERROR_BAD_ARGUMENTS;
+                memcpy(record->fingerprint, value, KEY_FINGERPRINT_LEN);
+                record->has_fingerprint = 1;
+                break;
+            case BUNDLE_FIELD_PKCS8:
+                record->pkcs8 = value;
+                record->pkcs8_len = length;
+                break;
+            case BUNDLE_FIELD_KEK:
+                record->kek = value;
+                record->kek_len = length;
+                break;
+            case BUNDLE_FIELD_SPKI:
+                record->spki = value;
+                record->spki_len = length;
+                break;
+            case BUNDLE_FIELD_ATTRIBUTE:
+            case BUNDLE_FIELD_ATTRIBUTE_NIL:
+            case BUNDLE_FIELD_ATTRIBUTE_REF:
+            case BUNDLE_FIELD_ATTRIBUTE_BOOL:
+            case BUNDLE_FIELD_ATTRIBUTE_ULONG:
+            {
+                if (length < sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+                hal_pkey_attribute_t *attr = &record->attributes[record->attributes_len++];
+                attr->type = get_u32(value);
+
+                if (tag == BUNDLE_FIELD_ATTRIBUTE_NIL)
+                {
+                    attr->value = NULL;
+                    attr->length = HAL_PKEY_ATTRIBUTE_NIL;
+                }
+                else if (tag == BUNDLE_FIELD_ATTRIBUTE_REF)
+                {
+                    if (length != 2 * sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+                    attr->value = attribute_dictionary_get(dictionary,
+                                                           get_u32(value + sizeof(uint32_t)), &attr->length);
+                    if (attr->value == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+                }
+                else if (tag == BUNDLE_FIELD_ATTRIBUTE_BOOL)
+                {
+                    if (length != sizeof(uint32_t) + sizeof(uint8_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+                    int rval = attribute_schema_from_number(arena, attr->type, value[sizeof(uint32_t)], attr);
+                    if (rval != HAL_OK) return rval;
+                }
+                else if (tag == BUNDLE_FIELD_ATTRIBUTE_ULONG)
+                {
+                    if (length != sizeof(uint32_t) + sizeof(uint64_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+                    int rval = attribute_schema_from_number(arena, attr->type, get_u64(value + sizeof(uint32_t)), attr);
+                    if (rval != HAL_OK) return rval;
+                }
+                else
+                {
+                    attr->value = value + sizeof(uint32_t);
+                    attr->length = length - sizeof(uint32_t);
+                }
+                break;
+            }
+            default:
+                // fields from newer versions
+                break;
+        }
+    }
+
+    return has_uuid ? HAL_OK : HAL_ERROR_BAD_ARGUMENTS;
+}
+
+static int binary_load_dictionary(bundle_reader_t *reader, const uint8_t *data, uint32_t data_len)
+{
+    if (reader->dictionary.count > 0 || data_len < sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+    uint32_t count = get_u32(data);
+    size_t pos = sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (data_len - pos < sizeof(uint32_t)) return HAL_ERROR_BAD_ARGUMENTS;
+
+        uint32_t length = get_u32(data + pos);
+        pos += sizeof(uint32_t);
+
+        if (data_len - pos < length) return HAL_ERROR_BAD_ARGUMENTS;
+
+        // the ids are the positions, so every value must be new
+        uint32_t id;
+        int rval = attribute_dictionary_add(&reader->dictionary, data + pos, length, &id);
+        if (rval != HAL_OK) return rval;
+        if (id != i) return HAL_ERROR_BAD_ARGUMENTS;
+
+        pos += length;
+    }
+
+    return HAL_OK;
+}
+
+static int binary_open(bundle_reader_t *reader)
+{
+    if (reader->map_len < sizeof(bundle_file_header_t) + sizeof(bundle_file_footer_t))
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    const bundle_file_header_t *file_header = (const bundle_file_header_t *)reader->map;
+    uint32_t header_len = le32toh(file_header->header_len);
+    size_t footer_offset = reader->map_len - sizeof(bundle_file_footer_t);
+
+    if (memcmp(file_header->magic, BUNDLE_MAGIC, sizeof(file_header->magic)) != 0 ||
+        le32toh(file_header->version) < 1 || le32toh(file_header->version) > BUNDLE_VERSION ||
+        header_len < sizeof(bundle_file_header_t) || header_len > footer_offset)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    reader->header.incremental = (le32toh(file_header->flags) & BUNDLE_FLAG_INCREMENTAL) != 0;
+    memcpy(&reader->header.kekek_uuid, &file_header->kekek_uuid, sizeof(hal_uuid_t));
+
+    // the footer points to the index, which ends the records. A bundle
+    // without one wasn't finished
+    // records have any length, so the footer may not be aligned
+    const uint8_t *footer = reader->map + footer_offset;
+    uint64_t index_offset = get_u64(footer + offsetof(bundle_file_footer_t, index_offset));
+
+    if (memcmp(footer + offsetof(bundle_file_footer_t, magic), BUNDLE_INDEX_MAGIC, sizeof(BUNDLE_INDEX_MAGIC) - 1) != 0 ||
+        index_offset < header_len || index_offset > footer_offset)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    uint32_t tag, length;
+    const uint8_t *value;
+    size_t pos = index_offset;
+
+    if (read_tlv(reader->map, footer_offset, &pos, &tag, &value, &length) != HAL_OK ||
+        tag != BUNDLE_TAG_INDEX || length < sizeof(uint32_t) ||
+        (length - sizeof(uint32_t)) != get_u32(value) * (uint64_t)sizeof(bundle_index_entry_t))
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    reader->index_count = get_u32(value);
+    reader->index = value + sizeof(uint32_t);
+    reader->records_start = header_len;
+    reader->records_end = index_offset;
+    reader->pos = header_len;
+
+    // check the records and get the header information
+    reader->header.device_index = -1;
+
+    for (pos = reader->records_start; pos < reader->records_end; )
+    {
+        if (read_tlv(reader->map, reader->records_end, &pos, &tag, &value, &length) != HAL_OK)
+        {
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
+
+        if (tag == BUNDLE_TAG_DEVICE_INDEX && length == sizeof(uint32_t))
+        {
+            reader->header.device_index = (int)get_u32(value);
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_PUBKEY)
+        {
+            reader->header.kekek_pubkey = value;
+            reader->header.kekek_pubkey_len = length;
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_SALT)
+        {
+            reader->header.kekek_salt = value;
+            reader->header.kekek_salt_len = length;
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_PKCS8)
+        {
+            reader->header.kekek_pkcs8 = value;
+            reader->header.kekek_pkcs8_len = length;
+        }
+        else if (tag == BUNDLE_TAG_DICTIONARY)
+        {
+            int rval = binary_load_dictionary(reader, value, length);
+            if (rval != HAL_OK) return rval;
+        }
+    }
+
+    return HAL_OK;
+}
+
+static int binary_next(bundle_reader_t *reader, bundle_record_t *record, int *done)
+{
+    uint32_t tag, length;
+    const uint8_t *value;
+
+    while (reader->pos < reader->records_end)
+    {
+        if (read_tlv(reader->map, reader->records_end, &reader->pos, &tag, &value, &length) != HAL_OK)
+        {
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
+
+        switch (tag)
+        {
+            case BUNDLE_TAG_KEY:
+                return binary_parse_key(&reader->arena, &reader->dictionary, value, length, record);
+
+            case BUNDLE_TAG_UNCHANGED:
+                if (length != sizeof(hal_uuid_t) + KEY_FINGERPRINT_LEN) return HAL_ERROR_BAD_ARGUMENTS;
+                memset(record, 0, sizeof(bundle_record_t));
+                record->type = BUNDLE_RECORD_UNCHANGED;
+                memcpy(&record->uuid, value, sizeof(hal_uuid_t));
+                memcpy(record->fingerprint, value + sizeof(hal_uuid_t), KEY_FINGERPRINT_LEN);
+                record->has_fingerprint = 1;
+                return HAL_OK;
+
+            case BUNDLE_TAG_REMOVED:
+                if (length != sizeof(hal_uuid_t)) return HAL_ERROR_BAD_ARGUMENTS;
+                memset(record, 0, sizeof(bundle_record_t));
+                record->type = BUNDLE_RECORD_REMOVED;
+                memcpy(&record->uuid, value, sizeof(hal_uuid_t));
+                return HAL_OK;
+
+            default:
+                // header and unknown records
+                break;
+        }
+    }
+
+    *done = 1;
+    return HAL_OK;
+}
+
+// Streamed binary format -----------------------------------------------
+// records are read into the arena, so one can't be bigger than this
+#define BUNDLE_STREAM_RECORD_MAX    (1024 * 1024)
+
+static int stream_read(bundle_reader_t *reader, void *data, size_t len)
+{
+    if (len > 0 && fread(data, 1, len, reader->stream) != len) return HAL_ERROR_IO_UNEXPECTED;
+
+    return HAL_OK;
+}
+
+// read the next TLV. The value comes from the arena, or from malloc when
+// arena is NULL
+static int stream_read_tlv(bundle_reader_t *reader, dks_arena_t *arena,
+                           uint32_t *tag, uint8_t **value, uint32_t *length)
+{
+    int rval;
+
+    if (reader->stream_tlv_pending) reader->stream_tlv_pending = 0;
+    else if ((rval = stream_read(reader, reader->stream_tlv, sizeof(reader->stream_tlv))) != HAL_OK) return rval;
+
+    *tag = get_u32(reader->stream_tlv);
+    *length = get_u32(reader->stream_tlv + sizeof(uint32_t));
+
+    if (*length > BUNDLE_STREAM_RECORD_MAX) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // one extra byte so an empty value isn't NULL
+    *value = (arena != NULL) ? dks_arena_alloc(arena, *length + 1) : malloc(*length + 1);
+    if (*value == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if ((rval = stream_read(reader, *value, *length)) != HAL_OK)
+    {
+        if (arena == NULL) free(*value);
+        return rval;
+    }
+
+    return HAL_OK;
+}
+
+static int stream_open(bundle_reader_t *reader)
+{
+    bundle_file_header_t file_header;
+    int rval;
+
+    if ((rval = stream_read(reader, &file_header, sizeof(file_header))) != HAL_OK) return rval;
+
+    uint32_t header_len = le32toh(file_header.header_len);
+
+    if (memcmp(file_header.magic, BUNDLE_MAGIC, sizeof(file_header.magic)) != 0 ||
+        le32toh(file_header.version) < 1 || le32toh(file_header.version) > BUNDLE_VERSION ||
+        header_len < sizeof(bundle_file_header_t) || header_len > BUNDLE_STREAM_RECORD_MAX)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    reader->header.incremental = (le32toh(file_header.flags) & BUNDLE_FLAG_INCREMENTAL) != 0;
+    memcpy(&reader->header.kekek_uuid, &file_header.kekek_uuid, sizeof(hal_uuid_t));
+    reader->header.device_index = -1;
+
+    // skip the parts of a newer header
+    for (uint32_t skip = header_len - sizeof(bundle_file_header_t); skip > 0; --skip)
+    {
+        if (fgetc(reader->stream) == EOF) return HAL_ERROR_IO_UNEXPECTED;
+    }
+
+    // the writer puts the header records first
+    for (;;)
+    {
+        if ((rval = stream_read(reader, reader->stream_tlv, sizeof(reader->stream_tlv))) != HAL_OK) return rval;
+
+        uint32_t tag = get_u32(reader->stream_tlv);
+        if (tag != BUNDLE_TAG_DEVICE_INDEX && tag != BUNDLE_TAG_KEKEK_PUBKEY &&
+            tag != BUNDLE_TAG_KEKEK_SALT && tag != BUNDLE_TAG_KEKEK_PKCS8)
+        {
+            reader->stream_tlv_pending = 1;
+            return HAL_OK;
+        }
+
+        uint8_t *value;
+        uint32_t length;
+
+        reader->stream_tlv_pending = 1;
+        if ((rval = stream_read_tlv(reader, NULL, &tag, &value, &length)) != HAL_OK) return rval;
+
+        if (tag == BUNDLE_TAG_DEVICE_INDEX && length == sizeof(uint32_t))
+        {
+            reader->header.device_index = (int)get_u32(value);
+            free(value);
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_PUBKEY && reader->kekek_pubkey == NULL)
+        {
+            reader->kekek_pubkey = value;
+            reader->header.kekek_pubkey = value;
+            reader->header.kekek_pubkey_len = length;
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_SALT && reader->kekek_salt == NULL)
+        {
+            reader->kekek_salt = value;
+            reader->header.kekek_salt = value;
+            reader->header.kekek_salt_len = length;
+        }
+        else if (tag == BUNDLE_TAG_KEKEK_PKCS8 && reader->kekek_pkcs8 == NULL)
+        {
+            reader->kekek_pkcs8 = value;
+            reader->header.kekek_pkcs8 = value;
+            reader->header.kekek_pkcs8_len = length;
+        }
+        else
+        {
+            free(value);
+        }
+    }
+}
+
+static int stream_next(bundle_reader_t *reader, bundle_record_t *record, int *done)
+{
+    uint32_t tag, length;
+    uint8_t *value;
+    int rval;
+
+    while (!reader->stream_done)
+    {
+        if ((rval = stream_read_tlv(reader, &reader->arena, &tag, &value, &length)) != HAL_OK) return rval;
+
+        switch (tag)
+        {
+            case BUNDLE_TAG_KEY:
+                // the dictionary hasn't been read, so references fail here
+                return binary_parse_key(&reader->arena, &reader->dictionary, value, length, record);
+
+            case BUNDLE_TAG_UNCHANGED:
+                if (length != sizeof(hal_uuid_t) + KEY_FINGERPRINT_LEN) return HAL_ERROR_BAD_ARGUMENTS;
+                memset(record, 0, sizeof(bundle_record_t));
+                record->type = BUNDLE_RECORD_UNCHANGED;
+                memcpy(&record->uuid, value, sizeof(hal_uuid_t));
+                memcpy(record->fingerprint, value + sizeof(hal_uuid_t), KEY_FINGERPRINT_LEN);
+                record->has_fingerprint = 1;
+                return HAL_OK;
+
+            case BUNDLE_TAG_REMOVED:
+                if (length != sizeof(hal_uuid_t)) return HAL_ERROR_BAD_ARGUMENTS;
+                memset(record, 0, sizeof(bundle_record_t));
+                record->type = BUNDLE_RECORD_REMOVED;
+                memcpy(&record->uuid, value, sizeof(hal_uuid_t));
+                return HAL_OK;
+
+            case BUNDLE_TAG_INDEX:
+                // the index ends the records. The footer is left in the stream
+                reader->stream_done = 1;
+                break;
+
+            default:
+                // the dictionary of an empty export and unknown records
+                dks_arena_reset(&reader->arena);
+                break;
+        }
+    }
+
+    *done = 1;
+    return HAL_OK;
+}
+
+static int compare_index_uuid(const void *key, const void *entry)
+{
+    // the UUID is the first field of an index entry
+    return memcmp(key, entry, sizeof(hal_uuid_t));
+}
+
+// JSON format ----------------------------------------------------------
+// decode a base64 string array. The result comes from the arena, or from
+// malloc when arena is NULL
+static diamond_json_error_t json_decode_b64(diamond_json_ptr_t *json_ptr, dks_arena_t *arena,
+                                            const uint8_t **data, size_t *data_len)
+{
+    char *b64data;
+
+    diamond_json_error_t result = djson_join_string_array(json_ptr, &b64data);
+    if (result != DJSON_OK) return result;
+
+    unsigned int b64data_len = strlen(b64data);
+    unsigned int decoded_size = b64d_size(b64data_len);
+
+    unsigned char *decoded = (arena != NULL) ? dks_arena_alloc(arena, decoded_size) : malloc(decoded_size);
+    if (decoded == NULL)
+    {
+        free(b64data);
+        return DJSON_ERROR_MEMORY;
+    }
+
+    *data_len = b64_decode((const unsigned char *)b64data, b64data_len, decoded);
+    *data = decoded;
+
+    free(b64data);
+
+    return DJSON_OK;
+}
+
+static int json_parse_attributes(bundle_reader_t *reader, char *attr_json, bundle_record_t *record)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+
+    // pool of nodes. must be the maximum depth
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+
+    record->attributes = dks_arena_alloc(&reader->arena, BUNDLE_MAX_ATTRIBUTES * sizeof(hal_pkey_attribute_t));
+    if (record->attributes == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    dks_json_check(djson_start_parser(attr_json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+
+    diamond_json_type_t curr_attr_type;
+    dks_json_check(djson_goto_next_element(&json_ptr));
+    dks_json_check(djson_get_type_current(&json_ptr, &curr_attr_type));
+
+    while (curr_attr_type != DJSON_TYPE_ObjectEnd)
+    {
+        // ignore strings and nested objects
+        if (curr_attr_type == DJSON_TYPE_Array ||
+            curr_attr_type == DJSON_TYPE_Primitive)
+        {
+            if (record->attributes_len == BUNDLE_MAX_ATTRIBUTES) dks_json_throw(HAL_ERROR_RESULT_TOO_LONG);
+
+            char *attr_name;
+            dks_json_check(djson_get_name_current(&json_ptr, &attr_name));
+
+            // the name is the attribute type
+            char *name_end;
+            hal_pkey_attribute_t *pkey_attr = &record->attributes[record->attributes_len++];
+            pkey_attr->type = (uint32_t)strtoul(attr_name, &name_end, 10);
+            if (name_end == attr_name || *name_end != 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+            if (curr_attr_type == DJSON_TYPE_Array)
+            {
+                dks_json_check(json_decode_b64(&json_ptr, &reader->arena, &pkey_attr->value, &pkey_attr->length));
+            }
+            else
+            {
+                int int_value;
+
+                // numbers are bools and ulongs. The schema says which
+                if (djson_get_integer_primitive_current(&json_ptr, &int_value) == DJSON_OK)
+                {
+                    if (int_value < 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+                    rval = attribute_schema_from_number(&reader->arena, pkey_attr->type, (uint64_t)int_value, pkey_attr);
+                    if (rval != HAL_OK) goto finished;
+                }
+                else
+                {
+                    pkey_attr->value = NULL;
+                    pkey_attr->length = HAL_PKEY_ATTRIBUTE_NIL;
+                }
+            }
+        }
+
+        // get the next element
+        dks_json_check(djson_goto_next_element(&json_ptr));
+        dks_json_check(djson_get_type_current(&json_ptr, &curr_attr_type));
+    }
+
+finished:
+    return rval;
+}
+
+static int json_parse_key(bundle_reader_t *reader, diamond_json_ptr_t *json_ptr, bundle_record_t *record)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    char *attr_json = NULL;
+    int has_uuid = 0;
+
+    memset(record, 0, sizeof(bundle_record_t));
+    record->type = BUNDLE_RECORD_KEY;
+
+    // go to the first element
+    diamond_json_type_t json_type;
+    dks_json_check(djson_goto_next_element(json_ptr));
+    dks_json_check(djson_get_type_current(json_ptr, &json_type));
+
+    // parse a key object
+    while (json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *name;
+        dks_json_check(djson_get_name_current(json_ptr, &name));
+
+        if (strcmp(name, "pkcs8") == 0 && json_type == DJSON_TYPE_Array)
+        {
+            dks_json_check(json_decode_b64(json_ptr, &reader->arena, &record->pkcs8, &record->pkcs8_len));
+        }
+        else if (strcmp(name, "kek") == 0 && json_type == DJSON_TYPE_Array)
+        {
+            dks_json_check(json_decode_b64(json_ptr, &reader->arena, &record->kek, &record->kek_len));
+        }
+        else if (strcmp(name, "spki") == 0 && json_type == DJSON_TYPE_Array)
+        {
+            dks_json_check(json_decode_b64(json_ptr, &reader->arena, &record->spki, &record->spki_len));
+        }
+        else if (strcmp(name, "attributes") == 0 && json_type == DJSON_TYPE_Object)
+        {
+            dks_json_check(djson_skip_save_object(json_ptr, &attr_json));
+        }
+        else if (strcmp(name, "uuid") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *uuid_string;
+            dks_json_check(djson_get_string_value_current(json_ptr, &uuid_string));
+            record->uuid = string_to_uuid(uuid_string);
+            has_uuid = 1;
+        }
+        else if (strcmp(name, "flags") == 0 && json_type == DJSON_TYPE_Primitive)
+        {
+            int flags;
+            dks_json_check(djson_get_integer_primitive_current(json_ptr, &flags));
+            record->flags = (hal_key_flags_t)flags;
+        }
+        else if (strcmp(name, "key_type") == 0 && json_type == DJSON_TYPE_Primitive)
+        {
+            int key_type;
+            dks_json_check(djson_get_integer_primitive_current(json_ptr, &key_type));
+            record->key_type = (hal_key_type_t)key_type;
+        }
+        else if (strcmp(name, "fingerprint") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *fingerprint_string;
+            dks_json_check(djson_get_string_value_current(json_ptr, &fingerprint_string));
+            record->has_fingerprint = string_to_fingerprint(fingerprint_string, record->fingerprint);
+        }
+        else if (strcmp(name, "comment") == 0 && json_type == DJSON_TYPE_String) { }
+        else
+        {
+            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+
+        dks_json_check(djson_pass(json_ptr));
+
+        dks_json_check(djson_get_type_current(json_ptr, &json_type));
+    }
+
+    if (!has_uuid) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+    if (attr_json != NULL) rval = json_parse_attributes(reader, attr_json, record);
+
+finished:
+    free(attr_json);
+    return rval;
+}
+
+// an entry of the "unchanged" array
+static int json_parse_unchanged(bundle_reader_t *reader, bundle_record_t *record)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    diamond_json_ptr_t *json_ptr = &reader->json_ptr;
+
+    memset(record, 0, sizeof(bundle_record_t));
+    record->type = BUNDLE_RECORD_UNCHANGED;
+
+    diamond_json_type_t json_type;
+    dks_json_check(djson_goto_next_element(json_ptr));
+    dks_json_check(djson_get_type_current(json_ptr, &json_type));
+
+    while (json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *name;
+        dks_json_check(djson_get_name_current(json_ptr, &name));
+
+        if (strcmp(name, "uuid") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *uuid_string;
+            dks_json_check(djson_get_string_value_current(json_ptr, &uuid_string));
+            record->uuid = string_to_uuid(uuid_string);
+        }
+        else if (strcmp(name, "fingerprint") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *fingerprint_string;
+            dks_json_check(djson_get_string_value_current(json_ptr, &fingerprint_string));
+            record->has_fingerprint = string_to_fingerprint(fingerprint_string, record->fingerprint);
+        }
+        else
+        {
+            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+
+        dks_json_check(djson_pass(json_ptr));
+
+        dks_json_check(djson_get_type_current(json_ptr, &json_type));
+    }
+
+    if (!record->has_fingerprint) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+finished:
+    return rval;
+}
+
+static int json_open(bundle_reader_t *reader)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+
+    // get the KEKEK
+    char kekek_uuid_buffer[40], *json_search_ptr = reader->json;
+    char *kekek_uuid_s = djson_find_element("kekek_uuid", kekek_uuid_buffer, 40, &json_search_ptr);
+
+    // a software KEKEK doesn't have one
+    if (kekek_uuid_s == NULL && strstr(reader->json, "\"kekek_pkcs8\"") == NULL)
+    {
+        cryptech_report("\r\n'kekek_uuid' not found in JSON.\r\n");
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+    if (kekek_uuid_s != NULL) reader->header.kekek_uuid = string_to_uuid(kekek_uuid_s);
+
+    dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                      sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+    if (djson_parse_until(&reader->json_ptr, "kekek_pubkey", DJSON_TYPE_Array) == DJSON_OK)
+    {
+        dks_json_check(json_decode_b64(&reader->json_ptr, NULL,
+                                       &reader->header.kekek_pubkey, &reader->header.kekek_pubkey_len));
+        reader->kekek_pubkey = (uint8_t *)reader->header.kekek_pubkey;
+    }
+
+    dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                      sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+    if (djson_parse_until(&reader->json_ptr, "kekek_salt", DJSON_TYPE_Array) == DJSON_OK)
+    {
+        dks_json_check(json_decode_b64(&reader->json_ptr, NULL,
+                                       &reader->header.kekek_salt, &reader->header.kekek_salt_len));
+        reader->kekek_salt = (uint8_t *)reader->header.kekek_salt;
+    }
+
+    dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                      sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+    if (djson_parse_until(&reader->json_ptr, "kekek_pkcs8", DJSON_TYPE_Array) == DJSON_OK)
+    {
+        dks_json_check(json_decode_b64(&reader->json_ptr, NULL,
+                                       &reader->header.kekek_pkcs8, &reader->header.kekek_pkcs8_len));
+        reader->kekek_pkcs8 = (uint8_t *)reader->header.kekek_pkcs8;
+    }
+
+    reader->header.device_index = -1;
+    dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                      sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+    if (djson_parse_until(&reader->json_ptr, "device_index", DJSON_TYPE_Primitive) == DJSON_OK)
+    {
+        dks_json_check(djson_get_integer_primitive_current(&reader->json_ptr, &reader->header.device_index));
+    }
+
+    // newer bundles say whether they're incremental before the keys. Older
+    // ones have to be searched for the unchanged array
+    const char *keys = strstr(reader->json, "\"keys\"");
+    const char *incremental = strstr(reader->json, "\"incremental\"");
+
+    dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                      sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+    if (incremental != NULL && (keys == NULL || incremental < keys))
+    {
+        dks_json_check(djson_parse_until(&reader->json_ptr, "incremental", DJSON_TYPE_Primitive));
+        dks_json_check(djson_get_integer_primitive_current(&reader->json_ptr, &reader->header.incremental));
+    }
+    else
+    {
+        reader->header.incremental = (djson_parse_until(&reader->json_ptr, "unchanged", DJSON_TYPE_Array) == DJSON_OK);
+    }
+
+finished:
+    return rval;
+}
+
+static int json_next(bundle_reader_t *reader, bundle_record_t *record, int *done)
+{
+    const char *section_names[] = { "keys", "unchanged", "removed" };
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+
+    while (reader->section <= BUNDLE_RECORD_REMOVED)
+    {
+        if (!reader->section_started)
+        {
+            dks_json_check(djson_start_parser(reader->json, &reader->json_ptr, reader->pool,
+                                              sizeof(reader->pool)/sizeof(diamond_json_node_t)));
+
+            if (djson_parse_until(&reader->json_ptr, section_names[reader->section], DJSON_TYPE_Array) != DJSON_OK)
+            {
+                // every bundle has keys. only incremental exports have the other arrays
+                if (reader->section == BUNDLE_RECORD_KEY) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+                reader->section++;
+                continue;
+            }
+            reader->section_started = 1;
+        }
+
+        dks_json_check(djson_goto_next_element(&reader->json_ptr));
+
+        diamond_json_type_t json_type;
+        dks_json_check(djson_get_type_current(&reader->json_ptr, &json_type));
+
+        if (json_type == DJSON_TYPE_ArrayEnd)
+        {
+            // finished looking at this array
+            reader->section++;
+            reader->section_started = 0;
+            continue;
+        }
+
+        if (reader->section == BUNDLE_RECORD_REMOVED)
+        {
+            if (json_type != DJSON_TYPE_String) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+            char *uuid_string;
+            dks_json_check(djson_get_string_value_current(&reader->json_ptr, &uuid_string));
+
+            memset(record, 0, sizeof(bundle_record_t));
+            record->type = BUNDLE_RECORD_REMOVED;
+            record->uuid = string_to_uuid(uuid_string);
+
+            return HAL_OK;
+        }
+
+        if (json_type != DJSON_TYPE_Object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+        if (reader->section == BUNDLE_RECORD_KEY) return json_parse_key(reader, &reader->json_ptr, record);
+        else return json_parse_unchanged(reader, record);
+    }
+
+    *done = 1;
+
+finished:
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+static int map_file(bundle_reader_t *reader, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    reader->map = map;
+    reader->map_len = st.st_size;
+
+    if (reader->format == BUNDLE_FORMAT_JSON)
+    {
+        // the parser needs a writable string that ends with a 0. Map the
+        // file over zeroed pages that are at least one byte bigger.
+        // Pages are only copied when the parser writes to them, so records
+        // can still be read from a big bundle without reading all of it
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_t json_map_len = ((reader->map_len / page_size) + 1) * page_size;
+
+        void *json = mmap(NULL, json_map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (json != MAP_FAILED &&
+            mmap(json, reader->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(json, json_map_len);
+            json = MAP_FAILED;
+        }
+
+        if (json == MAP_FAILED)
+        {
+            close(fd);
+            return HAL_ERROR_IO_OS_ERROR;
+        }
+
+        reader->json = json;
+        reader->json_map_len = json_map_len;
+    }
+
+    close(fd);
+    return HAL_OK;
+}
+
+static bundle_reader_t *reader_alloc(bundle_format_t format, int *error)
+{
+    bundle_reader_t *reader = calloc(1, sizeof(bundle_reader_t));
+    if (reader == NULL || dks_arena_init(&reader->arena, 32 * 1024) != HAL_OK)
+    {
+        free(reader);
+        *error = HAL_ERROR_ALLOCATION_FAILURE;
+        return NULL;
+    }
+
+    reader->format = format;
+    return reader;
+}
+
+bundle_reader_t *bundle_reader_open(const char *path, int *error)
+{
+    int dummy;
+    if (error == NULL) error = &dummy;
+
+    *error = HAL_ERROR_BAD_ARGUMENTS;
+    if (path == NULL) return NULL;
+
+    // look at the magic to find the format
+    char magic[sizeof(BUNDLE_MAGIC) - 1];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        *error = HAL_ERROR_IO_OS_ERROR;
+        return NULL;
+    }
+    size_t magic_len = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    int binary = (magic_len == sizeof(magic) && memcmp(magic, BUNDLE_MAGIC, sizeof(magic)) == 0);
+
+    bundle_reader_t *reader = reader_alloc(binary ? BUNDLE_FORMAT_BINARY : BUNDLE_FORMAT_JSON, error);
+    if (reader == NULL) return NULL;
+
+    if ((*error = map_file(reader, path)) == HAL_OK)
+    {
+        *error = binary ? binary_open(reader) : json_open(reader);
+    }
+
+    if (*error != HAL_OK)
+    {
+        bundle_reader_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+bundle_reader_t *bundle_reader_open_stream(FILE *fp, int *error)
+{
+    int dummy;
+    if (error == NULL) error = &dummy;
+
+    *error = HAL_ERROR_BAD_ARGUMENTS;
+    if (fp == NULL) return NULL;
+
+    bundle_reader_t *reader = reader_alloc(BUNDLE_FORMAT_BINARY, error);
+    if (reader == NULL) return NULL;
+
+    reader->stream = fp;
+
+    if ((*error = stream_open(reader)) != HAL_OK)
+    {
+        bundle_reader_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+bundle_reader_t *bundle_reader_open_json(char *json, int *error)
+{
+    int dummy;
+    if (error == NULL) error = &dummy;
+
+    *error = HAL_ERROR_BAD_ARGUMENTS;
+    if (json == NULL) return NULL;
+
+    bundle_reader_t *reader = reader_alloc(BUNDLE_FORMAT_JSON, error);
+    if (reader == NULL) return NULL;
+
+    reader->json = json;
+
+    if ((*error = json_open(reader)) != HAL_OK)
+    {
+        bundle_reader_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+void bundle_reader_close(bundle_reader_t *reader)
+{
+    if (reader == NULL) return;
+
+    if (reader->map != NULL) munmap(reader->map, reader->map_len);
+    if (reader->json_map_len > 0) munmap(reader->json, reader->json_map_len);
+    free(reader->kekek_pubkey);
+    free(reader->kekek_salt);
+    free(reader->kekek_pkcs8);
+    attribute_dictionary_free(&reader->dictionary);
+    dks_arena_free(&reader->arena);
+
+    free(reader);
+}
+
+bundle_format_t bundle_reader_format(const bundle_reader_t *reader)
+{
+    return reader->format;
+}
+
+const bundle_header_t *bundle_reader_header(const bundle_reader_t *reader)
+{
+    return &reader->header;
+}
+
+uint64_t bundle_reader_size(const bundle_reader_t *reader)
+{
+    return reader->map_len;
+}
+
+int bundle_reader_next(bundle_reader_t *reader, bundle_record_t *record, int *done)
+{
+    if (reader == NULL || record == NULL || done == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *done = 0;
+    dks_arena_reset(&reader->arena);
+
+    if (reader->stream != NULL) return stream_next(reader, record, done);
+    else if (reader->format == BUNDLE_FORMAT_BINARY) return binary_next(reader, record, done);
+    else return json_next(reader, record, done);
+}
+
+int bundle_reader_rewind(bundle_reader_t *reader)
+{
+    if (reader == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // records that have been streamed are gone
+    if (reader->stream != NULL) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    reader->pos = reader->records_start;
+    reader->section = BUNDLE_RECORD_KEY;
+    reader->section_started = 0;
+
+    return HAL_OK;
+}
+
+int bundle_reader_find(bundle_reader_t *reader, const hal_uuid_t *uuid, bundle_record_t *record)
+{
+    if (reader == NULL || uuid == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // JSON bundles don't have an index, and a stream's comes last
+    if (reader->format != BUNDLE_FORMAT_BINARY || reader->stream != NULL) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    const uint8_t *entry = bsearch(uuid, reader->index, reader->index_count,
+                                   sizeof(bundle_index_entry_t), compare_index_uuid);
+    if (entry == NULL) return HAL_ERROR_KEY_NOT_FOUND;
+
+    size_t pos = get_u64(entry + offsetof(bundle_index_entry_t, offset));
+    uint32_t record_len = get_u32(entry + offsetof(bundle_index_entry_t, length));
+
+    if (pos < reader->records_start || pos > reader->records_end ||
+        reader->records_end - pos < record_len)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    uint32_t tag, length;
+    const uint8_t *value;
+
+    dks_arena_reset(&reader->arena);
+
+    if (read_tlv(reader->map, pos + record_len, &pos, &tag, &value, &length) != HAL_OK ||
+        tag != BUNDLE_TAG_KEY)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    return binary_parse_key(&reader->arena, &reader->dictionary, value, length, record);
+}
+
+int bundle_record_decode(dks_arena_t *arena, const uint8_t *data, uint32_t data_len, bundle_record_t *record)
+{
+    if (arena == NULL || data == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    return binary_parse_key(arena, NULL, data, data_len, record);
+}
+
+int bundle_reader_read_entry(bundle_reader_t *reader, const key_index_entry_t *entry, bundle_record_t *record)
+{
+    if (reader == NULL || entry == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // the record has to be read from the file
+    if (reader->map == NULL) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    uint64_t offset = key_index_entry_offset(entry);
+    uint32_t record_len = key_index_entry_length(entry);
+
+    if (offset > reader->map_len || reader->map_len - offset < record_len) return HAL_ERROR_BAD_ARGUMENTS;
+
+    const uint8_t *data = reader->map + offset;
+
+    // make sure it's the record that was exported
+    uint8_t digest[KEY_INDEX_DIGEST_LEN];
+    key_index_digest(data, record_len, digest);
+    if (memcmp(digest, entry->digest, KEY_INDEX_DIGEST_LEN) != 0) return HAL_ERROR_KEYSTORE_BAD_CRC;
+
+    dks_arena_reset(&reader->arena);
+
+    int rval;
+
+    if (reader->format == BUNDLE_FORMAT_BINARY)
+    {
+        uint32_t tag, length;
+        const uint8_t *value;
+        size_t pos = 0;
+
+        if (read_tlv(data, record_len, &pos, &tag, &value, &length) != HAL_OK ||
+            tag != BUNDLE_TAG_KEY || pos != record_len)
+        {
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
+
+        rval = binary_parse_key(&reader->arena, &reader->dictionary, value, length, record);
+    }
+    else
+    {
+        diamond_json_error_t result;
+
+        // pool of nodes. must be the maximum depth
+        diamond_json_node_t pool[8];
+        diamond_json_ptr_t json_ptr;
+
+        // parse a copy of the key's object
+        char *key_json = dks_arena_alloc(&reader->arena, record_len + 1);
+        if (key_json == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        memcpy(key_json, data, record_len);
+        key_json[record_len] = 0;
+
+        dks_json_check(djson_start_parser(key_json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+
+        rval = json_parse_key(reader, &json_ptr, record);
+    }
+
+    if (rval == HAL_OK && memcmp(&record->uuid, &entry->uuid, sizeof(hal_uuid_t)) != 0)
+    {
+        rval = HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+finished:
+    return rval;
+}
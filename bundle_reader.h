@@ -0,0 +1,84 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef BUNDLE_READER_H
+#define BUNDLE_READER_H
+
+#include <stdio.h>
+
+#include <hal.h>
+
+#include "bundle.h"
+#include "dks_arena.h"
+#include "key_index.h"
+
+// Reads the records of an export bundle in either format. Binary bundles
+// are mapped into memory and their records point straight into the file.
+typedef struct bundle_reader bundle_reader_t;
+
+// the format is found from the contents of the file
+bundle_reader_t *bundle_reader_open(const char *path, int *error);
+
+// read a binary bundle from a pipe while it's being written. The bundle
+// must have been written with bundle_writer_t.streaming set. Records can
+// only be read in order, and fp isn't closed with the reader
+bundle_reader_t *bundle_reader_open_stream(FILE *fp, int *error);
+
+// json must stay valid until the reader is closed
+bundle_reader_t *bundle_reader_open_json(char *json, int *error);
+
+void bundle_reader_close(bundle_reader_t *reader);
+
+bundle_format_t bundle_reader_format(const bundle_reader_t *reader);
+const bundle_header_t *bundle_reader_header(const bundle_reader_t *reader);
+
+// the size of the bundle file. 0 when it wasn't opened from a file
+uint64_t bundle_reader_size(const bundle_reader_t *reader);
+
+// get the next record. *done is set after the last record. The record's
+// memory is only valid until the next call
+int bundle_reader_next(bundle_reader_t *reader, bundle_record_t *record, int *done);
+
+// start again at the first record
+int bundle_reader_rewind(bundle_reader_t *reader);
+
+// look up a key record in the trailing index of a binary bundle
+int bundle_reader_find(bundle_reader_t *reader, const hal_uuid_t *uuid, bundle_record_t *record);
+
+// read the key record at a key index entry, after checking it against the
+// entry's digest. Only the record is read, so this works on big bundles of
+// either format
+int bundle_reader_read_entry(bundle_reader_t *reader, const key_index_entry_t *entry, bundle_record_t *record);
+
+// decode the fields of a binary key record that doesn't refer to an
+// attribute dictionary. The record points into data and the arena
+int bundle_record_decode(dks_arena_t *arena, const uint8_t *data, uint32_t data_len, bundle_record_t *record);
+
+#endif
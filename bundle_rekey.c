@@ -0,0 +1,396 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <hal.h>
+
+#include "bundle_rekey.h"
+#include "bundle_writer.h"
+#include "cryptech_device.h"
+#include "soft_kekek.h"
+
+// the threads take this many keys at a time
+#define REKEY_BATCH         64
+
+// the longest KEK that's accepted. libhal uses 32 bytes
+#define REKEY_KEK_MAX       64
+
+// the KEK of one key. The old wrapped KEK is replaced by the new one
+typedef struct
+{
+    uint8_t *kek;
+    size_t kek_len;
+} rekey_job_t;
+
+// shared by the threads
+typedef struct
+{
+    EVP_PKEY *old_key;
+    EVP_PKEY *new_key;
+
+    rekey_job_t *jobs;
+    unsigned int count;
+    unsigned int capacity;
+
+    // protects next and rval
+    pthread_mutex_t lock;
+    unsigned int next;
+    int rval;
+} rekey_t;
+
+// Internal Functions ---------------------------------------------------
+static int add_job(rekey_t *rekey, const uint8_t *kek, size_t kek_len)
+{
+    if (rekey->count == rekey->capacity)
+    {
+        unsigned int capacity = (rekey->capacity == 0) ? 64 : rekey->capacity * 2;
+        rekey_job_t *jobs = realloc(rekey->jobs, capacity * sizeof(rekey_job_t));
+        if (jobs == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        rekey->jobs = jobs;
+        rekey->capacity = capacity;
+    }
+
+    rekey_job_t *job = &rekey->jobs[rekey->count];
+    job->kek = malloc(kek_len);
+    if (job->kek == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    memcpy(job->kek, kek, kek_len);
+    job->kek_len = kek_len;
+    ++rekey->count;
+
+    return HAL_OK;
+}
+
+// libhal encrypts the KEK with RSAES-PKCS1-v1_5. The block is decrypted
+// without padding and checked here, so a wrong key can't go unnoticed
+static int unpad_kek(const uint8_t *block, size_t block_len, const uint8_t **kek, size_t *kek_len)
+{
+    if (block_len < 11 || block[0] != 0x00 || block[1] != 0x02) return HAL_ERROR_KEYWRAP_BAD_PADDING;
+
+    size_t i = 2;
+    while (i < block_len && block[i] != 0x00) ++i;
+
+    // at least 8 bytes of padding, and a separator
+    if (i < 10 || i == block_len) return HAL_ERROR_KEYWRAP_BAD_PADDING;
+
+    *kek = block + i + 1;
+    *kek_len = block_len - i - 1;
+
+    return (*kek_len > 0 && *kek_len <= REKEY_KEK_MAX) ? HAL_OK : HAL_ERROR_KEYWRAP_BAD_LENGTH;
+}
+
+static int rewrap_kek(EVP_PKEY_CTX *decrypt, EVP_PKEY_CTX *encrypt, uint8_t *block, size_t block_max,
+                      uint8_t *wrapped, size_t wrapped_max, rekey_job_t *job)
+{
+    const uint8_t *algorithm, *data;
+    size_t algorithm_len, data_len;
+
+    // the algorithm identifier is kept as it is
+    int rval = encrypted_private_key_info_parse(job->kek, job->kek_len, &algorithm, &algorithm_len, &data, &data_len);
+    if (rval != HAL_OK) return rval;
+
+    size_t block_len = block_max;
+    if (EVP_PKEY_decrypt(decrypt, block, &block_len, data, data_len) != 1) return HAL_ERROR_KEYWRAP_BAD_LENGTH;
+
+    const uint8_t *kek;
+    size_t kek_len;
+    size_t wrapped_len = wrapped_max;
+
+    if ((rval = unpad_kek(block, block_len, &kek, &kek_len)) == HAL_OK &&
+        EVP_PKEY_encrypt(encrypt, wrapped, &wrapped_len, kek, kek_len) != 1)
+    {
+        rval = HAL_ERROR_IMPOSSIBLE;
+    }
+    OPENSSL_cleanse(block, block_max);
+    if (rval != HAL_OK) return rval;
+
+    size_t result_len;
+    uint8_t *result = encrypted_private_key_info_encode(algorithm, algorithm_len, wrapped, wrapped_len, &result_len);
+    if (result == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    free(job->kek);
+    job->kek = result;
+    job->kek_len = result_len;
+
+    return HAL_OK;
+}
+
+// the RSA contexts are made once per thread. libcrypto keeps the Montgomery
+// values of each modulus with the key, so they're only computed once
+static int rekey_thread_init(rekey_t *rekey, EVP_PKEY_CTX **decrypt, EVP_PKEY_CTX **encrypt)
+{
+    *decrypt = EVP_PKEY_CTX_new(rekey->old_key, NULL);
+    *encrypt = EVP_PKEY_CTX_new(rekey->new_key, NULL);
+
+    if (*decrypt == NULL || *encrypt == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if (EVP_PKEY_decrypt_init(*decrypt) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(*decrypt, RSA_NO_PADDING) != 1 ||
+        EVP_PKEY_encrypt_init(*encrypt) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(*encrypt, RSA_PKCS1_PADDING) != 1)
+    {
+        return HAL_ERROR_IMPOSSIBLE;
+    }
+
+    return HAL_OK;
+}
+
+static void *rekey_thread(void *arg)
+{
+    rekey_t *rekey = (rekey_t *)arg;
+    EVP_PKEY_CTX *decrypt = NULL, *encrypt = NULL;
+    size_t block_max = EVP_PKEY_size(rekey->old_key);
+    size_t wrapped_max = EVP_PKEY_size(rekey->new_key);
+    uint8_t *block = malloc(block_max);
+    uint8_t *wrapped = malloc(wrapped_max);
+
+    int rval = (block != NULL && wrapped != NULL) ? rekey_thread_init(rekey, &decrypt, &encrypt)
+                                                  : HAL_ERROR_ALLOCATION_FAILURE;
+
+    while (rval == HAL_OK)
+    {
+        pthread_mutex_lock(&rekey->lock);
+        unsigned int first = rekey->next;
+        rekey->next += REKEY_BATCH;
+        if (rekey->rval != HAL_OK) first = rekey->count;
+        pthread_mutex_unlock(&rekey->lock);
+
+        if (first >= rekey->count) break;
+
+        unsigned int last = (rekey->count - first < REKEY_BATCH) ? rekey->count : first + REKEY_BATCH;
+        for (unsigned int i = first; i < last && rval == HAL_OK; ++i)
+        {
+            rval = rewrap_kek(decrypt, encrypt, block, block_max, wrapped, wrapped_max, &rekey->jobs[i]);
+        }
+    }
+
+    if (rval != HAL_OK)
+    {
+        pthread_mutex_lock(&rekey->lock);
+        if (rekey->rval == HAL_OK) rekey->rval = rval;
+        pthread_mutex_unlock(&rekey->lock);
+    }
+
+    EVP_PKEY_CTX_free(decrypt);
+    EVP_PKEY_CTX_free(encrypt);
+    free(block);
+    free(wrapped);
+
+    return NULL;
+}
+
+static int run_threads(rekey_t *rekey, unsigned int threads_len)
+{
+    if (pthread_mutex_init(&rekey->lock, NULL) != 0) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if (threads_len == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_len = (cpus > 0) ? (unsigned int)cpus : 1;
+    }
+    if (threads_len > BUNDLE_REKEY_MAX_THREADS) threads_len = BUNDLE_REKEY_MAX_THREADS;
+
+    unsigned int batches = (rekey->count + REKEY_BATCH - 1) / REKEY_BATCH;
+    if (threads_len > batches) threads_len = batches;
+
+    pthread_t threads[BUNDLE_REKEY_MAX_THREADS];
+    unsigned int started = 0;
+
+    while (started < threads_len && pthread_create(&threads[started], NULL, rekey_thread, rekey) == 0)
+    {
+        ++started;
+    }
+
+    // without any threads, do the work here
+    if (started == 0) rekey_thread(rekey);
+
+    for (unsigned int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&rekey->lock);
+
+    return rekey->rval;
+}
+
+static EVP_PKEY *load_old_key(const bundle_rekey_options_t *options, const bundle_header_t *header)
+{
+    const uint8_t *p = options->old_key_der;
+    PKCS8_PRIV_KEY_INFO *p8 = d2i_PKCS8_PRIV_KEY_INFO(NULL, &p, (long)options->old_key_der_len);
+    if (p8 == NULL) return NULL;
+
+    EVP_PKEY *key = EVP_PKCS82PKEY(p8);
+    PKCS8_PRIV_KEY_INFO_free(p8);
+
+    if (key == NULL || EVP_PKEY_id(key) != EVP_PKEY_RSA)
+    {
+        EVP_PKEY_free(key);
+        return NULL;
+    }
+
+    // make sure it's the bundle's KEKEK
+    if (header->kekek_pubkey != NULL)
+    {
+        uint8_t *spki = NULL;
+        int spki_len = i2d_PUBKEY(key, &spki);
+        int match = (spki_len > 0 && (size_t)spki_len == header->kekek_pubkey_len &&
+                     memcmp(spki, header->kekek_pubkey, spki_len) == 0);
+        OPENSSL_free(spki);
+
+        if (!match)
+        {
+            cryptech_report("The private key is not the KEKEK of the export.\r\n");
+            EVP_PKEY_free(key);
+            return NULL;
+        }
+    }
+
+    return key;
+}
+
+static int write_bundle(bundle_reader_t *bundle, FILE *fp, const bundle_rekey_options_t *options,
+                        const bundle_header_t *setup_header, const rekey_t *rekey)
+{
+    bundle_writer_t writer;
+    bundle_record_t record;
+    int done = 0;
+    unsigned int j = 0;
+
+    // the new KEKEK's information, from its setup JSON
+    bundle_header_t header = *setup_header;
+    header.incremental = bundle_reader_header(bundle)->incremental;
+
+    int rval = bundle_reader_rewind(bundle);
+    if (rval == HAL_OK) rval = bundle_writer_start(&writer, options->format, fp, &header, options->setup_json);
+    if (rval != HAL_OK) return rval;
+
+    while ((rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
+    {
+        if (record.type == BUNDLE_RECORD_KEY && record.kek != NULL)
+        {
+            // the keys come in the same order as the first time
+            if (j >= rekey->count)
+            {
+                rval = HAL_ERROR_IMPOSSIBLE;
+                break;
+            }
+            record.kek = rekey->jobs[j].kek;
+            record.kek_len = rekey->jobs[j].kek_len;
+            ++j;
+        }
+
+        if ((rval = bundle_writer_add(&writer, &record)) != HAL_OK) break;
+    }
+
+    if (rval == HAL_OK) rval = bundle_writer_finish(&writer);
+    if (rval == HAL_OK && options->index_path != NULL) rval = bundle_writer_save_index(&writer, options->index_path);
+
+    bundle_writer_free(&writer);
+
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+int bundle_rekey(bundle_reader_t *bundle, FILE *fp, const bundle_rekey_options_t *options, unsigned int *keys)
+{
+    if (bundle == NULL || fp == NULL || options == NULL || options->old_key_der == NULL ||
+        options->setup_json == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    int rval;
+    int done = 0;
+    rekey_t rekey;
+    memset(&rekey, 0, sizeof(rekey));
+
+    bundle_reader_t *setup = bundle_reader_open_json(options->setup_json, &rval);
+    if (setup == NULL || bundle_reader_header(setup)->kekek_pubkey == NULL)
+    {
+        cryptech_report("Unable to read the KEKEK from the setup JSON.\r\n");
+        bundle_reader_close(setup);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    const bundle_header_t *setup_header = bundle_reader_header(setup);
+    const uint8_t *p = setup_header->kekek_pubkey;
+
+    rekey.new_key = d2i_PUBKEY(NULL, &p, (long)setup_header->kekek_pubkey_len);
+    rekey.old_key = load_old_key(options, bundle_reader_header(bundle));
+
+    if (rekey.new_key == NULL || EVP_PKEY_id(rekey.new_key) != EVP_PKEY_RSA || rekey.old_key == NULL)
+    {
+        rval = HAL_ERROR_BAD_ARGUMENTS;
+        goto finished;
+    }
+
+    // collect the KEKs. They're the only part of the keys that changes
+    bundle_record_t record;
+    while ((rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
+    {
+        if (record.type != BUNDLE_RECORD_KEY || record.kek == NULL) continue;
+
+        if ((rval = add_job(&rekey, record.kek, record.kek_len)) != HAL_OK) break;
+    }
+    if (rval != HAL_OK) goto finished;
+
+    if ((rval = run_threads(&rekey, options->threads)) != HAL_OK)
+    {
+        cryptech_report("Unable to re-wrap the keys: %s\r\n", hal_error_string(rval));
+        goto finished;
+    }
+
+    rval = write_bundle(bundle, fp, options, setup_header, &rekey);
+    if (rval == HAL_OK && keys != NULL) *keys = rekey.count;
+
+finished:
+    for (unsigned int i = 0; i < rekey.count; ++i)
+    {
+        free(rekey.jobs[i].kek);
+    }
+    free(rekey.jobs);
+    EVP_PKEY_free(rekey.old_key);
+    EVP_PKEY_free(rekey.new_key);
+    bundle_reader_close(setup);
+
+    return rval;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef BUNDLE_REKEY_H
+#define BUNDLE_REKEY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bundle.h"
+#include "bundle_reader.h"
+
+// Re-wraps an export to a new KEKEK without the primary HSM. Every key's
+// KEK is decrypted with the private key of the old KEKEK and encrypted to
+// the public key of the new one. The wrapped private keys (the pkcs8 of
+// the records) are copied as they are. This needs the old KEKEK's private
+// key, so it's only possible when that's a software KEKEK.
+#define BUNDLE_REKEY_MAX_THREADS    32
+
+typedef struct
+{
+    // PKCS #8 PrivateKeyInfo of the old KEKEK. See soft_kekek_recover
+    const uint8_t *old_key_der;
+    size_t old_key_der_len;
+
+    // the setup JSON of the new KEKEK
+    char *setup_json;
+
+    bundle_format_t format;
+
+    // where to save the key index of the result. NULL doesn't save one
+    const char *index_path;
+
+    // 0 uses one thread per CPU
+    unsigned int threads;
+} bundle_rekey_options_t;
+
+// keys is set to the number of keys that were re-wrapped
+int bundle_rekey(bundle_reader_t *bundle, FILE *fp, const bundle_rekey_options_t *options, unsigned int *keys);
+
+#endif
@@ -0,0 +1,693 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include "libs/base64.c/base64.h"
+
+#define CK_PTR                                          *
+#define CK_DEFINE_FUNCTION(returnType, name)            returnType name
+#define CK_DECLARE_FUNCTION(returnType, name)           returnType name
+#define CK_DECLARE_FUNCTION_POINTER(returnType, name)   returnType (* name)
+#define CK_CALLBACK_FUNCTION(returnType, name)          returnType (* name)
+#ifndef NULL_PTR
+#define NULL_PTR                                        NULL
+#endif
+
+#include "pkcs11t.h"
+
+#include "attribute_schema.h"
+#include "bundle_writer.h"
+#include "cryptech_device.h"
+#include "key_index.h"
+
+// JSON sections. Each one is an array in the bundle's object
+#define SECTION_NONE        0
+#define SECTION_KEYS        (BUNDLE_RECORD_KEY + 1)
+#define SECTION_UNCHANGED   (BUNDLE_RECORD_UNCHANGED + 1)
+#define SECTION_REMOVED     (BUNDLE_RECORD_REMOVED + 1)
+
+static int compare_keys(const void *a, const void *b)
+{
+    return memcmp(&((const key_index_entry_t *)a)->uuid,
+                  &((const key_index_entry_t *)b)->uuid,
+                  sizeof(hal_uuid_t));
+}
+
+// everything is written here so the offsets and digests are right
+static int write_bytes(bundle_writer_t *writer, const void *data, size_t len)
+{
+    if (len > 0 && fwrite(data, 1, len, writer->fp) != len) return HAL_ERROR_IO_OS_ERROR;
+
+    if (writer->hashing) SHA256_Update(&writer->record_hash, data, len);
+
+    writer->offset += len;
+    return HAL_OK;
+}
+
+// start the index entry of a key record
+static int begin_key(bundle_writer_t *writer, const bundle_record_t *record)
+{
+    if (writer->keys_count == writer->keys_capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (writer->keys_capacity == 0) ? 64 : writer->keys_capacity * 2;
+        key_index_entry_t *new_keys = realloc(writer->keys, new_capacity * sizeof(key_index_entry_t));
+        if (new_keys == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        writer->keys = new_keys;
+        writer->keys_capacity = new_capacity;
+    }
+
+    key_index_entry_t *entry = &writer->keys[writer->keys_count];
+    memset(entry, 0, sizeof(key_index_entry_t));
+    memcpy(&entry->uuid, &record->uuid, sizeof(hal_uuid_t));
+    entry->key_type = record->key_type;
+    entry->flags = record->flags;
+    entry->offset = writer->offset;
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        const hal_pkey_attribute_t *attr = &record->attributes[i];
+        if (attr->length == HAL_PKEY_ATTRIBUTE_NIL) continue;
+
+        if (attr->type == CKA_ID)
+        {
+            key_index_digest(attr->value, attr->length, entry->id_digest);
+            entry->attributes |= KEY_INDEX_HAS_ID;
+        }
+        else if (attr->type == CKA_LABEL)
+        {
+            key_index_digest(attr->value, attr->length, entry->label_digest);
+            entry->attributes |= KEY_INDEX_HAS_LABEL;
+        }
+    }
+
+    SHA256_Init(&writer->record_hash);
+    writer->hashing = 1;
+
+    return HAL_OK;
+}
+
+static void end_key(bundle_writer_t *writer)
+{
+    key_index_entry_t *entry = &writer->keys[writer->keys_count++];
+
+    entry->length = (uint32_t)(writer->offset - entry->offset);
+    SHA256_Final(entry->digest, &writer->record_hash);
+    writer->hashing = 0;
+}
+
+// Binary format --------------------------------------------------------
+
+static int write_u32(bundle_writer_t *writer, uint32_t value)
+{
+    value = htole32(value);
+    return write_bytes(writer, &value, sizeof(value));
+}
+
+static int write_u64(bundle_writer_t *writer, uint64_t value)
+{
+    value = htole64(value);
+    return write_bytes(writer, &value, sizeof(value));
+}
+
+static int write_tlv(bundle_writer_t *writer, uint32_t tag, uint32_t length, const void *value)
+{
+    int rval;
+    if ((rval = write_u32(writer, tag)) != HAL_OK) return rval;
+    if ((rval = write_u32(writer, length)) != HAL_OK) return rval;
+    if (value != NULL) return write_bytes(writer, value, length);
+
+    return HAL_OK;
+}
+
+// a streamed bundle is read before its dictionary has been written, so
+// every value stays in its record
+static int use_dictionary(const bundle_writer_t *writer, const hal_pkey_attribute_t *attr)
+{
+    return !writer->streaming && attribute_dictionary_accepts(attr);
+}
+
+static uint32_t key_record_length(const bundle_writer_t *writer, const bundle_record_t *record)
+{
+    uint32_t len = sizeof(bundle_tlv_t) + sizeof(hal_uuid_t) +
+                   sizeof(bundle_tlv_t) + sizeof(uint32_t);
+
+    if (record->key_type != HAL_KEY_TYPE_NONE) len += sizeof(bundle_tlv_t) + sizeof(uint32_t);
+    if (record->has_fingerprint) len += sizeof(bundle_tlv_t) + KEY_FINGERPRINT_LEN;
+    if (record->pkcs8 != NULL) len += sizeof(bundle_tlv_t) + record->pkcs8_len;
+    if (record->kek != NULL) len += sizeof(bundle_tlv_t) + record->kek_len;
+    if (record->spki != NULL) len += sizeof(bundle_tlv_t) + record->spki_len;
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        uint64_t number;
+
+        len += sizeof(bundle_tlv_t) + sizeof(uint32_t);
+
+        if (attribute_schema_to_number(&record->attributes[i], &number))
+        {
+            if (attribute_schema_type(record->attributes[i].type) == ATTRIBUTE_SCHEMA_BOOL) len += sizeof(uint8_t);
+            else len += sizeof(uint64_t);
+        }
+        else if (use_dictionary(writer, &record->attributes[i])) len += sizeof(uint32_t);
+        else if (record->attributes[i].length != HAL_PKEY_ATTRIBUTE_NIL) len += record->attributes[i].length;
+    }
+
+    return len;
+}
+
+static int binary_add_key(bundle_writer_t *writer, const bundle_record_t *record)
+{
+    int rval;
+
+    if ((rval = begin_key(writer, record)) != HAL_OK) return rval;
+
+    if ((rval = write_tlv(writer, BUNDLE_TAG_KEY, key_record_length(writer, record), NULL)) != HAL_OK) return rval;
+
+    if ((rval = write_tlv(writer, BUNDLE_FIELD_UUID, sizeof(hal_uuid_t), &record->uuid)) != HAL_OK) return rval;
+
+    if (record->key_type != HAL_KEY_TYPE_NONE &&
+        ((rval = write_tlv(writer, BUNDLE_FIELD_KEY_TYPE, sizeof(uint32_t), NULL)) != HAL_OK ||
+         (rval = write_u32(writer, record->key_type)) != HAL_OK)) return rval;
+
+    if ((rval = write_tlv(writer, BUNDLE_FIELD_FLAGS, sizeof(uint32_t), NULL)) != HAL_OK ||
+        (rval = write_u32(writer, record->flags)) != HAL_OK) return rval;
+
+    if (record->has_fingerprint &&
+        (rval = write_tlv(writer, BUNDLE_FIELD_FINGERPRINT, KEY_FINGERPRINT_LEN, record->fingerprint)) != HAL_OK) return rval;
+
+    if (record->pkcs8 != NULL &&
+        (rval = write_tlv(writer, BUNDLE_FIELD_PKCS8, record->pkcs8_len, record->pkcs8)) != HAL_OK) return rval;
+
+    if (record->kek != NULL &&
+        (rval = write_tlv(writer, BUNDLE_FIELD_KEK, record->kek_len, record->kek)) != HAL_OK) return rval;
+
+    if (record->spki != NULL &&
+        (rval = write_tlv(writer, BUNDLE_FIELD_SPKI, record->spki_len, record->spki)) != HAL_OK) return rval;
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        const hal_pkey_attribute_t *attr = &record->attributes[i];
+        uint64_t number;
+        uint32_t id;
+
+        if (attr->length == HAL_PKEY_ATTRIBUTE_NIL)
+        {
+            if ((rval = write_tlv(writer, BUNDLE_FIELD_ATTRIBUTE_NIL, sizeof(uint32_t), NULL)) != HAL_OK ||
+                (rval = write_u32(writer, attr->type)) != HAL_OK) return rval;
+        }
+        else if (attribute_schema_to_number(attr, &number))
+        {
+            if (attribute_schema_type(attr->type) == ATTRIBUTE_SCHEMA_BOOL)
+            {
+                uint8_t value = (uint8_t)number;
+                if ((rval = write_tlv(writer, BUNDLE_FIELD_ATTRIBUTE_BOOL, sizeof(uint32_t) + sizeof(uint8_t), NULL)) != HAL_OK ||
+                    (rval = write_u32(writer, attr->type)) != HAL_OK ||
+                    (rval = write_bytes(writer, &value, sizeof(value))) != HAL_OK) return rval;
+            }
+            else
+            {
+                if ((rval = write_tlv(writer, BUNDLE_FIELD_ATTRIBUTE_ULONG, sizeof(uint32_t) + sizeof(uint64_t), NULL)) != HAL_OK ||
+                    (rval = write_u32(writer, attr->type)) != HAL_OK ||
+                    (rval = write_u64(writer, number)) != HAL_OK) return rval;
+            }
+        }
+        else if (use_dictionary(writer, attr))
+        {
+            if ((rval = attribute_dictionary_add(&writer->dictionary, attr->value, attr->length, &id)) != HAL_OK ||
+                (rval = write_tlv(writer, BUNDLE_FIELD_ATTRIBUTE_REF, 2 * sizeof(uint32_t), NULL)) != HAL_OK ||
+                (rval = write_u32(writer, attr->type)) != HAL_OK ||
+                (rval = write_u32(writer, id)) != HAL_OK) return rval;
+        }
+        else
+        {
+            if ((rval = write_tlv(writer, BUNDLE_FIELD_ATTRIBUTE, sizeof(uint32_t) + attr->length, NULL)) != HAL_OK ||
+                (rval = write_u32(writer, attr->type)) != HAL_OK ||
+                (rval = write_bytes(writer, attr->value, attr->length)) != HAL_OK) return rval;
+        }
+    }
+
+    end_key(writer);
+
+    return HAL_OK;
+}
+
+static int binary_start(bundle_writer_t *writer, const bundle_header_t *header)
+{
+    int rval;
+
+    bundle_file_header_t file_header;
+    memcpy(file_header.magic, BUNDLE_MAGIC, sizeof(file_header.magic));
+    file_header.version = htole32(BUNDLE_VERSION);
+    file_header.header_len = htole32(sizeof(bundle_file_header_t));
+    file_header.flags = htole32(header->incremental ? BUNDLE_FLAG_INCREMENTAL : 0);
+    memcpy(&file_header.kekek_uuid, &header->kekek_uuid, sizeof(hal_uuid_t));
+
+    if ((rval = write_bytes(writer, &file_header, sizeof(file_header))) != HAL_OK) return rval;
+
+    if ((rval = write_tlv(writer, BUNDLE_TAG_DEVICE_INDEX, sizeof(uint32_t), NULL)) != HAL_OK ||
+        (rval = write_u32(writer, (uint32_t)header->device_index)) != HAL_OK) return rval;
+
+    if (header->kekek_pubkey != NULL)
+    {
+        rval = write_tlv(writer, BUNDLE_TAG_KEKEK_PUBKEY, header->kekek_pubkey_len, header->kekek_pubkey);
+    }
+
+    if (rval == HAL_OK && header->kekek_pkcs8 != NULL)
+    {
+        if ((rval = write_tlv(writer, BUNDLE_TAG_KEKEK_SALT, header->kekek_salt_len, header->kekek_salt)) == HAL_OK)
+        {
+            rval = write_tlv(writer, BUNDLE_TAG_KEKEK_PKCS8, header->kekek_pkcs8_len, header->kekek_pkcs8);
+        }
+    }
+
+    return rval;
+}
+
+static int binary_write_dictionary(bundle_writer_t *writer)
+{
+    const attribute_dictionary_t *dictionary = &writer->dictionary;
+    int rval;
+
+    if (dictionary->count == 0) return HAL_OK;
+
+    uint32_t length = sizeof(uint32_t) + dictionary->count * sizeof(uint32_t) + dictionary->data_len;
+
+    if ((rval = write_tlv(writer, BUNDLE_TAG_DICTIONARY, length, NULL)) != HAL_OK ||
+        (rval = write_u32(writer, dictionary->count)) != HAL_OK) return rval;
+
+    for (unsigned int i = 0; i < dictionary->count; ++i)
+    {
+        const attribute_dictionary_entry_t *entry = &dictionary->entries[i];
+
+        if ((rval = write_u32(writer, entry->length)) != HAL_OK ||
+            (rval = write_bytes(writer, dictionary->data + entry->offset, entry->length)) != HAL_OK) return rval;
+    }
+
+    return HAL_OK;
+}
+
+static int binary_finish(bundle_writer_t *writer)
+{
+    int rval;
+
+    // the dictionary is read when the bundle is opened, so it can come last
+    if ((rval = binary_write_dictionary(writer)) != HAL_OK) return rval;
+
+    // the index is sorted by UUID so readers can search it in place
+    qsort(writer->keys, writer->keys_count, sizeof(key_index_entry_t), compare_keys);
+
+    bundle_file_footer_t footer;
+    footer.index_offset = htole64(writer->offset);
+    memcpy(footer.magic, BUNDLE_INDEX_MAGIC, sizeof(footer.magic));
+
+    uint32_t length = sizeof(uint32_t) + writer->keys_count * sizeof(bundle_index_entry_t);
+
+    if ((rval = write_tlv(writer, BUNDLE_TAG_INDEX, length, NULL)) != HAL_OK ||
+        (rval = write_u32(writer, writer->keys_count)) != HAL_OK) return rval;
+
+    for (unsigned int i = 0; i < writer->keys_count; ++i)
+    {
+        bundle_index_entry_t entry;
+        memcpy(&entry.uuid, &writer->keys[i].uuid, sizeof(hal_uuid_t));
+        entry.offset = htole64(writer->keys[i].offset);
+        entry.length = htole32(writer->keys[i].length);
+        entry.reserved = 0;
+
+        if ((rval = write_bytes(writer, &entry, sizeof(entry))) != HAL_OK) return rval;
+    }
+
+    return write_bytes(writer, &footer, sizeof(footer));
+}
+
+// JSON format ----------------------------------------------------------
+static int json_puts(bundle_writer_t *writer, const char *s)
+{
+    // s is NULL when formatting it failed
+    if (s == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    return write_bytes(writer, s, strlen(s));
+}
+
+char *binary_to_split_b64(dks_arena_t *arena, const uint8_t *binary_data, size_t binary_data_len)
+{
+    unsigned int b64size = b64e_size(binary_data_len)+1;
+
+    // make sure the allocation was successful
+    unsigned char *b64data = dks_arena_alloc(arena, b64size);
+    if(b64data == NULL) return NULL;
+
+    unsigned int num_bytes = b64_encode((const unsigned char *)binary_data, binary_data_len, b64data);
+
+    // split b64 like the way CrypTech does it in Python
+    char *splitb64 = dks_arena_alloc(arena, split_b64_size(num_bytes));
+    if (splitb64 == NULL) return NULL;
+
+    return split_b64_into((const char *)b64data, num_bytes, splitb64);
+}
+
+static int json_write_b64(bundle_writer_t *writer, const char *name, const uint8_t *data, size_t len)
+{
+    char *splitb64 = binary_to_split_b64(&writer->arena, data, len);
+    if (splitb64 == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    return json_puts(writer, dks_arena_printf(&writer->arena, ", \"%s\": [ %s ]", name, splitb64));
+}
+
+// close the open array and open the arrays up to section. Arrays other than
+// "keys" are only written for incremental exports, unless they have records
+static int json_goto_section(bundle_writer_t *writer, int section)
+{
+    const char *openers[] = { ",\"keys\": [ ", ", \"unchanged\": [ ", ", \"removed\": [ " };
+    const char *closers[] = { "]", " ]", " ]" };
+    int rval;
+
+    while (writer->section < section)
+    {
+        if (writer->section_open &&
+            (rval = json_puts(writer, closers[writer->section - 1])) != HAL_OK) return rval;
+
+        writer->section++;
+        writer->section_open = (writer->section <= SECTION_REMOVED) &&
+                               (writer->section == section ||
+                                writer->section == SECTION_KEYS ||
+                                writer->incremental);
+        writer->section_records = 0;
+
+        if (writer->section_open &&
+            (rval = json_puts(writer, openers[writer->section - 1])) != HAL_OK) return rval;
+    }
+
+    return HAL_OK;
+}
+
+static int json_add_key(bundle_writer_t *writer, const bundle_record_t *record)
+{
+    dks_arena_t *arena = &writer->arena;
+    char uuid_buffer[40];
+    char fingerprint_buffer[KEY_FINGERPRINT_STRING_LEN];
+    int rval;
+
+    if ((rval = begin_key(writer, record)) != HAL_OK) return rval;
+
+    // start the object
+    if (record->pkcs8 != NULL && record->kek != NULL)
+    {
+        if ((rval = json_puts(writer, "{ \"comment\": \"Encrypted private key\" ")) != HAL_OK) return rval;
+
+        if ((rval = json_write_b64(writer, "pkcs8", record->pkcs8, record->pkcs8_len)) != HAL_OK) return rval;
+        if ((rval = json_write_b64(writer, "kek", record->kek, record->kek_len)) != HAL_OK) return rval;
+    }
+    else if (record->spki != NULL)
+    {
+        if ((rval = json_puts(writer, "{ \"comment\": \"Public key\" ")) != HAL_OK) return rval;
+
+        if ((rval = json_write_b64(writer, "spki", record->spki, record->spki_len)) != HAL_OK) return rval;
+    }
+    else
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    if ((rval = json_puts(writer, dks_arena_printf(arena, ",\"uuid\": \"%s\" ",
+                                                   uuid_to_string(record->uuid, uuid_buffer)))) != HAL_OK) return rval;
+
+    if ((rval = json_puts(writer, dks_arena_printf(arena, ",\"flags\": %u ", record->flags))) != HAL_OK) return rval;
+
+    if (record->key_type != HAL_KEY_TYPE_NONE &&
+        (rval = json_puts(writer, dks_arena_printf(arena, ",\"key_type\": %u ", record->key_type))) != HAL_OK) return rval;
+
+    if (record->has_fingerprint &&
+        (rval = json_puts(writer, dks_arena_printf(arena, ",\"fingerprint\": \"%s\" ",
+                                                   fingerprint_to_string(record->fingerprint, fingerprint_buffer)))) != HAL_OK) return rval;
+
+    if ((rval = json_puts(writer, ", \"attributes\": { ")) != HAL_OK) return rval;
+
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        const hal_pkey_attribute_t *attr = &record->attributes[i];
+        const char *separator = (i > 0) ? "," : "";
+
+        // typed values stay bytes. Older importers guess the size of a
+        // number from its value
+        if (attr->length == HAL_PKEY_ATTRIBUTE_NIL)
+        {
+            rval = json_puts(writer, dks_arena_printf(arena, "%s\"%u\":null", separator, attr->type));
+        }
+        else
+        {
+            char *attr_data = binary_to_split_b64(arena, attr->value, attr->length);
+            if (attr_data == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+            rval = json_puts(writer, dks_arena_printf(arena, "%s\"%u\":[%s]", separator, attr->type, attr_data));
+        }
+
+        if (rval != HAL_OK) return rval;
+    }
+
+    // close
+    if ((rval = json_puts(writer, " }}")) != HAL_OK) return rval;
+
+    end_key(writer);
+
+    return HAL_OK;
+}
+
+static int json_start(bundle_writer_t *writer, const bundle_header_t *header, const char *setup_json)
+{
+    dks_arena_t *arena = &writer->arena;
+    int rval;
+
+    if (setup_json != NULL)
+    {
+        // copy KEKEK info
+        const char *end = strchr(setup_json, '}');
+        rval = write_bytes(writer, setup_json, (end != NULL) ? (size_t)(end - setup_json) : strlen(setup_json));
+    }
+    else
+    {
+        char kekek_uuid_string[40];
+        uuid_to_string(header->kekek_uuid, kekek_uuid_string);
+
+        rval = json_puts(writer, dks_arena_printf(arena, "{\n    \"device_index\": %i,\n    \"comment\": \"KEKEK public key\",\n",
+                                                  header->device_index));
+
+        if (rval == HAL_OK && header->kekek_pubkey != NULL)
+        {
+            char *pubkey = binary_to_split_b64(arena, header->kekek_pubkey, header->kekek_pubkey_len);
+            if (pubkey == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+            rval = json_puts(writer, dks_arena_printf(arena, "    \"kekek_pubkey\": [\n%s\n    ],\n", pubkey));
+        }
+
+        if (rval == HAL_OK && header->kekek_pkcs8 != NULL)
+        {
+            // a software KEKEK, which has no uuid
+            char *pkcs8 = binary_to_split_b64(arena, header->kekek_pkcs8, header->kekek_pkcs8_len);
+            char *salt = binary_to_split_b64(arena, header->kekek_salt, header->kekek_salt_len);
+            if (pkcs8 == NULL || salt == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+            rval = json_puts(writer, dks_arena_printf(arena, "    \"kekek_pkcs8\": [\n%s\n    ],\n"
+                                                             "    \"kekek_salt\": [\n%s\n    ]\n", pkcs8, salt));
+        }
+        else if (rval == HAL_OK)
+        {
+            rval = json_puts(writer, dks_arena_printf(arena, "    \"kekek_uuid\": \"%s\"\n", kekek_uuid_string));
+        }
+    }
+
+    // readers find this before the keys, so they don't have to look
+    // through the whole bundle for the unchanged array
+    if (rval == HAL_OK && header->incremental) rval = json_puts(writer, ",\"incremental\": 1");
+
+    dks_arena_reset(arena);
+
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+int bundle_writer_start(bundle_writer_t *writer, bundle_format_t format, FILE *fp,
+                        const bundle_header_t *header, const char *setup_json)
+{
+    if (writer == NULL || fp == NULL || header == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(writer, 0, sizeof(bundle_writer_t));
+    attribute_dictionary_init(&writer->dictionary);
+    writer->format = format;
+    writer->fp = fp;
+    writer->incremental = header->incremental;
+    writer->section = SECTION_NONE;
+
+    if (dks_arena_init(&writer->arena, 32 * 1024) != HAL_OK) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if (format == BUNDLE_FORMAT_BINARY) return binary_start(writer, header);
+    else return json_start(writer, header, setup_json);
+}
+
+int bundle_writer_add(bundle_writer_t *writer, const bundle_record_t *record)
+{
+    if (writer == NULL || record == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char uuid_buffer[40];
+    char fingerprint_buffer[KEY_FINGERPRINT_STRING_LEN];
+    int rval = HAL_OK;
+
+    if (writer->format == BUNDLE_FORMAT_BINARY)
+    {
+        switch (record->type)
+        {
+            case BUNDLE_RECORD_KEY:
+                return binary_add_key(writer, record);
+            case BUNDLE_RECORD_UNCHANGED:
+                if ((rval = write_tlv(writer, BUNDLE_TAG_UNCHANGED, sizeof(hal_uuid_t) + KEY_FINGERPRINT_LEN, NULL)) != HAL_OK ||
+                    (rval = write_bytes(writer, &record->uuid, sizeof(hal_uuid_t))) != HAL_OK) return rval;
+                return write_bytes(writer, record->fingerprint, KEY_FINGERPRINT_LEN);
+            case BUNDLE_RECORD_REMOVED:
+                return write_tlv(writer, BUNDLE_TAG_REMOVED, sizeof(hal_uuid_t), &record->uuid);
+        }
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    // the JSON arrays have to be written in order
+    int section = record->type + 1;
+    if (section < writer->section) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if ((rval = json_goto_section(writer, section)) != HAL_OK) return rval;
+
+    // the separator isn't part of the record
+    if (writer->section_records > 0 && (rval = json_puts(writer, ", ")) != HAL_OK) return rval;
+
+    switch (record->type)
+    {
+        case BUNDLE_RECORD_KEY:
+            rval = json_add_key(writer, record);
+            break;
+        case BUNDLE_RECORD_UNCHANGED:
+            rval = json_puts(writer, dks_arena_printf(&writer->arena, "{ \"uuid\": \"%s\", \"fingerprint\": \"%s\" }",
+                                                      uuid_to_string(record->uuid, uuid_buffer),
+                                                      fingerprint_to_string(record->fingerprint, fingerprint_buffer)));
+            break;
+        case BUNDLE_RECORD_REMOVED:
+            rval = json_puts(writer, dks_arena_printf(&writer->arena, "\"%s\"",
+                                                      uuid_to_string(record->uuid, uuid_buffer)));
+            break;
+    }
+
+    writer->section_records++;
+    dks_arena_reset(&writer->arena);
+
+    return rval;
+}
+
+int bundle_writer_finish(bundle_writer_t *writer)
+{
+    if (writer == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (writer->format == BUNDLE_FORMAT_BINARY) return binary_finish(writer);
+
+    int rval;
+
+    // the keys array is always there. incremental exports also list the
+    // unchanged and removed keys, even when there aren't any
+    if ((rval = json_goto_section(writer, writer->incremental ? SECTION_REMOVED : SECTION_KEYS)) != HAL_OK) return rval;
+
+    // close the last array
+    if ((rval = json_goto_section(writer, SECTION_REMOVED + 1)) != HAL_OK) return rval;
+
+    // finish the json
+    return json_puts(writer, " }");
+}
+
+int bundle_writer_save_index(bundle_writer_t *writer, const char *path)
+{
+    if (writer == NULL || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (fflush(writer->fp) != 0) return HAL_ERROR_IO_OS_ERROR;
+
+    return key_index_save(path, writer->format, writer->offset, writer->keys, writer->keys_count);
+}
+
+void bundle_writer_free(bundle_writer_t *writer)
+{
+    if (writer == NULL) return;
+
+    free(writer->keys);
+    writer->keys = NULL;
+    writer->keys_count = 0;
+    writer->keys_capacity = 0;
+
+    attribute_dictionary_free(&writer->dictionary);
+    dks_arena_free(&writer->arena);
+}
+
+// the size of the buffer needed by split_b64_into()
+size_t split_b64_size(size_t b64data_len)
+{
+    const size_t CHARS_IN_ROW = 76;
+
+    size_t rows = (b64data_len / CHARS_IN_ROW) + 1;
+    return ((CHARS_IN_ROW + 12) * rows) + 1; // '        "..",\n
+}
+
+char *split_b64_into(const char *b64data, size_t b64data_len, char *splitbuffer)
+{
+    const size_t CHARS_IN_ROW = 76;
+    const char *row_start = "        \"";
+    const char *row_end = "\",\n";
+    char *p = splitbuffer;
+
+    for (size_t i = 0; i < b64data_len || i == 0; i += CHARS_IN_ROW)
+    {
+        if (i > 0)
+        {
+            memcpy(p, row_end, 3);
+            p += 3;
+        }
+        memcpy(p, row_start, 9);
+        p += 9;
+
+        size_t count = b64data_len - i;
+        if (count > CHARS_IN_ROW) count = CHARS_IN_ROW;
+
+        memcpy(p, &b64data[i], count);
+        p += count;
+    }
+    *p++ = '"';
+    *p = 0;
+
+    return splitbuffer;
+}
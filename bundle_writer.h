@@ -0,0 +1,97 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef BUNDLE_WRITER_H
+#define BUNDLE_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <openssl/sha.h>
+
+#include "attribute_dictionary.h"
+#include "bundle.h"
+#include "dks_arena.h"
+#include "key_index.h"
+
+// Writes an export bundle one record at a time. Key records come first,
+// followed by the unchanged and removed records of an incremental export.
+typedef struct
+{
+    bundle_format_t format;
+    FILE *fp;
+    int incremental;
+
+    // JSON: the array that's open and the number of records in it
+    int section;
+    int section_open;
+    unsigned int section_records;
+
+    // bytes written so far, and the digest of the record being written
+    uint64_t offset;
+    int hashing;
+    SHA256_CTX record_hash;
+
+    // where the key records are. Saved as the binary bundle's trailing
+    // index and as the key index
+    key_index_entry_t *keys;
+    unsigned int keys_count;
+    unsigned int keys_capacity;
+
+    // binary: shared attribute values. Written after the records. JSON
+    // bundles write every value in full, so older importers can read them
+    attribute_dictionary_t dictionary;
+
+    // binary: don't share attribute values, so the records can be read
+    // while the bundle is being written. Set after bundle_writer_start
+    int streaming;
+
+    // base64 for the JSON format. reset after every record
+    dks_arena_t arena;
+} bundle_writer_t;
+
+// setup_json is copied to a JSON bundle as is. When it's NULL, the JSON is
+// built from the header
+int bundle_writer_start(bundle_writer_t *writer, bundle_format_t format, FILE *fp,
+                        const bundle_header_t *header, const char *setup_json);
+int bundle_writer_add(bundle_writer_t *writer, const bundle_record_t *record);
+int bundle_writer_finish(bundle_writer_t *writer);
+
+// save the key index after the bundle has been finished
+int bundle_writer_save_index(bundle_writer_t *writer, const char *path);
+void bundle_writer_free(bundle_writer_t *writer);
+
+// split base64 into 76 character JSON strings, the way CrypTech does it in Python
+size_t split_b64_size(size_t b64data_len);
+char *split_b64_into(const char *b64data, size_t b64data_len, char *splitbuffer);
+// base64 encode and split in one go. The result comes from the arena
+char *binary_to_split_b64(dks_arena_t *arena, const uint8_t *binary_data, size_t binary_data_len);
+
+#endif
@@ -31,6 +31,9 @@
 //
 // Script to import CrypTech code into DKS HSM folders.
 //
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <time.h> 
@@ -40,7 +43,22 @@
 #include <slip_internal.h>
 
 #include "libs/base64.c/base64.h"
-#include "djson.h"
+
+#include "backup_store.h"
+#include "bundle_reader.h"
+#include "bundle_writer.h"
+#include "cryptech_device.h"
+#include "dks_arena.h"
+#include "export_manifest.h"
+#include "key_fingerprint.h"
+#include "kekek_pool.h"
+#include "key_tree.h"
+#include "rpc_mux.h"
+#include "rpc_socket.h"
+#include "shard_set.h"
+#include "soft_kekek.h"
+#include "uuid_enum.h"
+#include "uuid_map.h"
 
 #define CK_PTR                                          *
 #define CK_DEFINE_FUNCTION(returnType, name)            returnType name
@@ -58,27 +76,140 @@
     do {                                                        \
         hal_error_t err = (op);                                 \
         if (err) {                                              \
-            printf("%s: %s\r\n", #op, hal_error_string(err));     \
+            cryptech_report("%s: %s\r\n", #op, hal_error_string(err)); \
             return err;                                         \
         }                                                       \
     } while (0)
 
-#define dks_json_throw(a) { rval = a; goto finished; }
+static const unsigned char const_0x010001[] = { 0x01, 0x00, 0x01 };
+
+// the value of KEKEK_POOL_ATTRIBUTE on a KEKEK that hasn't been claimed
+static const uint8_t kekek_pool_available = 1;
 
-#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+// key lists read by the warm-up. See cryptech_use_prefetch
+static __thread const device_prefetch_t *prefetched = NULL;
 
-static const unsigned char const_0x010001[] = { 0x01, 0x00, 0x01 };
+// where this thread's messages and progress go. See cryptech_set_reporter
+static __thread const cryptech_reporter_t *reporter = NULL;
+
+#define SHARD_IMPORT_MAX_THREADS 8
+
+// KEKEK pool claims. See claim_pool_kekek
+#define KEKEK_CLAIM_TOKEN_LEN 8
+#define KEKEK_CLAIM_ATTEMPTS 8
+
+// shared by the threads that import a shard set
+typedef struct
+{
+    hal_client_handle_t client;
+    hal_session_handle_t session;
+    hal_pkey_handle_t kekek;
+    const shard_set_t *set;
+    uuid_map_builder_t *uuid_map;
+
+    // without the RPC multiplexer, one thread at a time talks to the device.
+    // The lock also protects the UUID map and the counters
+    pthread_mutex_t lock;
+    int muxed;
+    serial_connection_t *link;  // the link of the thread that started the import
+    const cryptech_reporter_t *reporter;
+    unsigned int next_shard;
+    unsigned int failed_shards;
+    int rval;
+} shard_import_t;
+
+// the key records of a bundle, decoded once and then only read by the
+// threads of import_keys_multi
+typedef struct
+{
+    dks_arena_t arena;
+    bundle_record_t *records;
+    unsigned int count;
+    unsigned int capacity;
+} record_list_t;
+
+typedef struct
+{
+    import_target_t *target;
+    unsigned int index;
+    const record_list_t *records;
+    const bundle_header_t *header;
+    const uint8_t *kekek_der;   // the decrypted software KEKEK, or NULL
+    size_t kekek_der_len;
+    const cryptech_reporter_t *reporter;
+} import_worker_t;
+
+// where the records of an export go: one bundle, a set of shards or a
+// backup store
+typedef struct
+{
+    bundle_writer_t writer;
+    shard_writer_t *shards;
+    backup_store_writer_t *store;
+} export_output_t;
+
+// one destination of an export
+typedef struct
+{
+    const export_options_t *options;
+    FILE *fp;
+
+    // the KEKEK from the setup JSON
+    bundle_reader_t *setup;
+    bundle_header_t header;
+    hal_pkey_handle_t kekek;
+    int kekek_loaded;
+
+    int incremental;
+    export_manifest_t previous;
+    export_manifest_t unchanged;
+    int unchanged_key;  // the current key is unchanged for this destination
+
+    export_output_t output;
+    shard_writer_t shard_writer;
+    backup_store_writer_t store_writer;
+} export_state_t;
+
+// like check(), but cleans up the export before returning
+#define export_check(op)                                        \
+    do {                                                        \
+        rval = (op);                                            \
+        if (rval != HAL_OK) {                                   \
+            cryptech_report("%s: %s\r\n", #op, hal_error_string(rval)); \
+            goto finished;                                      \
+        }                                                       \
+    } while (0)
 
 // Internal Functions --------------------------------------------------
 char *create_setup_json_string(hal_uuid_t kekek_uuid, uint8_t *kekek_public_key, unsigned int pub_key_len, int device_index);
-hal_error_t add_cached_attributes_to_json(const hal_pkey_handle_t pkey, FILE *fp);
-char *uuid_to_string(hal_uuid_t uuid, char *buffer);
-hal_uuid_t string_to_uuid(char *name);
-
-char *binary_to_split_b64(const uint8_t *binary_data, size_t binary_data_len);
+hal_error_t get_cached_attributes(const hal_pkey_handle_t pkey, dks_arena_t *arena,
+                                  hal_pkey_attribute_t **attributes, unsigned *attributes_len);
+hal_error_t import_bundle_key(const hal_client_handle_t client, const hal_session_handle_t session,
+                              const hal_pkey_handle_t kekek, const bundle_record_t *record,
+                              uuid_map_builder_t *uuid_map);
+
+hal_error_t match_export_filter(uuid_enum_t *keys, const hal_client_handle_t client,
+                                const hal_session_handle_t session, const export_filter_t *filter,
+                                int *filter_on_client);
+int key_has_filter_attributes(const hal_pkey_handle_t pkey, const export_filter_t *filter);
 char *split_b64_string(const char *b64data);
-diamond_json_error_t djson_ext_join_decodeb64string(diamond_json_ptr_t *json_ptr, char **decoded_result, unsigned int *result_len);
 hal_error_t dks_hal_rpc_client_transport_init(void);
+int load_previous_export(export_manifest_t *previous, const char *path, const bundle_header_t *header);
+static int same_kekek(const bundle_header_t *a, const bundle_header_t *b);
+int export_record(export_output_t *output, const bundle_record_t *record);
+static int export_state_open(export_state_t *state, const export_destination_t *destination,
+                             const hal_client_handle_t client, const hal_session_handle_t session);
+static int export_state_finish(export_state_t *state, const hal_client_handle_t client,
+                               const hal_session_handle_t session, const export_filter_t *filter,
+                               uuid_enum_t *all_keys, int *all_keys_loaded);
+static void export_state_close(export_state_t *state, const export_destination_t *destination, int rval);
+static int check_kekek_claim(const hal_pkey_handle_t kekek, const uint8_t *token, size_t token_len, int *owned);
+static int claim_kekek(const hal_pkey_handle_t kekek, kekek_pool_t *pool, const hal_uuid_t *kekek_uuid,
+                       const uint8_t *token, size_t token_len, int *owned,
+                       uint8_t **public_key, size_t *public_key_len);
+static int claim_pool_kekek(const hal_client_handle_t client, const hal_session_handle_t session,
+                            kekek_pool_t *pool, hal_uuid_t *kekek_uuid, uint8_t **public_key, size_t *public_key_len);
+static void report_progress(cryptech_event_t event, const hal_uuid_t *uuid, const hal_uuid_t *new_uuid);
 
 // Function Implementations --------------------------------------------
 int init_cryptech_device(char *pin, uint32_t handle)
@@ -105,680 +236,2035 @@ int close_cryptech_device(uint32_t handle)
     return 0;
 }
 
-int seeded = 0;
+int init_cryptech_device_link(serial_connection_t *link, const char *device, char *pin, uint32_t handle)
+{
+    if (link == NULL || device == NULL || pin == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    hal_client_handle_t client = {handle};
+    hal_user_t user = HAL_USER_WHEEL;
+
+    const char *speed_ = getenv(HAL_CLIENT_SERIAL_SPEED_ENVVAR);
+    uint32_t    speed  = HAL_CLIENT_SERIAL_DEFAULT_SPEED;
+
+    if (speed_ != NULL)
+        speed = (uint32_t) strtoul(speed_, NULL, 10);
+
+    check(serial_connection_open(link, device, speed));
+
+    // this thread's RPCs go to the new link
+    rpc_mux_use_link(link);
+
+    hal_error_t err = hal_rpc_login(client, user, pin, strlen(pin));
+    if (err == HAL_OK) err = hal_rpc_is_logged_in(client, user);
+
+    if (err != HAL_OK)
+    {
+        cryptech_report("Unable to log into '%s': %s\r\n", device, hal_error_string(err));
+        rpc_mux_use_link(NULL);
+        serial_connection_close(link);
+    }
+
+    return err;
+}
+
+int close_cryptech_device_link(serial_connection_t *link, uint32_t handle)
+{
+    hal_client_handle_t client = {handle};
+
+    hal_rpc_logout(client);
+
+    rpc_mux_use_link(NULL);
+
+    return serial_connection_close(link);
+}
+
+void cryptech_set_reporter(const cryptech_reporter_t *new_reporter)
+{
+    reporter = new_reporter;
+}
+
+const cryptech_reporter_t *cryptech_get_reporter(void)
+{
+    return reporter;
+}
+
+void cryptech_report(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (reporter == NULL || reporter->message == NULL)
+    {
+        vprintf(format, args);
+    }
+    else
+    {
+        char message[1024];
+        vsnprintf(message, sizeof(message), format, args);
+        reporter->message(reporter->context, message);
+    }
+
+    va_end(args);
+}
+
+static void report_progress(cryptech_event_t event, const hal_uuid_t *uuid, const hal_uuid_t *new_uuid)
+{
+    if (reporter != NULL && reporter->progress != NULL) reporter->progress(reporter->context, event, uuid, new_uuid);
+}
 
 uint32_t get_random_handle()
 {
     uint32_t handle = 0;
 
-    // make sure the number generator has been seeded
-    if (seeded == 0)
+    // safe to call from any thread, unlike rand()
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if (fp != NULL)
     {
-        seeded = 1;
-        srand(time(0));
+        if (fread(&handle, sizeof(handle), 1, fp) != 1) handle = 0;
+        fclose(fp);
     }
 
-    for (int i = 0; i < 32; ++i)
+    if (handle == 0)
     {
-        int bit = rand() % 2;
-        handle += bit < i;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        handle = (uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec ^ (uint32_t)(uintptr_t)&now;
     }
 
+    // the top bit is left for the tags of rpc_mux, and 0 is the client
+    // handle of RPCs that don't have one
+    handle &= 0x7FFFFFFF;
+    if (handle == 0) handle = 1;
+
     return handle;
 }
 
-int cmp_uuid(char *uuid1, char *uuid2)
+int cryptech_export_keys(uint32_t handle, char *setup_json, FILE **export_json, const export_options_t *options)
 {
-    return memcmp(uuid1, uuid2, sizeof(hal_uuid_t)) == 0;
+    export_destination_t destination;
+    destination.setup_json = setup_json;
+    destination.export_json = export_json;
+    destination.options = options;
+
+    return cryptech_export_keys_multi(handle, &destination, 1);
 }
 
-int cryptech_export_keys(uint32_t handle, char *setup_json, FILE **export_json)
+int cryptech_export_keys_multi(uint32_t handle, export_destination_t *destinations, unsigned int destinations_len)
 {
-    if (export_json == NULL || setup_json == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (destinations == NULL || destinations_len == 0) return HAL_ERROR_BAD_ARGUMENTS;
 
-    FILE *fp;
-    if (*export_json != NULL)
+    for (unsigned int d = 0; d < destinations_len; ++d)
     {
-        fp = *export_json;
+        if (destinations[d].export_json == NULL || destinations[d].setup_json == NULL) return HAL_ERROR_BAD_ARGUMENTS;
     }
-    else
-    {  
-        *export_json = NULL;
 
-        fp = tmpfile();
-        if(fp == NULL)
-        {
-            printf("\r\nUnable to create tmp file.\r\n");
-            return HAL_ERROR_ALLOCATION_FAILURE;
-        }
-    }
-    // copy KEKEK info to export_json
-    char *s = setup_json;
-    while (*s != '}' && *s != 0) fputc(*s++, fp);
+    export_state_t *states = calloc(destinations_len, sizeof(export_state_t));
+    if (states == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
     // add key data
     hal_client_handle_t client = {handle};
     hal_session_handle_t session = {0};
 
-    diamond_json_ptr_t json_ptr;
-    diamond_json_error_t result = DJSON_OK;
-    diamond_json_node_t pool[8];
     int rval = HAL_OK;
 
-    const int MAX_UUIDS = 64;
-    hal_uuid_t uuids[MAX_UUIDS];
+    hal_pkey_handle_t pkey;
+    int pkey_open = 0;
+
+    uuid_enum_t keys;
+    uuid_enum_init(&keys);
+
+    uuid_enum_t all_keys;
+    uuid_enum_init(&all_keys);
+    int all_keys_loaded = 0;
 
     const size_t der_max = 1024 * 8;   // overkill
     const size_t pkcs8_max = 1024 * 8; // overkill
     const size_t kek_max = 512 * 8;
 
-    char pkcs8[pkcs8_max];
-    char kek[kek_max];
-    char der[der_max];
+    // scratch memory for one key. it's reset after every key
+    dks_arena_t arena;
+    if (dks_arena_init(&arena, 64 * 1024) != HAL_OK)
+    {
+        free(states);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
 
+    // every destination gets its own file, previous export and KEKEK. This
+    // is done before touching the keys on the device
+    for (unsigned int d = 0; d < destinations_len; ++d)
+    {
+        rval = export_state_open(&states[d], &destinations[d], client, session);
+        if (rval != HAL_OK) goto finished;
+    }
 
-    dks_json_check(djson_start_parser(setup_json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    // the keys are only enumerated once, so every destination gets the same keys
+    const export_filter_t *filter = (destinations[0].options != NULL) ? destinations[0].options->filter : NULL;
+    int filter_on_client = 0;
 
-    // get the KEKEK
-    dks_json_check(djson_parse_until(&json_ptr, "kekek_pubkey", DJSON_TYPE_Array));
+    rval = match_export_filter(&keys, client, session, filter, &filter_on_client);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("Unable to enumerate the keys on the device: %s\r\n", hal_error_string(rval));
+        goto finished;
+    }
+
+    // loop through all keys on the device
+    for (unsigned int i = 0; i < keys.count; ++i)
+    {
+        char uuid_sub_buffer[40];
+
+        dks_arena_reset(&arena);
+
+        hal_key_type_t pkey_type;
+        hal_key_flags_t pkey_flags;
+
+        bundle_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.type = BUNDLE_RECORD_KEY;
+        record.uuid = keys.uuids[i];
+
+        export_check(hal_rpc_pkey_open(client,
+                                       session,
+                                       &pkey,
+                                       &keys.uuids[i]));
+        pkey_open = 1;
+
+        // the device couldn't match the attributes so do it here
+        if (filter_on_client && !key_has_filter_attributes(pkey, filter))
+        {
+            pkey_open = 0;
+            export_check(hal_rpc_pkey_close(pkey));
+            continue;
+        }
+
+        export_check(hal_rpc_pkey_get_key_type(pkey, &pkey_type));
+        export_check(hal_rpc_pkey_get_key_flags(pkey, &pkey_flags));
+        export_check(get_key_fingerprint(pkey, pkey_type, pkey_flags, record.fingerprint));
+
+        record.key_type = pkey_type;
+        record.flags = pkey_flags;
+        record.has_fingerprint = 1;
+
+        uuid_to_string(keys.uuids[i], uuid_sub_buffer);
+
+        // find the destinations that already have this version of the key
+        unsigned int needed = 0;
+        for (unsigned int d = 0; d < destinations_len; ++d)
+        {
+            export_state_t *state = &states[d];
+            state->unchanged_key = 0;
+
+            if (state->incremental)
+            {
+                export_manifest_entry_t *entry = export_manifest_find(&state->previous, &keys.uuids[i]);
+                if (entry != NULL) entry->seen = 1;
+
+                // the key is in the previous export and hasn't changed
+                if (entry != NULL && memcmp(entry->fingerprint, record.fingerprint, KEY_FINGERPRINT_LEN) == 0)
+                {
+                    export_check(export_manifest_add(&state->unchanged, &keys.uuids[i], record.fingerprint));
+                    state->unchanged_key = 1;
+
+                    if (destinations_len == 1) cryptech_report("Key '%s' unchanged.\r\n", uuid_sub_buffer);
+                    else cryptech_report("Key '%s' unchanged for export %u.\r\n", uuid_sub_buffer, d + 1);
+                    report_progress(CRYPTECH_EVENT_KEY_UNCHANGED, &keys.uuids[i], NULL);
+                    continue;
+                }
+            }
+
+            ++needed;
+        }
+
+        int is_private = (pkey_type == HAL_KEY_TYPE_RSA_PRIVATE || pkey_type == HAL_KEY_TYPE_EC_PRIVATE);
+        int is_public = (pkey_type == HAL_KEY_TYPE_RSA_PUBLIC || pkey_type == HAL_KEY_TYPE_EC_PUBLIC);
+
+        if (needed > 0 && !is_private && !is_public)
+        {
+            cryptech_report("Key '%s' skipped. Its type can't be exported.\r\n", uuid_sub_buffer);
+            report_progress(CRYPTECH_EVENT_KEY_SKIPPED, &keys.uuids[i], NULL);
+        }
+        if (needed == 0 || (!is_private && !is_public))
+        {
+            pkey_open = 0;
+            export_check(hal_rpc_pkey_close(pkey));
+            continue;
+        }
+
+        // the public key and the attributes are the same for every destination
+        if (is_public)
+        {
+            uint8_t *der = dks_arena_alloc(&arena, der_max);
+
+            if (der == NULL)
+            {
+                rval = HAL_ERROR_ALLOCATION_FAILURE;
+                goto finished;
+            }
+
+            export_check(hal_rpc_pkey_get_public_key(pkey,
+                                                     der, &record.spki_len, der_max));
+
+            record.spki = der;
+        }
+
+        export_check(get_cached_attributes(pkey, &arena, &record.attributes, &record.attributes_len));
+
+        // a private key is wrapped for each KEKEK
+        for (unsigned int d = 0; d < destinations_len; ++d)
+        {
+            if (states[d].unchanged_key) continue;
+
+            if (is_private)
+            {
+                uint8_t *pkcs8 = dks_arena_alloc(&arena, pkcs8_max);
+                uint8_t *kek = dks_arena_alloc(&arena, kek_max);
+
+                if (pkcs8 == NULL || kek == NULL)
+                {
+                    rval = HAL_ERROR_ALLOCATION_FAILURE;
+                    goto finished;
+                }
+
+                export_check(hal_rpc_pkey_export(pkey,
+                                                 states[d].kekek,
+                                                 pkcs8, &record.pkcs8_len, pkcs8_max,
+                                                 kek,   &record.kek_len,   kek_max));
+
+                record.pkcs8 = pkcs8;
+                record.kek = kek;
+            }
+
+            rval = export_record(&states[d].output, &record);
+            if (rval != HAL_OK) goto finished;
+        }
+
+        pkey_open = 0;
+        export_check(hal_rpc_pkey_close(pkey));
+
+        cryptech_report("Key '%s' processed.\r\n", uuid_sub_buffer);
+        report_progress(CRYPTECH_EVENT_KEY_EXPORTED, &keys.uuids[i], NULL);
+    }
+
+    for (unsigned int d = 0; d < destinations_len && rval == HAL_OK; ++d)
+    {
+        rval = export_state_finish(&states[d], client, session, filter, &all_keys, &all_keys_loaded);
+    }
+
+finished:
+    if (pkey_open) hal_rpc_pkey_close(pkey);
+
+    for (unsigned int d = 0; d < destinations_len; ++d)
+    {
+        export_state_close(&states[d], &destinations[d], rval);
+    }
+    free(states);
+
+    dks_arena_free(&arena);
+    uuid_enum_free(&keys);
+    uuid_enum_free(&all_keys);
+
+    return rval;
+}
+
+// get the previous export, the KEKEK and the output of a destination ready
+static int export_state_open(export_state_t *state, const export_destination_t *destination,
+                             const hal_client_handle_t client, const hal_session_handle_t session)
+{
+    const export_options_t *options = destination->options;
+    int rval;
+
+    state->options = options;
+    export_manifest_init(&state->previous);
+    export_manifest_init(&state->unchanged);
+
+    state->fp = *destination->export_json;
+    if (state->fp == NULL)
+    {
+        state->fp = tmpfile();
+        if (state->fp == NULL)
+        {
+            cryptech_report("\r\nUnable to create tmp file.\r\n");
+            return HAL_ERROR_ALLOCATION_FAILURE;
+        }
+    }
+
+    state->incremental = (options != NULL && options->previous_path != NULL);
+
+    // get the KEKEK from the setup JSON
+    state->setup = bundle_reader_open_json(destination->setup_json, &rval);
+    if (state->setup == NULL || bundle_reader_header(state->setup)->kekek_pubkey == NULL)
+    {
+        cryptech_report("\r\nUnable to read the KEKEK from the setup JSON.\r\n");
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    state->header = *bundle_reader_header(state->setup);
+    state->header.incremental = state->incremental;
+
+    // load the keys from the previous export. It must have gone to the same
+    // KEKEK, or the destination never received the keys it skips
+    if (state->incremental)
+    {
+        rval = load_previous_export(&state->previous, options->previous_path, &state->header);
+        if (rval != HAL_OK)
+        {
+            cryptech_report("\r\nUnable to read the previous export.\r\n");
+            return rval;
+        }
+        cryptech_report("Found %u keys in the previous export.\r\n", state->previous.count);
+    }
+
+    // shard sets and backup stores only keep the uuid of the KEKEK
+    if (state->header.kekek_pkcs8 != NULL && options != NULL &&
+        (options->store_path != NULL || options->shard_size > 0))
+    {
+        cryptech_report("\r\nA software KEKEK can only be used for a single export file.\r\n");
+        return HAL_ERROR_NOT_IMPLEMENTED;
+    }
+
+    // copy KEKEK info to the export
+    if (options != NULL && options->store_path != NULL)
+    {
+        // the keys go to the store. The export file gets the run manifest
+        state->output.store = &state->store_writer;
+        rval = backup_store_writer_start(state->output.store, options->store_path, options->previous_path,
+                                         &state->header.kekek_uuid);
+    }
+    else if (options != NULL && options->shard_size > 0)
+    {
+        // every shard gets the KEKEK info. The export file gets the manifest
+        state->output.shards = &state->shard_writer;
+        rval = shard_writer_start(state->output.shards, options->format, options->shard_path, options->shard_size,
+                                  options->index_path != NULL, &state->header, destination->setup_json);
+    }
+    else
+    {
+        rval = bundle_writer_start(&state->output.writer, (options != NULL) ? options->format : BUNDLE_FORMAT_JSON,
+                                   state->fp, &state->header, destination->setup_json);
+        state->output.writer.streaming = (options != NULL) ? options->streaming : 0;
+    }
+    if (rval != HAL_OK) return rval;
 
-    hal_pkey_handle_t kekek;
     hal_uuid_t kekek_uuid;
-    char *kekek_data = NULL;
-    int kekek_len;
-    dks_json_check(djson_ext_join_decodeb64string(&json_ptr, &kekek_data, &kekek_len));
 
-    check(hal_rpc_pkey_load(client,
-                            session,
-                            &kekek,
-                            &kekek_uuid,
-                            kekek_data, kekek_len,
-                            HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT));
+    rval = hal_rpc_pkey_load(client,
+                             session,
+                             &state->kekek,
+                             &kekek_uuid,
+                             state->header.kekek_pubkey, state->header.kekek_pubkey_len,
+                             HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("hal_rpc_pkey_load: %s\r\n", hal_error_string(rval));
+        return rval;
+    }
+    state->kekek_loaded = 1;
 
     char temp_buffer[40];
-    printf("Loaded KEYENCIPHERMENT as '%s'.\r\n", uuid_to_string(kekek_uuid, temp_buffer));
+    cryptech_report("Loaded KEYENCIPHERMENT as '%s'.\r\n", uuid_to_string(kekek_uuid, temp_buffer));
+
+    return HAL_OK;
+}
+
+// add the unchanged and removed keys and finish the output of a destination
+static int export_state_finish(export_state_t *state, const hal_client_handle_t client,
+                               const hal_session_handle_t session, const export_filter_t *filter,
+                               uuid_enum_t *all_keys, int *all_keys_loaded)
+{
+    int rval = HAL_OK;
 
-    hal_uuid_t previous_uuid;
-    memset(&previous_uuid, 0, sizeof(previous_uuid));
+    if (state->incremental)
+    {
+        // keep the fingerprints of the skipped keys so this export can be
+        // used as the previous export next time
+        bundle_record_t record;
+        memset(&record, 0, sizeof(record));
+
+        record.type = BUNDLE_RECORD_UNCHANGED;
+        record.has_fingerprint = 1;
+        for (unsigned int i = 0; i < state->unchanged.count && rval == HAL_OK; ++i)
+        {
+            record.uuid = state->unchanged.entries[i].uuid;
+            memcpy(record.fingerprint, state->unchanged.entries[i].fingerprint, KEY_FINGERPRINT_LEN);
+
+            rval = export_record(&state->output, &record);
+        }
+        if (rval != HAL_OK) return rval;
 
-    unsigned n = 0, state = 0, first = 1;
+        // keys that the filter left out are not gone, so get every
+        // exportable key before deciding what has been removed
+        if (filter != NULL && !*all_keys_loaded)
+        {
+            rval = match_export_filter(all_keys, client, session, NULL, NULL);
+            if (rval != HAL_OK) return rval;
 
-    fputs(",\"keys\": [ ", fp);
+            *all_keys_loaded = 1;
+        }
 
-    int isfirstuuid = 1;
-    hal_uuid_t first_uuid;
+        // keys in the previous export that are no longer on the device
+        record.type = BUNDLE_RECORD_REMOVED;
+        record.has_fingerprint = 0;
+        for (unsigned int i = 0; i < state->previous.count && rval == HAL_OK; ++i)
+        {
+            if (state->previous.entries[i].seen) continue;
+            if (filter != NULL && uuid_enum_contains(all_keys, &state->previous.entries[i].uuid)) continue;
 
-    // loop through all keys on the device
-    do
+            record.uuid = state->previous.entries[i].uuid;
+            rval = export_record(&state->output, &record);
+        }
+        if (rval != HAL_OK) return rval;
+
+        cryptech_report("%u keys unchanged since the previous export.\r\n", state->unchanged.count);
+    }
+
+    if (state->output.store != NULL)
     {
-        // First try to find an exisiting KEKEK on the device
-        check(hal_rpc_pkey_match(client,
-                                 session,
-                                 HAL_KEY_TYPE_NONE,
-                                 HAL_CURVE_NONE,
-                                 HAL_KEY_FLAG_EXPORTABLE,
-                                 HAL_KEY_FLAG_EXPORTABLE,
-                                 NULL, // const hal_pkey_attribute_t *attributes,
-                                 0,    // const unsigned attributes_len,
-                                 &state,
-                                 uuids,
-                                 &n,
-                                 MAX_UUIDS,
-                                 &previous_uuid));
-
-        for (int i = 0; i < n; ++i)
+        rval = backup_store_writer_finish(state->output.store, state->fp);
+    }
+    else if (state->output.shards != NULL)
+    {
+        rval = shard_writer_finish(state->output.shards, state->fp);
+        if (rval == HAL_OK) cryptech_report("%u shards written.\r\n", state->output.shards->set.count);
+    }
+    else
+    {
+        rval = bundle_writer_finish(&state->output.writer);
+
+        if (rval == HAL_OK && state->options != NULL && state->options->index_path != NULL)
+        {
+            rval = bundle_writer_save_index(&state->output.writer, state->options->index_path);
+        }
+    }
+
+    return rval;
+}
+
+static void export_state_close(export_state_t *state, const export_destination_t *destination, int rval)
+{
+    bundle_writer_free(&state->output.writer);
+    shard_writer_free(&state->shard_writer);
+    backup_store_writer_free(&state->store_writer);
+    export_manifest_free(&state->previous);
+    export_manifest_free(&state->unchanged);
+
+    // the header points into the setup reader
+    bundle_reader_close(state->setup);
+
+    if (state->kekek_loaded)
+    {
+        hal_error_t err = hal_rpc_pkey_delete(state->kekek);
+        if (err != HAL_OK) cryptech_report("hal_rpc_pkey_delete: %s\r\n", hal_error_string(err));
+    }
+
+    if (state->fp == NULL) return;
+
+    if (rval != HAL_OK) fclose(state->fp);
+    else *destination->export_json = state->fp;
+}
+
+// the fingerprints of the keys in a previous export, shard set or backup store run
+// whether two exports went to the same KEKEK. The public key is compared
+// when both have one, since a software KEKEK has no uuid
+static int same_kekek(const bundle_header_t *a, const bundle_header_t *b)
+{
+    if (a->kekek_pubkey != NULL && b->kekek_pubkey != NULL)
+    {
+        return a->kekek_pubkey_len == b->kekek_pubkey_len &&
+               memcmp(a->kekek_pubkey, b->kekek_pubkey, a->kekek_pubkey_len) == 0;
+    }
+
+    return memcmp(&a->kekek_uuid, &b->kekek_uuid, sizeof(hal_uuid_t)) == 0;
+}
+
+int load_previous_export(export_manifest_t *previous, const char *path, const bundle_header_t *header)
+{
+    int err;
+
+    if (backup_store_run_is_manifest(path))
+    {
+        backup_store_run_t run;
+        if ((err = backup_store_run_load(path, &run)) != HAL_OK) return err;
+
+        if (memcmp(&run.kekek_uuid, &header->kekek_uuid, sizeof(hal_uuid_t)) != 0)
+        {
+            cryptech_report("\r\nThe previous export used a different KEKEK.\r\n");
+            backup_store_run_free(&run);
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
+
+        for (unsigned int i = 0; i < run.count && err == HAL_OK; ++i)
+        {
+            if (!run.refs[i].has_fingerprint) continue;
+            err = export_manifest_add(previous, &run.refs[i].uuid, run.refs[i].fingerprint);
+        }
+
+        backup_store_run_free(&run);
+        export_manifest_sort(previous);
+
+        return err;
+    }
+
+    if (!shard_set_is_manifest(path))
+    {
+        bundle_reader_t *previous_bundle = bundle_reader_open(path, &err);
+        if (previous_bundle != NULL)
         {
-            if (isfirstuuid) {
-                memcpy(&first_uuid, &uuids[i], sizeof(hal_uuid_t));
-                isfirstuuid = 0;
+            if (!same_kekek(bundle_reader_header(previous_bundle), header))
+            {
+                cryptech_report("\r\nThe previous export used a different KEKEK.\r\n");
+                err = HAL_ERROR_BAD_ARGUMENTS;
             }
-            else if (cmp_uuid((char *)&first_uuid, (char *)&uuids[i]) == 1)
+            else
             {
-                n = 0;
-                break;
+                err = export_manifest_load(previous, previous_bundle);
             }
-            // start the object
-            if (first) { fputs("{ ", fp); first = 0; }
-            else { fputs(", { ", fp); }
+            bundle_reader_close(previous_bundle);
+        }
 
-            // write the data
-            char uuid_buffer[64];
-            char uuid_sub_buffer[40];
-            char flags_buffer[32];
+        return err;
+    }
 
-            hal_pkey_handle_t pkey;
-            hal_key_type_t pkey_type;
-            hal_key_flags_t pkey_flags;
+    shard_set_t set;
+    if ((err = shard_set_load(path, &set)) != HAL_OK) return err;
 
-            check(hal_rpc_pkey_open(client,
-                                    session,
-                                    &pkey,
-                                    &uuids[i]));
+    // shard_set_open checks each shard against the set's KEKEK
+    if (memcmp(&set.kekek_uuid, &header->kekek_uuid, sizeof(hal_uuid_t)) != 0)
+    {
+        cryptech_report("\r\nThe previous export used a different KEKEK.\r\n");
+        shard_set_free(&set);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
 
-            check(hal_rpc_pkey_get_key_type(pkey, &pkey_type));
-            check(hal_rpc_pkey_get_key_flags(pkey, &pkey_flags));
+    for (unsigned int i = 0; i < set.count && err == HAL_OK; ++i)
+    {
+        bundle_reader_t *previous_bundle = shard_set_open(&set, i, &err);
+        if (previous_bundle != NULL)
+        {
+            err = export_manifest_load(previous, previous_bundle);
+            bundle_reader_close(previous_bundle);
+        }
+
+        if (err != HAL_OK) cryptech_report("\r\nUnable to read shard '%s'.\r\n", set.shards[i].path);
+    }
+
+    shard_set_free(&set);
+
+    return err;
+}
+
+int export_record(export_output_t *output, const bundle_record_t *record)
+{
+    if (output->store != NULL) return backup_store_writer_add(output->store, record);
+    if (output->shards != NULL) return shard_writer_add(output->shards, record);
+
+    return bundle_writer_add(&output->writer, record);
+}
+
+int export_filter_add_attribute(export_filter_t *filter, uint32_t type, const void *value, size_t length)
+{
+    if (filter == NULL || value == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (filter->attributes_len >= EXPORT_FILTER_MAX_ATTRIBUTES) return HAL_ERROR_RESULT_TOO_LONG;
+
+    hal_pkey_attribute_t *attr = &filter->attributes[filter->attributes_len++];
+    attr->type = type;
+    attr->value = value;
+    attr->length = length;
+
+    return HAL_OK;
+}
+
+hal_error_t match_export_filter(uuid_enum_t *keys, const hal_client_handle_t client,
+                                const hal_session_handle_t session, const export_filter_t *filter,
+                                int *filter_on_client)
+{
+    if (filter_on_client != NULL) *filter_on_client = 0;
+
+    if (filter == NULL)
+    {
+        if (prefetched != NULL) return uuid_enum_copy(keys, &prefetched->exportable);
+
+        return uuid_enum_match(keys, client, session,
+                               HAL_KEY_TYPE_NONE,
+                               HAL_CURVE_NONE,
+                               HAL_KEY_FLAG_EXPORTABLE,
+                               HAL_KEY_FLAG_EXPORTABLE,
+                               NULL, // const hal_pkey_attribute_t *attributes,
+                               0);   // const unsigned attributes_len
+    }
+
+    const hal_key_flags_t mask = filter->flags_mask | HAL_KEY_FLAG_EXPORTABLE;
+    const hal_key_flags_t flags = (filter->flags & filter->flags_mask) | HAL_KEY_FLAG_EXPORTABLE;
+
+    hal_error_t err = uuid_enum_match(keys, client, session,
+                                      filter->key_type, filter->curve, mask, flags,
+                                      filter->attributes, filter->attributes_len);
+
+    if (err == HAL_OK || filter->attributes_len == 0) return err;
+
+    // transport, login and other errors aren't about the attributes
+    if (err != HAL_ERROR_NOT_IMPLEMENTED && err != HAL_ERROR_BAD_ATTRIBUTE_LENGTH) return err;
+
+    // the device didn't accept the attributes. Let it match everything else
+    // and leave the attributes to the caller
+    cryptech_report("The device is unable to match attributes. Filtering keys locally.\r\n");
+
+    uuid_enum_free(keys);
+    if (filter_on_client != NULL) *filter_on_client = 1;
+
+    return uuid_enum_match(keys, client, session,
+                           filter->key_type, filter->curve, mask, flags,
+                           NULL, // const hal_pkey_attribute_t *attributes,
+                           0);   // const unsigned attributes_len
+}
+
+int key_has_filter_attributes(const hal_pkey_handle_t pkey, const export_filter_t *filter)
+{
+    // larger than 2048 can cause a RPC packet overflow error
+    const size_t attributes_buffer_len = 2048;
+    uint8_t attributes_buffer[attributes_buffer_len];
+
+    for (unsigned i = 0; i < filter->attributes_len; ++i)
+    {
+        hal_pkey_attribute_t attr_get = { .type = filter->attributes[i].type };
+
+        if (hal_rpc_pkey_get_attributes(pkey, &attr_get, 1,
+                                        attributes_buffer, attributes_buffer_len) != HAL_OK ||
+            attr_get.length != filter->attributes[i].length ||
+            memcmp(attr_get.value, filter->attributes[i].value, attr_get.length) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int cryptech_list_keys(uint32_t handle)
+{
+    return cryptech_write_key_list(handle, stdout);
+}
+
+int cryptech_write_key_list(uint32_t handle, FILE *fp)
+{
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+
+    const char *type_strings[] = { "none", "RSA private", "RSA public", "EC private", "EC public",
+                                   "hashsig private", "hashsig public", "hashsig LMS", "hashsig LMOTS" };
+    const int num_type_strings = sizeof(type_strings) / sizeof(type_strings[0]);
+
+    uuid_enum_t keys;
+    uuid_enum_init(&keys);
+
+    int rval = (prefetched != NULL) ? uuid_enum_copy(&keys, &prefetched->keys) :
+               uuid_enum_match(&keys,
+                               client,
+                               session,
+                               HAL_KEY_TYPE_NONE,
+                               HAL_CURVE_NONE,
+                               0,    // const hal_key_flags_t mask,
+                               0,    // const hal_key_flags_t flags,
+                               NULL, // const hal_pkey_attribute_t *attributes,
+                               0);   // const unsigned attributes_len
+
+    if (rval != HAL_OK)
+    {
+        fprintf(fp, "Unable to enumerate the keys on the device: %s\r\n", hal_error_string(rval));
+        uuid_enum_free(&keys);
+        return rval;
+    }
+
+    fprintf(fp, "\r\n%u keys on the device.\r\n", keys.count);
+
+    for (unsigned int i = 0; i < keys.count; ++i)
+    {
+        char uuid_buffer[40];
+        hal_pkey_handle_t pkey;
+        hal_key_type_t pkey_type;
+        hal_key_flags_t pkey_flags;
+
+        uuid_to_string(keys.uuids[i], uuid_buffer);
+
+        // keep going so one bad key doesn't hide the rest
+        if (hal_rpc_pkey_open(client, session, &pkey, &keys.uuids[i]) != HAL_OK)
+        {
+            fprintf(fp, "%s  (unable to open)\r\n", uuid_buffer);
+            continue;
+        }
+
+        if (hal_rpc_pkey_get_key_type(pkey, &pkey_type) == HAL_OK &&
+            hal_rpc_pkey_get_key_flags(pkey, &pkey_flags) == HAL_OK)
+        {
+            fprintf(fp, "%s  %-15s  flags: 0x%04x\r\n", uuid_buffer,
+                    (pkey_type < num_type_strings) ? type_strings[pkey_type] : "unknown",
+                    pkey_flags);
+        }
+
+        hal_rpc_pkey_close(pkey);
+    }
+
+    uuid_enum_free(&keys);
+
+    return HAL_OK;
+}
+
+void device_prefetch_init(device_prefetch_t *prefetch)
+{
+    uuid_enum_init(&prefetch->keys);
+    uuid_enum_init(&prefetch->exportable);
+    uuid_enum_init(&prefetch->kekeks);
+    uuid_enum_init(&prefetch->pool);
+}
+
+void device_prefetch_free(device_prefetch_t *prefetch)
+{
+    if (prefetched == prefetch) prefetched = NULL;
+
+    uuid_enum_free(&prefetch->keys);
+    uuid_enum_free(&prefetch->exportable);
+    uuid_enum_free(&prefetch->kekeks);
+    uuid_enum_free(&prefetch->pool);
+}
+
+int cryptech_prefetch(uint32_t handle, device_prefetch_t *prefetch)
+{
+    if (prefetch == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+
+    // the same matches that cryptech_list_keys, match_export_filter, and
+    // setup_backup_destination make
+    check(uuid_enum_match(&prefetch->keys, client, session,
+                          HAL_KEY_TYPE_NONE, HAL_CURVE_NONE,
+                          0, 0,
+                          NULL, 0));
+
+    check(uuid_enum_match(&prefetch->exportable, client, session,
+                          HAL_KEY_TYPE_NONE, HAL_CURVE_NONE,
+                          HAL_KEY_FLAG_EXPORTABLE, HAL_KEY_FLAG_EXPORTABLE,
+                          NULL, 0));
+
+    check(uuid_enum_match(&prefetch->kekeks, client, session,
+                          HAL_KEY_TYPE_RSA_PRIVATE, HAL_CURVE_NONE,
+                          HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                          HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                          NULL, 0));
+
+    hal_pkey_attribute_t pool_attribute = { KEKEK_POOL_ATTRIBUTE, sizeof(kekek_pool_available), &kekek_pool_available };
+    check(uuid_enum_match(&prefetch->pool, client, session,
+                          HAL_KEY_TYPE_RSA_PRIVATE, HAL_CURVE_NONE,
+                          HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                          HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                          &pool_attribute, 1));
+
+    return HAL_OK;
+}
+
+void cryptech_use_prefetch(const device_prefetch_t *prefetch)
+{
+    prefetched = prefetch;
+}
+
+int cryptech_key_tree(uint32_t handle, key_tree_t *tree)
+{
+    if (tree == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+
+    uuid_enum_t keys;
+    uuid_enum_init(&keys);
+
+    int rval = uuid_enum_match(&keys, client, session, HAL_KEY_TYPE_NONE, HAL_CURVE_NONE, 0, 0, NULL, 0);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("Unable to enumerate the keys on the device: %s\r\n", hal_error_string(rval));
+        uuid_enum_free(&keys);
+        return rval;
+    }
+
+    for (unsigned int i = 0; i < keys.count && rval == HAL_OK; ++i)
+    {
+        hal_pkey_handle_t pkey;
+        hal_key_type_t pkey_type;
+        hal_key_flags_t pkey_flags;
+        uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+        uint8_t identity[KEY_FINGERPRINT_LEN];
+
+        // only the public parts are read
+        rval = hal_rpc_pkey_open(client, session, &pkey, &keys.uuids[i]);
+        if (rval != HAL_OK) break;
+
+        if ((rval = hal_rpc_pkey_get_key_type(pkey, &pkey_type)) == HAL_OK &&
+            (rval = hal_rpc_pkey_get_key_flags(pkey, &pkey_flags)) == HAL_OK &&
+            (rval = get_key_fingerprint_identity(pkey, pkey_type, pkey_flags, fingerprint, identity)) == HAL_OK)
+        {
+            rval = key_tree_add(tree, identity, fingerprint, &keys.uuids[i]);
+        }
+
+        hal_rpc_pkey_close(pkey);
+
+        if (rval != HAL_OK)
+        {
+            char uuid_buffer[40];
+            cryptech_report("Unable to read key '%s': %s\r\n", uuid_to_string(keys.uuids[i], uuid_buffer),
+                   hal_error_string(rval));
+        }
+    }
+
+    uuid_enum_free(&keys);
+
+    return (rval == HAL_OK) ? key_tree_build(tree) : rval;
+}
+
+// read back the claim token on a KEKEK. *owned is cleared when another
+// client's token replaced this one
+static int check_kekek_claim(const hal_pkey_handle_t kekek, const uint8_t *token, size_t token_len, int *owned)
+{
+    uint8_t attributes_buffer[64];
+    hal_pkey_attribute_t current = { .type = KEKEK_POOL_ATTRIBUTE };
+
+    check(hal_rpc_pkey_get_attributes(kekek, &current, 1, attributes_buffer, sizeof(attributes_buffer)));
+
+    *owned = (current.length == token_len && memcmp(current.value, token, token_len) == 0);
+
+    return HAL_OK;
+}
+
+// claim one KEKEK from the pool. The device can't swap an attribute in one
+// step, so the attribute is first set to a random token, and the token is
+// read back before and after the public key is read. A client that sees
+// another client's token leaves the KEKEK alone. A failure puts the KEKEK
+// back in the pool, but only while it still holds this client's token.
+//
+// The token only catches clients whose writes overlap. A client that
+// matched the KEKEK earlier can still write its token after this one has
+// cleared the attribute, so callers also hold the pool lock. See
+// kekek_pool_lock
+static int claim_kekek(const hal_pkey_handle_t kekek, kekek_pool_t *pool, const hal_uuid_t *kekek_uuid,
+                       const uint8_t *token, size_t token_len, int *owned,
+                       uint8_t **public_key, size_t *public_key_len)
+{
+    hal_pkey_attribute_t available = { KEKEK_POOL_ATTRIBUTE, sizeof(kekek_pool_available), &kekek_pool_available };
+    hal_pkey_attribute_t claiming = { KEKEK_POOL_ATTRIBUTE, token_len, token };
+    hal_pkey_attribute_t claimed = { KEKEK_POOL_ATTRIBUTE, HAL_PKEY_ATTRIBUTE_NIL, NULL };
+
+    *owned = 0;
+    check(hal_rpc_pkey_set_attributes(kekek, &claiming, 1));
+
+    hal_error_t result = check_kekek_claim(kekek, token, token_len, owned);
+    if (result == HAL_OK && !*owned) return HAL_OK;
+
+    // the public key is usually cached
+    const kekek_pool_entry_t *entry = kekek_pool_find(pool, kekek_uuid);
+    if (result == HAL_OK && entry != NULL)
+    {
+        *public_key_len = entry->pubkey_len;
+        *public_key = (uint8_t *)malloc(*public_key_len);
+        if (*public_key == NULL) result = HAL_ERROR_ALLOCATION_FAILURE;
+        else memcpy(*public_key, entry->pubkey, *public_key_len);
+    }
+    else if (result == HAL_OK)
+    {
+        size_t der_max = hal_rpc_pkey_get_public_key_len(kekek);
+        *public_key = (uint8_t *)malloc(der_max);
+        if (*public_key == NULL) result = HAL_ERROR_ALLOCATION_FAILURE;
+        else result = hal_rpc_pkey_get_public_key(kekek, *public_key, public_key_len, der_max);
+    }
+
+    if (result == HAL_OK) result = check_kekek_claim(kekek, token, token_len, owned);
+    if (result == HAL_OK && *owned) result = hal_rpc_pkey_set_attributes(kekek, &claimed, 1);
+
+    if (result != HAL_OK || !*owned)
+    {
+        free(*public_key);
+        *public_key = NULL;
+    }
+
+    if (result != HAL_OK)
+    {
+        // a KEKEK that another client has taken over is left with it
+        int still_owned = 0;
+        if (check_kekek_claim(kekek, token, token_len, &still_owned) != HAL_OK ||
+            (still_owned && hal_rpc_pkey_set_attributes(kekek, &available, 1) != HAL_OK))
+        {
+            char uuid_buffer[40];
+            cryptech_report("\r\nUnable to return KEKEK '%s' to the pool.\r\n", uuid_to_string(*kekek_uuid, uuid_buffer));
+        }
+        *owned = 0;
+    }
+
+    return result;
+}
+
+// find a KEKEK that hasn't been claimed, and claim it. A KEKEK that another
+// client claims at the same time is skipped. The caller holds the pool lock
+// when it has a pool cache
+static int claim_pool_kekek(const hal_client_handle_t client, const hal_session_handle_t session,
+                            kekek_pool_t *pool, hal_uuid_t *kekek_uuid, uint8_t **public_key, size_t *public_key_len)
+{
+    hal_pkey_attribute_t attribute = { KEKEK_POOL_ATTRIBUTE, sizeof(kekek_pool_available), &kekek_pool_available };
+    uint8_t token[KEKEK_CLAIM_TOKEN_LEN];
+
+    check(hal_rpc_get_random(token, sizeof(token)));
+
+    for (unsigned int attempt = 0; attempt < KEKEK_CLAIM_ATTEMPTS; ++attempt)
+    {
+        hal_uuid_t previous_uuid;
+        unsigned int state = 0, n = 0;
+        memset(&previous_uuid, 0, sizeof(previous_uuid));
+
+        // a KEKEK lost to another client no longer matches
+        check(hal_rpc_pkey_match(client,
+                                 session,
+                                 HAL_KEY_TYPE_RSA_PRIVATE,
+                                 HAL_CURVE_NONE,
+                                 HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                 HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                 &attribute, 1,
+                                 &state, kekek_uuid, &n, 1, &previous_uuid));
+
+        if (n == 0) return HAL_ERROR_KEY_NOT_FOUND;
+
+        hal_pkey_handle_t kekek;
+        check(hal_rpc_pkey_open(client, session, &kekek, kekek_uuid));
+
+        int owned = 0;
+        hal_error_t result = claim_kekek(kekek, pool, kekek_uuid, token, sizeof(token), &owned,
+                                         public_key, public_key_len);
+
+        // once claimed, the KEKEK is used even if the handle doesn't close
+        hal_rpc_pkey_close(kekek);
+
+        if (result != HAL_OK)
+        {
+            free(*public_key);
+            *public_key = NULL;
+            return result;
+        }
+
+        if (owned)
+        {
+            kekek_pool_remove(pool, kekek_uuid);
+            return HAL_OK;
+        }
+    }
+
+    return HAL_ERROR_KEY_NOT_FOUND;
+}
+
+int setup_backup_destination_from_pool(uint32_t handle, int device_index, const char *pool_path, char **json_result)
+{
+    if (json_result == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *json_result = NULL;
+
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+
+    kekek_pool_t pool;
+    kekek_pool_init(&pool);
+
+    // clients that share the cache claim one at a time. Without a cache,
+    // only the claim token guards against another client
+    int lock = -1;
+    if (pool_path != NULL)
+    {
+        int rval = kekek_pool_lock(pool_path, &lock);
+        if (rval != HAL_OK)
+        {
+            cryptech_report("\r\nUnable to lock the KEKEK pool cache, '%s'.\r\n", pool_path);
+            return rval;
+        }
+    }
+
+    // a missing or damaged cache only means the public key is read from the device
+    if (pool_path != NULL && kekek_pool_load(&pool, pool_path) != HAL_OK)
+    {
+        cryptech_report("\r\nUnable to read the KEKEK pool cache, '%s'.\r\n", pool_path);
+        kekek_pool_free(&pool);
+    }
+
+    hal_uuid_t kekek_uuid;
+    uint8_t *public_key = NULL;
+    size_t public_key_len = 0;
+
+    int rval = claim_pool_kekek(client, session, &pool, &kekek_uuid, &public_key, &public_key_len);
+    if (rval == HAL_ERROR_KEY_NOT_FOUND)
+    {
+        kekek_pool_free(&pool);
+        kekek_pool_unlock(lock);
+
+        cryptech_report("\r\nThe KEKEK pool is empty.\r\n");
+        return setup_backup_destination(handle, device_index, json_result);
+    }
+    else if (rval != HAL_OK)
+    {
+        kekek_pool_free(&pool);
+        kekek_pool_unlock(lock);
+
+        cryptech_report("\r\nUnable to claim a KEKEK from the pool: %s\r\n", hal_error_string(rval));
+        return rval;
+    }
+
+    char temp_buffer[40];
+    cryptech_report("\r\nClaimed KEKEK '%s' from the pool.\r\n", uuid_to_string(kekek_uuid, temp_buffer));
+
+    if (pool_path != NULL && kekek_pool_save(&pool, pool_path) != HAL_OK)
+    {
+        cryptech_report("\r\nUnable to update the KEKEK pool cache, '%s'.\r\n", pool_path);
+    }
+    kekek_pool_free(&pool);
+    kekek_pool_unlock(lock);
+
+    *json_result = create_setup_json_string(kekek_uuid, public_key, (unsigned int)public_key_len, device_index);
+    free(public_key);
+
+    if (*json_result == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    return HAL_OK;
+}
+
+int cryptech_fill_kekek_pool(uint32_t handle, unsigned int pool_size, const char *pool_path)
+{
+    if (pool_path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+    hal_pkey_attribute_t attribute = { KEKEK_POOL_ATTRIBUTE, sizeof(kekek_pool_available), &kekek_pool_available };
+    int rval = HAL_OK;
+
+    kekek_pool_t cache, pool;
+    kekek_pool_init(&cache);
+    kekek_pool_init(&pool);
+
+    uuid_enum_t available;
+    uuid_enum_init(&available);
+
+    if (kekek_pool_load(&cache, pool_path) != HAL_OK)
+    {
+        cryptech_report("\r\nThe KEKEK pool cache, '%s', is not usable. It will be rebuilt.\r\n", pool_path);
+        kekek_pool_free(&cache);
+    }
+
+    rval = uuid_enum_match(&available,
+                           client,
+                           session,
+                           HAL_KEY_TYPE_RSA_PRIVATE,
+                           HAL_CURVE_NONE,
+                           HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                           HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                           &attribute, 1);
+
+    // keep the cache in step with the device. KEKEKs that were claimed
+    // are dropped, and ones that aren't cached are read
+    for (unsigned int i = 0; rval == HAL_OK && i < available.count; ++i)
+    {
+        const kekek_pool_entry_t *entry = kekek_pool_find(&cache, &available.uuids[i]);
+        if (entry != NULL)
+        {
+            rval = kekek_pool_add(&pool, &entry->uuid, entry->pubkey, entry->pubkey_len);
+            continue;
+        }
+
+        hal_pkey_handle_t kekek;
+        uint8_t der[KEKEK_POOL_PUBKEY_MAX];
+        size_t der_len;
+
+        if ((rval = hal_rpc_pkey_open(client, session, &kekek, &available.uuids[i])) != HAL_OK) break;
+        rval = hal_rpc_pkey_get_public_key(kekek, der, &der_len, sizeof(der));
+        hal_rpc_pkey_close(kekek);
+
+        if (rval == HAL_OK) rval = kekek_pool_add(&pool, &available.uuids[i], der, der_len);
+    }
+
+    if (rval == HAL_OK) cryptech_report("\r\n%u KEKEKs are in the pool.\r\n", pool.count);
+
+    while (rval == HAL_OK && pool.count < pool_size)
+    {
+        cryptech_report("Generating KEKEK %u of %u. This takes a while.\r\n", pool.count + 1, pool_size);
+
+        hal_pkey_handle_t kekek;
+        hal_uuid_t name;
+        uint8_t der[KEKEK_POOL_PUBKEY_MAX];
+        size_t der_len;
+
+        rval = hal_rpc_pkey_generate_rsa(client,
+                                         session,
+                                         &kekek,
+                                         &name,
+                                         KEKEK_POOL_KEY_BITS,
+                                         const_0x010001,
+                                         sizeof(const_0x010001),
+                                         HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN);
+        if (rval != HAL_OK) break;
+
+        rval = hal_rpc_pkey_set_attributes(kekek, &attribute, 1);
+        if (rval == HAL_OK) rval = hal_rpc_pkey_get_public_key(kekek, der, &der_len, sizeof(der));
+        hal_rpc_pkey_close(kekek);
+
+        // saved after every key, so a run that's stopped keeps what it made
+        if (rval == HAL_OK) rval = kekek_pool_add(&pool, &name, der, der_len);
+        if (rval == HAL_OK) rval = kekek_pool_save(&pool, pool_path);
+    }
+
+    if (rval == HAL_OK) rval = kekek_pool_save(&pool, pool_path);
+    if (rval != HAL_OK) cryptech_report("\r\nUnable to fill the KEKEK pool: %s\r\n", hal_error_string(rval));
+
+    uuid_enum_free(&available);
+    kekek_pool_free(&cache);
+    kekek_pool_free(&pool);
+
+    return rval;
+}
+
+int setup_backup_destination(uint32_t handle, int device_index, char **json_result)
+{
+    if (json_result == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *json_result = NULL;
+    // """
+    // Set up backup HSM for subsequent import.
+    // Generates an RSA keypair with appropriate usage settings
+    // to use as a key-encryption-key-encryption-key (KEKEK), and
+    // writes the KEKEK to a JSON file for transfer to primary HSM.
+    // """
+    
+    hal_client_handle_t client = {handle};
+    hal_session_handle_t session = {0};
+    int rval = HAL_OK;
+
+    hal_uuid_t result_kekek_uuid;
+    uint8_t *result_kekek_public_key = NULL;
+    size_t pub_key_len;
+
+    hal_pkey_handle_t kekek;
+    int kekek_open = 0;
+
+    uuid_enum_t uuids, pool_uuids;
+    uuid_enum_init(&uuids);
+    uuid_enum_init(&pool_uuids);
+
+    // KEKEKs in the pool are left for setup_backup_destination_from_pool
+    hal_pkey_attribute_t pool_attribute = { KEKEK_POOL_ATTRIBUTE, sizeof(kekek_pool_available), &kekek_pool_available };
+    if (prefetched != NULL) rval = uuid_enum_copy(&pool_uuids, &prefetched->pool);
+    else rval = uuid_enum_match(&pool_uuids,
+                                client,
+                                session,
+                                HAL_KEY_TYPE_RSA_PRIVATE,
+                                HAL_CURVE_NONE,
+                                HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                &pool_attribute,
+                                1);
+    if (rval != HAL_OK) goto finished;
+
+    // First try to find an exisiting KEKEK on the device
+    if (prefetched != NULL) rval = uuid_enum_copy(&uuids, &prefetched->kekeks);
+    else rval = uuid_enum_match(&uuids,
+                                client,
+                                session,
+                                HAL_KEY_TYPE_RSA_PRIVATE,
+                                HAL_CURVE_NONE,
+                                HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
+                                NULL, // const hal_pkey_attribute_t *attributes,
+                                0);   // const unsigned attributes_len
+    if (rval != HAL_OK) goto finished;
+
+    for (unsigned i = 0; i < uuids.count; ++i)
+    {
+        if (uuid_enum_contains(&pool_uuids, &uuids.uuids[i])) continue;
+
+        hal_key_type_t kekek_type;
+        hal_key_flags_t kekek_flags;
+
+        rval = hal_rpc_pkey_open(client,
+                                 session,
+                                 &kekek,
+                                 &uuids.uuids[i]);
+        if (rval != HAL_OK) goto finished;
+        kekek_open = 1;
+
+        if ((rval = hal_rpc_pkey_get_key_type(kekek, &kekek_type)) != HAL_OK ||
+            (rval = hal_rpc_pkey_get_key_flags(kekek, &kekek_flags)) != HAL_OK)
+        {
+            goto finished;
+        }
+
+        if (kekek_type == HAL_KEY_TYPE_RSA_PRIVATE &&
+           (kekek_flags & HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT) != 0)
+        {
+            cryptech_report("\r\nAttempting to use existing KEYENCIPHERMENT key.\r\n");
+            memcpy(&result_kekek_uuid, &uuids.uuids[i], sizeof(hal_uuid_t));
+
+            pub_key_len = hal_rpc_pkey_get_public_key_len(kekek);
+            result_kekek_public_key = (uint8_t *)malloc(pub_key_len);
+            size_t der_len;
+
+            hal_error_t result = (result_kekek_public_key == NULL) ? HAL_ERROR_ALLOCATION_FAILURE :
+                                 hal_rpc_pkey_get_public_key(kekek, result_kekek_public_key, &der_len, pub_key_len);
+
+            kekek_open = 0;
+            if ((rval = hal_rpc_pkey_close(kekek)) != HAL_OK) goto finished;
+
+            if(result != 0)
+            {
+                // prevent a memory leak
+                free(result_kekek_public_key);
+                
+                // don't stop here. See if there's another acceptable key.
+                // If not, the next step will create another one
+                result_kekek_public_key = NULL;
+                cryptech_report("\r\nThe existing KEYENCIPHERMENT key is not usable.\r\n");
+            }
+            
+            break;
+        }
+
+        kekek_open = 0;
+        if ((rval = hal_rpc_pkey_close(kekek)) != HAL_OK) goto finished;
+    }
+
+    // try to generate a key
+    if (result_kekek_public_key == NULL)
+    {
+        cryptech_report("\r\nAttempting to generate a new KEYENCIPHERMENT key.\r\n");
+        hal_uuid_t name;
+
+        const uint8_t *public_exponent = const_0x010001;
+        size_t public_exponent_len = sizeof(const_0x010001);        
+
+        rval = hal_rpc_pkey_generate_rsa(client,
+                                         session,
+                                         &kekek,
+                                         &name,
+                                         2048,
+                                         public_exponent,
+                                         public_exponent_len,
+                                         HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN);
+        if (rval != HAL_OK) goto finished;
+        kekek_open = 1;
+
+        memcpy(&result_kekek_uuid, &name, sizeof(hal_uuid_t));
+
+        pub_key_len = hal_rpc_pkey_get_public_key_len(kekek);
+        result_kekek_public_key = (uint8_t *)malloc(pub_key_len);
+        if (result_kekek_public_key == NULL)
+        {
+            rval = HAL_ERROR_ALLOCATION_FAILURE;
+            goto finished;
+        }
+
+        size_t der_len;
+        if ((rval = hal_rpc_pkey_get_public_key(kekek, result_kekek_public_key, &der_len, pub_key_len)) != HAL_OK)
+        {
+            goto finished;
+        }
+
+        kekek_open = 0;
+        if ((rval = hal_rpc_pkey_close(kekek)) != HAL_OK) goto finished;
+    }
+
+    *json_result = create_setup_json_string(result_kekek_uuid, result_kekek_public_key, (unsigned int)pub_key_len, device_index);
+    if (*json_result == NULL) rval = HAL_ERROR_ALLOCATION_FAILURE;
+
+finished:
+    if (rval != HAL_OK) cryptech_report("\r\nUnable to set up the backup destination: %s\r\n", hal_error_string(rval));
+
+    if (kekek_open) hal_rpc_pkey_close(kekek);
+    free(result_kekek_public_key);
+    uuid_enum_free(&uuids);
+    uuid_enum_free(&pool_uuids);
+
+    return rval;
+}
+
+// open the KEKEK that a bundle was exported to. A software KEKEK is
+// decrypted with the passphrase and loaded into the HSM for the import
+static int open_bundle_kekek(const hal_client_handle_t client, const hal_session_handle_t session,
+                             const bundle_header_t *header, const char *kekek_passphrase,
+                             hal_pkey_handle_t *kekek)
+{
+    if (header->kekek_pkcs8 == NULL)
+    {
+        hal_uuid_t kekek_uuid = header->kekek_uuid;
+        return hal_rpc_pkey_open(client, session, kekek, &kekek_uuid);
+    }
+
+    if (kekek_passphrase == NULL || header->kekek_salt == NULL)
+    {
+        cryptech_report("\r\nThe bundle was exported to a software KEKEK. A passphrase is needed.\r\n");
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    uint8_t *key_der;
+    size_t key_der_len;
+    int rval = soft_kekek_recover(kekek_passphrase, header->kekek_salt, header->kekek_salt_len,
+                                  header->kekek_pkcs8, header->kekek_pkcs8_len, &key_der, &key_der_len);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("\r\nUnable to decrypt the software KEKEK. Check the passphrase.\r\n");
+        return rval;
+    }
+
+    hal_uuid_t kekek_uuid;
+    rval = hal_rpc_pkey_load(client, session, kekek, &kekek_uuid, key_der, key_der_len,
+                             HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT);
+    soft_kekek_free(key_der, key_der_len);
+
+    return rval;
+}
+
+// a software KEKEK doesn't stay on the HSM
+static int close_bundle_kekek(const bundle_header_t *header, const hal_pkey_handle_t kekek)
+{
+    return (header->kekek_pkcs8 != NULL) ? hal_rpc_pkey_delete(kekek) : hal_rpc_pkey_close(kekek);
+}
+
+static int compare_entry_offsets(const void *a, const void *b)
+{
+    uint64_t offset_a = key_index_entry_offset(*(const key_index_entry_t * const *)a);
+    uint64_t offset_b = key_index_entry_offset(*(const key_index_entry_t * const *)b);
+
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// receives the key records of a bundle. See read_bundle_keys
+typedef int (*record_visitor_t)(void *context, const bundle_record_t *record);
+
+// the keys in the selection, going straight to their records
+static int read_selected_keys(bundle_reader_t *bundle, const import_selection_t *selection,
+                              record_visitor_t visit, void *context)
+{
+    const key_index_t *index = selection->index;
+    char uuid_buffer[40];
+    int rval;
+
+    if ((rval = key_index_check_bundle(index, bundle_reader_format(bundle), bundle_reader_size(bundle))) != HAL_OK)
+    {
+        cryptech_report("\r\nThe key index was not made with this export.\r\n");
+        return rval;
+    }
+
+    // a key can be selected more than once, so mark the selected entries first
+    uint8_t *selected = calloc((index->count > 0) ? index->count : 1, sizeof(uint8_t));
+    const key_index_entry_t **entries = malloc(((index->count > 0) ? index->count : 1) * sizeof(key_index_entry_t *));
+    if (selected == NULL || entries == NULL)
+    {
+        free(selected);
+        free(entries);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    for (unsigned i = 0; i < selection->uuids_len; ++i)
+    {
+        const key_index_entry_t *entry = key_index_find(index, &selection->uuids[i]);
+
+        if (entry == NULL) cryptech_report("\r\nKey '%s' is not in the export.", uuid_to_string(selection->uuids[i], uuid_buffer));
+        else selected[entry - index->entries] = 1;
+    }
+
+    for (unsigned i = 0; i < selection->labels_len; ++i)
+    {
+        const char *label = selection->labels[i];
+
+        unsigned found = key_index_find_label(index, (const uint8_t *)label, strlen(label), entries, index->count);
+        if (found == 0) cryptech_report("\r\nNo keys labeled '%s' are in the export.", label);
+
+        for (unsigned j = 0; j < found; ++j) selected[entries[j] - index->entries] = 1;
+    }
+
+    unsigned entries_len = 0;
+    for (uint32_t i = 0; i < index->count; ++i)
+    {
+        if (selected[i]) entries[entries_len++] = &index->entries[i];
+    }
+
+    free(selected);
+
+    // read the bundle from front to back
+    qsort(entries, entries_len, sizeof(key_index_entry_t *), compare_entry_offsets);
+
+    bundle_record_t record;
+    for (unsigned i = 0; i < entries_len && rval == HAL_OK; ++i)
+    {
+        rval = bundle_reader_read_entry(bundle, entries[i], &record);
+        if (rval != HAL_OK)
+        {
+            cryptech_report("\r\nKey '%s' doesn't match the key index.", uuid_to_string(entries[i]->uuid, uuid_buffer));
+            break;
+        }
+
+        rval = visit(context, &record);
+    }
+
+    free(entries);
+
+    return rval;
+}
+
+// every key record of the bundle, or of the selection when there is one.
+// A record is only valid until visit returns
+static int read_bundle_keys(bundle_reader_t *bundle, const import_selection_t *selection,
+                            record_visitor_t visit, void *context)
+{
+    if (selection != NULL) return read_selected_keys(bundle, selection, visit, context);
+
+    int rval;
+    int done = 0;
+
+    bundle_record_t record;
+    while ((rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
+    {
+        // the unchanged and removed keys of an incremental export have
+        // nothing to import
+        if (record.type != BUNDLE_RECORD_KEY) continue;
+
+        rval = visit(context, &record);
+        if (rval != HAL_OK) break;
+    }
+
+    return rval;
+}
+
+typedef struct
+{
+    hal_client_handle_t client;
+    hal_session_handle_t session;
+    hal_pkey_handle_t kekek;
+    uuid_map_builder_t *uuid_map;
+} import_visit_t;
+
+static int import_visited_key(void *context, const bundle_record_t *record)
+{
+    import_visit_t *visit = context;
 
-            snprintf(uuid_buffer, 64, ",\"uuid\": \"%s\" ", uuid_to_string(uuids[i], uuid_sub_buffer));
-            snprintf(flags_buffer, 32, ",\"flags\": %u ", pkey_flags);
+    return import_bundle_key(visit->client, visit->session, visit->kekek, record, visit->uuid_map);
+}
 
-            if (pkey_type == HAL_KEY_TYPE_RSA_PRIVATE || pkey_type == HAL_KEY_TYPE_EC_PRIVATE)
-            {
-                fputs("\"comment\": \"Encrypted private key\" ", fp);
+// copy a record and everything it points to into the arena
+static int copy_record(dks_arena_t *arena, const bundle_record_t *src, bundle_record_t *dst)
+{
+    *dst = *src;
 
-                size_t pkcs8_len, kek_len;
+    const uint8_t **buffers[] = { &dst->pkcs8, &dst->kek, &dst->spki };
+    const size_t lengths[] = { src->pkcs8_len, src->kek_len, src->spki_len };
 
-                check(hal_rpc_pkey_export(pkey,
-                                          kekek,
-                                          pkcs8, &pkcs8_len, pkcs8_max,
-                                          kek,   &kek_len,   kek_max));
+    for (unsigned i = 0; i < sizeof(buffers)/sizeof(uint8_t **); ++i)
+    {
+        if (*buffers[i] == NULL) continue;
 
-                char *pkcs8_splitb64 = binary_to_split_b64(pkcs8, pkcs8_len);
-                char *kek_splitb64 = binary_to_split_b64(kek, kek_len);
+        uint8_t *copy = dks_arena_alloc(arena, (lengths[i] > 0) ? lengths[i] : 1);
+        if (copy == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-                fputs(", \"pkcs8\": [ ", fp);
-                fputs(pkcs8_splitb64, fp);
-                fputs(" ]", fp);
+        memcpy(copy, *buffers[i], lengths[i]);
+        *buffers[i] = copy;
+    }
 
-                fputs(", \"kek\": [ ", fp);
-                fputs(kek_splitb64, fp);
-                fputs(" ]", fp);
+    if (src->attributes_len == 0) return HAL_OK;
 
-                fputs(uuid_buffer, fp);
-                fputs(flags_buffer, fp);
+    dst->attributes = dks_arena_alloc(arena, src->attributes_len * sizeof(hal_pkey_attribute_t));
+    if (dst->attributes == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-                free(pkcs8_splitb64);
-                free(kek_splitb64);
-            }
-            else if (pkey_type == HAL_KEY_TYPE_RSA_PUBLIC || pkey_type == HAL_KEY_TYPE_EC_PUBLIC)
-            {
-                fputs("\"comment\": \"Public key\" ", fp);
+    for (unsigned i = 0; i < src->attributes_len; ++i)
+    {
+        dst->attributes[i] = src->attributes[i];
+        if (src->attributes[i].value == NULL) continue;
 
-                size_t der_len;
-                check(hal_rpc_pkey_get_public_key(pkey,
-                                                  der, &der_len, der_max));
+        uint8_t *value = dks_arena_alloc(arena, (src->attributes[i].length > 0) ? src->attributes[i].length : 1);
+        if (value == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-                char *spki_splitb64 = binary_to_split_b64(der, der_len);
+        memcpy(value, src->attributes[i].value, src->attributes[i].length);
+        dst->attributes[i].value = value;
+    }
 
-                fputs(", \"spki\": [ ", fp);
-                fputs(spki_splitb64, fp);
-                fputs(" ]", fp);
+    return HAL_OK;
+}
 
-                fputs(uuid_buffer, fp);
-                fputs(flags_buffer, fp);
+static int collect_record(void *context, const bundle_record_t *record)
+{
+    record_list_t *list = context;
 
-                free(spki_splitb64);
-            }
+    if (list->count == list->capacity)
+    {
+        unsigned int capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        bundle_record_t *records = realloc(list->records, capacity * sizeof(bundle_record_t));
+        if (records == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-            fputs(", \"attributes\": { ", fp);
-            check(add_cached_attributes_to_json(pkey, fp));
-            fputs(" }", fp);
+        list->records = records;
+        list->capacity = capacity;
+    }
 
-            // close
-            fputc('}', fp);
+    int rval = copy_record(&list->arena, record, &list->records[list->count]);
+    if (rval == HAL_OK) ++list->count;
 
-            check(hal_rpc_pkey_close(pkey));
+    return rval;
+}
 
-            printf("Key '%s' processed.\r\n", uuid_sub_buffer);
-        }
+// whether a target's KEKEK is the one the bundle was exported to. A wrong
+// KEKEK would otherwise only show up when the first key fails to unwrap
+static int kekek_matches_bundle(const hal_pkey_handle_t kekek, const bundle_header_t *header)
+{
+    if (header->kekek_pubkey == NULL) return HAL_OK;
 
-        // save the last uuid for more searches
-        if (n > 0)
-            memcpy(&previous_uuid, &uuids[n-1], sizeof(hal_uuid_t));
-    } while (n == MAX_UUIDS);
-    
-    // finish the json
-    fputs("] }", fp);
+    size_t der_max = hal_rpc_pkey_get_public_key_len(kekek);
+    size_t der_len = 0;
+    uint8_t *der = (uint8_t *)malloc(der_max);
+    if (der == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-finished:
-    if(kekek_data != NULL)
+    int rval = hal_rpc_pkey_get_public_key(kekek, der, &der_len, der_max);
+    if (rval == HAL_OK &&
+        (der_len != header->kekek_pubkey_len || memcmp(der, header->kekek_pubkey, der_len) != 0))
     {
-        check(hal_rpc_pkey_delete(kekek));
-        free(kekek_data);
+        rval = HAL_ERROR_KEY_NOT_FOUND;
     }
-    if (rval != HAL_OK) fclose(fp);
-    else *export_json = fp;
+
+    free(der);
 
     return rval;
 }
 
-int setup_backup_destination(uint32_t handle, int device_index, char **json_result)
+// import the shared records into one target, on the calling thread
+static void *import_target_thread(void *arg)
 {
-    if (json_result == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    import_worker_t *worker = (import_worker_t *)arg;
+    import_target_t *target = worker->target;
 
-    *json_result = NULL;
-    // """
-    // Set up backup HSM for subsequent import.
-    // Generates an RSA keypair with appropriate usage settings
-    // to use as a key-encryption-key-encryption-key (KEKEK), and
-    // writes the KEKEK to a JSON file for transfer to primary HSM.
-    // """
-    
-    hal_client_handle_t client = {handle};
-    hal_session_handle_t session = {0};
+    rpc_mux_use_link(target->link);
+    cryptech_set_reporter(worker->reporter);
 
-    hal_uuid_t result_kekek_uuid;
-    uint8_t *result_kekek_public_key = NULL;
-    size_t pub_key_len;
+    hal_client_handle_t client = {target->handle};
+    hal_session_handle_t session = {0};
+    hal_pkey_handle_t kekek;
+    hal_uuid_t kekek_uuid;
 
-    const int MAX_UUIDS = 64;
-    hal_uuid_t uuids[MAX_UUIDS];
-    hal_uuid_t previous_uuid;
-    memset(&previous_uuid, 0, sizeof(previous_uuid));
+    if (worker->kekek_der != NULL)
+    {
+        // every target gets its own copy of the software KEKEK
+        target->rval = hal_rpc_pkey_load(client, session, &kekek, &kekek_uuid, worker->kekek_der,
+                                         worker->kekek_der_len, HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT);
+    }
+    else
+    {
+        kekek_uuid = (target->kekek_uuid != NULL) ? *target->kekek_uuid : worker->header->kekek_uuid;
+        target->rval = hal_rpc_pkey_open(client, session, &kekek, &kekek_uuid);
+    }
 
-    unsigned n, state = 0;
+    if (target->rval != HAL_OK)
+    {
+        cryptech_report("\r\nUnable to open the KEKEK on import target %u: %s\r\n", worker->index + 1,
+                        hal_error_string(target->rval));
+        return NULL;
+    }
 
+    if (worker->kekek_der == NULL)
+    {
+        target->rval = kekek_matches_bundle(kekek, worker->header);
+        if (target->rval != HAL_OK)
+        {
+            char uuid_buffer[40];
+            cryptech_report("\r\nKEKEK '%s' on import target %u is not the KEKEK the bundle was exported to.\r\n",
+                            uuid_to_string(kekek_uuid, uuid_buffer), worker->index + 1);
+            hal_rpc_pkey_close(kekek);
+            return NULL;
+        }
+    }
 
-    // First try to find an exisiting KEKEK on the device
-    check(hal_rpc_pkey_match(client,
-                             session,
-                             HAL_KEY_TYPE_RSA_PRIVATE,
-                             HAL_CURVE_NONE,
-                             HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
-                             HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN,
-                             NULL, // const hal_pkey_attribute_t *attributes,
-                             0,    // const unsigned attributes_len,
-                             &state,
-                             uuids,
-                             &n,
-                             MAX_UUIDS,
-                             &previous_uuid));
-
-    for (unsigned i = 0; i < n; ++i)
+    const record_list_t *records = worker->records;
+    for (unsigned int i = 0; i < records->count; ++i)
     {
-        hal_pkey_handle_t kekek;
+        target->rval = import_bundle_key(client, session, kekek, &records->records[i], target->uuid_map);
+        if (target->rval != HAL_OK) break;
 
-        hal_key_type_t kekek_type;
-        hal_key_flags_t kekek_flags;
+        ++target->imported;
+    }
 
-        check(hal_rpc_pkey_open(client,
-                                session,
-                                &kekek,
-                                &uuids[i]));
+    int err = close_bundle_kekek(worker->header, kekek);
+    if (target->rval == HAL_OK) target->rval = err;
 
-        check(hal_rpc_pkey_get_key_type(kekek, &kekek_type));
-        check(hal_rpc_pkey_get_key_flags(kekek, &kekek_flags));
+    return NULL;
+}
 
-        if (kekek_type == HAL_KEY_TYPE_RSA_PRIVATE &&
-           (kekek_flags & HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT) != 0)
-        {
-            printf("\r\nAttempting to use existing KEYENCIPHERMENT key.\r\n");
-            memcpy(&result_kekek_uuid, &uuids[i], sizeof(hal_uuid_t));
+int import_keys(uint32_t handle, bundle_reader_t *bundle, const import_selection_t *selection,
+                const char *kekek_passphrase, uuid_map_builder_t *uuid_map)
+{
+    if (bundle == NULL) return HAL_ERROR_BAD_ARGUMENTS;
 
-            pub_key_len = hal_rpc_pkey_get_public_key_len(kekek);
-            result_kekek_public_key = (uint8_t *)malloc(pub_key_len);
-            size_t der_len;
+    import_visit_t visit;
+    visit.client.handle = handle;
+    visit.session.handle = 0;
+    visit.uuid_map = uuid_map;
 
-            hal_error_t result = hal_rpc_pkey_get_public_key(kekek, result_kekek_public_key, &der_len, pub_key_len);
+    // open the KEKEK
+    check(open_bundle_kekek(visit.client, visit.session, bundle_reader_header(bundle), kekek_passphrase, &visit.kekek));
 
-            check(hal_rpc_pkey_close(kekek));
+    int rval = read_bundle_keys(bundle, selection, import_visited_key, &visit);
 
-            if(result != 0)
-            {
-                // prevent a memory leak
-                free(result_kekek_public_key);
-                
-                // don't stop here. See if there's another acceptable key.
-                // If not, the next step will create another one
-                result_kekek_public_key = NULL;
-                printf("\r\nThe existing KEYENCIPHERMENT key is not usable.\r\n");
-            }
-            
-            break;
-        }
+    check(close_bundle_kekek(bundle_reader_header(bundle), visit.kekek));
+
+    return rval;
+}
 
-        check(hal_rpc_pkey_close(kekek));
+int import_keys_multi(bundle_reader_t *bundle, const import_selection_t *selection, const char *kekek_passphrase,
+                      import_target_t *targets, unsigned int targets_len)
+{
+    if (bundle == NULL || targets == NULL || targets_len == 0 || targets_len > IMPORT_TARGETS_MAX)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
     }
 
-    // try to generate a key
-    if (result_kekek_public_key == NULL)
+    // only one thread can use the process's link
+    unsigned int process_links = 0;
+    for (unsigned int t = 0; t < targets_len; ++t)
     {
-        printf("\r\nAttempting to generate a new KEYENCIPHERMENT key.\r\n");
-        hal_pkey_handle_t kekek;
-        hal_uuid_t name;
+        targets[t].rval = HAL_ERROR_NOT_READY;
+        targets[t].imported = 0;
+        if (targets[t].link == NULL) ++process_links;
+    }
+    if (process_links > 1) return HAL_ERROR_BAD_ARGUMENTS;
 
-        const uint8_t *public_exponent = const_0x010001;
-        size_t public_exponent_len = sizeof(const_0x010001);        
+    const bundle_header_t *header = bundle_reader_header(bundle);
 
-        check(hal_rpc_pkey_generate_rsa(client,
-                                        session,
-                                        &kekek,
-                                        &name,
-                                        2048,
-                                        public_exponent,
-                                        public_exponent_len,
-                                        HAL_KEY_FLAG_USAGE_KEYENCIPHERMENT | HAL_KEY_FLAG_TOKEN));
+    // a software KEKEK is decrypted once for all of them
+    uint8_t *kekek_der = NULL;
+    size_t kekek_der_len = 0;
+    if (header->kekek_pkcs8 != NULL)
+    {
+        if (kekek_passphrase == NULL || header->kekek_salt == NULL)
+        {
+            cryptech_report("\r\nThe bundle was exported to a software KEKEK. A passphrase is needed.\r\n");
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
 
-        memcpy(&result_kekek_uuid, &name, sizeof(hal_uuid_t));
+        int rval = soft_kekek_recover(kekek_passphrase, header->kekek_salt, header->kekek_salt_len,
+                                      header->kekek_pkcs8, header->kekek_pkcs8_len, &kekek_der, &kekek_der_len);
+        if (rval != HAL_OK)
+        {
+            cryptech_report("\r\nUnable to decrypt the software KEKEK. Check the passphrase.\r\n");
+            return rval;
+        }
+    }
 
-        pub_key_len = hal_rpc_pkey_get_public_key_len(kekek);
-        result_kekek_public_key = (uint8_t *)malloc(pub_key_len);
-        size_t der_len;
+    // the bundle is read and decoded once. The targets share the records
+    record_list_t records;
+    memset(&records, 0, sizeof(records));
 
-        hal_error_t result = hal_rpc_pkey_get_public_key(kekek, result_kekek_public_key, &der_len, pub_key_len);
+    int rval = dks_arena_init(&records.arena, 64 * 1024);
+    if (rval == HAL_OK) rval = read_bundle_keys(bundle, selection, collect_record, &records);
 
-        check(hal_rpc_pkey_close(kekek));
+    if (rval == HAL_OK)
+    {
+        import_worker_t workers[IMPORT_TARGETS_MAX];
+        pthread_t threads[IMPORT_TARGETS_MAX];
+        int started[IMPORT_TARGETS_MAX];
 
-        if(result != 0)
+        for (unsigned int t = 0; t < targets_len; ++t)
         {
-            // prevent a memory leak
-            free(result_kekek_public_key);
-            check(result);
+            workers[t].target = &targets[t];
+            workers[t].index = t;
+            workers[t].records = &records;
+            workers[t].header = header;
+            workers[t].kekek_der = kekek_der;
+            workers[t].kekek_der_len = kekek_der_len;
+            workers[t].reporter = reporter;
+
+            started[t] = (pthread_create(&threads[t], NULL, import_target_thread, &workers[t]) == 0);
         }
-    }
 
-    *json_result = create_setup_json_string(result_kekek_uuid, result_kekek_public_key, (unsigned int)pub_key_len, device_index);
+        // a target without a thread is done here
+        serial_connection_t *link = rpc_mux_get_link();
+        const cryptech_reporter_t *saved_reporter = reporter;
 
-    if (result_kekek_public_key != NULL)
-    {
-        free(result_kekek_public_key);
+        for (unsigned int t = 0; t < targets_len; ++t)
+        {
+            if (!started[t]) import_target_thread(&workers[t]);
+        }
+
+        rpc_mux_use_link(link);
+        cryptech_set_reporter(saved_reporter);
+
+        for (unsigned int t = 0; t < targets_len; ++t)
+        {
+            if (started[t]) pthread_join(threads[t], NULL);
+        }
+
+        // the first target that failed
+        for (unsigned int t = 0; t < targets_len && rval == HAL_OK; ++t)
+        {
+            rval = targets[t].rval;
+        }
     }
 
-    if (*json_result == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    free(records.records);
+    dks_arena_free(&records.arena);
+    if (kekek_der != NULL) soft_kekek_free(kekek_der, kekek_der_len);
 
-    return 0;
+    return rval;
 }
 
-int import_keys(uint32_t handle, char *json_string)
+int import_store_run(uint32_t handle, const char *store, const backup_store_run_t *run,
+                     uuid_map_builder_t *uuid_map)
 {
-    if (json_string == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (store == NULL || run == NULL) return HAL_ERROR_BAD_ARGUMENTS;
 
     int rval = HAL_OK;
-    
+    char uuid_buffer[40];
+
     hal_client_handle_t client = {handle};
     hal_session_handle_t session = {0};
 
-    // pool of nodes. must be the maximum depth
-    diamond_json_node_t pool[8];
-    diamond_json_ptr_t json_ptr;
+    dks_arena_t arena;
+    if (dks_arena_init(&arena, 64 * 1024) != HAL_OK) return HAL_ERROR_ALLOCATION_FAILURE;
 
-    char *pkcs8 = NULL;
-    unsigned int pkcs8_len;
-    char *kek = NULL;
-    unsigned int kek_len;
-    char *spki = NULL;
-    unsigned int spki_len;
-    char *attr_json = NULL;
+    // open the KEKEK
+    hal_pkey_handle_t kekek;
+    hal_uuid_t kekek_uuid = run->kekek_uuid;
 
-    // get the KEKEK
-    char kekek_uuid_buffer[40], *json_search_ptr = json_string;
-    char *kekek_uuid_s = djson_find_element("kekek_uuid", kekek_uuid_buffer, 40, &json_search_ptr);
+    rval = hal_rpc_pkey_open(client, session, &kekek, &kekek_uuid);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("hal_rpc_pkey_open: %s\r\n", hal_error_string(rval));
+        dks_arena_free(&arena);
+        return rval;
+    }
 
-    if (kekek_uuid_s == NULL)
+    bundle_record_t record;
+    for (unsigned int i = 0; i < run->count && rval == HAL_OK; ++i)
     {
-        printf("\r\n'kekek_uuid' not found in export JSON.\r\n");
-        return HAL_ERROR_ASSERTION_FAILED;
+        dks_arena_reset(&arena);
+
+        rval = backup_store_get(store, run->refs[i].object, &arena, &record);
+        if (rval == HAL_OK && memcmp(&record.uuid, &run->refs[i].uuid, sizeof(hal_uuid_t)) != 0)
+        {
+            rval = HAL_ERROR_KEYSTORE_BAD_CRC;
+        }
+        if (rval != HAL_OK)
+        {
+            cryptech_report("\r\nUnable to read key '%s' from the store: %s",
+                   uuid_to_string(run->refs[i].uuid, uuid_buffer), hal_error_string(rval));
+            break;
+        }
+
+        rval = import_bundle_key(client, session, kekek, &record, uuid_map);
     }
 
-    // starting JSON parser before opening KEKEK just incase there is an error
-    diamond_json_error_t result = djson_start_parser(json_string, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t));
-    if (result != DJSON_OK) return HAL_ERROR_BAD_ARGUMENTS;
+    dks_arena_free(&arena);
 
-    result = djson_parse_until(&json_ptr, "keys", DJSON_TYPE_Array);
-    if (result != DJSON_OK) return HAL_ERROR_BAD_ARGUMENTS;
+    check(hal_rpc_pkey_close(kekek));
 
-    // open the KEKEK
-    hal_pkey_handle_t kekek;
-    hal_uuid_t kekek_uuid = string_to_uuid(kekek_uuid_s);
+    return rval;
+}
+
+// import every key in one shard. The shard is read and decoded on this
+// thread. Without the multiplexer, the RPCs are made under the lock
+static int import_shard(shard_import_t *import, unsigned int i)
+{
+    int rval;
+    int done = 0;
 
-    check(hal_rpc_pkey_open(client, session, &kekek, &kekek_uuid));
+    // a shard that has been changed is caught before any of its keys are imported
+    bundle_reader_t *bundle = shard_set_open(import->set, i, &rval);
+    if (bundle == NULL) return rval;
 
-    // parse the JSON
-    while (1)
+    // the multiplexed threads keep their part of the UUID map until the end
+    uuid_map_builder_t shard_map;
+    uuid_map_builder_init(&shard_map);
+    uuid_map_builder_t *uuid_map = (import->uuid_map != NULL) ? &shard_map : NULL;
+
+    bundle_record_t record;
+    while ((rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
     {
-        char *uuid_string = NULL;
-        int flags;
+        if (record.type != BUNDLE_RECORD_KEY) continue;
 
-        // should be an object
-        dks_json_check(djson_goto_next_element(&json_ptr));
+        if (import->muxed)
+        {
+            rval = import_bundle_key(import->client, import->session, import->kekek, &record, uuid_map);
+        }
+        else
+        {
+            pthread_mutex_lock(&import->lock);
+            rval = import_bundle_key(import->client, import->session, import->kekek, &record, uuid_map);
+            pthread_mutex_unlock(&import->lock);
+        }
 
-        diamond_json_type_t json_type;
-        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+        if (rval != HAL_OK) break;
+    }
 
-        if (json_type == DJSON_TYPE_ArrayEnd) break; // finished looking at all keys
-        else if (json_type != DJSON_TYPE_Object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    bundle_reader_close(bundle);
 
-        // go to the first element
-        dks_json_check(djson_goto_next_element(&json_ptr));
-        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+    // the keys that were imported are kept even when the shard failed
+    if (uuid_map != NULL)
+    {
+        pthread_mutex_lock(&import->lock);
+        int err = uuid_map_builder_merge(import->uuid_map, &shard_map);
+        pthread_mutex_unlock(&import->lock);
 
-        // parse a key object
-        while (json_type != DJSON_TYPE_ObjectEnd)
-        {
-            char *name;
-            dks_json_check(djson_get_name_current(&json_ptr, &name));
+        if (rval == HAL_OK) rval = err;
+    }
+    uuid_map_builder_free(&shard_map);
 
-            if (strcmp(name, "pkcs8") == 0 && json_type == DJSON_TYPE_Array)
-            {
-                dks_json_check(djson_ext_join_decodeb64string(&json_ptr, &pkcs8, &pkcs8_len));
-            }
-            else if (strcmp(name, "kek") == 0 && json_type == DJSON_TYPE_Array)
-            {
-                dks_json_check(djson_ext_join_decodeb64string(&json_ptr, &kek, &kek_len));
-            }
-            else if (strcmp(name, "spki") == 0 && json_type == DJSON_TYPE_Array)
-            {
-                dks_json_check(djson_ext_join_decodeb64string(&json_ptr, &spki, &spki_len));
-            }
-            else if (strcmp(name, "attributes") == 0 && json_type == DJSON_TYPE_Object)
-            {
-                dks_json_check(djson_skip_save_object(&json_ptr, &attr_json));
-            }
-            else if (strcmp(name, "uuid") == 0 && json_type == DJSON_TYPE_String)
-            {
-                dks_json_check(djson_get_string_value_current(&json_ptr, &uuid_string));
-            }
-            else if (strcmp(name, "flags") == 0 && json_type == DJSON_TYPE_Primitive)
-            {
-                dks_json_check(djson_get_integer_primitive_current(&json_ptr, &flags));
-            }
-            else if (strcmp(name, "comment") == 0 && json_type == DJSON_TYPE_String) { printf("\r\n"); }
-            else
-            {
-                dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
-            }
+    return rval;
+}
 
-            dks_json_check(djson_pass(&json_ptr));
+static void *shard_import_thread(void *arg)
+{
+    shard_import_t *import = (shard_import_t *)arg;
 
-            dks_json_check(djson_get_type_current(&json_ptr, &json_type));
-        }
+    if (import->muxed) rpc_mux_attach();
+    rpc_mux_use_link(import->link);
+    cryptech_set_reporter(import->reporter);
 
-        // we know have all of our data from JSON
-        hal_uuid_t uuid = string_to_uuid(uuid_string);
+    while (1)
+    {
+        pthread_mutex_lock(&import->lock);
+        unsigned int i = import->next_shard++;
+        pthread_mutex_unlock(&import->lock);
 
-        hal_pkey_handle_t new_pkey = {0};
-        hal_uuid_t new_uuid;
+        if (i >= import->set->count) break;
 
-        // make sure we can parse the attributes before continuing
-        // pool of nodes. must be the maximum depth
-        diamond_json_node_t attr_pool[8];
-        diamond_json_ptr_t attr_json_ptr;
+        int rval = import_shard(import, i);
 
-        if(attr_json != NULL)
+        if (rval != HAL_OK)
         {
-            // starting JSON parser before opening KEKEK just incase there is an error
-            dks_json_check(djson_start_parser(attr_json, &attr_json_ptr, attr_pool, sizeof(attr_pool)/sizeof(diamond_json_node_t)));
-            if (result != DJSON_OK) return HAL_ERROR_BAD_ARGUMENTS;
+            pthread_mutex_lock(&import->lock);
+            cryptech_report("\r\nShard '%s' was not fully imported: %s", import->set->shards[i].path, hal_error_string(rval));
+            if (import->failed_shards++ == 0) import->rval = rval;
+            pthread_mutex_unlock(&import->lock);
         }
+    }
 
-        if (pkcs8 != NULL && kek != NULL)
-        {
-            check(hal_rpc_pkey_import(client,
-                                      session,
-                                      &new_pkey,
-                                      &new_uuid,
-                                      kekek,
-                                      pkcs8, pkcs8_len,
-                                      kek, kek_len,
-                                      flags));
-
-            char temp_buffer[40];
-            printf("Imported %s as %s", uuid_string, uuid_to_string(new_uuid, temp_buffer));
-        }
-        else if (spki != NULL)
-        {
-            check(hal_rpc_pkey_load(client,
-                                    session,
-                                    &new_pkey,
-                                    &new_uuid,
-                                    spki, spki_len,
-                                    flags));
-
-            char temp_buffer[40];
-            printf("Loaded %s as %s", uuid_string, uuid_to_string(new_uuid, temp_buffer));
-        }
-        else
-        {
-            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
-        }
-        
-        // save the attributes
-        if(attr_json != NULL)
-        {
-            diamond_json_type_t curr_attr_type;
-            dks_json_check(djson_goto_next_element(&attr_json_ptr));
-            dks_json_check(djson_get_type_current(&attr_json_ptr, &curr_attr_type));
+    return NULL;
+}
 
-            while (curr_attr_type != DJSON_TYPE_ObjectEnd)
-            {
-                // igore all none array types
-                if (curr_attr_type == DJSON_TYPE_Array ||
-                    curr_attr_type == DJSON_TYPE_Primitive)
-                {
-                    char *decoded_data = NULL;
-                    unsigned int data_len;
-                    char *attr_name;
-
-                    dks_json_check(djson_get_name_current(&attr_json_ptr, &attr_name));
-
-                    hal_pkey_attribute_t pkey_attr;
-                    pkey_attr.type = atoi(attr_name);
-
-                    unsigned char bool_value;
-                    unsigned int uint_value;
-
-
-                    if(curr_attr_type == DJSON_TYPE_Array)
-                    {
-                        dks_json_check(djson_ext_join_decodeb64string(&attr_json_ptr, &decoded_data, &data_len));
-                        pkey_attr.value = decoded_data;
-                        pkey_attr.length = data_len;
-                    }
-                    else
-                    {
-                        int int_value;
-                        diamond_primitive_value_t prim_type;
-
-                        if (djson_get_integer_primitive_current(&attr_json_ptr, &int_value) == DJSON_OK)
-                        {
-                            if (int_value == 0 || int_value == 1)
-                            {
-                                bool_value = (unsigned char)int_value;
-                                pkey_attr.value = &bool_value;
-                                pkey_attr.length = sizeof(bool_value);
-                            }
-                            else
-                            {
-                                uint_value = (unsigned int)int_value;
-                                pkey_attr.value = &uint_value;
-                                pkey_attr.length = sizeof(uint_value);
-                            }
-                        }
-                        else
-                        {
-                            pkey_attr.value = NULL;
-                            pkey_attr.length = 0xFFFFFFFF;
-                        }
-                    }                  
-
-
-                    check(hal_rpc_pkey_set_attributes(new_pkey,
-                                                      &pkey_attr,
-                                                      1));
-                    free(decoded_data);
-                }
+int import_shard_set(uint32_t handle, const shard_set_t *set, uuid_map_builder_t *uuid_map)
+{
+    if (set == NULL) return HAL_ERROR_BAD_ARGUMENTS;
 
-                // get the next element
-                dks_json_check(djson_goto_next_element(&attr_json_ptr));
-                dks_json_check(djson_get_type_current(&attr_json_ptr, &curr_attr_type));
-            }
-        }
+    shard_import_t import;
+    memset(&import, 0, sizeof(import));
+    import.client.handle = handle;
+    import.set = set;
+    import.uuid_map = uuid_map;
+    import.link = rpc_mux_get_link();
+    import.reporter = reporter;
 
-        // close the new pkey
-        check(hal_rpc_pkey_close(new_pkey));
+    // every shard uses the same KEKEK
+    hal_uuid_t kekek_uuid = set->kekek_uuid;
+    check(hal_rpc_pkey_open(import.client, import.session, &import.kekek, &kekek_uuid));
 
-        // free temporary data
-        free(pkcs8);
-        free(kek);
-        free(spki);
-        free(attr_json);
-        pkcs8 = NULL;
-        kek = NULL;
-        spki = NULL;
-        attr_json = NULL;
+    if (pthread_mutex_init(&import.lock, NULL) != 0)
+    {
+        hal_rpc_pkey_close(import.kekek);
+        return HAL_ERROR_ALLOCATION_FAILURE;
     }
 
-finished:
-    check(hal_rpc_pkey_close(kekek));
-    free(pkcs8);
-    free(kek);
-    free(spki);
-    free(attr_json);
+    // the threads share the link without the lock
+    import.muxed = (rpc_mux_start() == HAL_OK);
 
-    return rval;
+    pthread_t threads[SHARD_IMPORT_MAX_THREADS];
+    unsigned int threads_len = (set->count < SHARD_IMPORT_MAX_THREADS) ? set->count : SHARD_IMPORT_MAX_THREADS;
+    unsigned int started = 0;
+
+    while (started < threads_len && pthread_create(&threads[started], NULL, shard_import_thread, &import) == 0)
+    {
+        ++started;
+    }
+
+    // without any threads, do the work here
+    if (started == 0) shard_import_thread(&import);
+
+    for (unsigned int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (import.muxed) rpc_mux_stop();
+    pthread_mutex_destroy(&import.lock);
+
+    if (import.failed_shards > 0)
+    {
+        cryptech_report("\r\n%u of %u shards were not fully imported.", import.failed_shards, set->count);
+    }
+
+    check(hal_rpc_pkey_close(import.kekek));
+
+    return import.rval;
 }
 
-diamond_json_error_t djson_ext_join_decodeb64string(diamond_json_ptr_t *json_ptr, char **decoded_result,
-                                                    unsigned int *result_len)
+hal_error_t import_bundle_key(const hal_client_handle_t client, const hal_session_handle_t session,
+                              const hal_pkey_handle_t kekek, const bundle_record_t *record,
+                              uuid_map_builder_t *uuid_map)
 {
-    *decoded_result = NULL;
-    char *b64data;
-    char *decoded_data;
-    
-    diamond_json_error_t result = djson_join_string_array(json_ptr, &b64data);
-    if (result != DJSON_OK) return result;
+    hal_pkey_handle_t new_pkey = {0};
+    hal_uuid_t new_uuid;
+    char uuid_buffer[40];
+    char temp_buffer[40];
+
+    uuid_to_string(record->uuid, uuid_buffer);
+
+    if (record->pkcs8 != NULL && record->kek != NULL)
+    {
+        check(hal_rpc_pkey_import(client,
+                                  session,
+                                  &new_pkey,
+                                  &new_uuid,
+                                  kekek,
+                                  record->pkcs8, record->pkcs8_len,
+                                  record->kek, record->kek_len,
+                                  record->flags));
+
+        cryptech_report("\r\nImported %s as %s", uuid_buffer, uuid_to_string(new_uuid, temp_buffer));
+    }
+    else if (record->spki != NULL)
+    {
+        check(hal_rpc_pkey_load(client,
+                                session,
+                                &new_pkey,
+                                &new_uuid,
+                                record->spki, record->spki_len,
+                                record->flags));
 
-    unsigned int b64data_len = strlen(b64data);
+        cryptech_report("\r\nLoaded %s as %s", uuid_buffer, uuid_to_string(new_uuid, temp_buffer));
+    }
+    else
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
 
-    unsigned int decoded_size = b64d_size(b64data_len);
+    // remember where the key went so applications can find it again
+    if (uuid_map != NULL)
+    {
+        hal_key_type_t new_type;
+        check(hal_rpc_pkey_get_key_type(new_pkey, &new_type));
+        check(uuid_map_builder_add(uuid_map, &record->uuid, &new_uuid, new_type, record->flags));
+    }
 
-    // make sure the allocation was successful
-    decoded_data = malloc(decoded_size);
-    if(decoded_data == NULL) return DJSON_ERROR_MEMORY;
+    // save the attributes
+    for (unsigned i = 0; i < record->attributes_len; ++i)
+    {
+        check(hal_rpc_pkey_set_attributes(new_pkey,
+                                          &record->attributes[i],
+                                          1));
+    }
 
-    *result_len = b64_decode(b64data, b64data_len, decoded_data);
+    // close the new pkey
+    check(hal_rpc_pkey_close(new_pkey));
 
-    *decoded_result = decoded_data;
+    report_progress(CRYPTECH_EVENT_KEY_IMPORTED, &record->uuid, &new_uuid);
 
-    return result;
+    return HAL_OK;
 }
 
 char *split_b64_string(const char *b64data)
 {
-    const int CHARS_IN_ROW = 76;
-    unsigned int len = strlen(b64data);
+    size_t len = strlen(b64data);
 
-    int rows = (len / CHARS_IN_ROW) + 1;
-    char *splitbuffer = malloc(((CHARS_IN_ROW + 12) * rows) + 1); // '        "..",\n
+    char *splitbuffer = malloc(split_b64_size(len));
     if (splitbuffer == NULL) return NULL;
-    splitbuffer[0] = 0;
-    int count = 0;
-    int index = 0;
-
-    for (unsigned int i = 0; i < len; ++i)
-    {
-        if (count == 0)
-        {
-            if (index > 0) strcat(splitbuffer, "\",\n");
-            strcat(splitbuffer, "        \"");
-            index = strlen(splitbuffer);
-        }
-        splitbuffer[index++] = b64data[i];
-        splitbuffer[index] = 0;
-        count = (count + 1) % 76;
-    }
-    strcat(splitbuffer, "\"");
 
-    return splitbuffer;
+    return split_b64_into(b64data, len, splitbuffer);
 }
 
 //4700438d-4ac9-4561-823e-4f74c38de219
@@ -870,7 +2356,8 @@ char *create_setup_json_string(hal_uuid_t kekek_uuid, uint8_t *kekek_public_key,
     return json_result;
 }
 
-hal_error_t add_cached_attributes_to_json(const hal_pkey_handle_t pkey, FILE *fp)
+hal_error_t get_cached_attributes(const hal_pkey_handle_t pkey, dks_arena_t *arena,
+                                  hal_pkey_attribute_t **attributes, unsigned *attributes_len)
 {
     // what are the attributes that we want to read from the CrypTech device
     const uint32_t cached_attributes[] = { CKA_CLASS, CKA_TOKEN, CKA_PRIVATE, CKA_LABEL, CKA_APPLICATION,
@@ -904,15 +2391,21 @@ hal_error_t add_cached_attributes_to_json(const hal_pkey_handle_t pkey, FILE *fp
     // the buffer size is much larger than needed for most cases, but larger than 2048
     // can cause a RPC packet overflow error
     const size_t attributes_buffer_len = 2048;
-    unsigned char attributes_buffer[attributes_buffer_len];
+    uint8_t *attributes_buffer = dks_arena_alloc(arena, attributes_buffer_len);
+    if (attributes_buffer == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-    int first = 1;
+    hal_pkey_attribute_t *result = dks_arena_alloc(arena, (num_cached_attributes + num_optional_attributes) *
+                                                          sizeof(hal_pkey_attribute_t));
+    if (result == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-    char buffer[4096]; // lazy waste of memory
+    *attributes = result;
+    *attributes_len = 0;
 
-    for (int i = 0; i < num_cached_attributes; ++i)
+    for (int i = 0; i < num_cached_attributes + num_optional_attributes; ++i)
     {
-        hal_pkey_attribute_t attr_get = { .type = cached_attributes[i] };
+        int optional = (i >= num_cached_attributes);
+        hal_pkey_attribute_t attr_get = { .type = optional ? optional_attributes[i - num_cached_attributes]
+                                                           : cached_attributes[i] };
 
         hal_error_t err;
         if ((err = hal_rpc_pkey_get_attributes(pkey,
@@ -921,61 +2414,25 @@ hal_error_t add_cached_attributes_to_json(const hal_pkey_handle_t pkey, FILE *fp
                                         attributes_buffer,
                                         attributes_buffer_len)) == HAL_OK)
         {
-            if (!first) { fputc(',', fp);}
-            else first = 0; 
+            // only keep optional attributes that have a value
+            if (optional && attr_get.length == 0) continue;
 
-            char *attr_data = binary_to_split_b64(attr_get.value, attr_get.length);
-            snprintf(buffer, 4095, "\"%u\":[%s]", attr_get.type, attr_data);
+            // attributes_buffer is used again by the next attribute
+            uint8_t *value = dks_arena_alloc(arena, attr_get.length);
+            if (value == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
 
-            fputs(buffer, fp);
+            memcpy(value, attr_get.value, attr_get.length);
+
+            hal_pkey_attribute_t *attr = &result[(*attributes_len)++];
+            attr->type = attr_get.type;
+            attr->value = value;
+            attr->length = attr_get.length;
         }       
     }
 
-    for (int i = 0; i < num_optional_attributes; ++i)
-    {
-        hal_pkey_attribute_t attr_get = { .type = optional_attributes[i] };
-
-        hal_error_t err;
-        if ((err = hal_rpc_pkey_get_attributes(pkey,
-                                        &attr_get,
-                                        1,
-                                        attributes_buffer,
-                                        attributes_buffer_len)) == HAL_OK)
-        {
-            if (attr_get.length > 0)
-            {
-                if (!first) { fputc(',', fp);}
-                else first = 0; 
-
-                char *attr_data = binary_to_split_b64(attr_get.value, attr_get.length);
-                snprintf(buffer, 4095, "\"%u\":[%s]", attr_get.type, attr_data);
-
-                fputs(buffer, fp);
-            }
-        }       
-    }    
     return HAL_OK;
 }
 
-char *binary_to_split_b64(const uint8_t *binary_data, size_t binary_data_len)
-{
-    unsigned int b64size = b64e_size(binary_data_len)+1;
-
-    // make sure the allocation was successful
-    unsigned char *b64data = malloc(b64size);
-    if(b64data == NULL) return NULL;
-
-    // encode the public key
-    unsigned int num_bytes = b64_encode((const unsigned char *)binary_data, binary_data_len, b64data);
-
-    // split b64 like the way CrypTech does it in Python
-    char *splitb64 = split_b64_string(b64data);
-    
-    free(b64data);
-
-    return splitb64;
-}
-
 // --------------------------------------------------------------------------------
 // Taken from rpc_client_serial.c with modifications
 /*
@@ -1013,6 +2470,10 @@ char *binary_to_split_b64(const uint8_t *binary_data, size_t binary_data_len)
  */
 hal_error_t dks_hal_rpc_client_transport_init(void)
 {
+    // share the device through cryptech_muxd
+    const char *socket_name = getenv(RPC_SOCKET_ENVVAR);
+    if (socket_name != NULL && socket_name[0] != 0) return rpc_socket_open(socket_name);
+
     const char *device = getenv(HAL_CLIENT_SERIAL_DEVICE_ENVVAR);
     const char *speed_ = getenv(HAL_CLIENT_SERIAL_SPEED_ENVVAR);
     uint32_t    speed  = HAL_CLIENT_SERIAL_DEFAULT_SPEED;
@@ -1023,6 +2484,6 @@ hal_error_t dks_hal_rpc_client_transport_init(void)
     if (speed_ != NULL)
         speed = (uint32_t) strtoul(speed_, NULL, 10);
 
-    return hal_serial_init(device, speed);
+    return rpc_mux_open_serial(device, speed);
 }
 // --------------------------------------------------------------------------------
@@ -32,14 +32,203 @@
 #define CRYPTECH_DEVICE_H
 
 #include <stdint.h>
+#include <stdio.h>
+
+#include <hal.h>
+
+#include "backup_store.h"
+#include "bundle.h"
+#include "bundle_reader.h"
+#include "key_index.h"
+#include "key_tree.h"
+#include "serial.h"
+#include "shard_set.h"
+#include "uuid_enum.h"
+#include "uuid_map.h"
+
+#define EXPORT_FILTER_MAX_ATTRIBUTES 4
+
+// Limits an export to the keys that match every criteria that has been set.
+// The attribute values (CKA_ID, CKA_LABEL, CKA_APPLICATION...) are matched
+// by the device when it supports it, otherwise on this side of the link.
+typedef struct
+{
+    hal_key_type_t key_type;    // HAL_KEY_TYPE_NONE matches any type
+    hal_curve_name_t curve;     // HAL_CURVE_NONE matches any curve
+    hal_key_flags_t flags_mask; // (key flags & flags_mask) must equal flags
+    hal_key_flags_t flags;
+    hal_pkey_attribute_t attributes[EXPORT_FILTER_MAX_ATTRIBUTES];
+    unsigned attributes_len;
+} export_filter_t;
+
+typedef struct
+{
+    // the path of a previous export. Keys whose fingerprint has not changed
+    // since then are not exported again, and the result only holds the changes.
+    const char *previous_path;
+
+    // BUNDLE_FORMAT_JSON is compatible with CrypTech's cryptech_backup
+    bundle_format_t format;
+
+    // NULL exports every exportable key
+    const export_filter_t *filter;
+
+    // where to save the key index of the export. NULL doesn't save one.
+    // A sharded export saves one key index next to every shard instead
+    const char *index_path;
+
+    // split the export into shards of about shard_size bytes, saved as
+    // shard_path.000, shard_path.001... The export file gets the shard set
+    // manifest. 0 exports a single bundle
+    uint64_t shard_size;
+    const char *shard_path;
+
+    // write the keys to this backup store instead. The export file gets the
+    // run manifest, and previous_path should be the store's latest run
+    const char *store_path;
+
+    // binary: write the bundle so it can be read from a pipe while it's
+    // being exported. See bundle_reader_open_stream
+    int streaming;
+} export_options_t;
+
+// One of the exports made by cryptech_export_keys_multi. *export_json is
+// the file to write to, or NULL to write to a temporary file that is
+// returned in *export_json
+typedef struct
+{
+    char *setup_json;
+    FILE **export_json;
+    const export_options_t *options;
+} export_destination_t;
+
+// The keys to import from an export, found with the export's key index.
+// Every key with one of the labels is imported.
+typedef struct
+{
+    const key_index_t *index;
+    const hal_uuid_t *uuids;
+    unsigned uuids_len;
+    const char * const *labels;
+    unsigned labels_len;
+} import_selection_t;
+
+#define IMPORT_TARGETS_MAX 16
+
+// One of the devices that import_keys_multi imports into. It must be logged
+// in on link (see init_cryptech_device_link), or on the process's link when
+// link is NULL. Only one target can use the process's link
+typedef struct
+{
+    serial_connection_t *link;
+    uint32_t handle;
+
+    // the KEKEK on this device, from its own setup. NULL uses the KEKEK
+    // named by the bundle. Its public key must match the bundle's. Not used
+    // for a bundle exported to a software KEKEK, which is loaded onto each
+    // device
+    const hal_uuid_t *kekek_uuid;
+
+    uuid_map_builder_t *uuid_map;   // may be NULL
+
+    // the result on this device
+    int rval;
+    unsigned int imported;
+} import_target_t;
+
+// The key lists that every operation starts with. They can be read while
+// the operator is still answering prompts. See device_warmup.h
+typedef struct
+{
+    uuid_enum_t keys;           // every key on the device
+    uuid_enum_t exportable;     // keys with HAL_KEY_FLAG_EXPORTABLE
+    uuid_enum_t kekeks;         // RSA private keys with KEYENCIPHERMENT and TOKEN
+    uuid_enum_t pool;           // KEKEKs in the pool that haven't been claimed
+} device_prefetch_t;
+
+typedef enum
+{
+    CRYPTECH_EVENT_KEY_EXPORTED,
+    CRYPTECH_EVENT_KEY_UNCHANGED,   // an incremental export left it out
+    CRYPTECH_EVENT_KEY_SKIPPED,     // its type can't be exported
+    CRYPTECH_EVENT_KEY_IMPORTED     // new_uuid is its UUID on this device
+} cryptech_event_t;
+
+// Receives what the functions below report instead of printing it. Either
+// callback can be NULL
+typedef struct
+{
+    void (*message)(void *context, const char *text);
+    void (*progress)(void *context, cryptech_event_t event, const hal_uuid_t *uuid, const hal_uuid_t *new_uuid);
+    void *context;
+} cryptech_reporter_t;
+
+// for the calling thread. NULL prints the messages. The threads started by
+// an operation use the reporter of the thread that started it
+void cryptech_set_reporter(const cryptech_reporter_t *reporter);
+const cryptech_reporter_t *cryptech_get_reporter(void);
+// print a message, or pass it to the calling thread's reporter
+void cryptech_report(const char *format, ...);
 
 int init_cryptech_device(char *pin, uint32_t handle);
 int close_cryptech_device(uint32_t handle);
 
+// log into another device on its own serial link. The calling thread talks
+// to that device until close_cryptech_device_link, so one thread can be
+// started for each device
+int init_cryptech_device_link(serial_connection_t *link, const char *device, char *pin, uint32_t handle);
+int close_cryptech_device_link(serial_connection_t *link, uint32_t handle);
+
 uint32_t get_random_handle();
 
 int setup_backup_destination(uint32_t handle, int device_index, char **json_result);
-int cryptech_export_keys(uint32_t handle, char *setup_json, FILE **export_json);
-int import_keys(uint32_t handle, char *json_data);
+// claim a KEKEK from the pool, or do a normal setup when it's empty.
+// pool_path is the pool's cache file, and may be NULL. Clients that share
+// a pool_path claim one at a time; clients that don't can still race for
+// the same KEKEK. See kekek_pool.h
+int setup_backup_destination_from_pool(uint32_t handle, int device_index, const char *pool_path, char **json_result);
+// generate KEKEKs until the pool holds pool_size of them
+int cryptech_fill_kekek_pool(uint32_t handle, unsigned int pool_size, const char *pool_path);
+int cryptech_export_keys(uint32_t handle, char *setup_json, FILE **export_json, const export_options_t *options);
+// export the keys to several KEKEKs in one pass over the device. Each key is
+// read once and wrapped once per KEKEK. The filter of the first
+// destination's options selects the keys for all of them
+int cryptech_export_keys_multi(uint32_t handle, export_destination_t *destinations, unsigned int destinations_len);
+// selection is NULL to import every key. kekek_passphrase decrypts the KEKEK
+// of a bundle that was exported to a software KEKEK, and is NULL otherwise
+int import_keys(uint32_t handle, bundle_reader_t *bundle, const import_selection_t *selection,
+                const char *kekek_passphrase, uuid_map_builder_t *uuid_map);
+// import the same keys into several devices at once. The bundle is read and
+// decoded once, and each target imports the records on its own thread. The
+// reporter of the calling thread hears from all of them. Returns the first
+// target's error; each target has its own result
+int import_keys_multi(bundle_reader_t *bundle, const import_selection_t *selection, const char *kekek_passphrase,
+                      import_target_t *targets, unsigned int targets_len);
+// the shards are read on several threads. A shard that can't be read only
+// loses its own keys
+int import_shard_set(uint32_t handle, const shard_set_t *set, uuid_map_builder_t *uuid_map);
+// import the keys of a backup store run
+int import_store_run(uint32_t handle, const char *store, const backup_store_run_t *run,
+                     uuid_map_builder_t *uuid_map);
+int cryptech_list_keys(uint32_t handle);
+// the same list, written to fp
+int cryptech_write_key_list(uint32_t handle, FILE *fp);
+
+// read the key lists. They're used instead of asking the device again once
+// they're passed to cryptech_use_prefetch, until that's called with NULL.
+// They're only right as long as no keys have been added or removed
+int cryptech_prefetch(uint32_t handle, device_prefetch_t *prefetch);
+void cryptech_use_prefetch(const device_prefetch_t *prefetch);
+void device_prefetch_init(device_prefetch_t *prefetch);
+void device_prefetch_free(device_prefetch_t *prefetch);
+// the fingerprint of every key on the device, in a Merkle tree. No private
+// key material is read
+int cryptech_key_tree(uint32_t handle, key_tree_t *tree);
+
+int export_filter_add_attribute(export_filter_t *filter, uint32_t type, const void *value, size_t length);
+
+// buffer must be at least 40 characters
+char *uuid_to_string(hal_uuid_t uuid, char *buffer);
+hal_uuid_t string_to_uuid(char *name);
 
 #endif
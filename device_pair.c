@@ -0,0 +1,182 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <hal.h>
+#include <hal_internal.h>
+
+#include "cryptech_device.h"
+#include "device_pair.h"
+#include "rpc_socket.h"
+
+int device_pair_connect(const char *device, char *pin, uint32_t handle)
+{
+    // the RPC client finds the device in the environment. A device that's
+    // named is opened even when cryptech_muxd is set up
+    if (device != NULL && setenv(HAL_CLIENT_SERIAL_DEVICE_ENVVAR, device, 1) != 0) return HAL_ERROR_IO_OS_ERROR;
+    if (device != NULL && unsetenv(RPC_SOCKET_ENVVAR) != 0) return HAL_ERROR_IO_OS_ERROR;
+
+    return init_cryptech_device(pin, handle);
+}
+
+int device_pair_write(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0)
+    {
+        ssize_t written = write(fd, p, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return HAL_ERROR_IO_OS_ERROR;
+
+        p += written;
+        len -= written;
+    }
+
+    return HAL_OK;
+}
+
+int device_pair_read(int fd, void *data, size_t len)
+{
+    uint8_t *p = data;
+
+    while (len > 0)
+    {
+        ssize_t count = read(fd, p, len);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return HAL_ERROR_IO_OS_ERROR;
+        if (count == 0) return HAL_ERROR_IO_UNEXPECTED;
+
+        p += count;
+        len -= count;
+    }
+
+    return HAL_OK;
+}
+
+int device_pair_start(device_pair_t *pair, const char *device, char *pin,
+                      device_pair_child_t child, void *context)
+{
+    if (pair == NULL || pin == NULL || child == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int down[2];
+    int up[2];
+
+    if (pipe(down) != 0) return HAL_ERROR_IO_OS_ERROR;
+    if (pipe(up) != 0)
+    {
+        close(down[0]);
+        close(down[1]);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    // or the child prints it again
+    fflush(stdout);
+
+    pair->pid = fork();
+    if (pair->pid < 0)
+    {
+        close(down[0]);
+        close(down[1]);
+        close(up[0]);
+        close(up[1]);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    if (pair->pid == 0)
+    {
+        close(down[1]);
+        close(up[0]);
+
+        uint32_t handle = get_random_handle();
+        int rval = device_pair_connect(device, pin, handle);
+        if (rval != HAL_OK)
+        {
+            cryptech_report("Unable to log into the CrypTech device at '%s'.\r\n", (device != NULL) ? device : "");
+        }
+        else
+        {
+            rval = child(handle, down[0], up[1], context);
+            close_cryptech_device(handle);
+        }
+
+        // HAL errors fit in an exit status
+        close(down[0]);
+        close(up[1]);
+        fflush(stdout);
+        _exit(rval);
+    }
+
+    close(down[0]);
+    close(up[1]);
+    pair->to_child = down[1];
+    pair->from_child = up[0];
+
+    // a child that stops reading fails the write instead of killing this
+    // process
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &pair->sigpipe);
+
+    return HAL_OK;
+}
+
+int device_pair_finish(device_pair_t *pair, int rval)
+{
+    if (pair->to_child >= 0) close(pair->to_child);
+    if (pair->from_child >= 0) close(pair->from_child);
+    pair->to_child = -1;
+    pair->from_child = -1;
+
+    int status;
+    while (waitpid(pair->pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            status = -1;
+            break;
+        }
+    }
+
+    sigaction(SIGPIPE, &pair->sigpipe, NULL);
+
+    // the child's error is more useful than a broken pipe
+    if (status == -1 || !WIFEXITED(status)) return HAL_ERROR_IO_UNEXPECTED;
+    if (WEXITSTATUS(status) != HAL_OK) return WEXITSTATUS(status);
+
+    return rval;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef DEVICE_PAIR_H
+#define DEVICE_PAIR_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Talks to a second CrypTech device from a child process. The RPC client
+// only has one link, so each process opens its own device. The processes
+// are connected with a pipe in each direction.
+typedef struct
+{
+    pid_t pid;
+    int to_child;
+    int from_child;
+    struct sigaction sigpipe;
+} device_pair_t;
+
+// runs in the child process after it has logged into the device. The
+// result becomes the child's exit status
+typedef int (*device_pair_child_t)(uint32_t handle, int from_parent, int to_parent, void *context);
+
+// device is a serial device, like CRYPTECH_RPC_CLIENT_SERIAL_DEVICE. NULL
+// uses the one in the environment. Call this before this process has
+// opened its own device
+int device_pair_start(device_pair_t *pair, const char *device, char *pin,
+                      device_pair_child_t child, void *context);
+
+// closes the pipes and waits for the child. Returns rval, or the child's
+// error when it failed
+int device_pair_finish(device_pair_t *pair, int rval);
+
+// log into a device. NULL uses the one in the environment
+int device_pair_connect(const char *device, char *pin, uint32_t handle);
+
+// write or read all of len. Reading fails at the end of the pipe
+int device_pair_write(int fd, const void *data, size_t len);
+int device_pair_read(int fd, void *data, size_t len);
+
+#endif
@@ -0,0 +1,142 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "device_warmup.h"
+
+// Internal Functions ---------------------------------------------------
+static int warmup_cancelled(device_warmup_t *warmup)
+{
+    pthread_mutex_lock(&warmup->mutex);
+    int cancelled = warmup->cancelled;
+    pthread_mutex_unlock(&warmup->mutex);
+
+    return cancelled;
+}
+
+static void *warmup_thread(void *arg)
+{
+    device_warmup_t *warmup = arg;
+
+    warmup->rval = init_cryptech_device(warmup->pin, warmup->handle);
+
+    // the PIN isn't needed again
+    memset(warmup->pin, 0, sizeof(warmup->pin));
+
+    if (warmup->rval != 0 || warmup_cancelled(warmup)) return NULL;
+
+    if (cryptech_prefetch(warmup->handle, &warmup->prefetch) == HAL_OK)
+    {
+        warmup->prefetched = 1;
+    }
+    else
+    {
+        // the operation will read them itself
+        device_prefetch_free(&warmup->prefetch);
+        device_prefetch_init(&warmup->prefetch);
+    }
+
+    return NULL;
+}
+
+static void warmup_join(device_warmup_t *warmup)
+{
+    if (!warmup->started) return;
+
+    pthread_join(warmup->thread, NULL);
+    pthread_mutex_destroy(&warmup->mutex);
+    warmup->started = 0;
+}
+
+// Function Implementations ---------------------------------------------
+int device_warmup_start(device_warmup_t *warmup, const char *pin)
+{
+    if (warmup == NULL || pin == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(warmup, 0, sizeof(*warmup));
+    device_prefetch_init(&warmup->prefetch);
+    warmup->rval = HAL_ERROR_NOT_READY;
+
+    if (strlen(pin) >= sizeof(warmup->pin)) return HAL_ERROR_BAD_ARGUMENTS;
+    strcpy(warmup->pin, pin);
+
+    warmup->handle = get_random_handle();
+
+    if (pthread_mutex_init(&warmup->mutex, NULL) != 0) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if (pthread_create(&warmup->thread, NULL, warmup_thread, warmup) != 0)
+    {
+        pthread_mutex_destroy(&warmup->mutex);
+        memset(warmup->pin, 0, sizeof(warmup->pin));
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    warmup->started = 1;
+    return HAL_OK;
+}
+
+int device_warmup_finish(device_warmup_t *warmup, uint32_t *handle)
+{
+    if (warmup == NULL || handle == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    warmup_join(warmup);
+
+    *handle = warmup->handle;
+    if (warmup->rval == 0 && warmup->prefetched) cryptech_use_prefetch(&warmup->prefetch);
+
+    return warmup->rval;
+}
+
+void device_warmup_cancel(device_warmup_t *warmup)
+{
+    if (warmup == NULL || !warmup->started) return;
+
+    pthread_mutex_lock(&warmup->mutex);
+    warmup->cancelled = 1;
+    pthread_mutex_unlock(&warmup->mutex);
+
+    warmup_join(warmup);
+
+    if (warmup->rval == 0) close_cryptech_device(warmup->handle);
+    device_warmup_free(warmup);
+}
+
+void device_warmup_free(device_warmup_t *warmup)
+{
+    if (warmup == NULL) return;
+
+    device_prefetch_free(&warmup->prefetch);
+    warmup->prefetched = 0;
+}
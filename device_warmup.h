@@ -0,0 +1,68 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef DEVICE_WARMUP_H
+#define DEVICE_WARMUP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cryptech_device.h"
+
+// Logs into the CrypTech device and reads its key lists on another thread,
+// while the operator is still answering prompts. Nothing else may use the
+// RPC client until the warm-up has been finished or cancelled.
+typedef struct
+{
+    pthread_t thread;
+    int started;
+    pthread_mutex_t mutex;
+    int cancelled;
+    char pin[64];
+    uint32_t handle;
+    int rval;           // the result of the login
+    int prefetched;     // the key lists were read
+    device_prefetch_t prefetch;
+} device_warmup_t;
+
+int device_warmup_start(device_warmup_t *warmup, const char *pin);
+
+// waits for the warm-up. Returns the result of the login, like
+// init_cryptech_device. The key lists are passed to cryptech_use_prefetch
+// when they were read. Call device_warmup_free once the device is closed
+int device_warmup_finish(device_warmup_t *warmup, uint32_t *handle);
+
+// the device isn't going to be used. Waits for the warm-up and closes the
+// device if it logged in
+void device_warmup_cancel(device_warmup_t *warmup);
+
+void device_warmup_free(device_warmup_t *warmup);
+
+#endif
@@ -0,0 +1,148 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "dks_arena.h"
+
+#define DKS_ARENA_ALIGNMENT 16
+
+static size_t align_size(size_t len)
+{
+    return (len + DKS_ARENA_ALIGNMENT - 1) & ~((size_t)DKS_ARENA_ALIGNMENT - 1);
+}
+
+int dks_arena_init(dks_arena_t *arena, size_t size)
+{
+    if (arena == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(arena, 0, sizeof(dks_arena_t));
+
+    size = align_size(size);
+    arena->base = malloc(size);
+    if (arena->base == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    arena->size = size;
+
+    return HAL_OK;
+}
+
+void *dks_arena_alloc(dks_arena_t *arena, size_t len)
+{
+    if (arena == NULL) return NULL;
+
+    len = align_size(len);
+    arena->total_used += len;
+
+    if (arena->size - arena->used >= len)
+    {
+        void *result = arena->base + arena->used;
+        arena->used += len;
+        return result;
+    }
+
+    // out of room. take it from the heap until the next reset
+    size_t header_len = align_size(sizeof(dks_arena_spill_t));
+    dks_arena_spill_t *spill = malloc(header_len + len);
+    if (spill == NULL) return NULL;
+
+    spill->size = len;
+    spill->next = arena->spills;
+    arena->spills = spill;
+
+    return (uint8_t *)spill + header_len;
+}
+
+char *dks_arena_printf(dks_arena_t *arena, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (len < 0) return NULL;
+
+    char *result = dks_arena_alloc(arena, len + 1);
+    if (result == NULL) return NULL;
+
+    va_start(args, format);
+    vsnprintf(result, len + 1, format, args);
+    va_end(args);
+
+    return result;
+}
+
+void dks_arena_reset(dks_arena_t *arena)
+{
+    if (arena == NULL) return;
+
+    if (arena->spills != NULL)
+    {
+        while (arena->spills != NULL)
+        {
+            dks_arena_spill_t *next = arena->spills->next;
+            free(arena->spills);
+            arena->spills = next;
+        }
+
+        // grow so the same amount of work fits next time
+        uint8_t *new_base = malloc(arena->total_used);
+        if (new_base != NULL)
+        {
+            free(arena->base);
+            arena->base = new_base;
+            arena->size = arena->total_used;
+        }
+    }
+
+    arena->used = 0;
+    arena->total_used = 0;
+}
+
+void dks_arena_free(dks_arena_t *arena)
+{
+    if (arena == NULL) return;
+
+    while (arena->spills != NULL)
+    {
+        dks_arena_spill_t *next = arena->spills->next;
+        free(arena->spills);
+        arena->spills = next;
+    }
+
+    free(arena->base);
+    memset(arena, 0, sizeof(dks_arena_t));
+}
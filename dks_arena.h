@@ -0,0 +1,66 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef DKS_ARENA_H
+#define DKS_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A bump allocator for scratch memory that only lives while one key is
+// being processed. Allocations are never freed one at a time; the whole
+// arena is reset instead. If a key needs more than the arena holds, the
+// extra memory is taken from the heap and the arena grows to cover it at
+// the next reset, so after the first few keys there is no heap activity.
+typedef struct dks_arena_spill
+{
+    struct dks_arena_spill *next;
+    size_t size;
+} dks_arena_spill_t;
+
+typedef struct
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+
+    // memory used since the last reset, including spills
+    size_t total_used;
+
+    dks_arena_spill_t *spills;
+} dks_arena_t;
+
+int dks_arena_init(dks_arena_t *arena, size_t size);
+void *dks_arena_alloc(dks_arena_t *arena, size_t len);
+char *dks_arena_printf(dks_arena_t *arena, const char *format, ...);
+void dks_arena_reset(dks_arena_t *arena);
+void dks_arena_free(dks_arena_t *arena);
+
+#endif
@@ -0,0 +1,338 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+#include <hal_internal.h>
+
+#include "backup_store.h"
+#include "bundle_reader.h"
+#include "dks_backup.h"
+#include "rpc_mux.h"
+#include "shard_set.h"
+
+#define SINK_BUFFER_SIZE 4096
+
+// Internal Functions ---------------------------------------------------
+
+// the calling thread uses the context's link and reporter until unbind
+static void bind(dks_backup_t *backup, const cryptech_reporter_t **saved_reporter)
+{
+    *saved_reporter = cryptech_get_reporter();
+    cryptech_set_reporter(backup->reporter);
+    rpc_mux_use_link(&backup->link);
+}
+
+static void unbind(const cryptech_reporter_t *saved_reporter)
+{
+    rpc_mux_use_link(NULL);
+    cryptech_set_reporter(saved_reporter);
+}
+
+// copy fp from the start to the sink, and close it
+static int drain_to_sink(FILE *fp, const dks_backup_sink_t *sink)
+{
+    int rval = HAL_OK;
+    uint8_t buffer[SINK_BUFFER_SIZE];
+
+    rewind(fp);
+
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        if (sink->write(sink->context, buffer, len) != 0)
+        {
+            rval = HAL_ERROR_IO_OS_ERROR;
+            break;
+        }
+    }
+    if (rval == HAL_OK && ferror(fp)) rval = HAL_ERROR_IO_OS_ERROR;
+
+    fclose(fp);
+
+    return rval;
+}
+
+static int write_file(void *context, const void *data, size_t len)
+{
+    return (fwrite(data, 1, len, (FILE *)context) == len) ? 0 : -1;
+}
+
+static int import_path(uint32_t handle, const char *path, const import_selection_t *selection,
+                       const char *kekek_passphrase, uuid_map_builder_t *uuid_map)
+{
+    int rval;
+
+    if (shard_set_is_manifest(path))
+    {
+        shard_set_t set;
+        shard_set_init(&set);
+
+        rval = shard_set_load(path, &set);
+        if (rval == HAL_OK) rval = import_shard_set(handle, &set, uuid_map);
+
+        shard_set_free(&set);
+    }
+    else if (backup_store_run_is_manifest(path))
+    {
+        backup_store_run_t run;
+        backup_store_run_init(&run);
+
+        char store[1024];
+        rval = backup_store_run_load(path, &run);
+        if (rval == HAL_OK && backup_store_of_run(path, store, sizeof(store)/sizeof(char)) == NULL)
+        {
+            rval = HAL_ERROR_RESULT_TOO_LONG;
+        }
+        if (rval == HAL_OK) rval = import_store_run(handle, store, &run, uuid_map);
+
+        backup_store_run_free(&run);
+    }
+    else
+    {
+        bundle_reader_t *bundle = bundle_reader_open(path, &rval);
+        if (bundle == NULL) return rval;
+
+        rval = import_keys(handle, bundle, selection, kekek_passphrase, uuid_map);
+
+        bundle_reader_close(bundle);
+    }
+
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+void dks_backup_init(dks_backup_t *backup)
+{
+    memset(backup, 0, sizeof(dks_backup_t));
+    serial_connection_init(&backup->link);
+}
+
+int dks_backup_open(dks_backup_t *backup, const char *device, const char *pin, const cryptech_reporter_t *reporter)
+{
+    if (backup == NULL || pin == NULL || backup->open) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (device == NULL) device = getenv(HAL_CLIENT_SERIAL_DEVICE_ENVVAR);
+    if (device == NULL) return HAL_ERROR_RPC_TRANSPORT;
+
+    char pin_buffer[64];
+    if (strlen(pin) >= sizeof(pin_buffer)) return HAL_ERROR_BAD_ARGUMENTS;
+    strcpy(pin_buffer, pin);
+
+    backup->handle = get_random_handle();
+    backup->reporter = reporter;
+
+    const cryptech_reporter_t *saved_reporter = cryptech_get_reporter();
+    cryptech_set_reporter(reporter);
+
+    int rval = init_cryptech_device_link(&backup->link, device, pin_buffer, backup->handle);
+
+    // the link is bound again for every call
+    rpc_mux_use_link(NULL);
+    cryptech_set_reporter(saved_reporter);
+
+    memset(pin_buffer, 0, sizeof(pin_buffer));
+
+    if (rval == HAL_OK) backup->open = 1;
+
+    return rval;
+}
+
+int dks_backup_close(dks_backup_t *backup)
+{
+    if (backup == NULL || !backup->open) return HAL_ERROR_BAD_ARGUMENTS;
+
+    const cryptech_reporter_t *saved_reporter;
+    bind(backup, &saved_reporter);
+
+    int rval = close_cryptech_device_link(&backup->link, backup->handle);
+
+    unbind(saved_reporter);
+
+    backup->open = 0;
+
+    return rval;
+}
+
+void dks_backup_set_deadline(dks_backup_t *backup, time_t deadline)
+{
+    if (backup != NULL) serial_connection_set_deadline(&backup->link, deadline);
+}
+
+int dks_backup_setup(dks_backup_t *backup, const dks_backup_sink_t *sink)
+{
+    if (backup == NULL || !backup->open || sink == NULL || sink->write == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    const cryptech_reporter_t *saved_reporter;
+    bind(backup, &saved_reporter);
+
+    char *setup_json = NULL;
+    int rval = setup_backup_destination(backup->handle, -1, &setup_json);
+
+    unbind(saved_reporter);
+
+    if (rval == HAL_OK && sink->write(sink->context, setup_json, strlen(setup_json)) != 0)
+    {
+        rval = HAL_ERROR_IO_OS_ERROR;
+    }
+
+    free(setup_json);
+
+    return rval;
+}
+
+int dks_backup_export(dks_backup_t *backup, const char *setup_json, const export_options_t *options,
+                      const dks_backup_sink_t *sink)
+{
+    if (backup == NULL || !backup->open || setup_json == NULL || sink == NULL || sink->write == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    // the export may change the JSON while reading it
+    char *setup_copy = strdup(setup_json);
+    if (setup_copy == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    const cryptech_reporter_t *saved_reporter;
+    bind(backup, &saved_reporter);
+
+    // the export goes to a temporary file, which is copied to the sink
+    FILE *fp = NULL;
+    int rval = cryptech_export_keys(backup->handle, setup_copy, &fp, options);
+
+    unbind(saved_reporter);
+
+    free(setup_copy);
+
+    if (rval == HAL_OK) rval = drain_to_sink(fp, sink);
+
+    return rval;
+}
+
+int dks_backup_import(dks_backup_t *backup, const char *path, const import_selection_t *selection,
+                      const char *kekek_passphrase, uuid_map_builder_t *uuid_map)
+{
+    if (backup == NULL || !backup->open || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    const cryptech_reporter_t *saved_reporter;
+    bind(backup, &saved_reporter);
+
+    int rval = import_path(backup->handle, path, selection, kekek_passphrase, uuid_map);
+
+    unbind(saved_reporter);
+
+    return rval;
+}
+
+int dks_backup_import_multi(dks_backup_t * const *backups, unsigned int backups_len, const char *path,
+                            const import_selection_t *selection, const char *kekek_passphrase,
+                            const hal_uuid_t * const *kekek_uuids, uuid_map_builder_t * const *uuid_maps,
+                            int *results)
+{
+    if (backups == NULL || backups_len == 0 || backups_len > IMPORT_TARGETS_MAX || path == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    for (unsigned int i = 0; i < backups_len; ++i)
+    {
+        if (backups[i] == NULL || !backups[i]->open) return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    // the shards of a set and the runs of a store are their own files
+    if (shard_set_is_manifest(path) || backup_store_run_is_manifest(path)) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    import_target_t targets[IMPORT_TARGETS_MAX];
+    memset(targets, 0, sizeof(targets));
+
+    for (unsigned int i = 0; i < backups_len; ++i)
+    {
+        targets[i].link = &backups[i]->link;
+        targets[i].handle = backups[i]->handle;
+        targets[i].kekek_uuid = (kekek_uuids != NULL) ? kekek_uuids[i] : NULL;
+        targets[i].uuid_map = (uuid_maps != NULL) ? uuid_maps[i] : NULL;
+    }
+
+    // the targets report to the first context's reporter
+    const cryptech_reporter_t *saved_reporter = cryptech_get_reporter();
+    cryptech_set_reporter(backups[0]->reporter);
+
+    int rval;
+    bundle_reader_t *bundle = bundle_reader_open(path, &rval);
+    if (bundle != NULL)
+    {
+        rval = import_keys_multi(bundle, selection, kekek_passphrase, targets, backups_len);
+        bundle_reader_close(bundle);
+    }
+
+    cryptech_set_reporter(saved_reporter);
+
+    if (results != NULL)
+    {
+        for (unsigned int i = 0; i < backups_len; ++i)
+        {
+            results[i] = (bundle != NULL) ? targets[i].rval : rval;
+        }
+    }
+
+    return rval;
+}
+
+int dks_backup_list(dks_backup_t *backup, const dks_backup_sink_t *sink)
+{
+    if (backup == NULL || !backup->open || sink == NULL || sink->write == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    FILE *fp = tmpfile();
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    const cryptech_reporter_t *saved_reporter;
+    bind(backup, &saved_reporter);
+
+    int rval = cryptech_write_key_list(backup->handle, fp);
+
+    unbind(saved_reporter);
+
+    if (rval == HAL_OK) rval = drain_to_sink(fp, sink);
+    else fclose(fp);
+
+    return rval;
+}
+
+dks_backup_sink_t dks_backup_file_sink(FILE *fp)
+{
+    dks_backup_sink_t sink;
+    sink.write = write_file;
+    sink.context = fp;
+
+    return sink;
+}
@@ -0,0 +1,108 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef DKS_BACKUP_H
+#define DKS_BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <hal.h>
+
+#include "cryptech_device.h"
+#include "serial.h"
+#include "uuid_map.h"
+
+// The backup engine as a library (lib/libdksbackup.a). Every call returns a
+// hal_error_t, writes its results to a sink and reports what it does to the
+// context's reporter instead of printing.
+//
+// A context is one logged-in session on its own serial link, so a process
+// can hold several of them and use them on different threads at the same
+// time. A context may only be used by one thread at a time.
+
+// Where an operation writes what it produces
+typedef struct
+{
+    // returns 0 once all len bytes are written
+    int (*write)(void *context, const void *data, size_t len);
+    void *context;
+} dks_backup_sink_t;
+
+typedef struct
+{
+    serial_connection_t link;
+    uint32_t handle;
+    const cryptech_reporter_t *reporter;
+    int open;
+} dks_backup_t;
+
+// device NULL uses CRYPTECH_RPC_CLIENT_SERIAL_DEVICE, like the tools.
+// reporter NULL prints the messages. The reporter must outlive the context
+void dks_backup_init(dks_backup_t *backup);
+int dks_backup_open(dks_backup_t *backup, const char *device, const char *pin, const cryptech_reporter_t *reporter);
+int dks_backup_close(dks_backup_t *backup);
+
+// calls that are still waiting for the device at this time (from time())
+// fail with HAL_ERROR_IO_TIMEOUT. It can be set before dks_backup_open to
+// bound the login too. The context should be closed after a timeout
+void dks_backup_set_deadline(dks_backup_t *backup, time_t deadline);
+
+// write the setup JSON of a new KEKEK, for the device that exports
+int dks_backup_setup(dks_backup_t *backup, const dks_backup_sink_t *sink);
+
+// export the keys to the KEKEK of setup_json. options NULL exports every
+// exportable key as JSON. A sharded or backup store export writes its
+// manifest to the sink
+int dks_backup_export(dks_backup_t *backup, const char *setup_json, const export_options_t *options,
+                      const dks_backup_sink_t *sink);
+
+// import a JSON or binary export, a shard set or a backup store run. The
+// arguments are those of import_keys. uuid_map may be NULL
+int dks_backup_import(dks_backup_t *backup, const char *path, const import_selection_t *selection,
+                      const char *kekek_passphrase, uuid_map_builder_t *uuid_map);
+
+// import one JSON or binary export into several devices at once, each on
+// its own thread. See import_keys_multi. kekek_uuids and uuid_maps may be
+// NULL, or hold an entry (which may be NULL) for each context. results may
+// be NULL, or gets each context's result
+int dks_backup_import_multi(dks_backup_t * const *backups, unsigned int backups_len, const char *path,
+                            const import_selection_t *selection, const char *kekek_passphrase,
+                            const hal_uuid_t * const *kekek_uuids, uuid_map_builder_t * const *uuid_maps,
+                            int *results);
+
+// the key list of cryptech_write_key_list
+int dks_backup_list(dks_backup_t *backup, const dks_backup_sink_t *sink);
+
+// a sink that writes to fp
+dks_backup_sink_t dks_backup_file_sink(FILE *fp);
+
+#endif
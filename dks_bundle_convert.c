@@ -0,0 +1,136 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle_reader.h"
+#include "bundle_writer.h"
+#include "cryptech_device.h"
+
+// Internal Function Declarations ------------------------------------------
+int ConvertBundle(bundle_reader_t *bundle, FILE *fp, bundle_format_t format, const char *index_path);
+void PrintUsage();
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    int format = -1;
+
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) { format = BUNDLE_FORMAT_JSON; ++arg; }
+    else if (argc > 1 && strcmp(argv[1], "-b") == 0) { format = BUNDLE_FORMAT_BINARY; ++arg; }
+
+    if (argc - arg != 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const char *input_path = argv[arg];
+    const char *output_path = argv[arg + 1];
+
+    // the key index is saved next to the output file
+    char index_path[2048 + 16];
+    snprintf(index_path, sizeof(index_path)/sizeof(char), "%s.idx", output_path);
+
+    int err;
+    bundle_reader_t *bundle = bundle_reader_open(input_path, &err);
+    if (bundle == NULL)
+    {
+        printf("Unable to read export file, '%s': %s\r\n", input_path, hal_error_string(err));
+        return 1;
+    }
+
+    // by default, convert to the other format
+    if (format == -1)
+    {
+        format = (bundle_reader_format(bundle) == BUNDLE_FORMAT_JSON) ? BUNDLE_FORMAT_BINARY : BUNDLE_FORMAT_JSON;
+    }
+
+    FILE *fp = fopen(output_path, (format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
+    if (fp == NULL)
+    {
+        printf("Unable to open output file, '%s'.\r\n", output_path);
+        bundle_reader_close(bundle);
+        return 1;
+    }
+
+    err = ConvertBundle(bundle, fp, format, index_path);
+
+    bundle_reader_close(bundle);
+    if (fclose(fp) != 0 && err == HAL_OK) err = HAL_ERROR_IO_OS_ERROR;
+
+    if (err != HAL_OK)
+    {
+        printf("Unable to convert '%s': %s\r\n", input_path, hal_error_string(err));
+        remove(output_path);
+        remove(index_path);
+        return 1;
+    }
+
+    printf("Converted '%s' to %s '%s'.\r\n", input_path,
+           (format == BUNDLE_FORMAT_BINARY) ? "binary" : "JSON", output_path);
+
+    return 0;
+}
+
+int ConvertBundle(bundle_reader_t *bundle, FILE *fp, bundle_format_t format, const char *index_path)
+{
+    bundle_writer_t writer;
+    bundle_record_t record;
+    int done = 0;
+
+    int rval = bundle_writer_start(&writer, format, fp, bundle_reader_header(bundle), NULL);
+
+    while (rval == HAL_OK &&
+           (rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
+    {
+        rval = bundle_writer_add(&writer, &record);
+    }
+
+    if (rval == HAL_OK) rval = bundle_writer_finish(&writer);
+    if (rval == HAL_OK) rval = bundle_writer_save_index(&writer, index_path);
+
+    bundle_writer_free(&writer);
+
+    return rval;
+}
+
+void PrintUsage()
+{
+    printf("dks_bundle_convert\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Converts a dks_cryptech_backup export file between the JSON format,\r\n\
+which is compatible with CrypTech's cryptech_backup, and the binary\r\n\
+format. Without -j or -b, the file is converted to the other format.\r\n\
+The key index of the new file is saved as <output file>.idx.\r\n\r\n\
+usage: dks_bundle_convert [-j | -b] <input file> <output file>\r\n");
+}
@@ -0,0 +1,174 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <djson.h>
+
+#include "bundle_reader.h"
+#include "bundle_rekey.h"
+#include "cryptech_device.h"
+#include "soft_kekek.h"
+
+// the passphrase of the old KEKEK can be given here instead of typing it
+#define PASSPHRASE_ENVVAR "DKS_KEKEK_PASSPHRASE"
+
+// Internal Function Declarations ------------------------------------------
+void PrintUsage();
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    int format = -1;
+    unsigned int threads = 0;
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-j") == 0) format = BUNDLE_FORMAT_JSON;
+        else if (strcmp(argv[arg], "-b") == 0) format = BUNDLE_FORMAT_BINARY;
+        else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) threads = (unsigned int)atoi(argv[++arg]);
+        else break;
+        ++arg;
+    }
+
+    if (argc - arg != 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const char *input_path = argv[arg];
+    const char *setup_path = argv[arg + 1];
+    const char *output_path = argv[arg + 2];
+
+    // the key index is saved next to the output file
+    char index_path[2048 + 16];
+    snprintf(index_path, sizeof(index_path)/sizeof(char), "%s.idx", output_path);
+
+    int err;
+    bundle_reader_t *bundle = bundle_reader_open(input_path, &err);
+    if (bundle == NULL)
+    {
+        printf("Unable to read export file, '%s': %s\r\n", input_path, hal_error_string(err));
+        return 1;
+    }
+
+    const bundle_header_t *header = bundle_reader_header(bundle);
+    if (header->kekek_pkcs8 == NULL || header->kekek_salt == NULL)
+    {
+        printf("'%s' was not exported to a software KEKEK, so it can't be re-wrapped.\r\n", input_path);
+        bundle_reader_close(bundle);
+        return 1;
+    }
+
+    char *setup_json = djson_loadfile(setup_path);
+    if (setup_json == NULL)
+    {
+        printf("Unable to open setup file, '%s'.\r\n", setup_path);
+        bundle_reader_close(bundle);
+        return 1;
+    }
+
+    // same prompt as cryptech_backup
+    const char *passphrase = getenv(PASSPHRASE_ENVVAR);
+    if (passphrase == NULL) passphrase = getpass("KEKEK Passphrase: ");
+
+    uint8_t *key_der = NULL;
+    size_t key_der_len = 0;
+    err = soft_kekek_recover(passphrase, header->kekek_salt, header->kekek_salt_len,
+                             header->kekek_pkcs8, header->kekek_pkcs8_len, &key_der, &key_der_len);
+    if (err != HAL_OK)
+    {
+        printf("Unable to decrypt the KEKEK of '%s'. Check the passphrase.\r\n", input_path);
+        free(setup_json);
+        bundle_reader_close(bundle);
+        return 1;
+    }
+
+    // by default, keep the format
+    if (format == -1) format = bundle_reader_format(bundle);
+
+    FILE *fp = fopen(output_path, (format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
+    if (fp == NULL)
+    {
+        printf("Unable to open output file, '%s'.\r\n", output_path);
+        soft_kekek_free(key_der, key_der_len);
+        free(setup_json);
+        bundle_reader_close(bundle);
+        return 1;
+    }
+
+    bundle_rekey_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.old_key_der = key_der;
+    options.old_key_der_len = key_der_len;
+    options.setup_json = setup_json;
+    options.format = format;
+    options.index_path = index_path;
+    options.threads = threads;
+
+    unsigned int keys = 0;
+    err = bundle_rekey(bundle, fp, &options, &keys);
+
+    soft_kekek_free(key_der, key_der_len);
+    free(setup_json);
+    bundle_reader_close(bundle);
+    if (fclose(fp) != 0 && err == HAL_OK) err = HAL_ERROR_IO_OS_ERROR;
+
+    if (err != HAL_OK)
+    {
+        printf("Unable to re-wrap '%s': %s\r\n", input_path, hal_error_string(err));
+        remove(output_path);
+        remove(index_path);
+        return 1;
+    }
+
+    printf("Re-wrapped %u keys from '%s' to the KEKEK of '%s' in '%s'.\r\n", keys, input_path, setup_path, output_path);
+
+    return 0;
+}
+
+void PrintUsage()
+{
+    printf("dks_bundle_rekey\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Re-wraps a dks_cryptech_backup export file to a new KEKEK without the\r\n\
+primary HSM, for when the backup HSM is replaced. The export must have\r\n\
+been made to a software KEKEK. Its passphrase is asked for, or read from\r\n\
+" PASSPHRASE_ENVVAR ". The new KEKEK comes from a setup JSON file.\r\n\
+Only the KEKs are re-encrypted; the wrapped private keys are copied.\r\n\
+Without -j or -b, the file keeps its format. -t sets the number of\r\n\
+threads, one per CPU by default.\r\n\
+The key index of the new file is saved as <output file>.idx.\r\n\r\n\
+usage: dks_bundle_rekey [-j | -b] [-t threads] <input file> <setup json> <output file>\r\n");
+}
@@ -38,8 +38,56 @@
 
 #include <djson.h>
 
+#define CK_PTR                                          *
+#define CK_DEFINE_FUNCTION(returnType, name)            returnType name
+#define CK_DECLARE_FUNCTION(returnType, name)           returnType name
+#define CK_DECLARE_FUNCTION_POINTER(returnType, name)   returnType (* name)
+#define CK_CALLBACK_FUNCTION(returnType, name)          returnType (* name)
+#ifndef NULL_PTR
+#define NULL_PTR                                        NULL
+#endif
+
+#include "pkcs11t.h"
+
 #include "cryptech_device.h"
 #include "cryptech_device_cty.h"
+#include "device_warmup.h"
+#include "replicate.h"
+#include "soft_kekek.h"
+#include "verify.h"
+
+// Internal Types ----------------------------------------------------------
+typedef struct
+{
+    export_filter_t filter;
+    char label[256];
+    char application[256];
+    char id_hex[256];
+    uint8_t id[128];
+} export_selection_t;
+
+#define IMPORT_SELECTION_MAX 64
+
+// the UUIDs and labels of the keys to import
+typedef struct
+{
+    char lines[IMPORT_SELECTION_MAX][256];
+    hal_uuid_t uuids[IMPORT_SELECTION_MAX];
+    const char *labels[IMPORT_SELECTION_MAX];
+    import_selection_t selection;
+} import_keys_selection_t;
+
+#define EXPORT_DESTINATIONS_MAX 4
+
+// another backup HSM that gets the same keys in the same pass
+typedef struct
+{
+    char setup_path[2048];
+    char output_path[2048];
+    char index_path[2048 + 16];
+    char *setup_json;
+    FILE *fp;
+} extra_destination_t;
 
 // Internal Function Declarations ------------------------------------------
 void ResetKeyboardInput(struct termios *oldAttributes);
@@ -49,21 +97,40 @@ int GetOption(const char *banner, const char *answers, const char *question);
 void GetMasterKey(char *buffer, int buffer_len);
 void GetLine(char *buffer, int buffer_len);
 int GetLineCheck(char *buffer, int buffer_len, const char *question);
+void GetOptionalLine(char *buffer, int buffer_len, const char *question);
+int GetExportSelection(export_selection_t *selection);
+int GetImportSelection(import_keys_selection_t *selection);
+int IsUuidString(const char *s);
+int ParseHex(const char *hex, uint8_t *result, int result_max);
 int isMasterKeyValid(char *buffer);
 int SetMasterKey(char *masterkey, char *pin);
+void DiscardWarmup(void);
 
-void SaveSetupJson(FILE **fp, uint32_t handle);
-void SaveExportJson(FILE **ofp, char *setup_json, uint32_t handle);
-void ImportKeys(char *import_json, uint32_t handle);
+void SaveSetupJson(FILE **fp, const char *pool_path, uint32_t handle);
+void SaveSoftSetupJson(FILE **fp, const char *passphrase);
+int SaveExportJson(FILE **ofp, char *setup_json, const char *previous_path, const export_filter_t *filter,
+                   bundle_format_t format, const char *index_path, uint64_t shard_size, const char *shard_path,
+                   const char *store_path, extra_destination_t *extras, unsigned int extras_len, uint32_t handle);
+void ImportKeys(bundle_reader_t *bundle, const shard_set_t *shards, const backup_store_run_t *store_run,
+                const char *store_path, const import_selection_t *selection, const char *kekek_passphrase,
+                const char *uuid_map_path, uint32_t handle);
 
 // Internal Enumerations --------------------------------------------------
 typedef enum
 {
     cmd_op_setup = 0,
     cmd_op_export = 1,
-    cmd_op_import = 2
+    cmd_op_import = 2,
+    cmd_op_list = 3,
+    cmd_op_replicate = 4,
+    cmd_op_verify = 5,
+    cmd_op_pool = 6
 } backup_operations_t;
 
+// Internal Variables -----------------------------------------------------
+// logs in while the options are being entered
+static device_warmup_t warmup;
+
 // Function Definintions --------------------------------------------------
 int main(int argc, char *argv[])
 {
@@ -72,10 +139,45 @@ int main(int argc, char *argv[])
     char masterkey[128];
     char inputfile[2048];
     char outputfile[2048];
+    char uuidmapfile[2048 + 16];
+    char indexfile[2048 + 16];
+    char previousfile[2048];
+    char storefolder[2048];
+    char sourcedevice[256];
+    char destinationdevice[256];
+    char destinationpin[64];
+    char poolfile[2048];
+    char passphrase[64];
+    char passphrase_check[64];
     inputfile[0] = 0;
+    passphrase[0] = 0;
     outputfile[0] = 0;
+    previousfile[0] = 0;
+    storefolder[0] = 0;
+    sourcedevice[0] = 0;
+    destinationdevice[0] = 0;
+    uuidmapfile[0] = 0;
+    poolfile[0] = 0;
+    unsigned int pool_size = 0;
     FILE *ofp = NULL;
     char *input_json = NULL;
+    bundle_reader_t *import_bundle = NULL;
+    shard_set_t import_shards;
+    shard_set_init(&import_shards);
+    int sharded = 0;
+    uint64_t shard_size = 0;
+    backup_store_run_t import_run;
+    backup_store_run_init(&import_run);
+    int store = 0;
+    extra_destination_t extras[EXPORT_DESTINATIONS_MAX - 1];
+    unsigned int extras_len = 0;
+    key_index_t import_index;
+    memset(&import_index, 0, sizeof(import_index));
+    export_selection_t selection;
+    import_keys_selection_t import_selection;
+    int selective = 0;
+    int soft = 0;
+    bundle_format_t format = BUNDLE_FORMAT_JSON;
 
     printf("dks_cryptech_backup\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\
 Port of cryptech_backup from CrypTech with support for copying key attributes.\r\n\r\n\
@@ -107,25 +209,221 @@ the target HSM.\r\n");
     if (setmasterkey == 2) return 0;
     if (setmasterkey == 0) GetMasterKey(masterkey, 80);
 
+    // the device can't be used until the master key has been set. Quitting
+    // at any of the prompts below discards the warm-up
+    atexit(DiscardWarmup);
+    if (setmasterkey == 1) device_warmup_start(&warmup, pin);
+
     int mode = GetOption("Please select a backup operation.\r\n\
   S) Setup - Create a KEKEK on the CrypTech device and save a 'setup.json' file.\r\n\
   E) Export - Load a KEKEK from an external device from a 'setup.json' file and save a 'export.json' file.\r\n\
-  I) Import - Import data from an 'export.json' file.\r\n\
-  Q) Quit\r\n", "SsEeIiQq", "Please choose a backup operation (S, E, I, Q): ");
-    if (mode == 3) return 0;
+  I) Import - Import data from an 'export.json' or binary export file.\r\n\
+  L) List - Show the keys on the CrypTech device.\r\n\
+  R) Replicate - Copy the keys straight to another CrypTech device on this computer.\r\n\
+  V) Verify - Check that another CrypTech device on this computer holds the same keys.\r\n\
+  P) Pool - Generate KEKEKs ahead of time so setups don't have to wait for one.\r\n\
+  Q) Quit\r\n", "SsEeIiLlRrVvPpQq", "Please choose a backup operation (S, E, I, L, R, V, P, Q): ");
+    if (mode == 7) return 0;
+
+    if (mode == cmd_op_replicate || mode == cmd_op_verify)
+    {
+        // both devices are opened in child processes
+        device_warmup_cancel(&warmup);
+
+        // the password entered above is the source's, or the primary's
+        const char *first = (mode == cmd_op_replicate) ? "source" : "primary";
+        const char *second = (mode == cmd_op_replicate) ? "destination" : "backup";
+
+        printf("\r\nPlease enter the serial port of the %s CrypTech device.\r\nLeave it empty to use CRYPTECH_RPC_CLIENT_SERIAL_DEVICE.\r\n", first);
+        GetOptionalLine(sourcedevice, sizeof(sourcedevice)/sizeof(char), "> ");
+
+        printf("\r\nPlease enter the serial port of the %s CrypTech device:", second);
+        if(GetLineCheck(destinationdevice, sizeof(destinationdevice)/sizeof(char), "\r\n> ") == 0) return 0;
+
+        printf("\r\nPlease enter the 'wheel' password for the %s CrypTech device.\r\n", second);
+        GetPassword(destinationpin, 64);
+    }
+    if (mode == cmd_op_replicate)
+    {
+        GetOptionalLine(uuidmapfile, sizeof(uuidmapfile)/sizeof(char),
+                        "\r\nPlease enter the file path of the UUID map.\r\nLeave it empty to not save one.\r\n> ");
+    }
+
+    if (mode == cmd_op_setup)
+    {
+        int use_soft = GetOption(
+"Would you like to make the KEKEK in software instead of on the CrypTech device?\r\n\
+This is for when there's no backup HSM. The private key is kept in the\r\n\
+setup file, encrypted with a passphrase, and is only as safe as that.\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (use_soft == 2) return 0;
+        soft = (use_soft == 0);
+    }
+    if (mode == cmd_op_setup && !soft)
+    {
+        GetOptionalLine(poolfile, sizeof(poolfile)/sizeof(char),
+                        "\r\nPlease enter the file path of the KEKEK pool cache.\r\nLeave it empty if there isn't one.\r\n> ");
+    }
+    if (mode == cmd_op_pool)
+    {
+        if(GetLineCheck(poolfile, sizeof(poolfile)/sizeof(char),
+                        "\r\nPlease enter the file path of the KEKEK pool cache:\r\n> ") == 0) return 0;
+
+        if(GetLineCheck(buffer, sizeof(buffer)/sizeof(char),
+                        "\r\nHow many KEKEKs should the pool hold?\r\n> ") == 0) return 0;
+
+        pool_size = (unsigned int)strtoul(buffer, NULL, 10);
+        if (pool_size == 0)
+        {
+            printf("\r\nThe pool must hold at least 1 KEKEK.\r\n");
+            return 0;
+        }
+    }
+    if (soft)
+    {
+        printf("\r\nPlease enter the passphrase for the software KEKEK.\r\n");
+        GetPassword(passphrase, 64);
+        printf("\r\nPlease enter the passphrase again.\r\n");
+        GetPassword(passphrase_check, 64);
+        if (strcmp(passphrase, passphrase_check) != 0)
+        {
+            printf("\r\nThe passphrases don't match.\r\n");
+            return 0;
+        }
+    }
 
     if (mode == cmd_op_export || mode == cmd_op_import)
     {
         if(GetLineCheck(inputfile, sizeof(inputfile)/sizeof(char),
                         "\r\nPlease enter the file path of the input file:\r\n> ") == 0) return 0;
     }
-    if (mode == cmd_op_setup || mode == cmd_op_export)
+    if (mode == cmd_op_export)
+    {
+        int use_store = GetOption(
+"Would you like to save the export in a backup store?\r\n\
+Keys that are already in the store are not written again.\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (use_store == 2) return 0;
+        store = (use_store == 0);
+    }
+    if (mode == cmd_op_setup || (mode == cmd_op_export && !store))
     {
         if(GetLineCheck(outputfile, sizeof(outputfile)/sizeof(char),
                         "\r\nPlease enter the file path of the output file:\r\n> ") == 0) return 0;
     }
+    if (store)
+    {
+        if(GetLineCheck(storefolder, sizeof(storefolder)/sizeof(char),
+                        "\r\nPlease enter the folder of the backup store:\r\n> ") == 0) return 0;
+    }
+    if (mode == cmd_op_export && !store)
+    {
+        int binary = GetOption(
+"Which format should the export file use?\r\n\
+  J) JSON - Compatible with CrypTech's cryptech_backup.\r\n\
+  B) Binary - Smaller and faster to import.\r\n\
+  Q) Quit\r\n", "JjBbQq", "Please select a format (J, B, Q): ");
+        if (binary == 2) return 0;
+        if (binary == 1) format = BUNDLE_FORMAT_BINARY;
+
+        int incremental = GetOption(
+"Would you like to only export keys that changed since a previous export?\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (incremental == 2) return 0;
+        if (incremental == 0)
+        {
+            if(GetLineCheck(previousfile, sizeof(previousfile)/sizeof(char),
+                            "\r\nPlease enter the file path of the previous export file:\r\n> ") == 0) return 0;
+        }
+
+        int split = GetOption(
+"Would you like to split the export into shards that can be imported in parallel?\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (split == 2) return 0;
+        if (split == 0)
+        {
+            if(GetLineCheck(buffer, sizeof(buffer)/sizeof(char),
+                            "\r\nPlease enter the size of a shard in megabytes:\r\n> ") == 0) return 0;
+
+            shard_size = strtoull(buffer, NULL, 10) * 1024 * 1024;
+            if (shard_size == 0)
+            {
+                printf("\r\nThe shard size must be at least 1 megabyte.\r\n");
+                return 0;
+            }
+            sharded = 1;
+        }
+    }
+    if (mode == cmd_op_export || mode == cmd_op_replicate)
+    {
+        int selected = GetOption(
+"Would you like to only export selected keys?\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (selected == 2) return 0;
+        if (selected == 0)
+        {
+            if (GetExportSelection(&selection) == 0) return 0;
+            selective = 1;
+        }
+    }
+    if (mode == cmd_op_export && !store)
+    {
+        int more = GetOption(
+"Would you like to export the same keys to more backup HSMs in the same pass?\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (more == 2) return 0;
+        while (more == 0 && extras_len < EXPORT_DESTINATIONS_MAX - 1)
+        {
+            extra_destination_t *extra = &extras[extras_len];
+            memset(extra, 0, sizeof(extra_destination_t));
+
+            GetOptionalLine(extra->setup_path, sizeof(extra->setup_path)/sizeof(char),
+                            "\r\nPlease enter the file path of the setup file of the next backup HSM.\r\nLeave it empty when there are no more.\r\n> ");
+            if (extra->setup_path[0] == 0) break;
+
+            if(GetLineCheck(extra->output_path, sizeof(extra->output_path)/sizeof(char),
+                            "\r\nPlease enter the file path of its output file:\r\n> ") == 0) return 0;
+
+            // the key index is saved next to the output file
+            strcpy(extra->index_path, extra->output_path);
+            strcat(extra->index_path, ".idx");
+            ++extras_len;
+        }
+    }
+    if (mode == cmd_op_import)
+    {
+        // the keys of a shard set or backup store run are all imported
+        sharded = shard_set_is_manifest(inputfile);
+        store = backup_store_run_is_manifest(inputfile);
+    }
+    if (mode == cmd_op_import && !sharded && !store)
+    {
+        int selected = GetOption(
+"Would you like to only import selected keys?\r\n\
+  Y) Yes\r\n\
+  N) No\r\n\
+  Q) Quit\r\n", "YyNnQq", "Please select an option (Y, N, Q): ");
+        if (selected == 2) return 0;
+        if (selected == 0)
+        {
+            if (GetImportSelection(&import_selection) == 0) return 0;
+            selective = 1;
+        }
+    }
 
-    const char *mode_strings[] = { "Setup", "Export", "Import"};
+    const char *mode_strings[] = { "Setup", "Export", "Import", "List", "Replicate", "Verify", "Pool"};
 
     printf("\r\n\r\n----------------------------------------------------------\r\n");
     printf("Please confirm options:\r\n");
@@ -136,13 +434,126 @@ the target HSM.\r\n");
     else printf("%s\r\n", masterkey);
     if(inputfile[0] != 0) printf("  Input file: %s\r\n", inputfile);
     if(outputfile[0] != 0) printf("  Output file: %s\r\n", outputfile);
+    if(mode == cmd_op_export) printf("  Export format: %s\r\n", (format == BUNDLE_FORMAT_BINARY) ? "Binary" : "JSON");
+    if(previousfile[0] != 0) printf("  Previous export file: %s\r\n", previousfile);
+    if (store && mode == cmd_op_export)
+    {
+        printf("  Backup store: %s\r\n", storefolder);
+        printf("  Only keys that changed since the store's last run will be exported.\r\n");
+    }
+    if (mode == cmd_op_export && !store)
+    {
+        // the key index is saved next to the export file
+        snprintf(indexfile, sizeof(indexfile)/sizeof(char), "%s.idx", outputfile);
+        if (sharded) printf("  Key index files: %s.000.idx, %s.001.idx...\r\n", outputfile, outputfile);
+        else printf("  Key index file: %s\r\n", indexfile);
+    }
+    if (sharded && mode == cmd_op_export)
+    {
+        printf("  Shard size: %llu MB\r\n", (unsigned long long)(shard_size / (1024 * 1024)));
+        printf("  Shard files: %s.000, %s.001...\r\n", outputfile, outputfile);
+        printf("  The output file will list the shards.\r\n");
+    }
+    for (unsigned int i = 0; i < extras_len; ++i)
+    {
+        printf("  Backup HSM %u setup file: %s\r\n", i + 2, extras[i].setup_path);
+        printf("  Backup HSM %u output file: %s\r\n", i + 2, extras[i].output_path);
+        printf("  Backup HSM %u key index file: %s\r\n", i + 2, extras[i].index_path);
+    }
+    if (mode == cmd_op_verify)
+    {
+        printf("  Primary device: %s\r\n", (sourcedevice[0] != 0) ? sourcedevice : "CRYPTECH_RPC_CLIENT_SERIAL_DEVICE");
+        printf("  Backup device: %s\r\n", destinationdevice);
+        printf("  Only public keys, flags and attributes are compared.\r\n");
+    }
+    if (poolfile[0] != 0) printf("  KEKEK pool cache file: %s\r\n", poolfile);
+    if (mode == cmd_op_setup && !soft) printf("  A KEKEK is claimed from the pool when it has one.\r\n");
+    if (mode == cmd_op_pool)
+    {
+        printf("  Pool size: %u\r\n", pool_size);
+        printf("  Each new KEKEK takes a while to generate. Run this when the device is idle.\r\n");
+    }
+    if (mode == cmd_op_replicate)
+    {
+        printf("  Source device: %s\r\n", (sourcedevice[0] != 0) ? sourcedevice : "CRYPTECH_RPC_CLIENT_SERIAL_DEVICE");
+        printf("  Destination device: %s\r\n", destinationdevice);
+        if (uuidmapfile[0] != 0) printf("  UUID map file: %s\r\n", uuidmapfile);
+        printf("  The keys are copied without an export file.\r\n");
+    }
+    if (sharded && mode == cmd_op_import) printf("  The input file lists shards. They will be imported in parallel.\r\n");
+    if (store && mode == cmd_op_import) printf("  The input file is a backup store run.\r\n");
+    if (selective && mode == cmd_op_import)
+    {
+        // the key index from the export
+        snprintf(indexfile, sizeof(indexfile)/sizeof(char), "%s.idx", inputfile);
+        printf("  Key index file: %s\r\n", indexfile);
+        printf("  Selected keys:\r\n");
+        for (unsigned i = 0; i < import_selection.selection.uuids_len; ++i)
+        {
+            char uuid_buffer[40];
+            printf("    UUID: %s\r\n", uuid_to_string(import_selection.uuids[i], uuid_buffer));
+        }
+        for (unsigned i = 0; i < import_selection.selection.labels_len; ++i)
+        {
+            printf("    Label: %s\r\n", import_selection.labels[i]);
+        }
+    }
+    else if (selective)
+    {
+        printf("  Selected keys:\r\n");
+        const char *key_type_strings[] = { "Any", "RSA private", "RSA public", "EC private", "EC public" };
+        const char *curve_strings[] = { "Any", "P-256", "P-384", "P-521" };
+        printf("    Key type: %s\r\n", key_type_strings[selection.filter.key_type]);
+        if (selection.filter.curve != HAL_CURVE_NONE) printf("    Curve: %s\r\n", curve_strings[selection.filter.curve]);
+        if (selection.filter.flags_mask != 0) printf("    Flags: 0x%x\r\n", selection.filter.flags);
+        if (selection.label[0] != 0) printf("    Label: %s\r\n", selection.label);
+        if (selection.id_hex[0] != 0) printf("    ID: %s\r\n", selection.id_hex);
+        if (selection.application[0] != 0) printf("    Application: %s\r\n", selection.application);
+    }
+    if (mode == cmd_op_import)
+    {
+        // the UUID map is saved next to the import file
+        snprintf(uuidmapfile, sizeof(uuidmapfile)/sizeof(char), "%s.uuidmap", inputfile);
+        printf("  UUID map file: %s\r\n", uuidmapfile);
+    }
 
     if (GetOption("\r\nContinue with these options?\r\n\
   Y) Yes\r\n\
   N) No\r\n", "NnYy", "Please select an option (Y, N): ") == 0) return 0;
 
     // try to open files
-    if(inputfile[0] != 0)
+    if(inputfile[0] != 0 && mode == cmd_op_import)
+    {
+        // JSON, binary, a shard set or a backup store run
+        int err;
+        if (sharded) err = shard_set_load(inputfile, &import_shards);
+        else if (store) err = backup_store_run_load(inputfile, &import_run);
+        else import_bundle = bundle_reader_open(inputfile, &err);
+
+        if (store) backup_store_of_run(inputfile, storefolder, sizeof(storefolder)/sizeof(char));
+        if(err != 0)
+        {
+            printf("\r\nUnable to open input file, '%s'.\r\n", inputfile);
+            goto done;
+        }
+
+        if(selective)
+        {
+            if(key_index_open(indexfile, &import_index) != 0)
+            {
+                printf("\r\nUnable to open key index file, '%s'.\r\n", indexfile);
+                goto done;
+            }
+            import_selection.selection.index = &import_index;
+        }
+
+        if (import_bundle != NULL && bundle_reader_header(import_bundle)->kekek_pkcs8 != NULL)
+        {
+            printf("\r\nThe export was made with a software KEKEK.\r\nPlease enter its passphrase.\r\n");
+            GetPassword(passphrase, 64);
+        }
+    }
+    else if(inputfile[0] != 0)
     {
         input_json = djson_loadfile(inputfile);
         if(input_json == NULL)
@@ -152,9 +563,54 @@ the target HSM.\r\n");
         }
     }
 
+    for (unsigned int i = 0; i < extras_len; ++i)
+    {
+        extras[i].setup_json = djson_loadfile(extras[i].setup_path);
+        if (extras[i].setup_json == NULL)
+        {
+            printf("\r\nUnable to open input file, '%s'.\r\n", extras[i].setup_path);
+            goto done;
+        }
+
+        extras[i].fp = fopen(extras[i].output_path, (format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
+        if (extras[i].fp == NULL)
+        {
+            printf("\r\nUnable to open output file, '%s'.\r\n", extras[i].output_path);
+            goto done;
+        }
+    }
+
+    if (store && mode == cmd_op_export)
+    {
+        if (backup_store_create(storefolder) != 0)
+        {
+            printf("\r\nUnable to create backup store, '%s'.\r\n", storefolder);
+            goto done;
+        }
+
+        // only the changes since the last run are exported
+        if (backup_store_latest_run(storefolder, previousfile, sizeof(previousfile)/sizeof(char)) != 0) previousfile[0] = 0;
+
+        // the run manifest is the output file
+        if (backup_store_new_run_path(storefolder, outputfile, sizeof(outputfile)/sizeof(char)) != 0)
+        {
+            printf("\r\nUnable to name the run in backup store, '%s'.\r\n", storefolder);
+            goto done;
+        }
+        printf("\r\nRun manifest: %s\r\n", outputfile);
+        if (previousfile[0] != 0) printf("Previous run: %s\r\n", previousfile);
+    }
+
+    // the previous export is read by the export
+    if(previousfile[0] != 0 && access(previousfile, R_OK) != 0)
+    {
+        printf("\r\nUnable to open previous export file, '%s'.\r\n", previousfile);
+        goto done;
+    }
+
     if(outputfile[0] != 0)
     {
-        ofp = fopen(outputfile, "wt");
+        ofp = fopen(outputfile, (format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
         if(ofp == NULL)
         {
             printf("\r\nUnable to open output file, '%s'.\r\n", outputfile);
@@ -173,9 +629,68 @@ the target HSM.\r\n");
         printf("\r\nMaster key set.\r\n\r\n");
     }
 
-    uint32_t handle = get_random_handle();
+    if (soft)
+    {
+        // the CrypTech device isn't needed
+        device_warmup_cancel(&warmup);
+        SaveSoftSetupJson(&ofp, passphrase);
+        goto done;
+    }
+    else if (mode == cmd_op_replicate)
+    {
+        // both devices are opened by the replication
+        replicate_options_t replicate;
+        memset(&replicate, 0, sizeof(replicate));
+        replicate.source_device = (sourcedevice[0] != 0) ? sourcedevice : NULL;
+        replicate.destination_device = destinationdevice;
+        replicate.source_pin = pin;
+        replicate.destination_pin = destinationpin;
+        replicate.device_index = -1;
+        replicate.filter = selective ? &selection.filter : NULL;
+        replicate.uuid_map_path = (uuidmapfile[0] != 0) ? uuidmapfile : NULL;
+
+        if (cryptech_replicate(&replicate) == 0) printf("\r\nReplication complete\r\n");
+        else printf("\r\nUnable to replicate the keys.\r\n");
+        goto done;
+    }
+    else if (mode == cmd_op_verify)
+    {
+        verify_options_t verify;
+        verify_result_t result;
+        memset(&verify, 0, sizeof(verify));
+        verify.primary_device = (sourcedevice[0] != 0) ? sourcedevice : NULL;
+        verify.backup_device = destinationdevice;
+        verify.primary_pin = pin;
+        verify.backup_pin = destinationpin;
+
+        if (cryptech_verify(&verify, &result) != 0)
+        {
+            printf("\r\nUnable to compare the devices.\r\n");
+        }
+        else
+        {
+            printf("\r\n%u keys on the primary, %u on the backup. %u tree hashes compared.\r\n",
+                   result.primary_keys, result.backup_keys, result.comparisons);
+            if (result.missing + result.extra + result.changed == 0) printf("The devices match.\r\n");
+            else printf("%u keys missing on the backup, %u only on the backup, %u changed.\r\n",
+                        result.missing, result.extra, result.changed);
+        }
+        goto done;
+    }
 
-    int rval = init_cryptech_device(pin, handle);
+    uint32_t handle = 0;
+    int rval;
+
+    // the key lists read by the warm-up are used by the operation
+    if (warmup.started)
+    {
+        rval = device_warmup_finish(&warmup, &handle);
+    }
+    else
+    {
+        handle = get_random_handle();
+        rval = init_cryptech_device(pin, handle);
+    }
 
     if (rval != 0)
     {
@@ -186,32 +701,57 @@ the target HSM.\r\n");
     {
         if (mode == cmd_op_setup)
         {
-            SaveSetupJson(&ofp, handle);
+            SaveSetupJson(&ofp, (poolfile[0] != 0) ? poolfile : NULL, handle);
+        }
+        else if (mode == cmd_op_pool)
+        {
+            if (cryptech_fill_kekek_pool(handle, pool_size, poolfile) == 0) printf("\r\nThe KEKEK pool is full.\r\n");
         }
         else if (mode == cmd_op_export)
         {
-            SaveExportJson(&ofp, input_json, handle);
+            rval = SaveExportJson(&ofp, input_json, (previousfile[0] != 0) ? previousfile : NULL,
+                                  selective ? &selection.filter : NULL, format, store ? NULL : indexfile,
+                                  shard_size, outputfile, store ? storefolder : NULL, extras, extras_len, handle);
+
+            // a failed run must not be used as the previous run
+            if (rval != 0 && store) remove(outputfile);
         }
         else if (mode == cmd_op_import)
         {
-            ImportKeys(input_json, handle);
+            ImportKeys(import_bundle, sharded ? &import_shards : NULL, store ? &import_run : NULL, storefolder,
+                       selective ? &import_selection.selection : NULL,
+                       (passphrase[0] != 0) ? passphrase : NULL, uuidmapfile, handle);
+        }
+        else if (mode == cmd_op_list)
+        {
+            cryptech_list_keys(handle);
         }
 
         close_cryptech_device(handle);  
+        device_warmup_free(&warmup);
     }
 
 done:
     free(input_json);
+    bundle_reader_close(import_bundle);
+    shard_set_free(&import_shards);
+    backup_store_run_free(&import_run);
+    for (unsigned int i = 0; i < extras_len; ++i)
+    {
+        free(extras[i].setup_json);
+        if (extras[i].fp != NULL) fclose(extras[i].fp);
+    }
+    key_index_close(&import_index);
     if (ofp != NULL) fclose(ofp);
     return 0;
 }
 
-void SaveSetupJson(FILE **fp, uint32_t handle)
+void SaveSetupJson(FILE **fp, const char *pool_path, uint32_t handle)
 {
     printf("\r\nGenerating setup json with KEKEK.\r\n");
 
     char *setup_json;
-    int rval = setup_backup_destination(handle, -1, &setup_json);
+    int rval = setup_backup_destination_from_pool(handle, -1, pool_path, &setup_json);
 
     if (rval == 0)
     {
@@ -234,26 +774,97 @@ void SaveSetupJson(FILE **fp, uint32_t handle)
     return;
 }
 
-void SaveExportJson(FILE **export_json, char *setup_json, uint32_t handle)
+void SaveSoftSetupJson(FILE **fp, const char *passphrase)
+{
+    printf("\r\nGenerating setup json with a software KEKEK.\r\n");
+
+    char *setup_json;
+    int rval = soft_kekek_setup_json(passphrase, SOFT_KEKEK_DEFAULT_BITS, &setup_json);
+
+    if (rval == 0)
+    {
+        fputs(setup_json, *fp);
+        fclose(*fp);
+        *fp = NULL;
+        free(setup_json);
+
+        printf("KEKEK written to output json.\r\nKeep the passphrase, it's needed to import the exports.\r\n");
+    }
+    else
+    {
+        printf("Unable to make the KEKEK.\r\n");
+    }
+}
+
+int SaveExportJson(FILE **export_json, char *setup_json, const char *previous_path, const export_filter_t *filter,
+                   bundle_format_t format, const char *index_path, uint64_t shard_size, const char *shard_path,
+                   const char *store_path, extra_destination_t *extras, unsigned int extras_len, uint32_t handle)
 {
-    int rval = cryptech_export_keys(handle, setup_json, export_json);
+    export_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.previous_path = previous_path;
+    options.filter = filter;
+    options.format = format;
+    options.index_path = index_path;
+    options.shard_size = shard_size;
+    options.shard_path = shard_path;
+    options.store_path = store_path;
+
+    // the other backup HSMs get plain exports of the same keys
+    export_options_t extra_options[EXPORT_DESTINATIONS_MAX - 1];
+    export_destination_t destinations[EXPORT_DESTINATIONS_MAX];
+
+    destinations[0].setup_json = setup_json;
+    destinations[0].export_json = export_json;
+    destinations[0].options = &options;
+
+    for (unsigned int i = 0; i < extras_len; ++i)
+    {
+        memset(&extra_options[i], 0, sizeof(export_options_t));
+        extra_options[i].filter = filter;
+        extra_options[i].format = format;
+        extra_options[i].index_path = extras[i].index_path;
+
+        destinations[i + 1].setup_json = extras[i].setup_json;
+        destinations[i + 1].export_json = &extras[i].fp;
+        destinations[i + 1].options = &extra_options[i];
+    }
+
+    int rval = cryptech_export_keys_multi(handle, destinations, extras_len + 1);
     if (rval == 0)
     {
         // keep export data in a temporary file that we can access when the
         // HSM ask for it
-        fclose(*export_json);
-        *export_json = NULL;
+        for (unsigned int i = 0; i <= extras_len; ++i)
+        {
+            fclose(*destinations[i].export_json);
+            *destinations[i].export_json = NULL;
+        }
     }
     else
     {
+        // the export closed the files
+        for (unsigned int i = 0; i <= extras_len; ++i)
+        {
+            *destinations[i].export_json = NULL;
+        }
         printf("\r\nFailure:%i, exporting data.\r\n", rval);
     }
-    
+
+    return rval;
 }
 
-void ImportKeys(char *import_json, uint32_t handle)
+void ImportKeys(bundle_reader_t *bundle, const shard_set_t *shards, const backup_store_run_t *store_run,
+                const char *store_path, const import_selection_t *selection, const char *kekek_passphrase,
+                const char *uuid_map_path, uint32_t handle)
 {
-    int rval = import_keys(handle, import_json);
+    uuid_map_builder_t uuid_map;
+    uuid_map_builder_init(&uuid_map);
+
+    int rval;
+    if (shards != NULL) rval = import_shard_set(handle, shards, &uuid_map);
+    else if (store_run != NULL) rval = import_store_run(handle, store_path, store_run, &uuid_map);
+    else rval = import_keys(handle, bundle, selection, kekek_passphrase, &uuid_map);
 
     if (rval == 0)
     {
@@ -263,6 +874,27 @@ void ImportKeys(char *import_json, uint32_t handle)
     {
         printf("Unable to import data into CrypTech device.\r\n");
     }
+
+    // save whatever was imported, even after a failure, so the keys that
+    // made it onto the device can still be found
+    if (uuid_map.count > 0)
+    {
+        if (uuid_map_builder_save(&uuid_map, uuid_map_path) == 0)
+        {
+            printf("UUID map written to '%s'.\r\n", uuid_map_path);
+        }
+        else
+        {
+            printf("Unable to write the UUID map to '%s'.\r\n", uuid_map_path);
+        }
+    }
+
+    uuid_map_builder_free(&uuid_map);
+}
+
+void DiscardWarmup(void)
+{
+    device_warmup_cancel(&warmup);
 }
 
 int SetMasterKey(char *masterkey, char *pin)
@@ -331,6 +963,192 @@ int isMasterKeyValid(char *buffer)
     return 1;
 }
 
+int GetExportSelection(export_selection_t *selection)
+{
+    memset(selection, 0, sizeof(export_selection_t));
+
+    const hal_key_type_t key_types[] = { HAL_KEY_TYPE_NONE, HAL_KEY_TYPE_RSA_PRIVATE, HAL_KEY_TYPE_EC_PRIVATE,
+                                         HAL_KEY_TYPE_RSA_PUBLIC, HAL_KEY_TYPE_EC_PUBLIC };
+    const hal_curve_name_t curves[] = { HAL_CURVE_NONE, HAL_CURVE_P256, HAL_CURVE_P384, HAL_CURVE_P521 };
+
+    int key_type = GetOption("Which type of key would you like to export?\r\n\
+  A) Any\r\n\
+  R) RSA private keys\r\n\
+  E) EC private keys\r\n\
+  P) RSA public keys\r\n\
+  C) EC public keys\r\n\
+  Q) Quit\r\n", "AaRrEePpCcQq", "Please select an option (A, R, E, P, C, Q): ");
+    if (key_type == 5) return 0;
+    selection->filter.key_type = key_types[key_type];
+
+    if (selection->filter.key_type == HAL_KEY_TYPE_EC_PRIVATE ||
+        selection->filter.key_type == HAL_KEY_TYPE_EC_PUBLIC)
+    {
+        int curve = GetOption("Which curve would you like to export?\r\n\
+  A) Any\r\n\
+  B) P-256\r\n\
+  C) P-384\r\n\
+  D) P-521\r\n\
+  Q) Quit\r\n", "AaBbCcDdQq", "Please select an option (A, B, C, D, Q): ");
+        if (curve == 4) return 0;
+        selection->filter.curve = curves[curve];
+    }
+
+    char flags_hex[32];
+    while (1)
+    {
+        GetOptionalLine(flags_hex, sizeof(flags_hex)/sizeof(char),
+                        "\r\nPlease enter the key flags that must be set in hex, or leave it blank for any flags:\r\n> ");
+
+        if (strlen(flags_hex) == 0) break;
+
+        char *end;
+        unsigned long flags = strtoul(flags_hex, &end, 16);
+        if (*end == 0)
+        {
+            selection->filter.flags_mask = (hal_key_flags_t)flags;
+            selection->filter.flags = (hal_key_flags_t)flags;
+            break;
+        }
+        printf("\r\nInvalid flags. Please try again.\r\n");
+    }
+
+    GetOptionalLine(selection->label, sizeof(selection->label)/sizeof(char),
+                    "\r\nPlease enter the CKA_LABEL to export, or leave it blank for any label:\r\n> ");
+    if (strlen(selection->label) > 0)
+    {
+        export_filter_add_attribute(&selection->filter, CKA_LABEL, selection->label, strlen(selection->label));
+    }
+
+    while (1)
+    {
+        GetOptionalLine(selection->id_hex, sizeof(selection->id_hex)/sizeof(char),
+                        "\r\nPlease enter the CKA_ID to export in hex, or leave it blank for any ID:\r\n> ");
+
+        if (strlen(selection->id_hex) == 0) break;
+
+        int id_len = ParseHex(selection->id_hex, selection->id, sizeof(selection->id));
+        if (id_len > 0)
+        {
+            export_filter_add_attribute(&selection->filter, CKA_ID, selection->id, id_len);
+            break;
+        }
+        printf("\r\nInvalid ID. Please try again.\r\n");
+    }
+
+    GetOptionalLine(selection->application, sizeof(selection->application)/sizeof(char),
+                    "\r\nPlease enter the CKA_APPLICATION to export, or leave it blank for any application:\r\n> ");
+    if (strlen(selection->application) > 0)
+    {
+        export_filter_add_attribute(&selection->filter, CKA_APPLICATION, selection->application,
+                                    strlen(selection->application));
+    }
+
+    return 1;
+}
+
+int GetImportSelection(import_keys_selection_t *selection)
+{
+    memset(selection, 0, sizeof(import_keys_selection_t));
+
+    printf("\r\nThe keys are found with the key index that was saved with the export.\r\n");
+
+    unsigned count = 0;
+    while (count < IMPORT_SELECTION_MAX)
+    {
+        char *line = selection->lines[count];
+
+        GetOptionalLine(line, sizeof(selection->lines[count])/sizeof(char),
+                        "\r\nPlease enter the UUID or CKA_LABEL of a key to import, or leave it blank when done:\r\n> ");
+
+        if (strlen(line) == 0) break;
+
+        if (IsUuidString(line))
+        {
+            selection->uuids[selection->selection.uuids_len++] = string_to_uuid(line);
+        }
+        else
+        {
+            selection->labels[selection->selection.labels_len++] = line;
+        }
+        ++count;
+    }
+
+    if (count == 0)
+    {
+        printf("\r\nNo keys were selected.\r\n");
+        return 0;
+    }
+
+    selection->selection.uuids = selection->uuids;
+    selection->selection.labels = selection->labels;
+
+    return 1;
+}
+
+// UUIDs look like 2f0e4f43-7a4b-4e35-9a1b-1c2d3e4f5a6b
+int IsUuidString(const char *s)
+{
+    if (strlen(s) != 36) return 0;
+
+    for (int i = 0; i < 36; ++i)
+    {
+        if (i == 8 || i == 13 || i == 18 || i == 23)
+        {
+            if (s[i] != '-') return 0;
+        }
+        else if (!((s[i] >= '0' && s[i] <= '9') ||
+                   (s[i] >= 'a' && s[i] <= 'f') ||
+                   (s[i] >= 'A' && s[i] <= 'F')))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// returns the number of bytes in result, or 0 if the string isn't valid hex
+int ParseHex(const char *hex, uint8_t *result, int result_max)
+{
+    int count = 0;
+    int high = -1;
+
+    for (const char *c = hex; *c != 0; ++c)
+    {
+        int value;
+
+        if (*c == ' ' || *c == ':') continue;
+        else if (*c >= '0' && *c <= '9') value = *c - '0';
+        else if (*c >= 'a' && *c <= 'f') value = *c - 'a' + 10;
+        else if (*c >= 'A' && *c <= 'F') value = *c - 'A' + 10;
+        else return 0;
+
+        if (high < 0)
+        {
+            high = value;
+        }
+        else
+        {
+            if (count >= result_max) return 0;
+            result[count++] = (uint8_t)((high << 4) | value);
+            high = -1;
+        }
+    }
+
+    // must have an even number of digits
+    if (high >= 0) return 0;
+
+    return count;
+}
+
+void GetOptionalLine(char *buffer, int buffer_len, const char *question)
+{
+    printf("%s", question);
+
+    GetLine(buffer, buffer_len);
+}
+
 int GetLineCheck(char *buffer, int buffer_len, const char *question)
 {
     int result;
@@ -0,0 +1,125 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "fleet.h"
+
+// Internal Function Declarations ------------------------------------------
+void PrintSummary(const fleet_t *fleet);
+void PrintUsage();
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    unsigned int workers = 0;
+    const char *report_path = NULL;
+
+    while (arg + 1 < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-j") == 0) workers = (unsigned int)strtoul(argv[arg + 1], NULL, 10);
+        else if (strcmp(argv[arg], "-r") == 0) report_path = argv[arg + 1];
+        else break;
+        arg += 2;
+    }
+
+    if (arg + 1 != argc || (workers > FLEET_MAX_WORKERS))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    fleet_t fleet;
+    int err = fleet_load(argv[arg], &fleet);
+    if (err != 0)
+    {
+        printf("Unable to load the fleet manifest, '%s': %s\r\n", argv[arg], hal_error_string(err));
+        return 1;
+    }
+
+    if (workers > 0) fleet.workers = workers;
+
+    printf("Running %u devices, %u at a time.\r\n", fleet.count, fleet.workers);
+
+    unsigned int failed = fleet_run(&fleet);
+
+    PrintSummary(&fleet);
+
+    if (report_path != NULL)
+    {
+        FILE *fp = fopen(report_path, "wt");
+        if (fp == NULL || fleet_save_report(&fleet, fp) != 0)
+        {
+            printf("Unable to write the report to '%s'.\r\n", report_path);
+            failed = (failed > 0) ? failed : 1;
+        }
+        if (fp != NULL) fclose(fp);
+    }
+
+    fleet_free(&fleet);
+
+    return (failed == 0) ? 0 : 1;
+}
+
+void PrintSummary(const fleet_t *fleet)
+{
+    unsigned int failed = 0;
+
+    printf("\r\n%-16s %-8s %-24s %8s %8s %8s\r\n", "Device", "Op", "Result", "Attempts", "Seconds", "Keys");
+
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        const fleet_device_t *device = &fleet->devices[i];
+        unsigned int keys = (device->op == FLEET_OP_IMPORT) ? device->keys_imported : device->keys_exported;
+
+        printf("%-16s %-8s %-24s %8u %8ld %8u\r\n", device->name, fleet_op_name(device->op),
+               (device->rval == 0) ? "ok" : hal_error_string(device->rval), device->attempts,
+               (long)(device->finished - device->started), keys);
+
+        if (device->rval != 0) ++failed;
+    }
+
+    printf("\r\n%u of %u devices failed.\r\n", failed, fleet->count);
+}
+
+void PrintUsage()
+{
+    printf("dks_fleet\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Runs the setups, exports and imports of a fleet manifest on many CrypTech\r\n\
+devices at once, without prompts. See fleet.h for the manifest.\r\n\r\n\
+usage: dks_fleet [-j <workers>] [-r <report file>] <fleet manifest>\r\n\
+  -j  the number of devices to run at a time, instead of the manifest's\r\n\
+  -r  write the results to this JSON file\r\n");
+}
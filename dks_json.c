@@ -0,0 +1,103 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "djson.h"
+
+#include "dks_json.h"
+
+#define dks_json_throw(a) { rval = a; goto finished; }
+
+#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+
+// Function Implementations ---------------------------------------------
+void dks_json_write_string(FILE *fp, const char *text)
+{
+    fputc('"', fp);
+    for (const unsigned char *c = (const unsigned char *)text; *c != 0; ++c)
+    {
+        if (*c == '"' || *c == '\\') fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+int dks_json_has_member(char *json, const char *name)
+{
+    int rval = HAL_OK;
+    int found = 0;
+    diamond_json_error_t result;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+    diamond_json_type_t json_type;
+
+    dks_json_check(djson_start_parser(json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    dks_json_check(djson_goto_next_element(&json_ptr));
+    dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+
+    while (!found && json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *member;
+        dks_json_check(djson_get_name_current(&json_ptr, &member));
+        found = (strcmp(member, name) == 0);
+
+        dks_json_check(djson_pass(&json_ptr));
+        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+    }
+
+finished:
+    return (rval == HAL_OK) && found;
+}
+
+int dks_json_file_has_member(const char *path, const char *name)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    int c;
+    while ((c = fgetc(fp)) != EOF && isspace(c)) { }
+    fclose(fp);
+
+    if (c != '{') return 0;
+
+    char *json = djson_loadfile(path);
+    if (json == NULL) return 0;
+
+    int found = dks_json_has_member(json, name);
+    free(json);
+
+    return found;
+}
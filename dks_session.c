@@ -0,0 +1,225 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <djson.h>
+#include <hal.h>
+
+#include "session.h"
+
+// Internal Function Declarations ------------------------------------------
+void PrintUsage();
+int AbsolutePath(const char *path, char *buffer, size_t buffer_len);
+int Request(int fd, uint32_t op, const char * const *fields, unsigned int fields_len, session_message_t *reply);
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    const char *socket_path = getenv(SESSION_SOCKET_ENVVAR);
+
+    if (arg + 1 < argc && strcmp(argv[arg], "-s") == 0)
+    {
+        socket_path = argv[arg + 1];
+        arg += 2;
+    }
+
+    if (arg >= argc || socket_path == NULL)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const char *command = argv[arg++];
+    int binary = 0;
+    const char *previous = NULL;
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-b") == 0) binary = 1;
+        else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) previous = argv[++arg];
+        else break;
+        ++arg;
+    }
+
+    uint32_t op;
+    int args_needed;
+    if (strcmp(command, "list") == 0) { op = SESSION_OP_LIST; args_needed = 0; }
+    else if (strcmp(command, "setup") == 0) { op = SESSION_OP_SETUP; args_needed = 1; }
+    else if (strcmp(command, "export") == 0) { op = SESSION_OP_EXPORT; args_needed = 2; }
+    else if (strcmp(command, "ping") == 0) { op = SESSION_OP_PING; args_needed = 0; }
+    else
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (argc - arg != args_needed)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    // the daemon opens the files of an export, so it needs full paths
+    char output_path[2048];
+    char index_path[2048 + 16];
+    char previous_path[2048];
+    char *setup_json = NULL;
+    previous_path[0] = 0;
+
+    if (op == SESSION_OP_EXPORT)
+    {
+        setup_json = djson_loadfile(argv[arg]);
+        if (setup_json == NULL)
+        {
+            printf("Unable to open setup file, '%s'.\r\n", argv[arg]);
+            return 1;
+        }
+
+        if (AbsolutePath(argv[arg + 1], output_path, sizeof(output_path)/sizeof(char)) != 0 ||
+            (previous != NULL && AbsolutePath(previous, previous_path, sizeof(previous_path)/sizeof(char)) != 0))
+        {
+            printf("Unable to find the full path of the output or previous export file.\r\n");
+            free(setup_json);
+            return 1;
+        }
+
+        // the key index is saved next to the export file
+        snprintf(index_path, sizeof(index_path)/sizeof(char), "%s.idx", output_path);
+    }
+
+    int fd = session_connect(socket_path);
+    if (fd < 0)
+    {
+        printf("Unable to connect to dks_sessiond at '%s'.\r\n", socket_path);
+        free(setup_json);
+        return 1;
+    }
+
+    session_message_t reply;
+    int rval;
+
+    if (op == SESSION_OP_EXPORT)
+    {
+        const char *fields[] = { setup_json, binary ? "binary" : "json", output_path, index_path, previous_path };
+        rval = Request(fd, op, fields, 5, &reply);
+    }
+    else
+    {
+        rval = Request(fd, op, NULL, 0, &reply);
+    }
+
+    close(fd);
+    free(setup_json);
+
+    if (rval != HAL_OK)
+    {
+        printf("Lost the connection to dks_sessiond: %s\r\n", hal_error_string(rval));
+        return 1;
+    }
+
+    rval = (int)reply.code;
+
+    if (rval == HAL_OK && op == SESSION_OP_SETUP)
+    {
+        FILE *fp = fopen(argv[arg], "wt");
+        if (fp == NULL || reply.fields_len != 1 || fwrite(reply.fields[0], 1, reply.lengths[0], fp) != reply.lengths[0])
+        {
+            printf("Unable to write setup file, '%s'.\r\n", argv[arg]);
+            rval = HAL_ERROR_IO_OS_ERROR;
+        }
+        if (fp != NULL && fclose(fp) != 0) rval = HAL_ERROR_IO_OS_ERROR;
+        if (rval == HAL_OK) printf("KEKEK written to '%s'.\r\n", argv[arg]);
+    }
+    else if (op == SESSION_OP_LIST && reply.fields_len == 1)
+    {
+        fwrite(reply.fields[0], 1, reply.lengths[0], stdout);
+    }
+    else if (rval == HAL_OK && op == SESSION_OP_EXPORT)
+    {
+        printf("Keys exported to '%s'.\r\nKey index written to '%s'.\r\n", output_path, index_path);
+    }
+
+    if (rval != HAL_OK) printf("%s failed: %s\r\n", command, hal_error_string(rval));
+    else if (op == SESSION_OP_PING) printf("dks_sessiond is logged in.\r\n");
+
+    session_message_free(&reply);
+
+    return (rval == HAL_OK) ? 0 : 1;
+}
+
+int AbsolutePath(const char *path, char *buffer, size_t buffer_len)
+{
+    if (path[0] == '/')
+    {
+        if (strlen(path) >= buffer_len) return -1;
+        strcpy(buffer, path);
+        return 0;
+    }
+
+    char folder[2048];
+    if (getcwd(folder, sizeof(folder)/sizeof(char)) == NULL) return -1;
+
+    int written = snprintf(buffer, buffer_len, "%s/%s", folder, path);
+    return (written < 0 || (size_t)written >= buffer_len) ? -1 : 0;
+}
+
+int Request(int fd, uint32_t op, const char * const *fields, unsigned int fields_len, session_message_t *reply)
+{
+    uint32_t lengths[SESSION_FIELDS_MAX];
+    for (unsigned int i = 0; i < fields_len; ++i) lengths[i] = strlen(fields[i]);
+
+    int rval = session_send(fd, op, fields, lengths, fields_len);
+    if (rval == HAL_OK) rval = session_receive(fd, reply);
+
+    return rval;
+}
+
+void PrintUsage()
+{
+    printf("dks_session\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Runs a backup operation through dks_sessiond, which is already logged\r\n\
+into the CrypTech device. The socket is given with -s, or in\r\n\
+" SESSION_SOCKET_ENVVAR ".\r\n\
+  list - Show the keys on the CrypTech device.\r\n\
+  setup - Create a KEKEK and save its setup JSON file.\r\n\
+  export - Export the keys to the KEKEK of a setup JSON file. -b makes a\r\n\
+           binary export, -p only exports the changes since a previous\r\n\
+           export. The key index is saved as <output file>.idx.\r\n\
+  ping - Check that the daemon is still logged in.\r\n\r\n\
+usage: dks_session [-s socket] list\r\n\
+       dks_session [-s socket] setup <setup json>\r\n\
+       dks_session [-s socket] export [-b] [-p previous export] <setup json> <output file>\r\n\
+       dks_session [-s socket] ping\r\n");
+}
@@ -0,0 +1,289 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <hal.h>
+
+#include "cryptech_device.h"
+#include "session.h"
+
+// a client that stops in the middle of a request is dropped after this
+#define CLIENT_TIMEOUT_SECONDS 30
+
+// Internal Function Declarations ------------------------------------------
+void PrintUsage();
+void OnSignal(int signal_number);
+int ServeClient(int fd, uint32_t handle);
+int ServeList(int fd, uint32_t handle);
+int ServeSetup(int fd, uint32_t handle);
+int ServeExport(int fd, const session_message_t *request, uint32_t handle);
+int SendReply(int fd, int code, const char *text, size_t text_len);
+
+// Internal Variables -----------------------------------------------------
+static volatile sig_atomic_t stopping = 0;
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    const char *socket_path = getenv(SESSION_SOCKET_ENVVAR);
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc) socket_path = argv[++arg];
+        else break;
+        ++arg;
+    }
+
+    if (arg != argc || socket_path == NULL)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    char pin[64];
+    const char *entered = getpass("CrypTech 'wheel' password: ");
+    if (entered == NULL || strlen(entered) >= sizeof(pin)/sizeof(char))
+    {
+        printf("Unable to read the password.\r\n");
+        return 1;
+    }
+    strcpy(pin, entered);
+
+    uint32_t handle = get_random_handle();
+    int rval = init_cryptech_device(pin, handle);
+
+    // the session stays logged in, so the PIN isn't needed again
+    memset(pin, 0, sizeof(pin));
+
+    if (rval != 0)
+    {
+        printf("Unable to log into CrypTech device.\r\n");
+        printf("Did you run 'eval $(cryptech_probe)' before running this command?\r\n");
+        return 1;
+    }
+
+    int listener = session_listen(socket_path);
+    if (listener < 0)
+    {
+        printf("Unable to listen on '%s': %s\r\n", socket_path, strerror(errno));
+        close_cryptech_device(handle);
+        return 1;
+    }
+
+    // a client that goes away mustn't stop the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    // accept is interrupted so the session can be closed
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Logged in. Listening on '%s'.\r\n", socket_path);
+    fflush(stdout);
+
+    while (!stopping)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            printf("Unable to accept a client: %s\r\n", strerror(errno));
+            break;
+        }
+
+        if (!session_peer_allowed(fd))
+        {
+            printf("Refused a client that runs as another user.\r\n");
+            close(fd);
+            continue;
+        }
+
+        struct timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // one client at a time, they all share the device link
+        rval = ServeClient(fd, handle);
+        close(fd);
+
+        if (rval == HAL_ERROR_FORBIDDEN)
+        {
+            printf("The session has been logged out. Stopping.\r\n");
+            break;
+        }
+    }
+
+    close(listener);
+    unlink(socket_path);
+    close_cryptech_device(handle);
+
+    return 0;
+}
+
+void OnSignal(int signal_number)
+{
+    (void)signal_number;
+    stopping = 1;
+}
+
+int ServeClient(int fd, uint32_t handle)
+{
+    hal_client_handle_t client = {handle};
+
+    while (!stopping)
+    {
+        session_message_t request;
+        if (session_receive(fd, &request) != HAL_OK) return HAL_OK;
+
+        int rval;
+
+        // the device may have dropped the login, for example when it restarted
+        if (hal_rpc_is_logged_in(client, HAL_USER_WHEEL) != HAL_OK)
+        {
+            SendReply(fd, HAL_ERROR_FORBIDDEN, NULL, 0);
+            session_message_free(&request);
+            return HAL_ERROR_FORBIDDEN;
+        }
+
+        if (request.code == SESSION_OP_LIST) rval = ServeList(fd, handle);
+        else if (request.code == SESSION_OP_SETUP) rval = ServeSetup(fd, handle);
+        else if (request.code == SESSION_OP_EXPORT) rval = ServeExport(fd, &request, handle);
+        else if (request.code == SESSION_OP_PING) rval = SendReply(fd, HAL_OK, NULL, 0);
+        else rval = SendReply(fd, HAL_ERROR_RPC_BAD_FUNCTION, NULL, 0);
+
+        session_message_free(&request);
+
+        if (rval != HAL_OK) return HAL_OK;
+    }
+
+    return HAL_OK;
+}
+
+int ServeList(int fd, uint32_t handle)
+{
+    char *text = NULL;
+    size_t text_len = 0;
+
+    FILE *fp = open_memstream(&text, &text_len);
+    if (fp == NULL) return SendReply(fd, HAL_ERROR_ALLOCATION_FAILURE, NULL, 0);
+
+    int code = cryptech_write_key_list(handle, fp);
+    fclose(fp);
+
+    int rval = SendReply(fd, code, text, text_len);
+    free(text);
+
+    return rval;
+}
+
+int ServeSetup(int fd, uint32_t handle)
+{
+    char *setup_json = NULL;
+    int code = setup_backup_destination(handle, -1, &setup_json);
+
+    int rval = SendReply(fd, code, setup_json, (setup_json != NULL) ? strlen(setup_json) : 0);
+    free(setup_json);
+
+    return rval;
+}
+
+int ServeExport(int fd, const session_message_t *request, uint32_t handle)
+{
+    if (request->fields_len != 5) return SendReply(fd, HAL_ERROR_BAD_ARGUMENTS, NULL, 0);
+
+    char *setup_json = request->fields[0];
+    const char *format = request->fields[1];
+    const char *output_path = request->fields[2];
+    const char *index_path = request->fields[3];
+    const char *previous_path = request->fields[4];
+
+    // the daemon doesn't run in the client's folder
+    if (output_path[0] != '/' ||
+        (index_path[0] != 0 && index_path[0] != '/') ||
+        (previous_path[0] != 0 && previous_path[0] != '/'))
+    {
+        return SendReply(fd, HAL_ERROR_BAD_ARGUMENTS, NULL, 0);
+    }
+
+    export_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.format = (strcmp(format, "binary") == 0) ? BUNDLE_FORMAT_BINARY : BUNDLE_FORMAT_JSON;
+    options.index_path = (index_path[0] != 0) ? index_path : NULL;
+    options.previous_path = (previous_path[0] != 0) ? previous_path : NULL;
+
+    FILE *fp = fopen(output_path, (options.format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
+    if (fp == NULL) return SendReply(fd, HAL_ERROR_IO_OS_ERROR, NULL, 0);
+
+    int code = cryptech_export_keys(handle, setup_json, &fp, &options);
+    if (code == HAL_OK)
+    {
+        if (fclose(fp) != 0) code = HAL_ERROR_IO_OS_ERROR;
+    }
+
+    // the export closed the file when it failed
+    if (code != HAL_OK)
+    {
+        remove(output_path);
+        if (options.index_path != NULL) remove(options.index_path);
+    }
+
+    return SendReply(fd, code, NULL, 0);
+}
+
+int SendReply(int fd, int code, const char *text, size_t text_len)
+{
+    if (text == NULL) return session_send(fd, (uint32_t)code, NULL, NULL, 0);
+
+    uint32_t length = (uint32_t)text_len;
+    return session_send(fd, (uint32_t)code, &text, &length, 1);
+}
+
+void PrintUsage()
+{
+    printf("dks_sessiond\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Logs into the CrypTech device once and keeps the session, so dks_session\r\n\
+can list keys, set up KEKEKs and export keys without opening the serial\r\n\
+port or logging in again. The 'wheel' password is asked for when it starts.\r\n\
+Only processes running as the same user can connect to the socket.\r\n\
+The socket is given with -s, or in " SESSION_SOCKET_ENVVAR ".\r\n\r\n\
+usage: dks_sessiond [-s socket]\r\n");
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cryptech_device.h"
+#include "uuid_map.h"
+
+// Internal Function Declarations ------------------------------------------
+int IsUuid(const char *text);
+void PrintEntry(const uuid_map_entry_t *entry);
+void PrintUsage();
+
+// Function Definintions --------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    uuid_map_t map;
+    if (uuid_map_open(argv[1], &map) != 0)
+    {
+        printf("Unable to open UUID map file, '%s'.\r\n", argv[1]);
+        return 1;
+    }
+
+    int rval = 0;
+
+    if (argc == 2)
+    {
+        // no UUIDs given, so show the whole map
+        for (uint32_t i = 0; i < map.count; ++i)
+        {
+            PrintEntry(&map.entries[i]);
+        }
+    }
+    else
+    {
+        for (int i = 2; i < argc; ++i)
+        {
+            // string_to_uuid skips anything that isn't a hex digit
+            if (!IsUuid(argv[i]))
+            {
+                printf("'%s' is not a UUID. Use the form 01234567-89ab-cdef-0123-456789abcdef.\r\n", argv[i]);
+                rval = 1;
+                continue;
+            }
+
+            hal_uuid_t source = string_to_uuid(argv[i]);
+            const uuid_map_entry_t *entry = uuid_map_lookup(&map, &source);
+
+            if (entry != NULL)
+            {
+                PrintEntry(entry);
+            }
+            else
+            {
+                printf("%s not found\r\n", argv[i]);
+                rval = 1;
+            }
+        }
+    }
+
+    uuid_map_close(&map);
+
+    return rval;
+}
+
+int IsUuid(const char *text)
+{
+    // 8-4-4-4-12 hex digits, the way uuid_to_string writes them
+    for (int i = 0; i < 36; ++i)
+    {
+        int dash = (i == 8 || i == 13 || i == 18 || i == 23);
+
+        if (text[i] == 0) return 0;
+        if (dash && text[i] != '-') return 0;
+        if (!dash && !isxdigit((unsigned char)text[i])) return 0;
+    }
+
+    return text[36] == 0;
+}
+
+void PrintEntry(const uuid_map_entry_t *entry)
+{
+    char source_buffer[40];
+    char destination_buffer[40];
+
+    printf("%s %s %u %u\r\n",
+           uuid_to_string(entry->source, source_buffer),
+           uuid_to_string(entry->destination, destination_buffer),
+           uuid_map_entry_key_type(entry),
+           uuid_map_entry_flags(entry));
+}
+
+void PrintUsage()
+{
+    printf("dks_uuid_map\r\nCopyright 2019 Diamond Key Security, NFP.\r\n\r\n\
+Looks up the UUIDs that keys received when they were imported by\r\n\
+dks_cryptech_backup. Each line of output is:\r\n\
+  <source uuid> <destination uuid> <key type> <flags>\r\n\r\n\
+usage: dks_uuid_map <uuid map file> [source uuid ...]\r\n");
+}
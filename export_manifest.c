@@ -0,0 +1,119 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle_reader.h"
+#include "export_manifest.h"
+
+static int compare_entries(const void *a, const void *b)
+{
+    return memcmp(&((const export_manifest_entry_t *)a)->uuid,
+                  &((const export_manifest_entry_t *)b)->uuid,
+                  sizeof(hal_uuid_t));
+}
+
+void export_manifest_init(export_manifest_t *manifest)
+{
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+}
+
+int export_manifest_add(export_manifest_t *manifest, const hal_uuid_t *uuid, const uint8_t *fingerprint)
+{
+    if (manifest == NULL || uuid == NULL || fingerprint == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (manifest->count == manifest->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (manifest->capacity == 0) ? 64 : manifest->capacity * 2;
+        export_manifest_entry_t *new_entries = realloc(manifest->entries,
+                                                       new_capacity * sizeof(export_manifest_entry_t));
+        if (new_entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        manifest->entries = new_entries;
+        manifest->capacity = new_capacity;
+    }
+
+    export_manifest_entry_t *entry = &manifest->entries[manifest->count++];
+    memcpy(&entry->uuid, uuid, sizeof(hal_uuid_t));
+    memcpy(entry->fingerprint, fingerprint, KEY_FINGERPRINT_LEN);
+    entry->seen = 0;
+
+    return HAL_OK;
+}
+
+void export_manifest_sort(export_manifest_t *manifest)
+{
+    qsort(manifest->entries, manifest->count, sizeof(export_manifest_entry_t), compare_entries);
+}
+
+export_manifest_entry_t *export_manifest_find(export_manifest_t *manifest, const hal_uuid_t *uuid)
+{
+    if (manifest == NULL || manifest->entries == NULL || uuid == NULL) return NULL;
+
+    // the entries are sorted by UUID and the UUID field is first
+    return bsearch(uuid, manifest->entries, manifest->count, sizeof(export_manifest_entry_t), compare_entries);
+}
+
+void export_manifest_free(export_manifest_t *manifest)
+{
+    if (manifest == NULL) return;
+
+    free(manifest->entries);
+    export_manifest_init(manifest);
+}
+
+int export_manifest_load(export_manifest_t *manifest, bundle_reader_t *bundle)
+{
+    if (manifest == NULL || bundle == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int rval;
+    int done = 0;
+    bundle_record_t record;
+
+    while ((rval = bundle_reader_next(bundle, &record, &done)) == HAL_OK && !done)
+    {
+        // keys without a fingerprint will always be exported again
+        if (record.type == BUNDLE_RECORD_REMOVED || !record.has_fingerprint) continue;
+
+        rval = export_manifest_add(manifest, &record.uuid, record.fingerprint);
+        if (rval != HAL_OK) break;
+    }
+
+    if (rval != HAL_OK) return rval;
+
+    export_manifest_sort(manifest);
+
+    return HAL_OK;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef EXPORT_MANIFEST_H
+#define EXPORT_MANIFEST_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+#include "bundle_reader.h"
+#include "key_fingerprint.h"
+
+// The UUIDs and fingerprints of the keys in a previous export. This is used
+// to skip keys that have not changed since that export was made.
+typedef struct
+{
+    hal_uuid_t uuid;
+    uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+    int seen;
+} export_manifest_entry_t;
+
+typedef struct
+{
+    export_manifest_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+} export_manifest_t;
+
+void export_manifest_init(export_manifest_t *manifest);
+int export_manifest_add(export_manifest_t *manifest, const hal_uuid_t *uuid, const uint8_t *fingerprint);
+void export_manifest_sort(export_manifest_t *manifest);
+export_manifest_entry_t *export_manifest_find(export_manifest_t *manifest, const hal_uuid_t *uuid);
+void export_manifest_free(export_manifest_t *manifest);
+
+// read the manifest from the key and unchanged records of an export
+int export_manifest_load(export_manifest_t *manifest, bundle_reader_t *bundle);
+
+#endif
@@ -0,0 +1,623 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "djson.h"
+
+#include "cryptech_device.h"
+#include "dks_backup.h"
+#include "dks_json.h"
+#include "fleet.h"
+#include "uuid_map.h"
+
+#define dks_json_throw(a) { rval = a; goto finished; }
+
+#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+
+#define FLEET_SECRET_MAX 64
+
+// shared by the worker threads
+typedef struct
+{
+    fleet_t *fleet;
+    pthread_mutex_t lock;
+    unsigned int next_device;
+} fleet_run_t;
+
+// Internal Variables -----------------------------------------------------
+
+// the devices' messages are printed one line at a time
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Internal Functions ---------------------------------------------------
+static fleet_device_t *add_device(fleet_t *fleet)
+{
+    if (fleet->count == fleet->capacity)
+    {
+        unsigned int capacity = (fleet->capacity == 0) ? 64 : fleet->capacity * 2;
+        fleet_device_t *devices = realloc(fleet->devices, capacity * sizeof(fleet_device_t));
+        if (devices == NULL) return NULL;
+
+        fleet->devices = devices;
+        fleet->capacity = capacity;
+    }
+
+    fleet_device_t *device = &fleet->devices[fleet->count++];
+    memset(device, 0, sizeof(fleet_device_t));
+    device->format = BUNDLE_FORMAT_JSON;
+    device->rval = HAL_ERROR_NOT_READY;
+
+    return device;
+}
+
+static void free_device(fleet_device_t *device)
+{
+    char **strings[] = { &device->name, &device->device, &device->pin_env, &device->pin_file, &device->passphrase_env,
+                         &device->passphrase_file, &device->setup_path, &device->input_path, &device->output_path,
+                         &device->previous_path, &device->index_path, &device->uuid_map_path };
+
+    for (unsigned int i = 0; i < sizeof(strings)/sizeof(char **); ++i)
+    {
+        free(*strings[i]);
+        *strings[i] = NULL;
+    }
+}
+
+// a path from the manifest, relative to the manifest's folder
+static char *manifest_path(const char *folder, size_t folder_len, const char *path)
+{
+    if (path[0] == '/') folder_len = 0;
+
+    char *result = malloc(folder_len + strlen(path) + 1);
+    if (result == NULL) return NULL;
+
+    memcpy(result, folder, folder_len);
+    strcpy(&result[folder_len], path);
+
+    return result;
+}
+
+static int parse_device(fleet_t *fleet, diamond_json_ptr_t *json_ptr, unsigned int timeout, unsigned int retries,
+                        const char *folder, size_t folder_len)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    int has_op = 0;
+
+    fleet_device_t *device = add_device(fleet);
+    if (device == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    device->timeout = timeout;
+    device->retries = retries;
+
+    // the string members and whether they're paths
+    const char *names[] = { "name", "device", "pin_env", "pin_file", "passphrase_env", "passphrase_file", "setup",
+                            "input", "output", "previous", "index", "uuid_map" };
+    char **values[] = { &device->name, &device->device, &device->pin_env, &device->pin_file, &device->passphrase_env,
+                        &device->passphrase_file, &device->setup_path, &device->input_path, &device->output_path,
+                        &device->previous_path, &device->index_path, &device->uuid_map_path };
+    const int is_path[] = { 0, 0, 0, 1, 0, 1, 1, 1, 1, 1, 1, 1 };
+
+    diamond_json_type_t json_type;
+    dks_json_check(djson_goto_next_element(json_ptr));
+    dks_json_check(djson_get_type_current(json_ptr, &json_type));
+
+    while (json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *name;
+        dks_json_check(djson_get_name_current(json_ptr, &name));
+
+        unsigned int i = 0;
+        while (i < sizeof(names)/sizeof(char *) && strcmp(name, names[i]) != 0) ++i;
+
+        if (i < sizeof(names)/sizeof(char *) && json_type == DJSON_TYPE_String && *values[i] == NULL)
+        {
+            char *value;
+            dks_json_check(djson_get_string_value_current(json_ptr, &value));
+
+            *values[i] = is_path[i] ? manifest_path(folder, folder_len, value) : strdup(value);
+            if (*values[i] == NULL) dks_json_throw(HAL_ERROR_ALLOCATION_FAILURE);
+        }
+        else if (strcmp(name, "operation") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *op;
+            dks_json_check(djson_get_string_value_current(json_ptr, &op));
+
+            if (strcmp(op, "setup") == 0) device->op = FLEET_OP_SETUP;
+            else if (strcmp(op, "export") == 0) device->op = FLEET_OP_EXPORT;
+            else if (strcmp(op, "import") == 0) device->op = FLEET_OP_IMPORT;
+            else dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+            has_op = 1;
+        }
+        else if (strcmp(name, "format") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *format;
+            dks_json_check(djson_get_string_value_current(json_ptr, &format));
+
+            if (strcmp(format, "binary") == 0) device->format = BUNDLE_FORMAT_BINARY;
+            else if (strcmp(format, "json") == 0) device->format = BUNDLE_FORMAT_JSON;
+            else dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+        else if ((strcmp(name, "timeout") == 0 || strcmp(name, "retries") == 0) && json_type == DJSON_TYPE_Primitive)
+        {
+            int value;
+            dks_json_check(djson_get_integer_primitive_current(json_ptr, &value));
+            if (value < 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+            if (name[0] == 't') device->timeout = (unsigned int)value;
+            else device->retries = (unsigned int)value;
+        }
+        else if (strcmp(name, "comment") == 0 && json_type == DJSON_TYPE_String) { }
+        else
+        {
+            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+
+        dks_json_check(djson_pass(json_ptr));
+
+        dks_json_check(djson_get_type_current(json_ptr, &json_type));
+    }
+
+    // what every operation needs
+    if (!has_op || device->name == NULL || device->device == NULL || device->timeout == 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    if ((device->pin_env == NULL) == (device->pin_file == NULL)) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    if (device->passphrase_env != NULL && device->passphrase_file != NULL) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+    if (device->op == FLEET_OP_SETUP && device->output_path == NULL) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    if (device->op == FLEET_OP_EXPORT && (device->setup_path == NULL || device->output_path == NULL))
+    {
+        dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    }
+    if (device->op == FLEET_OP_IMPORT && (device->input_path == NULL || device->uuid_map_path == NULL))
+    {
+        dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    }
+
+finished:
+    return rval;
+}
+
+static int load_integer(char *json, const char *name, unsigned int *value)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+
+    dks_json_check(djson_start_parser(json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    if (djson_parse_until(&json_ptr, name, DJSON_TYPE_Primitive) == DJSON_OK)
+    {
+        int int_value;
+        dks_json_check(djson_get_integer_primitive_current(&json_ptr, &int_value));
+        if (int_value < 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        *value = (unsigned int)int_value;
+    }
+
+finished:
+    return rval;
+}
+
+// the first line of a file that only its owner can read
+static int read_secret_file(const char *path, char *secret)
+{
+    FILE *fp = fopen(path, "rt");
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+    {
+        fclose(fp);
+        return HAL_ERROR_FORBIDDEN;
+    }
+
+    int rval = (fgets(secret, FLEET_SECRET_MAX, fp) != NULL) ? HAL_OK : HAL_ERROR_BAD_ARGUMENTS;
+    fclose(fp);
+
+    secret[strcspn(secret, "\r\n")] = 0;
+
+    return rval;
+}
+
+static int get_secret(const char *env, const char *path, char *secret)
+{
+    secret[0] = 0;
+
+    if (path != NULL) return read_secret_file(path, secret);
+
+    const char *value = getenv(env);
+    if (value == NULL || strlen(value) >= FLEET_SECRET_MAX) return HAL_ERROR_BAD_ARGUMENTS;
+    strcpy(secret, value);
+
+    return HAL_OK;
+}
+
+static void device_message(void *context, const char *text)
+{
+    fleet_device_t *device = context;
+
+    // one line per message, whatever line ends the engine used
+    while (*text == '\r' || *text == '\n') ++text;
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == '\r' || text[len - 1] == '\n')) --len;
+    if (len == 0) return;
+
+    pthread_mutex_lock(&print_lock);
+    printf("[%s] %.*s\r\n", device->name, (int)len, text);
+    fflush(stdout);
+    pthread_mutex_unlock(&print_lock);
+}
+
+static void device_progress(void *context, cryptech_event_t event, const hal_uuid_t *uuid, const hal_uuid_t *new_uuid)
+{
+    fleet_device_t *device = context;
+    (void)uuid;
+    (void)new_uuid;
+
+    switch (event)
+    {
+        case CRYPTECH_EVENT_KEY_EXPORTED: ++device->keys_exported; break;
+        case CRYPTECH_EVENT_KEY_UNCHANGED: ++device->keys_unchanged; break;
+        case CRYPTECH_EVENT_KEY_SKIPPED: ++device->keys_skipped; break;
+        case CRYPTECH_EVENT_KEY_IMPORTED: ++device->keys_imported; break;
+    }
+}
+
+static int run_operation(fleet_device_t *device, dks_backup_t *backup)
+{
+    int rval;
+
+    if (device->op == FLEET_OP_IMPORT)
+    {
+        char passphrase[FLEET_SECRET_MAX];
+        const char *kekek_passphrase = NULL;
+
+        if (device->passphrase_env != NULL || device->passphrase_file != NULL)
+        {
+            rval = get_secret(device->passphrase_env, device->passphrase_file, passphrase);
+            if (rval != HAL_OK) return rval;
+            kekek_passphrase = passphrase;
+        }
+
+        uuid_map_builder_t uuid_map;
+        uuid_map_builder_init(&uuid_map);
+
+        rval = dks_backup_import(backup, device->input_path, NULL, kekek_passphrase, &uuid_map);
+
+        // the keys that made it onto the device can still be found
+        if (uuid_map.count > 0 && uuid_map_builder_save(&uuid_map, device->uuid_map_path) != 0)
+        {
+            device_message(device, "Unable to write the UUID map.");
+            if (rval == HAL_OK) rval = HAL_ERROR_IO_OS_ERROR;
+        }
+
+        uuid_map_builder_free(&uuid_map);
+        memset(passphrase, 0, sizeof(passphrase));
+
+        return rval;
+    }
+
+    char *setup_json = NULL;
+    if (device->op == FLEET_OP_EXPORT)
+    {
+        setup_json = djson_loadfile(device->setup_path);
+        if (setup_json == NULL) return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    int binary = (device->op == FLEET_OP_EXPORT && device->format == BUNDLE_FORMAT_BINARY);
+    FILE *fp = fopen(device->output_path, binary ? "wb" : "wt");
+    if (fp == NULL)
+    {
+        free(setup_json);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    dks_backup_sink_t sink = dks_backup_file_sink(fp);
+
+    if (device->op == FLEET_OP_SETUP)
+    {
+        rval = dks_backup_setup(backup, &sink);
+    }
+    else
+    {
+        export_options_t options;
+        memset(&options, 0, sizeof(options));
+        options.format = device->format;
+        options.previous_path = device->previous_path;
+        options.index_path = device->index_path;
+
+        rval = dks_backup_export(backup, setup_json, &options, &sink);
+    }
+
+    if (fclose(fp) != 0 && rval == HAL_OK) rval = HAL_ERROR_IO_OS_ERROR;
+
+    // don't leave a partial file where the next step would find it
+    if (rval != HAL_OK) remove(device->output_path);
+
+    free(setup_json);
+
+    return rval;
+}
+
+static int run_attempt(fleet_device_t *device)
+{
+    char pin[FLEET_SECRET_MAX];
+    int rval = get_secret(device->pin_env, device->pin_file, pin);
+    if (rval != HAL_OK) return rval;
+
+    cryptech_reporter_t reporter;
+    reporter.message = device_message;
+    reporter.progress = device_progress;
+    reporter.context = device;
+
+    dks_backup_t backup;
+    dks_backup_init(&backup);
+    dks_backup_set_deadline(&backup, time(NULL) + device->timeout);
+
+    rval = dks_backup_open(&backup, device->device, pin, &reporter);
+    memset(pin, 0, sizeof(pin));
+    if (rval != HAL_OK) return rval;
+
+    rval = run_operation(device, &backup);
+
+    dks_backup_close(&backup);
+
+    return rval;
+}
+
+static void run_device(fleet_device_t *device)
+{
+    device->started = time(NULL);
+
+    unsigned int delay = FLEET_RETRY_DELAY;
+
+    while (1)
+    {
+        ++device->attempts;
+        device->keys_exported = device->keys_unchanged = device->keys_skipped = 0;
+
+        device->rval = run_attempt(device);
+        if (device->rval == HAL_OK) break;
+
+        char message[256];
+        snprintf(message, sizeof(message), "Attempt %u failed: %s", device->attempts, hal_error_string(device->rval));
+        device_message(device, message);
+
+        if (device->attempts > device->retries) break;
+
+        // the same PIN would fail again, and the device may lock it out
+        if (device->rval == HAL_ERROR_PIN_INCORRECT || device->rval == HAL_ERROR_FORBIDDEN) break;
+
+        // importing again would make a second copy of those keys
+        if (device->op == FLEET_OP_IMPORT && device->keys_imported > 0) break;
+
+        sleep(delay);
+        delay *= 2;
+    }
+
+    device->finished = time(NULL);
+}
+
+static void *fleet_worker_thread(void *arg)
+{
+    fleet_run_t *run = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&run->lock);
+        unsigned int i = run->next_device++;
+        pthread_mutex_unlock(&run->lock);
+
+        if (i >= run->fleet->count) break;
+
+        run_device(&run->fleet->devices[i]);
+    }
+
+    return NULL;
+}
+
+// Function Implementations ---------------------------------------------
+void fleet_init(fleet_t *fleet)
+{
+    memset(fleet, 0, sizeof(fleet_t));
+    fleet->workers = FLEET_DEFAULT_WORKERS;
+}
+
+void fleet_free(fleet_t *fleet)
+{
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        free_device(&fleet->devices[i]);
+    }
+    free(fleet->devices);
+    fleet_init(fleet);
+}
+
+int fleet_is_manifest(const char *path)
+{
+    return dks_json_file_has_member(path, "fleet");
+}
+
+int fleet_load(const char *path, fleet_t *fleet)
+{
+    if (path == NULL || fleet == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    fleet_init(fleet);
+
+    char *json = djson_loadfile(path);
+    if (json == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    if (!dks_json_has_member(json, "fleet"))
+    {
+        free(json);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+
+    unsigned int timeout = FLEET_DEFAULT_TIMEOUT;
+    unsigned int retries = FLEET_DEFAULT_RETRIES;
+
+    rval = load_integer(json, "workers", &fleet->workers);
+    if (rval == HAL_OK) rval = load_integer(json, "device_timeout", &timeout);
+    if (rval == HAL_OK) rval = load_integer(json, "device_retries", &retries);
+    if (rval != HAL_OK) goto finished;
+
+    if (fleet->workers == 0 || fleet->workers > FLEET_MAX_WORKERS) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+    // relative paths are next to the manifest
+    const char *folder_end = strrchr(path, '/');
+    size_t folder_len = (folder_end != NULL) ? (size_t)(folder_end - path) + 1 : 0;
+
+    dks_json_check(djson_start_parser(json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    dks_json_check(djson_parse_until(&json_ptr, "devices", DJSON_TYPE_Array));
+
+    while (1)
+    {
+        diamond_json_type_t json_type;
+        dks_json_check(djson_goto_next_element(&json_ptr));
+        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+
+        if (json_type == DJSON_TYPE_ArrayEnd) break;
+        if (json_type != DJSON_TYPE_Object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+        rval = parse_device(fleet, &json_ptr, timeout, retries, path, folder_len);
+        if (rval != HAL_OK) goto finished;
+    }
+
+    // two workers on one serial port would garble each other's packets
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        for (unsigned int j = 0; j < i; ++j)
+        {
+            if (strcmp(fleet->devices[i].device, fleet->devices[j].device) == 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+    }
+
+finished:
+    free(json);
+    if (rval != HAL_OK) fleet_free(fleet);
+
+    return rval;
+}
+
+unsigned int fleet_run(fleet_t *fleet)
+{
+    fleet_run_t run;
+    run.fleet = fleet;
+    run.next_device = 0;
+
+    if (pthread_mutex_init(&run.lock, NULL) != 0) return fleet->count;
+
+    pthread_t threads[FLEET_MAX_WORKERS];
+    unsigned int threads_len = (fleet->count < fleet->workers) ? fleet->count : fleet->workers;
+    if (threads_len > FLEET_MAX_WORKERS) threads_len = FLEET_MAX_WORKERS;
+    unsigned int started = 0;
+
+    while (started < threads_len && pthread_create(&threads[started], NULL, fleet_worker_thread, &run) == 0)
+    {
+        ++started;
+    }
+
+    // without any threads, do the work here
+    if (started == 0) fleet_worker_thread(&run);
+
+    for (unsigned int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&run.lock);
+
+    unsigned int failed = 0;
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        if (fleet->devices[i].rval != HAL_OK) ++failed;
+    }
+
+    return failed;
+}
+
+int fleet_save_report(const fleet_t *fleet, FILE *fp)
+{
+    if (fleet == NULL || fp == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    unsigned int failed = 0;
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        if (fleet->devices[i].rval != HAL_OK) ++failed;
+    }
+
+    fprintf(fp, "{\r\n    \"fleet_report\": 1,\r\n");
+    fprintf(fp, "    \"devices_ok\": %u,\r\n", fleet->count - failed);
+    fprintf(fp, "    \"devices_failed\": %u,\r\n", failed);
+    fprintf(fp, "    \"devices\": [");
+
+    for (unsigned int i = 0; i < fleet->count; ++i)
+    {
+        const fleet_device_t *device = &fleet->devices[i];
+
+        fprintf(fp, "%s\r\n        { \"name\": ", (i > 0) ? "," : "");
+        dks_json_write_string(fp, device->name);
+        fprintf(fp, ", \"device\": ");
+        dks_json_write_string(fp, device->device);
+        fprintf(fp, ", \"operation\": \"%s\", ", fleet_op_name(device->op));
+        fprintf(fp, "\"result\": \"%s\", \"attempts\": %u, \"seconds\": %ld, ",
+                (device->rval == HAL_OK) ? "ok" : hal_error_string(device->rval), device->attempts,
+                (long)(device->finished - device->started));
+        fprintf(fp, "\"exported\": %u, \"unchanged\": %u, \"skipped\": %u, \"imported\": %u }",
+                device->keys_exported, device->keys_unchanged, device->keys_skipped, device->keys_imported);
+    }
+
+    fprintf(fp, "\r\n    ]\r\n}\r\n");
+
+    return ferror(fp) ? HAL_ERROR_IO_OS_ERROR : HAL_OK;
+}
+
+const char *fleet_op_name(fleet_op_t op)
+{
+    switch (op)
+    {
+        case FLEET_OP_SETUP: return "setup";
+        case FLEET_OP_EXPORT: return "export";
+        case FLEET_OP_IMPORT: return "import";
+    }
+
+    return "unknown";
+}
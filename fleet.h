@@ -0,0 +1,135 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "bundle.h"
+
+// Runs setup, export and import on many CrypTech devices at once, without
+// prompts. A fleet manifest lists the devices:
+//
+// {
+//     "fleet": 1,
+//     "workers": 4,
+//     "device_timeout": 1800,
+//     "device_retries": 2,
+//     "devices": [
+//         { "name": "hsm-a", "device": "/dev/ttyUSB0", "pin_file": "hsm-a.pin",
+//           "operation": "export", "setup": "hsm-b.setup.json", "output": "hsm-a.export", "format": "binary" },
+//         { "name": "hsm-b", "device": "/dev/ttyUSB1", "pin_env": "HSM_B_PIN",
+//           "operation": "import", "input": "hsm-a.export", "uuid_map": "hsm-b.uuidmap" }
+//     ]
+// }
+//
+// Relative paths are relative to the manifest. Each device runs on its own
+// serial link, with up to "workers" devices at a time. An attempt that takes
+// longer than its timeout (in seconds) fails, and is tried again "retries"
+// times. An import is not tried again once any of its keys were imported.
+
+#define FLEET_DEFAULT_WORKERS 4
+#define FLEET_MAX_WORKERS 64
+#define FLEET_DEFAULT_TIMEOUT 3600
+#define FLEET_DEFAULT_RETRIES 1
+
+// seconds to wait before the first retry. It doubles for each retry after it
+#define FLEET_RETRY_DELAY 5
+
+typedef enum
+{
+    FLEET_OP_SETUP,     // write the setup JSON of a new KEKEK to output
+    FLEET_OP_EXPORT,    // export to the KEKEK of setup, into output
+    FLEET_OP_IMPORT     // import input
+} fleet_op_t;
+
+typedef struct
+{
+    char *name;
+    char *device;
+    fleet_op_t op;
+
+    // where the PIN comes from: an environment variable or the first line
+    // of a file only its owner can read
+    char *pin_env;
+    char *pin_file;
+
+    // the passphrase of a software KEKEK, for an import. May be NULL
+    char *passphrase_env;
+    char *passphrase_file;
+
+    char *setup_path;
+    char *input_path;
+    char *output_path;
+    char *previous_path;
+    char *index_path;
+    char *uuid_map_path;
+    bundle_format_t format;
+
+    unsigned int timeout;
+    unsigned int retries;
+
+    // the result of fleet_run
+    int rval;
+    unsigned int attempts;
+    time_t started;
+    time_t finished;
+    unsigned int keys_exported;
+    unsigned int keys_unchanged;
+    unsigned int keys_skipped;
+    unsigned int keys_imported;
+} fleet_device_t;
+
+typedef struct
+{
+    fleet_device_t *devices;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int workers;
+} fleet_t;
+
+void fleet_init(fleet_t *fleet);
+void fleet_free(fleet_t *fleet);
+
+int fleet_load(const char *path, fleet_t *fleet);
+int fleet_is_manifest(const char *path);
+
+// run every device. Returns the number of devices that failed
+unsigned int fleet_run(fleet_t *fleet);
+
+// the results as JSON
+int fleet_save_report(const fleet_t *fleet, FILE *fp);
+
+const char *fleet_op_name(fleet_op_t op);
+
+#endif
@@ -0,0 +1,202 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <hal.h>
+
+#include "kekek_pool.h"
+
+// Function Implementations ---------------------------------------------
+void kekek_pool_init(kekek_pool_t *pool)
+{
+    memset(pool, 0, sizeof(kekek_pool_t));
+}
+
+void kekek_pool_free(kekek_pool_t *pool)
+{
+    if (pool == NULL) return;
+
+    free(pool->entries);
+    kekek_pool_init(pool);
+}
+
+int kekek_pool_load(kekek_pool_t *pool, const char *path)
+{
+    if (pool == NULL || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return (errno == ENOENT) ? HAL_OK : HAL_ERROR_IO_OS_ERROR;
+
+    int rval = HAL_OK;
+    kekek_pool_header_t header;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, KEKEK_POOL_MAGIC, sizeof(header.magic)) != 0 ||
+        le32toh(header.version) != KEKEK_POOL_VERSION)
+    {
+        rval = HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    kekek_pool_entry_t entry;
+    for (uint32_t i = 0; rval == HAL_OK && i < le32toh(header.count); ++i)
+    {
+        if (fread(&entry, sizeof(entry), 1, fp) != 1) rval = HAL_ERROR_IO_UNEXPECTED;
+        else if (le32toh(entry.pubkey_len) > KEKEK_POOL_PUBKEY_MAX) rval = HAL_ERROR_BAD_ARGUMENTS;
+        else rval = kekek_pool_add(pool, &entry.uuid, entry.pubkey, le32toh(entry.pubkey_len));
+    }
+
+    fclose(fp);
+
+    return rval;
+}
+
+int kekek_pool_save(const kekek_pool_t *pool, const char *path)
+{
+    if (pool == NULL || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    kekek_pool_header_t header;
+    memcpy(header.magic, KEKEK_POOL_MAGIC, sizeof(header.magic));
+    header.version = htole32(KEKEK_POOL_VERSION);
+    header.count = htole32(pool->count);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    int rval = HAL_OK;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) rval = HAL_ERROR_IO_OS_ERROR;
+
+    for (unsigned int i = 0; rval == HAL_OK && i < pool->count; ++i)
+    {
+        kekek_pool_entry_t entry = pool->entries[i];
+        entry.pubkey_len = htole32(entry.pubkey_len);
+
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1) rval = HAL_ERROR_IO_OS_ERROR;
+    }
+
+    if (fclose(fp) != 0) rval = HAL_ERROR_IO_OS_ERROR;
+
+    return rval;
+}
+
+int kekek_pool_lock(const char *path, int *lock)
+{
+    if (path == NULL || lock == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *lock = -1;
+
+    size_t path_len = strlen(path);
+    char *lock_path = malloc(path_len + sizeof(".lock"));
+    if (lock_path == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    memcpy(lock_path, path, path_len);
+    memcpy(lock_path + path_len, ".lock", sizeof(".lock"));
+
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    free(lock_path);
+    if (fd < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    int rval;
+    while ((rval = flock(fd, LOCK_EX)) != 0 && errno == EINTR) { }
+
+    if (rval != 0)
+    {
+        close(fd);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    *lock = fd;
+
+    return HAL_OK;
+}
+
+void kekek_pool_unlock(int lock)
+{
+    if (lock < 0) return;
+
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+int kekek_pool_add(kekek_pool_t *pool, const hal_uuid_t *uuid, const uint8_t *pubkey, size_t pubkey_len)
+{
+    if (pool == NULL || uuid == NULL || pubkey == NULL || pubkey_len > KEKEK_POOL_PUBKEY_MAX)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    if (pool->count == pool->capacity)
+    {
+        unsigned int capacity = (pool->capacity == 0) ? 64 : pool->capacity * 2;
+        kekek_pool_entry_t *entries = realloc(pool->entries, capacity * sizeof(kekek_pool_entry_t));
+        if (entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        pool->entries = entries;
+        pool->capacity = capacity;
+    }
+
+    kekek_pool_entry_t *entry = &pool->entries[pool->count++];
+    memset(entry, 0, sizeof(kekek_pool_entry_t));
+    memcpy(&entry->uuid, uuid, sizeof(hal_uuid_t));
+    memcpy(entry->pubkey, pubkey, pubkey_len);
+    entry->pubkey_len = (uint32_t)pubkey_len;
+
+    return HAL_OK;
+}
+
+const kekek_pool_entry_t *kekek_pool_find(const kekek_pool_t *pool, const hal_uuid_t *uuid)
+{
+    if (pool == NULL || uuid == NULL) return NULL;
+
+    for (unsigned int i = 0; i < pool->count; ++i)
+    {
+        if (memcmp(&pool->entries[i].uuid, uuid, sizeof(hal_uuid_t)) == 0) return &pool->entries[i];
+    }
+
+    return NULL;
+}
+
+void kekek_pool_remove(kekek_pool_t *pool, const hal_uuid_t *uuid)
+{
+    const kekek_pool_entry_t *entry = kekek_pool_find(pool, uuid);
+    if (entry == NULL) return;
+
+    unsigned int i = (unsigned int)(entry - pool->entries);
+    memmove(&pool->entries[i], &pool->entries[i + 1], (pool->count - i - 1) * sizeof(kekek_pool_entry_t));
+    --pool->count;
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef KEKEK_POOL_H
+#define KEKEK_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <hal.h>
+
+// Generating a KEKEK on the device takes minutes, so they can be made ahead
+// of time. Pool KEKEKs carry the KEKEK_POOL_ATTRIBUTE until they're claimed
+// by a setup, which finds one with a single filtered hal_rpc_pkey_match().
+//
+// The public keys of the pool are cached in a local file, so a claimed
+// KEKEK doesn't have to be read back from the device. The file is a
+// kekek_pool_header_t followed by 'count' kekek_pool_entry_t records.
+// Integers are stored little endian.
+#define KEKEK_POOL_MAGIC            "DKSKPOL1"
+#define KEKEK_POOL_VERSION          1
+
+// CKA_VENDOR_DEFINED | "DK" 01. Holds one byte, 1
+#define KEKEK_POOL_ATTRIBUTE        0x80444B01
+
+#define KEKEK_POOL_PUBKEY_MAX       1024
+#define KEKEK_POOL_KEY_BITS         2048
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} kekek_pool_header_t;
+
+typedef struct
+{
+    hal_uuid_t uuid;
+    uint32_t pubkey_len;
+    uint8_t pubkey[KEKEK_POOL_PUBKEY_MAX];
+} kekek_pool_entry_t;
+
+typedef struct
+{
+    kekek_pool_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+} kekek_pool_t;
+
+void kekek_pool_init(kekek_pool_t *pool);
+void kekek_pool_free(kekek_pool_t *pool);
+
+// a file that doesn't exist is an empty pool
+int kekek_pool_load(kekek_pool_t *pool, const char *path);
+int kekek_pool_save(const kekek_pool_t *pool, const char *path);
+
+// claims and refills are serialized with an exclusive flock() on
+// "<path>.lock", so clients on this host that share a cache never claim the
+// same KEKEK. kekek_pool_lock waits for the lock and sets *lock to its
+// descriptor
+int kekek_pool_lock(const char *path, int *lock);
+void kekek_pool_unlock(int lock);
+
+int kekek_pool_add(kekek_pool_t *pool, const hal_uuid_t *uuid, const uint8_t *pubkey, size_t pubkey_len);
+// NULL when the KEKEK isn't in the cache
+const kekek_pool_entry_t *kekek_pool_find(const kekek_pool_t *pool, const hal_uuid_t *uuid);
+void kekek_pool_remove(kekek_pool_t *pool, const hal_uuid_t *uuid);
+
+#endif
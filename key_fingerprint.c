@@ -0,0 +1,168 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include <hal.h>
+
+#define CK_PTR                                          *
+#define CK_DEFINE_FUNCTION(returnType, name)            returnType name
+#define CK_DECLARE_FUNCTION(returnType, name)           returnType name
+#define CK_DECLARE_FUNCTION_POINTER(returnType, name)   returnType (* name)
+#define CK_CALLBACK_FUNCTION(returnType, name)          returnType (* name)
+#ifndef NULL_PTR
+#define NULL_PTR                                        NULL
+#endif
+
+#include "pkcs11t.h"
+
+#include "key_fingerprint.h"
+
+// the attributes that applications are likely to change after a key has
+// been created
+static const uint32_t fingerprint_attributes[] = { CKA_LABEL, CKA_ID, CKA_APPLICATION, CKA_SUBJECT,
+                                                   CKA_START_DATE, CKA_END_DATE, CKA_MODIFIABLE,
+                                                   CKA_ENCRYPT, CKA_DECRYPT, CKA_WRAP, CKA_UNWRAP,
+                                                   CKA_SIGN, CKA_VERIFY, CKA_DERIVE };
+
+static void sha256_update_uint32(SHA256_CTX *ctx, uint32_t value)
+{
+    uint8_t buffer[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16),
+                          (uint8_t)(value >> 8), (uint8_t)value };
+
+    SHA256_Update(ctx, buffer, sizeof(buffer));
+}
+
+hal_error_t get_key_fingerprint(const hal_pkey_handle_t pkey, const hal_key_type_t key_type,
+                                const hal_key_flags_t key_flags, uint8_t *fingerprint)
+{
+    return get_key_fingerprint_identity(pkey, key_type, key_flags, fingerprint, NULL);
+}
+
+hal_error_t get_key_fingerprint_identity(const hal_pkey_handle_t pkey, const hal_key_type_t key_type,
+                                         const hal_key_flags_t key_flags, uint8_t *fingerprint,
+                                         uint8_t *identity)
+{
+    if (fingerprint == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    const unsigned num_attributes = sizeof(fingerprint_attributes) / sizeof(uint32_t);
+
+    // the public key of an RSA-4096 key is well under this
+    const size_t der_max = 1024 * 2;
+    uint8_t der[der_max];
+    size_t der_len;
+
+    // larger than 2048 can cause a RPC packet overflow error
+    const size_t attributes_buffer_len = 2048;
+    uint8_t attributes_buffer[attributes_buffer_len];
+    hal_pkey_attribute_t attributes[num_attributes];
+
+    hal_error_t err = hal_rpc_pkey_get_public_key(pkey, der, &der_len, der_max);
+    if (err != HAL_OK) return err;
+
+    if (identity != NULL) SHA256(der, der_len, identity);
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+
+    sha256_update_uint32(&ctx, key_type);
+    sha256_update_uint32(&ctx, key_flags);
+    sha256_update_uint32(&ctx, der_len);
+    SHA256_Update(&ctx, der, der_len);
+
+    // try to get all of the attributes in one call
+    for (unsigned i = 0; i < num_attributes; ++i)
+    {
+        attributes[i].type = fingerprint_attributes[i];
+        attributes[i].value = NULL;
+        attributes[i].length = 0;
+    }
+
+    if (hal_rpc_pkey_get_attributes(pkey, attributes, num_attributes,
+                                    attributes_buffer, attributes_buffer_len) == HAL_OK)
+    {
+        for (unsigned i = 0; i < num_attributes; ++i)
+        {
+            sha256_update_uint32(&ctx, attributes[i].type);
+            sha256_update_uint32(&ctx, attributes[i].length);
+            SHA256_Update(&ctx, attributes[i].value, attributes[i].length);
+        }
+    }
+    else
+    {
+        // at least one attribute is missing, so get them one at a time
+        for (unsigned i = 0; i < num_attributes; ++i)
+        {
+            hal_pkey_attribute_t attr_get = { .type = fingerprint_attributes[i] };
+
+            if (hal_rpc_pkey_get_attributes(pkey, &attr_get, 1,
+                                            attributes_buffer, attributes_buffer_len) != HAL_OK)
+            {
+                attr_get.value = NULL;
+                attr_get.length = 0;
+            }
+
+            sha256_update_uint32(&ctx, attr_get.type);
+            sha256_update_uint32(&ctx, attr_get.length);
+            SHA256_Update(&ctx, attr_get.value, attr_get.length);
+        }
+    }
+
+    SHA256_Final(fingerprint, &ctx);
+
+    return HAL_OK;
+}
+
+char *fingerprint_to_string(const uint8_t *fingerprint, char *buffer)
+{
+    for (int i = 0; i < KEY_FINGERPRINT_LEN; ++i)
+    {
+        sprintf(&buffer[i * 2], "%02x", (unsigned int)fingerprint[i]);
+    }
+
+    return buffer;
+}
+
+int string_to_fingerprint(const char *s, uint8_t *fingerprint)
+{
+    if (s == NULL || strlen(s) != KEY_FINGERPRINT_LEN * 2) return 0;
+
+    for (int i = 0; i < KEY_FINGERPRINT_LEN; ++i)
+    {
+        unsigned int t;
+        if (sscanf(&s[i * 2], "%2x", &t) != 1) return 0;
+        fingerprint[i] = (uint8_t)t;
+    }
+
+    return 1;
+}
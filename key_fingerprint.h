@@ -0,0 +1,58 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef KEY_FINGERPRINT_H
+#define KEY_FINGERPRINT_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+// A key fingerprint is a SHA-256 digest over the key type, the key flags,
+// the public key and a small set of attributes that applications change.
+// It never includes private key material or the key's UUID, so the same key
+// has the same fingerprint on every device that holds it.
+#define KEY_FINGERPRINT_LEN         32
+#define KEY_FINGERPRINT_STRING_LEN  (KEY_FINGERPRINT_LEN * 2 + 1)
+
+hal_error_t get_key_fingerprint(const hal_pkey_handle_t pkey, const hal_key_type_t key_type,
+                                const hal_key_flags_t key_flags, uint8_t *fingerprint);
+
+// also gets the SHA-256 digest of the public key, which identifies the key
+// on every device even when its attributes change. identity may be NULL
+hal_error_t get_key_fingerprint_identity(const hal_pkey_handle_t pkey, const hal_key_type_t key_type,
+                                         const hal_key_flags_t key_flags, uint8_t *fingerprint,
+                                         uint8_t *identity);
+
+// buffer must be at least KEY_FINGERPRINT_STRING_LEN characters
+char *fingerprint_to_string(const uint8_t *fingerprint, char *buffer);
+int string_to_fingerprint(const char *s, uint8_t *fingerprint);
+
+#endif
@@ -0,0 +1,264 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "key_index.h"
+
+static int compare_entries(const void *a, const void *b)
+{
+    return memcmp(&((const key_index_entry_t *)a)->uuid,
+                  &((const key_index_entry_t *)b)->uuid,
+                  sizeof(hal_uuid_t));
+}
+
+static int compare_label_digests(const void *a, const void *b)
+{
+    return memcmp((*(const key_index_entry_t * const *)a)->label_digest,
+                  (*(const key_index_entry_t * const *)b)->label_digest,
+                  KEY_INDEX_DIGEST_LEN);
+}
+
+static uint32_t label_order_at(const key_index_t *index, uint32_t i)
+{
+    uint32_t value;
+    memcpy(&value, index->label_order + i * sizeof(uint32_t), sizeof(value));
+    return le32toh(value);
+}
+
+void key_index_digest(const void *data, size_t len, uint8_t *digest)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, data, len);
+    SHA256_Final(digest, &ctx);
+}
+
+int key_index_save(const char *path, bundle_format_t format, uint64_t bundle_len,
+                   key_index_entry_t *entries, uint32_t count)
+{
+    if (path == NULL || (entries == NULL && count > 0)) return HAL_ERROR_BAD_ARGUMENTS;
+
+    qsort(entries, count, sizeof(key_index_entry_t), compare_entries);
+
+    // the entries with a label, in label digest order
+    const key_index_entry_t **labeled = malloc((count > 0 ? count : 1) * sizeof(key_index_entry_t *));
+    if (labeled == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    uint32_t label_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (entries[i].attributes & KEY_INDEX_HAS_LABEL) labeled[label_count++] = &entries[i];
+    }
+    qsort(labeled, label_count, sizeof(key_index_entry_t *), compare_label_digests);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        free(labeled);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    key_index_header_t header;
+    memcpy(header.magic, KEY_INDEX_MAGIC, sizeof(header.magic));
+    header.version = htole32(KEY_INDEX_VERSION);
+    header.format = htole32(format);
+    header.bundle_len = htole64(bundle_len);
+    header.count = htole32(count);
+    header.label_count = htole32(label_count);
+
+    int ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        key_index_entry_t entry = entries[i];
+        entry.key_type = htole32(entry.key_type);
+        entry.flags = htole32(entry.flags);
+        entry.attributes = htole32(entry.attributes);
+        entry.length = htole32(entry.length);
+        entry.offset = htole64(entry.offset);
+
+        ok = (fwrite(&entry, sizeof(entry), 1, fp) == 1);
+    }
+
+    for (uint32_t i = 0; ok && i < label_count; ++i)
+    {
+        uint32_t position = htole32((uint32_t)(labeled[i] - entries));
+        ok = (fwrite(&position, sizeof(position), 1, fp) == 1);
+    }
+
+    free(labeled);
+
+    if (fclose(fp) != 0) ok = 0;
+
+    return ok ? HAL_OK : HAL_ERROR_IO_OS_ERROR;
+}
+
+int key_index_open(const char *path, key_index_t *index)
+{
+    if (path == NULL || index == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(index, 0, sizeof(key_index_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(key_index_header_t))
+    {
+        close(fd);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return HAL_ERROR_IO_OS_ERROR;
+
+    index->map = map;
+    index->map_len = st.st_size;
+    index->header = map;
+    index->count = le32toh(index->header->count);
+    index->label_count = le32toh(index->header->label_count);
+    index->entries = (const key_index_entry_t *)(index->map + sizeof(key_index_header_t));
+    index->label_order = (const uint8_t *)(index->entries + index->count);
+
+    uint64_t expected_len = sizeof(key_index_header_t) +
+                            (uint64_t)index->count * sizeof(key_index_entry_t) +
+                            (uint64_t)index->label_count * sizeof(uint32_t);
+
+    if (memcmp(index->header->magic, KEY_INDEX_MAGIC, sizeof(index->header->magic)) != 0 ||
+        le32toh(index->header->version) != KEY_INDEX_VERSION ||
+        expected_len != index->map_len || index->label_count > index->count)
+    {
+        key_index_close(index);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    for (uint32_t i = 0; i < index->label_count; ++i)
+    {
+        if (label_order_at(index, i) >= index->count)
+        {
+            key_index_close(index);
+            return HAL_ERROR_BAD_ARGUMENTS;
+        }
+    }
+
+    return HAL_OK;
+}
+
+void key_index_close(key_index_t *index)
+{
+    if (index == NULL) return;
+
+    if (index->map != NULL) munmap(index->map, index->map_len);
+    memset(index, 0, sizeof(key_index_t));
+}
+
+int key_index_check_bundle(const key_index_t *index, bundle_format_t format, uint64_t bundle_len)
+{
+    if (index == NULL || index->header == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // the bundle has changed since the index was saved
+    if (le32toh(index->header->format) != (uint32_t)format ||
+        le64toh(index->header->bundle_len) != bundle_len)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    return HAL_OK;
+}
+
+const key_index_entry_t *key_index_find(const key_index_t *index, const hal_uuid_t *uuid)
+{
+    if (index == NULL || index->entries == NULL || uuid == NULL) return NULL;
+
+    // the entries are sorted by UUID and the UUID field is first
+    return bsearch(uuid, index->entries, index->count, sizeof(key_index_entry_t), compare_entries);
+}
+
+unsigned key_index_find_label(const key_index_t *index, const uint8_t *label, size_t label_len,
+                              const key_index_entry_t **results, unsigned results_max)
+{
+    if (index == NULL || index->entries == NULL || label == NULL) return 0;
+
+    uint8_t digest[KEY_INDEX_DIGEST_LEN];
+    key_index_digest(label, label_len, digest);
+
+    // find the first entry with the digest
+    uint32_t low = 0, high = index->label_count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (memcmp(index->entries[label_order_at(index, mid)].label_digest, digest, KEY_INDEX_DIGEST_LEN) < 0) low = mid + 1;
+        else high = mid;
+    }
+
+    // several keys can share a label
+    unsigned found = 0;
+    for (uint32_t i = low; i < index->label_count; ++i)
+    {
+        const key_index_entry_t *entry = &index->entries[label_order_at(index, i)];
+        if (memcmp(entry->label_digest, digest, KEY_INDEX_DIGEST_LEN) != 0) break;
+
+        if (found < results_max) results[found] = entry;
+        ++found;
+    }
+
+    return found;
+}
+
+uint32_t key_index_entry_key_type(const key_index_entry_t *entry)
+{
+    return le32toh(entry->key_type);
+}
+
+uint32_t key_index_entry_flags(const key_index_entry_t *entry)
+{
+    return le32toh(entry->flags);
+}
+
+uint32_t key_index_entry_length(const key_index_entry_t *entry)
+{
+    return le32toh(entry->length);
+}
+
+uint64_t key_index_entry_offset(const key_index_entry_t *entry)
+{
+    return le64toh(entry->offset);
+}
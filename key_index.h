@@ -0,0 +1,117 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <hal.h>
+
+#include "bundle.h"
+
+// A key index is saved next to an export bundle. It records where each key
+// is in the bundle, a SHA-256 digest of the key's record and digests of its
+// CKA_ID and CKA_LABEL, so single keys can be found, checked and read
+// without parsing the rest of the bundle.
+//
+// The file is a key_index_header_t followed by the entries sorted by UUID,
+// then the positions of the entries that have a label, sorted by the label
+// digest. Integers are little endian.
+#define KEY_INDEX_MAGIC         "DKSKIDX1"
+#define KEY_INDEX_VERSION       1
+#define KEY_INDEX_DIGEST_LEN    32
+
+// key_index_entry_t attributes
+#define KEY_INDEX_HAS_ID        0x00000001
+#define KEY_INDEX_HAS_LABEL     0x00000002
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t format;        // bundle_format_t of the bundle
+    uint64_t bundle_len;    // used to catch an index that doesn't belong to the bundle
+    uint32_t count;
+    uint32_t label_count;
+} key_index_header_t;
+
+typedef struct
+{
+    hal_uuid_t uuid;
+    uint32_t key_type;
+    uint32_t flags;
+    uint32_t attributes;
+    uint32_t length;
+    uint64_t offset;
+    uint8_t digest[KEY_INDEX_DIGEST_LEN];
+    uint8_t id_digest[KEY_INDEX_DIGEST_LEN];
+    uint8_t label_digest[KEY_INDEX_DIGEST_LEN];
+} key_index_entry_t;
+
+typedef struct
+{
+    uint8_t *map;
+    size_t map_len;
+
+    const key_index_header_t *header;
+    const key_index_entry_t *entries;
+    const uint8_t *label_order;
+    uint32_t count;
+    uint32_t label_count;
+} key_index_t;
+
+// entries are in host byte order. They are sorted by UUID when saved
+int key_index_save(const char *path, bundle_format_t format, uint64_t bundle_len,
+                   key_index_entry_t *entries, uint32_t count);
+
+int key_index_open(const char *path, key_index_t *index);
+void key_index_close(key_index_t *index);
+
+// make sure the index was saved with this bundle
+int key_index_check_bundle(const key_index_t *index, bundle_format_t format, uint64_t bundle_len);
+
+const key_index_entry_t *key_index_find(const key_index_t *index, const hal_uuid_t *uuid);
+
+// the entries with the label. Returns the number of entries found, which may
+// be more than results_max
+unsigned key_index_find_label(const key_index_t *index, const uint8_t *label, size_t label_len,
+                              const key_index_entry_t **results, unsigned results_max);
+
+void key_index_digest(const void *data, size_t len, uint8_t *digest);
+
+// fields of a mapped entry
+uint32_t key_index_entry_key_type(const key_index_entry_t *entry);
+uint32_t key_index_entry_flags(const key_index_entry_t *entry);
+uint32_t key_index_entry_length(const key_index_entry_t *entry);
+uint64_t key_index_entry_offset(const key_index_entry_t *entry);
+
+#endif
@@ -0,0 +1,169 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include "key_tree.h"
+
+#define KEY_TREE_BUCKETS    (1u << KEY_TREE_DEPTH)
+#define KEY_TREE_NODES      ((1u << (KEY_TREE_DEPTH + 1)) - 1)
+
+static int compare_entries(const void *a, const void *b)
+{
+    // the identity is followed by the fingerprint
+    return memcmp(a, b, 2 * KEY_FINGERPRINT_LEN);
+}
+
+// the first KEY_TREE_DEPTH bits of the identity
+static unsigned int entry_bucket(const key_tree_entry_t *entry)
+{
+    uint32_t prefix = ((uint32_t)entry->identity[0] << 24) | ((uint32_t)entry->identity[1] << 16) |
+                      ((uint32_t)entry->identity[2] << 8) | entry->identity[3];
+
+    return prefix >> (32 - KEY_TREE_DEPTH);
+}
+
+static int is_empty(const uint8_t *hash)
+{
+    static const uint8_t zeros[KEY_TREE_HASH_LEN];
+
+    return memcmp(hash, zeros, KEY_TREE_HASH_LEN) == 0;
+}
+
+void key_tree_init(key_tree_t *tree)
+{
+    memset(tree, 0, sizeof(key_tree_t));
+}
+
+int key_tree_add(key_tree_t *tree, const uint8_t *identity, const uint8_t *fingerprint, const hal_uuid_t *uuid)
+{
+    if (tree == NULL || identity == NULL || fingerprint == NULL || uuid == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (tree->count == tree->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (tree->capacity == 0) ? 64 : tree->capacity * 2;
+        key_tree_entry_t *new_entries = realloc(tree->entries, new_capacity * sizeof(key_tree_entry_t));
+        if (new_entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        tree->entries = new_entries;
+        tree->capacity = new_capacity;
+    }
+
+    key_tree_entry_t *entry = &tree->entries[tree->count++];
+    memcpy(entry->identity, identity, KEY_FINGERPRINT_LEN);
+    memcpy(entry->fingerprint, fingerprint, KEY_FINGERPRINT_LEN);
+    memcpy(&entry->uuid, uuid, sizeof(hal_uuid_t));
+
+    return HAL_OK;
+}
+
+int key_tree_build(key_tree_t *tree)
+{
+    if (tree == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    free(tree->nodes);
+    free(tree->bucket_start);
+
+    tree->nodes = calloc(KEY_TREE_NODES, KEY_TREE_HASH_LEN);
+    tree->bucket_start = malloc((KEY_TREE_BUCKETS + 1) * sizeof(unsigned int));
+    if (tree->nodes == NULL || tree->bucket_start == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    if (tree->count > 0) qsort(tree->entries, tree->count, sizeof(key_tree_entry_t), compare_entries);
+
+    // the entries are sorted, so each bucket is a run of them
+    uint8_t (*buckets)[KEY_TREE_HASH_LEN] = &tree->nodes[KEY_TREE_BUCKETS - 1];
+    unsigned int i = 0;
+
+    for (unsigned int b = 0; b < KEY_TREE_BUCKETS; ++b)
+    {
+        tree->bucket_start[b] = i;
+        if (i == tree->count || entry_bucket(&tree->entries[i]) != b) continue;
+
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+
+        for ( ; i < tree->count && entry_bucket(&tree->entries[i]) == b; ++i)
+        {
+            SHA256_Update(&ctx, tree->entries[i].identity, KEY_FINGERPRINT_LEN);
+            SHA256_Update(&ctx, tree->entries[i].fingerprint, KEY_FINGERPRINT_LEN);
+        }
+
+        SHA256_Final(buckets[b], &ctx);
+    }
+    tree->bucket_start[KEY_TREE_BUCKETS] = i;
+
+    // hash the levels above, from the bottom up
+    for (unsigned int node = KEY_TREE_BUCKETS - 1; node-- > 0; )
+    {
+        const uint8_t *left = tree->nodes[2 * node + 1];
+        const uint8_t *right = tree->nodes[2 * node + 2];
+
+        if (is_empty(left) && is_empty(right)) continue;
+
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, left, KEY_TREE_HASH_LEN);
+        SHA256_Update(&ctx, right, KEY_TREE_HASH_LEN);
+        SHA256_Final(tree->nodes[node], &ctx);
+    }
+
+    return HAL_OK;
+}
+
+void key_tree_free(key_tree_t *tree)
+{
+    if (tree == NULL) return;
+
+    free(tree->entries);
+    free(tree->nodes);
+    free(tree->bucket_start);
+    key_tree_init(tree);
+}
+
+const uint8_t *key_tree_node(const key_tree_t *tree, unsigned int level, unsigned int index)
+{
+    if (tree == NULL || tree->nodes == NULL || level > KEY_TREE_DEPTH || index >= (1u << level)) return NULL;
+
+    return tree->nodes[(1u << level) - 1 + index];
+}
+
+const key_tree_entry_t *key_tree_bucket(const key_tree_t *tree, unsigned int index, unsigned int *count)
+{
+    *count = 0;
+    if (tree == NULL || tree->bucket_start == NULL || index >= KEY_TREE_BUCKETS) return NULL;
+
+    *count = tree->bucket_start[index + 1] - tree->bucket_start[index];
+
+    return &tree->entries[tree->bucket_start[index]];
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef KEY_TREE_H
+#define KEY_TREE_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+#include "key_fingerprint.h"
+
+// A Merkle tree over the keys on a device, used to compare two devices
+// without sending every key. A key is placed by its identity, the digest of
+// its public key, so the same key lands in the same bucket on every device.
+// A bucket's hash covers the identities and fingerprints of its keys, and
+// each node above hashes its two children. Empty subtrees hash to zeros.
+#define KEY_TREE_DEPTH      12      // 4096 buckets
+#define KEY_TREE_HASH_LEN   32
+
+typedef struct
+{
+    uint8_t identity[KEY_FINGERPRINT_LEN];
+    uint8_t fingerprint[KEY_FINGERPRINT_LEN];
+    hal_uuid_t uuid;    // on this device
+} key_tree_entry_t;
+
+typedef struct
+{
+    // sorted by identity, then fingerprint, after key_tree_build
+    key_tree_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+
+    // level l index i is at (1 << l) - 1 + i. Level KEY_TREE_DEPTH holds the buckets
+    uint8_t (*nodes)[KEY_TREE_HASH_LEN];
+
+    // the entries of bucket b are bucket_start[b] to bucket_start[b + 1]
+    unsigned int *bucket_start;
+} key_tree_t;
+
+void key_tree_init(key_tree_t *tree);
+int key_tree_add(key_tree_t *tree, const uint8_t *identity, const uint8_t *fingerprint, const hal_uuid_t *uuid);
+// sort the keys and hash the tree. Call after the last key has been added
+int key_tree_build(key_tree_t *tree);
+void key_tree_free(key_tree_t *tree);
+
+// NULL when the node doesn't exist
+const uint8_t *key_tree_node(const key_tree_t *tree, unsigned int level, unsigned int index);
+const key_tree_entry_t *key_tree_bucket(const key_tree_t *tree, unsigned int index, unsigned int *count);
+
+#endif
@@ -0,0 +1,183 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hal.h>
+
+#include "bundle_reader.h"
+#include "cryptech_device.h"
+#include "device_pair.h"
+#include "replicate.h"
+#include "uuid_map.h"
+
+// Internal Functions --------------------------------------------------
+// the setup JSON is a small RSA public key
+#define REPLICATE_SETUP_JSON_MAX    (64 * 1024)
+
+// read the setup JSON that the destination sends with its length first
+static char *read_setup_json(int fd)
+{
+    uint32_t len;
+    if (device_pair_read(fd, &len, sizeof(len)) != HAL_OK || len == 0 || len > REPLICATE_SETUP_JSON_MAX) return NULL;
+
+    char *setup_json = malloc(len + 1);
+    if (setup_json == NULL) return NULL;
+
+    if (device_pair_read(fd, setup_json, len) != HAL_OK)
+    {
+        free(setup_json);
+        return NULL;
+    }
+    setup_json[len] = 0;
+
+    return setup_json;
+}
+
+// runs in the child process on the destination device. Sends the setup
+// JSON to the parent, then imports the bundle that comes back
+static int replicate_destination(uint32_t handle, int from_parent, int to_parent, void *context)
+{
+    const replicate_options_t *options = context;
+
+    char *setup_json = NULL;
+    int rval = setup_backup_destination(handle, options->device_index, &setup_json);
+    if (rval == HAL_OK)
+    {
+        uint32_t len = (uint32_t)strlen(setup_json);
+        if ((rval = device_pair_write(to_parent, &len, sizeof(len))) == HAL_OK)
+        {
+            rval = device_pair_write(to_parent, setup_json, len);
+        }
+    }
+    else
+    {
+        cryptech_report("Unable to get KEKEK.\r\nPlease check that the master key is correct.\r\n");
+    }
+    free(setup_json);
+    if (rval != HAL_OK) return rval;
+
+    // the pipe is closed by device_pair_start
+    FILE *fp = fdopen(dup(from_parent), "rb");
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    bundle_reader_t *bundle = bundle_reader_open_stream(fp, &rval);
+    if (bundle != NULL)
+    {
+        uuid_map_builder_t uuid_map;
+        uuid_map_builder_init(&uuid_map);
+
+        rval = import_keys(handle, bundle, NULL, NULL, &uuid_map);
+
+        // save whatever was imported, even after a failure
+        if (options->uuid_map_path != NULL && uuid_map.count > 0 &&
+            uuid_map_builder_save(&uuid_map, options->uuid_map_path) != 0)
+        {
+            cryptech_report("Unable to write the UUID map to '%s'.\r\n", options->uuid_map_path);
+        }
+
+        uuid_map_builder_free(&uuid_map);
+        bundle_reader_close(bundle);
+    }
+
+    fclose(fp);
+
+    return rval;
+}
+
+// exports the keys to the KEKEK from the destination's setup JSON
+static int replicate_source(const replicate_options_t *options, device_pair_t *pair)
+{
+    uint32_t handle = get_random_handle();
+
+    // log in while the destination makes the KEKEK
+    int rval = device_pair_connect(options->source_device, options->source_pin, handle);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("Unable to log into the source CrypTech device.\r\n");
+        return rval;
+    }
+
+    char *setup_json = read_setup_json(pair->from_child);
+
+    FILE *fp = (setup_json != NULL) ? fdopen(pair->to_child, "wb") : NULL;
+    if (fp == NULL)
+    {
+        cryptech_report("Unable to get the KEKEK from the destination CrypTech device.\r\n");
+        rval = HAL_ERROR_RPC_TRANSPORT;
+    }
+    else
+    {
+        // the file owns the pipe now
+        pair->to_child = -1;
+
+        export_options_t export_options;
+        memset(&export_options, 0, sizeof(export_options));
+        export_options.format = BUNDLE_FORMAT_BINARY;
+        export_options.filter = options->filter;
+        export_options.streaming = 1;
+
+        // closing the pipe ends the import. The export closes it after a failure
+        rval = cryptech_export_keys(handle, setup_json, &fp, &export_options);
+        if (rval == HAL_OK) fclose(fp);
+    }
+
+    free(setup_json);
+    close_cryptech_device(handle);
+
+    return rval;
+}
+
+// Function Implementations --------------------------------------------
+int cryptech_replicate(const replicate_options_t *options)
+{
+    if (options == NULL || options->source_pin == NULL || options->destination_pin == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    device_pair_t pair;
+    int rval = device_pair_start(&pair, options->destination_device, options->destination_pin,
+                                 replicate_destination, (void *)options);
+    if (rval != HAL_OK) return rval;
+
+#ifdef F_SETPIPE_SZ
+    // the pipe is the queue between the devices. The export waits when it's full
+    if (options->queue_size > 0) fcntl(pair.to_child, F_SETPIPE_SZ, (int)options->queue_size);
+#endif
+
+    rval = replicate_source(options, &pair);
+
+    return device_pair_finish(&pair, rval);
+}
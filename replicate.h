@@ -0,0 +1,72 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cryptech_device.h"
+
+// Copies the keys of one CrypTech device straight to another. The
+// destination makes a KEKEK, the source exports to it and the destination
+// imports the records as they arrive. Nothing is written to disk.
+typedef struct
+{
+    // the serial devices, like CRYPTECH_RPC_CLIENT_SERIAL_DEVICE. NULL uses
+    // the one in the environment
+    const char *source_device;
+    const char *destination_device;
+
+    // 'wheel' PINs
+    char *source_pin;
+    char *destination_pin;
+
+    // the destination's index for the setup JSON. -1 when there isn't one
+    int device_index;
+
+    // NULL copies every exportable key
+    const export_filter_t *filter;
+
+    // where to save the map from the source's key UUIDs to the
+    // destination's. NULL doesn't save one
+    const char *uuid_map_path;
+
+    // how many bytes of records can wait for the destination. 0 uses the
+    // system's pipe size
+    size_t queue_size;
+} replicate_options_t;
+
+// the RPC client only has one link, so the destination is run in a child
+// process. Call this before the device has been opened in this process
+int cryptech_replicate(const replicate_options_t *options);
+
+#endif
@@ -0,0 +1,381 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+#include <hal_internal.h>
+
+#include "rpc_mux.h"
+#include "rpc_socket.h"
+#include "serial.h"
+
+// tags are kept away from the handles of get_random_handle
+#define RPC_MUX_FIRST_TAG 0x80000001
+
+// a thread waiting for a response
+typedef struct rpc_mux_waiter_s
+{
+    uint32_t client;
+    uint32_t function;
+    uint8_t *packet;
+    size_t packet_len;
+    int done;
+    struct rpc_mux_waiter_s *next;
+} rpc_mux_waiter_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_mutex_t send_lock;
+    pthread_t reader;
+    unsigned int users;
+    int failed;                 // the link failed and nothing more can be read
+    rpc_mux_waiter_t *waiters;
+    uint32_t next_tag;
+} rpc_mux_t;
+
+// Internal Variables -----------------------------------------------------
+static rpc_mux_t mux = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                         0, 0, HAL_OK, NULL, RPC_MUX_FIRST_TAG };
+
+// the serial link of the process
+static serial_connection_t rpc_link = { .fd = -1 };
+
+// this thread's tag, and its request between hal_rpc_send and hal_rpc_recv
+static __thread uint32_t thread_tag = 0;
+static __thread rpc_mux_waiter_t thread_waiter;
+
+// the device this thread talks to, when it isn't the process's
+static __thread serial_connection_t *thread_link = NULL;
+
+hal_error_t dks_hal_rpc_client_transport_init(void);
+
+// Internal Functions ---------------------------------------------------
+// this thread's device, the socket of cryptech_muxd, or the serial port
+static hal_error_t link_send(const uint8_t * const buf, const size_t len)
+{
+    if (thread_link != NULL) return serial_connection_send_packet(thread_link, buf, len);
+    if (rpc_socket_is_open()) return rpc_socket_send(buf, len);
+
+    return serial_connection_send_packet(&rpc_link, buf, len);
+}
+
+static hal_error_t link_recv(uint8_t * const buf, size_t * const len, const size_t maxlen)
+{
+    if (thread_link != NULL) return serial_connection_recv_packet(thread_link, buf, len, maxlen);
+    if (rpc_socket_is_open()) return rpc_socket_recv(buf, len, maxlen);
+
+    return serial_connection_recv_packet(&rpc_link, buf, len, maxlen);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// call with the lock
+static rpc_mux_waiter_t *find_waiter(uint32_t client, uint32_t function)
+{
+    for (rpc_mux_waiter_t *waiter = mux.waiters; waiter != NULL; waiter = waiter->next)
+    {
+        if (waiter->client == client && waiter->function == function) return waiter;
+    }
+
+    return NULL;
+}
+
+// call with the lock
+static void remove_waiter(rpc_mux_waiter_t *waiter)
+{
+    for (rpc_mux_waiter_t **p = &mux.waiters; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == waiter)
+        {
+            *p = waiter->next;
+            break;
+        }
+    }
+}
+
+static void *reader_thread(void *arg)
+{
+    (void)arg;
+
+    uint8_t *packet = malloc(HAL_RPC_MAX_PKT_SIZE);
+    hal_error_t err = (packet == NULL) ? HAL_ERROR_ALLOCATION_FAILURE : HAL_OK;
+
+    while (err == HAL_OK)
+    {
+        // rpc_mux_stop cancels the thread while it waits here
+        size_t len = 0;
+        err = link_recv(packet, &len, HAL_RPC_MAX_PKT_SIZE);
+        if (err != HAL_OK) break;
+
+        // function and client handle
+        if (len < 8) continue;
+
+        int state;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        pthread_mutex_lock(&mux.lock);
+
+        // a response that nobody is waiting for is dropped, like libhal does
+        rpc_mux_waiter_t *waiter = find_waiter(get_u32(&packet[4]), get_u32(&packet[0]));
+        if (waiter != NULL && !waiter->done)
+        {
+            waiter->packet = malloc(len);
+            if (waiter->packet != NULL) memcpy(waiter->packet, packet, len);
+            waiter->packet_len = len;
+            waiter->done = 1;
+            pthread_cond_broadcast(&mux.changed);
+        }
+
+        pthread_mutex_unlock(&mux.lock);
+        pthread_setcancelstate(state, NULL);
+    }
+
+    // wake everybody, there won't be a response
+    pthread_mutex_lock(&mux.lock);
+    mux.failed = (err == HAL_OK) ? HAL_ERROR_RPC_TRANSPORT : err;
+    pthread_cond_broadcast(&mux.changed);
+    pthread_mutex_unlock(&mux.lock);
+
+    free(packet);
+    return NULL;
+}
+
+static hal_error_t mux_send(const uint8_t * const buf, const size_t len)
+{
+    if (len < 8 || len > HAL_RPC_MAX_PKT_SIZE) return HAL_ERROR_BAD_ARGUMENTS;
+
+    uint8_t *request = malloc(len);
+    if (request == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    memcpy(request, buf, len);
+
+    // RPCs without a client handle go out under this thread's tag
+    if (get_u32(&request[4]) == 0) put_u32(&request[4], thread_tag);
+
+    rpc_mux_waiter_t *waiter = &thread_waiter;
+    memset(waiter, 0, sizeof(*waiter));
+    waiter->function = get_u32(&request[0]);
+    waiter->client = get_u32(&request[4]);
+
+    pthread_mutex_lock(&mux.lock);
+
+    // the response couldn't be told apart from the other request's
+    while (mux.failed == HAL_OK && find_waiter(waiter->client, waiter->function) != NULL)
+    {
+        pthread_cond_wait(&mux.changed, &mux.lock);
+    }
+
+    hal_error_t err = mux.failed;
+    if (err == HAL_OK)
+    {
+        // waiting before the request is sent, so the response can't be missed
+        waiter->next = mux.waiters;
+        mux.waiters = waiter;
+    }
+
+    pthread_mutex_unlock(&mux.lock);
+
+    if (err == HAL_OK)
+    {
+        pthread_mutex_lock(&mux.send_lock);
+        err = link_send(request, len);
+        pthread_mutex_unlock(&mux.send_lock);
+
+        if (err != HAL_OK)
+        {
+            pthread_mutex_lock(&mux.lock);
+            remove_waiter(waiter);
+            pthread_cond_broadcast(&mux.changed);
+            pthread_mutex_unlock(&mux.lock);
+        }
+    }
+
+    free(request);
+    return err;
+}
+
+static hal_error_t mux_recv(uint8_t * const buf, size_t * const len)
+{
+    rpc_mux_waiter_t *waiter = &thread_waiter;
+
+    pthread_mutex_lock(&mux.lock);
+
+    if (find_waiter(waiter->client, waiter->function) != waiter)
+    {
+        // hal_rpc_send failed or wasn't called
+        pthread_mutex_unlock(&mux.lock);
+        return HAL_ERROR_RPC_TRANSPORT;
+    }
+
+    while (!waiter->done && mux.failed == HAL_OK)
+    {
+        pthread_cond_wait(&mux.changed, &mux.lock);
+    }
+
+    remove_waiter(waiter);
+    pthread_cond_broadcast(&mux.changed);
+    pthread_mutex_unlock(&mux.lock);
+
+    hal_error_t err = HAL_OK;
+    if (!waiter->done) err = mux.failed;
+    else if (waiter->packet == NULL) err = HAL_ERROR_ALLOCATION_FAILURE;
+    else if (waiter->packet_len > *len) err = HAL_ERROR_RPC_PACKET_OVERFLOW;
+    else
+    {
+        memcpy(buf, waiter->packet, waiter->packet_len);
+        *len = waiter->packet_len;
+    }
+
+    free(waiter->packet);
+    waiter->packet = NULL;
+
+    return err;
+}
+
+// Function Implementations ---------------------------------------------
+int rpc_mux_start(void)
+{
+    // cryptech_muxd puts its own client handle on every request, so the
+    // responses can't be told apart here
+    if (rpc_socket_is_open()) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    // the reader thread only reads the process's link
+    if (thread_link != NULL) return HAL_ERROR_NOT_IMPLEMENTED;
+
+    pthread_mutex_lock(&mux.lock);
+
+    int rval = HAL_OK;
+    if (mux.users == 0)
+    {
+        mux.failed = HAL_OK;
+        if (pthread_create(&mux.reader, NULL, reader_thread, NULL) != 0) rval = HAL_ERROR_ALLOCATION_FAILURE;
+    }
+    if (rval == HAL_OK) ++mux.users;
+
+    pthread_mutex_unlock(&mux.lock);
+
+    return rval;
+}
+
+void rpc_mux_stop(void)
+{
+    pthread_mutex_lock(&mux.lock);
+
+    int last = (mux.users == 1);
+    if (mux.users > 0) --mux.users;
+
+    pthread_mutex_unlock(&mux.lock);
+
+    if (last)
+    {
+        pthread_cancel(mux.reader);
+        pthread_join(mux.reader, NULL);
+    }
+}
+
+int rpc_mux_running(void)
+{
+    pthread_mutex_lock(&mux.lock);
+    int running = (mux.users > 0);
+    pthread_mutex_unlock(&mux.lock);
+
+    return running;
+}
+
+hal_error_t rpc_mux_open_serial(const char *device, uint32_t speed)
+{
+    if (serial_connection_is_open(&rpc_link)) return HAL_OK;
+
+    return serial_connection_open(&rpc_link, device, speed);
+}
+
+void rpc_mux_use_link(serial_connection_t *link)
+{
+    thread_link = link;
+}
+
+serial_connection_t *rpc_mux_get_link(void)
+{
+    return thread_link;
+}
+
+uint32_t rpc_mux_attach(void)
+{
+    pthread_mutex_lock(&mux.lock);
+    thread_tag = mux.next_tag++;
+    if (mux.next_tag == 0) mux.next_tag = RPC_MUX_FIRST_TAG;
+    pthread_mutex_unlock(&mux.lock);
+
+    return thread_tag;
+}
+
+// libhal's transport -------------------------------------------------------
+hal_error_t hal_rpc_client_transport_init(void)
+{
+    return dks_hal_rpc_client_transport_init();
+}
+
+hal_error_t hal_rpc_client_transport_close(void)
+{
+    if (thread_link != NULL) return serial_connection_close(thread_link);
+    if (rpc_socket_is_open()) return rpc_socket_close();
+
+    return serial_connection_close(&rpc_link);
+}
+
+hal_error_t hal_rpc_send(const uint8_t * const buf, const size_t len)
+{
+    if (thread_link == NULL && rpc_mux_running()) return mux_send(buf, len);
+
+    return link_send(buf, len);
+}
+
+hal_error_t hal_rpc_recv(uint8_t * const buf, size_t * const len)
+{
+    if (thread_link == NULL && rpc_mux_running()) return mux_recv(buf, len);
+
+    const size_t max = *len;
+    *len = 0;
+    return link_recv(buf, len, max);
+}
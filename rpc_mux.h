@@ -0,0 +1,77 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef RPC_MUX_H
+#define RPC_MUX_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+#include "serial.h"
+
+// Lets several threads share the one RPC link to the device without taking
+// turns. This replaces libhal's serial transport (hal_rpc_send and
+// hal_rpc_recv). Until rpc_mux_start is called, the link is used directly
+// and only one thread may talk to the device.
+//
+// While the multiplexer runs, a reader thread takes the responses off the
+// link and hands each one to the thread waiting for its client handle and
+// function. RPCs on a key, hash or other handle don't carry a client handle,
+// so they're sent under the calling thread's tag from rpc_mux_attach. The
+// device doesn't look at the client handle of those. Two requests that
+// would get the same client handle and function wait for each other.
+
+// the link must be open. Starting it again only counts the callers. A link
+// through cryptech_muxd can't be multiplexed; see rpc_socket.h. Neither can
+// a thread's own link
+int rpc_mux_start(void);
+
+// every rpc_mux_start has a stop. The last one waits for the reader thread.
+// No requests may be waiting
+void rpc_mux_stop(void);
+
+int rpc_mux_running(void);
+
+// give this thread its own tag. Returns the tag
+uint32_t rpc_mux_attach(void);
+
+// open the process's serial link. dks_hal_rpc_client_transport_init calls this
+hal_error_t rpc_mux_open_serial(const char *device, uint32_t speed);
+
+// this thread talks to another device on its own link, until it's called
+// with NULL. Closing the RPC client on this thread closes the link. The
+// multiplexer only runs on the process's link
+void rpc_mux_use_link(serial_connection_t *link);
+
+// the link set by rpc_mux_use_link, or NULL
+serial_connection_t *rpc_mux_get_link(void);
+
+#endif
@@ -0,0 +1,155 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <hal.h>
+
+#include "rpc_socket.h"
+#include "slip_packet.h"
+
+#define RPC_SOCKET_BUFFER_SIZE 4096
+
+// Internal Variables -----------------------------------------------------
+static int socket_fd = -1;
+
+// bytes read from the socket that haven't been decoded
+static uint8_t read_buffer[RPC_SOCKET_BUFFER_SIZE];
+static size_t read_pos = 0;
+static size_t read_len = 0;
+
+// Internal Functions ---------------------------------------------------
+static hal_error_t write_all(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(socket_fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return HAL_ERROR_IO_OS_ERROR;
+
+        data += written;
+        len -= written;
+    }
+
+    return HAL_OK;
+}
+
+// slip_packet_decode reads from the socket's buffer
+static hal_error_t read_byte(void *context, uint8_t *c)
+{
+    (void)context;
+
+    while (read_pos == read_len)
+    {
+        ssize_t count = read(socket_fd, read_buffer, sizeof(read_buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return HAL_ERROR_IO_OS_ERROR;
+
+        // the daemon went away
+        if (count == 0) return HAL_ERROR_RPC_TRANSPORT;
+
+        read_pos = 0;
+        read_len = count;
+    }
+
+    *c = read_buffer[read_pos++];
+    return HAL_OK;
+}
+
+// Function Implementations ---------------------------------------------
+hal_error_t rpc_socket_open(const char *path)
+{
+    if (path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (socket_fd >= 0) return HAL_OK;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return HAL_ERROR_BAD_ARGUMENTS;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return HAL_ERROR_IO_SETUP_FAILED;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return HAL_ERROR_IO_SETUP_FAILED;
+    }
+
+    socket_fd = fd;
+    read_pos = read_len = 0;
+
+    return HAL_OK;
+}
+
+hal_error_t rpc_socket_close(void)
+{
+    if (socket_fd < 0) return HAL_OK;
+
+    int rval = close(socket_fd);
+    socket_fd = -1;
+    read_pos = read_len = 0;
+
+    return (rval == 0) ? HAL_OK : HAL_ERROR_IO_OS_ERROR;
+}
+
+int rpc_socket_is_open(void)
+{
+    return socket_fd >= 0;
+}
+
+hal_error_t rpc_socket_send(const uint8_t * const buf, const size_t len)
+{
+    if (socket_fd < 0) return HAL_ERROR_RPC_TRANSPORT;
+
+    uint8_t *packet;
+    size_t packet_len;
+    hal_error_t err = slip_packet_encode(buf, len, &packet, &packet_len);
+    if (err != HAL_OK) return err;
+
+    // the daemon reads a whole packet at a time
+    err = write_all(packet, packet_len);
+    free(packet);
+
+    return err;
+}
+
+hal_error_t rpc_socket_recv(uint8_t * const buf, size_t * const len, const size_t maxlen)
+{
+    if (socket_fd < 0) return HAL_ERROR_RPC_TRANSPORT;
+
+    return slip_packet_decode(read_byte, NULL, buf, len, maxlen);
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef RPC_SOCKET_H
+#define RPC_SOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hal.h>
+
+// The RPC link can go through CrypTech's mux daemon (cryptech_muxd) instead
+// of opening the serial port. The daemon shares the device with its other
+// clients. When this is set, dks_hal_rpc_client_transport_init connects to
+// the daemon's socket. It's the same setting as CrypTech's Python client
+#define RPC_SOCKET_ENVVAR "CRYPTECH_RPC_CLIENT_SOCKET_NAME"
+
+// The packets are SLIP framed, like on the serial port. The daemon gives
+// each connection its own client handle, so a login belongs to the
+// connection
+hal_error_t rpc_socket_open(const char *path);
+hal_error_t rpc_socket_close(void);
+int rpc_socket_is_open(void);
+
+hal_error_t rpc_socket_send(const uint8_t * const buf, const size_t len);
+hal_error_t rpc_socket_recv(uint8_t * const buf, size_t * const len, const size_t maxlen);
+
+#endif
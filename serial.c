@@ -30,32 +30,254 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 
-// This defines a simple serial interface. For Mac and Linux builds,
-// we can just use the rpc_serial implementation given by HAL. We
-// can't use it directly because it acts as a singleton for all serial
-// connections to an HSM, and we use it as a secondary connection
-// to a CrypTech device
+// A serial interface that can be opened more than once. libhal's
+// rpc_serial acts as a singleton for all serial connections to an HSM.
+// We need a secondary connection to the CTY, and one RPC link for each
+// device a process talks to.
 
-#define fd serial_fd
-#define hal_serial_init serial_init
-#define hal_serial_close serial_close
-#define hal_serial_send_char serial_send_char
-#define hal_serial_recv_char _serial_recv_char_
-#define hal_serial_get_fd serial_get_fd
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include <rpc_serial.c>
+#include "cryptech_device.h"
+#include "serial.h"
+#include "slip_packet.h"
+
+// Internal Variables -----------------------------------------------------
+static serial_connection_t cty_connection = { .fd = -1 };
+
+// Internal Functions ---------------------------------------------------
+static int speed_to_termios(uint32_t speed, speed_t *termios_speed)
+{
+    switch (speed)
+    {
+        case 9600: *termios_speed = B9600; break;
+        case 19200: *termios_speed = B19200; break;
+        case 38400: *termios_speed = B38400; break;
+        case 57600: *termios_speed = B57600; break;
+        case 115200: *termios_speed = B115200; break;
+        case 230400: *termios_speed = B230400; break;
+        case 460800: *termios_speed = B460800; break;
+        case 921600: *termios_speed = B921600; break;
+        default: return 0;
+    }
+
+    return 1;
+}
+
+// slip_packet_decode reads from the connection's buffer
+static hal_error_t read_connection_byte(void *context, uint8_t *c)
+{
+    return serial_connection_recv_char((serial_connection_t *)context, c);
+}
+
+// Function Implementations ---------------------------------------------
+void serial_connection_init(serial_connection_t *conn)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+}
+
+hal_error_t serial_connection_open(serial_connection_t *conn, const char *device, uint32_t speed)
+{
+    if (conn == NULL || device == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    speed_t termios_speed;
+    if (!speed_to_termios(speed, &termios_speed))
+    {
+        cryptech_report("Invalid line speed %lu\r\n", (unsigned long)speed);
+        return HAL_ERROR_IO_SETUP_FAILED;
+    }
+
+    time_t deadline = conn->deadline;
+    serial_connection_init(conn);
+    conn->deadline = deadline;
+
+    int fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
+    if (fd == -1)
+    {
+        cryptech_report("Unable to open '%s': %s\r\n", device, strerror(errno));
+        return HAL_ERROR_IO_SETUP_FAILED;
+    }
+
+    struct termios tty;
+    if (tcgetattr(fd, &conn->saved) != 0 || tcgetattr(fd, &tty) != 0)
+    {
+        close(fd);
+        return HAL_ERROR_IO_SETUP_FAILED;
+    }
+
+    cfsetospeed(&tty, termios_speed);
+    cfsetispeed(&tty, termios_speed);
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+    {
+        close(fd);
+        return HAL_ERROR_IO_SETUP_FAILED;
+    }
+
+    conn->fd = fd;
+    conn->speed = speed;
+
+    return HAL_OK;
+}
+
+hal_error_t serial_connection_close(serial_connection_t *conn)
+{
+    if (conn == NULL || conn->fd < 0) return HAL_OK;
+
+    tcsetattr(conn->fd, TCSANOW, &conn->saved);
+    int rval = close(conn->fd);
+    conn->fd = -1;
+    conn->read_pos = conn->read_len = 0;
+
+    return (rval == 0) ? HAL_OK : HAL_ERROR_IO_OS_ERROR;
+}
+
+int serial_connection_is_open(const serial_connection_t *conn)
+{
+    return conn != NULL && conn->fd >= 0;
+}
+
+hal_error_t serial_connection_set_timeout(serial_connection_t *conn, uint8_t deciseconds)
+{
+    if (conn == NULL || conn->fd < 0) return HAL_ERROR_BAD_ARGUMENTS;
+
+    struct termios tty;
+    if (tcgetattr(conn->fd, &tty) < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    tty.c_cc[VMIN] = (deciseconds == 0) ? 1 : 0;
+    tty.c_cc[VTIME] = deciseconds;
+
+    if (tcsetattr(conn->fd, TCSANOW, &tty) < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    return HAL_OK;
+}
+
+void serial_connection_set_deadline(serial_connection_t *conn, time_t deadline)
+{
+    if (conn != NULL) conn->deadline = deadline;
+}
+
+hal_error_t serial_connection_send(serial_connection_t *conn, const uint8_t *data, size_t len)
+{
+    if (conn == NULL || conn->fd < 0) return HAL_ERROR_IO_SETUP_FAILED;
+
+    while (len > 0)
+    {
+        ssize_t written = write(conn->fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return HAL_ERROR_IO_OS_ERROR;
+
+        conn->stats.bytes_sent += written;
+        data += written;
+        len -= written;
+    }
+
+    return HAL_OK;
+}
+
+hal_error_t serial_connection_send_char(serial_connection_t *conn, const uint8_t c)
+{
+    return serial_connection_send(conn, &c, 1);
+}
+
+hal_error_t serial_connection_recv_char(serial_connection_t *conn, uint8_t * const c)
+{
+    if (conn == NULL || conn->fd < 0) return HAL_ERROR_IO_SETUP_FAILED;
+
+    while (conn->read_pos == conn->read_len)
+    {
+        if (conn->deadline != 0)
+        {
+            time_t remaining = conn->deadline - time(NULL);
+            if (remaining > 3600) remaining = 3600;     // poll again after an hour
+            struct pollfd pfd = { conn->fd, POLLIN, 0 };
+
+            int ready = (remaining > 0) ? poll(&pfd, 1, (int)remaining * 1000) : 0;
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0) return HAL_ERROR_IO_OS_ERROR;
+            if (ready == 0 && remaining == 3600) continue;
+            if (ready == 0)
+            {
+                ++conn->stats.timeouts;
+                return HAL_ERROR_IO_TIMEOUT;
+            }
+        }
+
+        ssize_t count = read(conn->fd, conn->read_buffer, sizeof(conn->read_buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return HAL_ERROR_IO_OS_ERROR;
+
+        // only a read with a timeout comes back empty
+        if (count == 0)
+        {
+            ++conn->stats.timeouts;
+            return HAL_ERROR_IO_TIMEOUT;
+        }
+
+        conn->stats.bytes_received += count;
+        conn->read_pos = 0;
+        conn->read_len = count;
+    }
+
+    *c = conn->read_buffer[conn->read_pos++];
+    return HAL_OK;
+}
+
+hal_error_t serial_connection_send_packet(serial_connection_t *conn, const uint8_t *buf, size_t len)
+{
+    uint8_t *packet;
+    size_t packet_len;
+    hal_error_t err = slip_packet_encode(buf, len, &packet, &packet_len);
+    if (err != HAL_OK) return err;
+
+    // one write instead of one for each byte
+    err = serial_connection_send(conn, packet, packet_len);
+    if (err == HAL_OK) ++conn->stats.packets_sent;
+
+    free(packet);
+    return err;
+}
+
+hal_error_t serial_connection_recv_packet(serial_connection_t *conn, uint8_t *buf, size_t *len, size_t maxlen)
+{
+    hal_error_t err = slip_packet_decode(read_connection_byte, conn, buf, len, maxlen);
+    if (err == HAL_OK || err == HAL_ERROR_RPC_PACKET_OVERFLOW) ++conn->stats.packets_received;
+
+    return err;
+}
+
+hal_error_t serial_init(const char * const device, const uint32_t speed)
+{
+    return serial_connection_open(&cty_connection, device, speed);
+}
+
+hal_error_t serial_close(void)
+{
+    return serial_connection_close(&cty_connection);
+}
+
+hal_error_t serial_send_char(const uint8_t c)
+{
+    return serial_connection_send_char(&cty_connection, c);
+}
 
 hal_error_t serial_recv_char(uint8_t * const c)
 {
     // we allow timing out
-    if (read(fd, c, 1) != 1)
-	    return HAL_ERROR_IO_TIMEOUT;
-    return HAL_OK;
+    return serial_connection_recv_char(&cty_connection, c);
 }
 
-#undef fd
-#undef hal_serial_init
-#undef hal_serial_close
-#undef hal_serial_send_char
-#undef hal_serial_recv_char
-#undef hal_serial_get_fd
+int serial_get_fd(void)
+{
+    return cty_connection.fd;
+}
@@ -34,8 +34,64 @@
 #ifndef SERIAL_H_DIAMONDKEY
 #define SERIAL_H_DIAMONDKEY
 
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+
 #include <hal.h>
 
+#define SERIAL_READ_BUFFER_SIZE 1024
+
+typedef struct
+{
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t timeouts;
+} serial_stats_t;
+
+// One serial connection to a CrypTech device. A process can open as many
+// as it has devices. Each one is used by one thread at a time
+typedef struct
+{
+    int fd;
+    uint32_t speed;
+    struct termios saved;       // put back when it's closed
+    uint8_t read_buffer[SERIAL_READ_BUFFER_SIZE];
+    size_t read_pos;
+    size_t read_len;
+    time_t deadline;            // 0 for none. See serial_connection_set_deadline
+    serial_stats_t stats;
+} serial_connection_t;
+
+void serial_connection_init(serial_connection_t *conn);
+
+// opens the port raw, with reads that wait for data. A deadline set after
+// serial_connection_init is kept
+hal_error_t serial_connection_open(serial_connection_t *conn, const char *device, uint32_t speed);
+hal_error_t serial_connection_close(serial_connection_t *conn);
+int serial_connection_is_open(const serial_connection_t *conn);
+
+// 0 waits for data. Otherwise a read that gets nothing for this many tenths
+// of a second times out
+hal_error_t serial_connection_set_timeout(serial_connection_t *conn, uint8_t deciseconds);
+
+// every read after this time (from time()) times out, however long the
+// device keeps the line busy. 0 removes the deadline
+void serial_connection_set_deadline(serial_connection_t *conn, time_t deadline);
+
+hal_error_t serial_connection_send(serial_connection_t *conn, const uint8_t *data, size_t len);
+hal_error_t serial_connection_send_char(serial_connection_t *conn, const uint8_t c);
+// HAL_ERROR_IO_TIMEOUT when nothing came in time
+hal_error_t serial_connection_recv_char(serial_connection_t *conn, uint8_t * const c);
+
+// one SLIP framed RPC packet, like libhal's hal_slip_send and hal_slip_recv
+hal_error_t serial_connection_send_packet(serial_connection_t *conn, const uint8_t *buf, size_t len);
+hal_error_t serial_connection_recv_packet(serial_connection_t *conn, uint8_t *buf, size_t *len, size_t maxlen);
+
+// The connection to the CTY. See cryptech_device_cty.h
 hal_error_t serial_init(const char * const device, const uint32_t speed);
 
 hal_error_t serial_close(void);
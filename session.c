@@ -0,0 +1,213 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// struct ucred
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <hal.h>
+
+#include "device_pair.h"
+#include "session.h"
+
+// Internal Functions ---------------------------------------------------
+static int set_socket_path(struct sockaddr_un *address, const char *path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (path == NULL || strlen(path) >= sizeof(address->sun_path)) return HAL_ERROR_BAD_ARGUMENTS;
+    strcpy(address->sun_path, path);
+
+    return HAL_OK;
+}
+
+static int write_u32(int fd, uint32_t value)
+{
+    uint32_t n = htonl(value);
+    return device_pair_write(fd, &n, sizeof(n));
+}
+
+static int read_u32(int fd, uint32_t *value)
+{
+    uint32_t n;
+    int rval = device_pair_read(fd, &n, sizeof(n));
+    if (rval == HAL_OK) *value = ntohl(n);
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+int session_send(int fd, uint32_t code, const char * const *fields, const uint32_t *lengths, unsigned int fields_len)
+{
+    if (fields_len > SESSION_FIELDS_MAX) return HAL_ERROR_BAD_ARGUMENTS;
+
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < fields_len; ++i) total += lengths[i];
+    if (total > SESSION_MESSAGE_MAX) return HAL_ERROR_RESULT_TOO_LONG;
+
+    int rval = write_u32(fd, code);
+    if (rval == HAL_OK) rval = write_u32(fd, fields_len);
+
+    for (unsigned int i = 0; i < fields_len && rval == HAL_OK; ++i)
+    {
+        rval = write_u32(fd, lengths[i]);
+        if (rval == HAL_OK && lengths[i] > 0) rval = device_pair_write(fd, fields[i], lengths[i]);
+    }
+
+    return rval;
+}
+
+int session_receive(int fd, session_message_t *message)
+{
+    memset(message, 0, sizeof(*message));
+
+    uint32_t fields_len;
+    int rval = read_u32(fd, &message->code);
+    if (rval == HAL_OK) rval = read_u32(fd, &fields_len);
+    if (rval != HAL_OK) return rval;
+
+    if (fields_len > SESSION_FIELDS_MAX) return HAL_ERROR_RPC_PROTOCOL_ERROR;
+
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < fields_len; ++i)
+    {
+        uint32_t length;
+        rval = read_u32(fd, &length);
+        if (rval != HAL_OK) break;
+
+        total += length;
+        if (total > SESSION_MESSAGE_MAX)
+        {
+            rval = HAL_ERROR_RPC_PACKET_OVERFLOW;
+            break;
+        }
+
+        char *field = malloc(length + 1);
+        if (field == NULL)
+        {
+            rval = HAL_ERROR_ALLOCATION_FAILURE;
+            break;
+        }
+
+        message->fields[i] = field;
+        message->lengths[i] = length;
+        message->fields_len = i + 1;
+
+        if (length > 0) rval = device_pair_read(fd, field, length);
+        if (rval != HAL_OK) break;
+        field[length] = 0;
+    }
+
+    if (rval != HAL_OK) session_message_free(message);
+    return rval;
+}
+
+void session_message_free(session_message_t *message)
+{
+    if (message == NULL) return;
+
+    for (unsigned int i = 0; i < message->fields_len; ++i) free(message->fields[i]);
+    memset(message, 0, sizeof(*message));
+}
+
+int session_connect(const char *path)
+{
+    struct sockaddr_un address;
+    if (set_socket_path(&address, path) != HAL_OK) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int session_listen(const char *path)
+{
+    struct sockaddr_un address;
+    if (set_socket_path(&address, path) != HAL_OK) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // only remove what an earlier daemon left behind. A socket that still
+    // accepts connections belongs to a daemon that's running
+    struct stat st;
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode) ||
+            connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 ||
+            errno != ECONNREFUSED ||
+            unlink(path) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // the socket is created with no access for anyone else
+    mode_t old_mask = umask(0177);
+    int rval = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_mask);
+
+    if (rval != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(fd, 8) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int session_peer_allowed(int fd)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) return 0;
+    if (length != sizeof(credentials)) return 0;
+
+    return credentials.uid == geteuid();
+}
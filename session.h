@@ -0,0 +1,86 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+// The socket of dks_sessiond, when it isn't given with -s
+#define SESSION_SOCKET_ENVVAR "DKS_SESSION_SOCKET"
+
+#define SESSION_FIELDS_MAX 8
+// a message can't be bigger than this. Exports are written to a file by
+// the daemon instead of being sent back
+#define SESSION_MESSAGE_MAX (1024 * 1024)
+
+// Requests to dks_sessiond. The reply's code is a hal_error_t
+typedef enum
+{
+    // reply: the key list, as cryptech_list_keys shows it
+    SESSION_OP_LIST = 1,
+    // reply: the setup JSON of a KEKEK
+    SESSION_OP_SETUP = 2,
+    // request: setup JSON, "json" or "binary", output path, key index path,
+    // previous export path. The paths must be absolute, and the last two
+    // may be empty. reply: nothing
+    SESSION_OP_EXPORT = 3,
+    // reply: nothing. Checks that the daemon is still logged in
+    SESSION_OP_PING = 4
+} session_op_t;
+
+// A request or a reply. Every field is a string of bytes, with a 0 added
+// after it on this side so text can be used as it is.
+//
+// On the socket: code, field count, then the length and bytes of each
+// field. The numbers are 32 bits in network order
+typedef struct
+{
+    uint32_t code;
+    unsigned int fields_len;
+    char *fields[SESSION_FIELDS_MAX];
+    uint32_t lengths[SESSION_FIELDS_MAX];
+} session_message_t;
+
+int session_send(int fd, uint32_t code, const char * const *fields, const uint32_t *lengths, unsigned int fields_len);
+int session_receive(int fd, session_message_t *message);
+void session_message_free(session_message_t *message);
+
+// connect to a daemon. Returns the socket, or -1
+int session_connect(const char *path);
+
+// listen on a socket that only this user can connect to. A socket that
+// was left behind at path is replaced. Returns the socket, or -1
+int session_listen(const char *path);
+
+// the connected process runs as this user
+int session_peer_allowed(int fd);
+
+#endif
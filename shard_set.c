@@ -0,0 +1,463 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include "djson.h"
+
+#include "cryptech_device.h"
+#include "dks_json.h"
+#include "shard_set.h"
+
+#define dks_json_throw(a) { rval = a; goto finished; }
+
+#define dks_json_check(a) { result = (a); if (result != DJSON_OK) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS); }
+
+// Internal Functions ---------------------------------------------------
+static int digest_file(const char *path, uint64_t *size, uint8_t *digest)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    uint8_t *buffer = malloc(64 * 1024);
+    if (buffer == NULL)
+    {
+        fclose(fp);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    *size = 0;
+
+    size_t read;
+    while ((read = fread(buffer, 1, 64 * 1024, fp)) > 0)
+    {
+        SHA256_Update(&ctx, buffer, read);
+        *size += read;
+    }
+
+    int rval = ferror(fp) ? HAL_ERROR_IO_OS_ERROR : HAL_OK;
+    SHA256_Final(digest, &ctx);
+
+    free(buffer);
+    fclose(fp);
+
+    return rval;
+}
+
+static shard_set_entry_t *add_entry(shard_set_t *set)
+{
+    if (set->count == set->capacity)
+    {
+        unsigned int capacity = (set->capacity == 0) ? 64 : set->capacity * 2;
+        shard_set_entry_t *shards = realloc(set->shards, capacity * sizeof(shard_set_entry_t));
+        if (shards == NULL) return NULL;
+
+        set->shards = shards;
+        set->capacity = capacity;
+    }
+
+    shard_set_entry_t *entry = &set->shards[set->count++];
+    memset(entry, 0, sizeof(shard_set_entry_t));
+
+    return entry;
+}
+
+static int parse_shard(shard_set_t *set, diamond_json_ptr_t *json_ptr, const char *folder, size_t folder_len)
+{
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    int has_digest = 0;
+
+    shard_set_entry_t *entry = add_entry(set);
+    if (entry == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    diamond_json_type_t json_type;
+    dks_json_check(djson_goto_next_element(json_ptr));
+    dks_json_check(djson_get_type_current(json_ptr, &json_type));
+
+    while (json_type != DJSON_TYPE_ObjectEnd)
+    {
+        char *name;
+        dks_json_check(djson_get_name_current(json_ptr, &name));
+
+        if (strcmp(name, "path") == 0 && json_type == DJSON_TYPE_String && entry->path == NULL)
+        {
+            char *path;
+            dks_json_check(djson_get_string_value_current(json_ptr, &path));
+
+            // relative to the manifest
+            if (path[0] == '/') folder_len = 0;
+
+            entry->path = malloc(folder_len + strlen(path) + 1);
+            if (entry->path == NULL) dks_json_throw(HAL_ERROR_ALLOCATION_FAILURE);
+
+            memcpy(entry->path, folder, folder_len);
+            strcpy(&entry->path[folder_len], path);
+        }
+        else if (strcmp(name, "keys") == 0 && json_type == DJSON_TYPE_Primitive)
+        {
+            int keys;
+            dks_json_check(djson_get_integer_primitive_current(json_ptr, &keys));
+            if (keys < 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+            entry->keys = (uint32_t)keys;
+        }
+        else if (strcmp(name, "size") == 0 && json_type == DJSON_TYPE_String)
+        {
+            // a string because shards can be bigger than a JSON integer here
+            char *size, *end;
+            dks_json_check(djson_get_string_value_current(json_ptr, &size));
+            entry->size = strtoull(size, &end, 10);
+            if (end == size || *end != 0) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+        else if (strcmp(name, "sha256") == 0 && json_type == DJSON_TYPE_String)
+        {
+            char *digest;
+            dks_json_check(djson_get_string_value_current(json_ptr, &digest));
+            has_digest = string_to_fingerprint(digest, entry->digest);
+        }
+        else if (strcmp(name, "comment") == 0 && json_type == DJSON_TYPE_String) { }
+        else
+        {
+            dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+        }
+
+        dks_json_check(djson_pass(json_ptr));
+
+        dks_json_check(djson_get_type_current(json_ptr, &json_type));
+    }
+
+    if (entry->path == NULL || !has_digest) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+finished:
+    return rval;
+}
+
+static int open_shard(shard_writer_t *writer)
+{
+    size_t len = strlen(writer->base_path) + 16;
+
+    writer->path = malloc(len);
+    if (writer->path == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    snprintf(writer->path, len, "%s.%03u", writer->base_path, writer->set.count);
+
+    writer->fp = fopen(writer->path, (writer->format == BUNDLE_FORMAT_BINARY) ? "wb" : "wt");
+    if (writer->fp == NULL)
+    {
+        cryptech_report("\r\nUnable to open shard file, '%s'.\r\n", writer->path);
+        return HAL_ERROR_IO_OS_ERROR;
+    }
+
+    writer->keys = 0;
+    memset(&writer->writer, 0, sizeof(writer->writer));
+
+    return bundle_writer_start(&writer->writer, writer->format, writer->fp, writer->header, writer->setup_json);
+}
+
+static int close_shard(shard_writer_t *writer)
+{
+    int rval = bundle_writer_finish(&writer->writer);
+
+    if (rval == HAL_OK && writer->save_indexes)
+    {
+        size_t len = strlen(writer->path) + 5;
+        char *index_path = malloc(len);
+
+        if (index_path == NULL) rval = HAL_ERROR_ALLOCATION_FAILURE;
+        else
+        {
+            snprintf(index_path, len, "%s.idx", writer->path);
+            rval = bundle_writer_save_index(&writer->writer, index_path);
+            free(index_path);
+        }
+    }
+
+    bundle_writer_free(&writer->writer);
+
+    if (fclose(writer->fp) != 0 && rval == HAL_OK) rval = HAL_ERROR_IO_OS_ERROR;
+    writer->fp = NULL;
+
+    // the digest is taken from the file as it is on disk
+    if (rval == HAL_OK) rval = shard_set_add(&writer->set, writer->path, writer->keys);
+
+    if (rval == HAL_OK) cryptech_report("Shard '%s' written with %u keys.\r\n", writer->path, writer->keys);
+
+    free(writer->path);
+    writer->path = NULL;
+
+    return rval;
+}
+
+// Function Implementations ---------------------------------------------
+void shard_set_init(shard_set_t *set)
+{
+    memset(set, 0, sizeof(shard_set_t));
+}
+
+void shard_set_free(shard_set_t *set)
+{
+    if (set == NULL) return;
+
+    for (unsigned int i = 0; i < set->count; ++i)
+    {
+        free(set->shards[i].path);
+    }
+    free(set->shards);
+
+    shard_set_init(set);
+}
+
+int shard_set_add(shard_set_t *set, const char *path, uint32_t keys)
+{
+    if (set == NULL || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    uint64_t size;
+    uint8_t digest[SHARD_SET_DIGEST_LEN];
+
+    int rval = digest_file(path, &size, digest);
+    if (rval != HAL_OK) return rval;
+
+    char *path_copy = strdup(path);
+    if (path_copy == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    shard_set_entry_t *entry = add_entry(set);
+    if (entry == NULL)
+    {
+        free(path_copy);
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    entry->path = path_copy;
+    entry->keys = keys;
+    entry->size = size;
+    memcpy(entry->digest, digest, SHARD_SET_DIGEST_LEN);
+
+    return HAL_OK;
+}
+
+int shard_set_save(const shard_set_t *set, FILE *fp)
+{
+    if (set == NULL || fp == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    char uuid_buffer[40];
+    char digest_buffer[KEY_FINGERPRINT_STRING_LEN];
+
+    fprintf(fp, "{\r\n    \"shard_set\": 1,\r\n");
+    fprintf(fp, "    \"comment\": \"Diamond Key Security export shards. Every shard can be imported on its own.\",\r\n");
+    fprintf(fp, "    \"kekek_uuid\": \"%s\",\r\n", uuid_to_string(set->kekek_uuid, uuid_buffer));
+    fprintf(fp, "    \"format\": \"%s\",\r\n", (set->format == BUNDLE_FORMAT_BINARY) ? "binary" : "json");
+    fprintf(fp, "    \"shards\": [");
+
+    for (unsigned int i = 0; i < set->count; ++i)
+    {
+        const shard_set_entry_t *entry = &set->shards[i];
+
+        // the shards are next to the manifest
+        const char *name = strrchr(entry->path, '/');
+        name = (name != NULL) ? name + 1 : entry->path;
+
+        fprintf(fp, "%s\r\n        { \"path\": ", (i > 0) ? "," : "");
+        dks_json_write_string(fp, name);
+        fprintf(fp, ", \"keys\": %u, \"size\": \"%llu\", \"sha256\": \"%s\" }",
+                entry->keys, (unsigned long long)entry->size, fingerprint_to_string(entry->digest, digest_buffer));
+    }
+
+    fprintf(fp, "\r\n    ]\r\n}\r\n");
+
+    return ferror(fp) ? HAL_ERROR_IO_OS_ERROR : HAL_OK;
+}
+
+int shard_set_is_manifest(const char *path)
+{
+    return dks_json_file_has_member(path, "shard_set");
+}
+
+int shard_set_load(const char *path, shard_set_t *set)
+{
+    if (path == NULL || set == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    shard_set_init(set);
+
+    char *json = djson_loadfile(path);
+    if (json == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    if (!dks_json_has_member(json, "shard_set"))
+    {
+        free(json);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    int rval = HAL_OK;
+    diamond_json_error_t result;
+    diamond_json_node_t pool[8];
+    diamond_json_ptr_t json_ptr;
+
+    char buffer[40], *json_search_ptr = json;
+    char *kekek_uuid_s = djson_find_element("kekek_uuid", buffer, sizeof(buffer), &json_search_ptr);
+    if (kekek_uuid_s == NULL) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    set->kekek_uuid = string_to_uuid(kekek_uuid_s);
+
+    json_search_ptr = json;
+    char *format_s = djson_find_element("format", buffer, sizeof(buffer), &json_search_ptr);
+    if (format_s == NULL) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+    set->format = (strcmp(format_s, "binary") == 0) ? BUNDLE_FORMAT_BINARY : BUNDLE_FORMAT_JSON;
+
+    // the shards are next to the manifest
+    const char *folder_end = strrchr(path, '/');
+    size_t folder_len = (folder_end != NULL) ? (size_t)(folder_end - path) + 1 : 0;
+
+    dks_json_check(djson_start_parser(json, &json_ptr, pool, sizeof(pool)/sizeof(diamond_json_node_t)));
+    dks_json_check(djson_parse_until(&json_ptr, "shards", DJSON_TYPE_Array));
+
+    while (1)
+    {
+        diamond_json_type_t json_type;
+        dks_json_check(djson_goto_next_element(&json_ptr));
+        dks_json_check(djson_get_type_current(&json_ptr, &json_type));
+
+        if (json_type == DJSON_TYPE_ArrayEnd) break;
+        if (json_type != DJSON_TYPE_Object) dks_json_throw(HAL_ERROR_BAD_ARGUMENTS);
+
+        rval = parse_shard(set, &json_ptr, path, folder_len);
+        if (rval != HAL_OK) goto finished;
+    }
+
+finished:
+    free(json);
+    if (rval != HAL_OK) shard_set_free(set);
+
+    return rval;
+}
+
+bundle_reader_t *shard_set_open(const shard_set_t *set, unsigned int i, int *error)
+{
+    int dummy;
+    if (error == NULL) error = &dummy;
+
+    *error = HAL_ERROR_BAD_ARGUMENTS;
+    if (set == NULL || i >= set->count) return NULL;
+
+    const shard_set_entry_t *entry = &set->shards[i];
+
+    uint64_t size;
+    uint8_t digest[SHARD_SET_DIGEST_LEN];
+
+    if ((*error = digest_file(entry->path, &size, digest)) != HAL_OK) return NULL;
+
+    if (size != entry->size || memcmp(digest, entry->digest, SHARD_SET_DIGEST_LEN) != 0)
+    {
+        *error = HAL_ERROR_KEYSTORE_BAD_CRC;
+        return NULL;
+    }
+
+    bundle_reader_t *reader = bundle_reader_open(entry->path, error);
+    if (reader == NULL) return NULL;
+
+    // every shard has to use the KEKEK of the set
+    if (bundle_reader_format(reader) != set->format ||
+        memcmp(&bundle_reader_header(reader)->kekek_uuid, &set->kekek_uuid, sizeof(hal_uuid_t)) != 0)
+    {
+        bundle_reader_close(reader);
+        *error = HAL_ERROR_BAD_ARGUMENTS;
+        return NULL;
+    }
+
+    return reader;
+}
+
+int shard_writer_start(shard_writer_t *writer, bundle_format_t format, const char *base_path, uint64_t shard_size,
+                       int save_indexes, const bundle_header_t *header, const char *setup_json)
+{
+    if (writer == NULL || base_path == NULL || header == NULL || shard_size == 0) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(writer, 0, sizeof(shard_writer_t));
+    shard_set_init(&writer->set);
+
+    writer->set.kekek_uuid = header->kekek_uuid;
+    writer->set.format = format;
+
+    writer->format = format;
+    writer->header = header;
+    writer->setup_json = setup_json;
+    writer->base_path = base_path;
+    writer->shard_size = shard_size;
+    writer->save_indexes = save_indexes;
+
+    return open_shard(writer);
+}
+
+int shard_writer_add(shard_writer_t *writer, const bundle_record_t *record)
+{
+    if (writer == NULL || record == NULL || writer->fp == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int rval;
+
+    // keys are never split between shards
+    if (record->type == BUNDLE_RECORD_KEY && writer->keys > 0 && writer->writer.offset >= writer->shard_size)
+    {
+        if ((rval = close_shard(writer)) != HAL_OK) return rval;
+        if ((rval = open_shard(writer)) != HAL_OK) return rval;
+    }
+
+    rval = bundle_writer_add(&writer->writer, record);
+    if (rval == HAL_OK && record->type == BUNDLE_RECORD_KEY) writer->keys++;
+
+    return rval;
+}
+
+int shard_writer_finish(shard_writer_t *writer, FILE *fp)
+{
+    if (writer == NULL || writer->fp == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    int rval = close_shard(writer);
+    if (rval != HAL_OK) return rval;
+
+    return shard_set_save(&writer->set, fp);
+}
+
+void shard_writer_free(shard_writer_t *writer)
+{
+    if (writer == NULL) return;
+
+    if (writer->fp != NULL)
+    {
+        bundle_writer_free(&writer->writer);
+        fclose(writer->fp);
+    }
+    free(writer->path);
+
+    shard_set_free(&writer->set);
+    memset(writer, 0, sizeof(shard_writer_t));
+}
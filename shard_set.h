@@ -0,0 +1,119 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef SHARD_SET_H
+#define SHARD_SET_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <hal.h>
+
+#include "bundle.h"
+#include "bundle_reader.h"
+#include "bundle_writer.h"
+
+// A big export can be split into shards. Every shard is a complete export
+// bundle with its own KEKEK information and key index, so it can be
+// imported on its own. A shard set manifest lists the shards with their
+// size and SHA-256 digest:
+//
+// { "shard_set": 1, "comment": "...", "kekek_uuid": "...", "format": "binary",
+//   "shards": [ { "path": "export.000", "keys": 100, "size": "123456", "sha256": "..." }, ... ] }
+//
+// "shard_set" is always the first member, so a manifest can be told apart
+// from an export bundle by looking at the start of the file. Shard paths are
+// relative to the folder of the manifest.
+#define SHARD_SET_DIGEST_LEN    32
+
+typedef struct
+{
+    char *path;
+    uint32_t keys;
+    uint64_t size;
+    uint8_t digest[SHARD_SET_DIGEST_LEN];
+} shard_set_entry_t;
+
+typedef struct
+{
+    hal_uuid_t kekek_uuid;
+    bundle_format_t format;
+    shard_set_entry_t *shards;
+    unsigned int count;
+    unsigned int capacity;
+} shard_set_t;
+
+void shard_set_init(shard_set_t *set);
+void shard_set_free(shard_set_t *set);
+
+// add a finished shard. Its size and digest are read from the file
+int shard_set_add(shard_set_t *set, const char *path, uint32_t keys);
+int shard_set_save(const shard_set_t *set, FILE *fp);
+
+// HAL_ERROR_BAD_ARGUMENTS when the file is not a shard set manifest
+int shard_set_load(const char *path, shard_set_t *set);
+int shard_set_is_manifest(const char *path);
+
+// open a shard after checking its size and digest against the manifest.
+// *error is HAL_ERROR_KEYSTORE_BAD_CRC when the shard has been changed
+bundle_reader_t *shard_set_open(const shard_set_t *set, unsigned int i, int *error);
+
+// Writes an export as a shard set. A new shard is started before a key
+// record once the current shard has reached shard_size bytes. The records of
+// unchanged and removed keys always go in the last shard.
+typedef struct
+{
+    shard_set_t set;
+
+    bundle_format_t format;
+    const bundle_header_t *header;
+    const char *setup_json;
+    const char *base_path;  // shards are base_path.000, base_path.001...
+    uint64_t shard_size;
+    int save_indexes;       // save base_path.000.idx...
+
+    // the shard being written
+    FILE *fp;
+    char *path;
+    bundle_writer_t writer;
+    uint32_t keys;
+} shard_writer_t;
+
+// header and setup_json are used for every shard and must stay valid until
+// the shard writer has been freed
+int shard_writer_start(shard_writer_t *writer, bundle_format_t format, const char *base_path, uint64_t shard_size,
+                       int save_indexes, const bundle_header_t *header, const char *setup_json);
+int shard_writer_add(shard_writer_t *writer, const bundle_record_t *record);
+
+// finish the last shard and write the manifest to fp
+int shard_writer_finish(shard_writer_t *writer, FILE *fp);
+void shard_writer_free(shard_writer_t *writer);
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+
+#include <hal.h>
+#include <slip_internal.h>
+
+#include "slip_packet.h"
+
+// Function Implementations ---------------------------------------------
+hal_error_t slip_packet_encode(const uint8_t *buf, size_t len, uint8_t **packet, size_t *packet_len)
+{
+    if (packet == NULL || packet_len == NULL || (buf == NULL && len > 0)) return HAL_ERROR_BAD_ARGUMENTS;
+
+    // every byte may be escaped, and there's an END on each side
+    uint8_t *out = malloc(len * 2 + 2);
+    if (out == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    size_t out_len = 0;
+    out[out_len++] = END;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (buf[i] == END)
+        {
+            out[out_len++] = ESC;
+            out[out_len++] = ESC_END;
+        }
+        else if (buf[i] == ESC)
+        {
+            out[out_len++] = ESC;
+            out[out_len++] = ESC_ESC;
+        }
+        else
+        {
+            out[out_len++] = buf[i];
+        }
+    }
+
+    out[out_len++] = END;
+
+    *packet = out;
+    *packet_len = out_len;
+
+    return HAL_OK;
+}
+
+hal_error_t slip_packet_decode(slip_read_byte_t read_byte, void *context,
+                               uint8_t *buf, size_t *len, size_t maxlen)
+{
+    size_t received = 0;
+    int escaped = 0;
+    int overflow = 0;
+
+    while (1)
+    {
+        uint8_t c;
+        hal_error_t err = read_byte(context, &c);
+        if (err != HAL_OK) return err;
+
+        if (c == END)
+        {
+            // skip the empty packets between two ENDs
+            if (received == 0 && !overflow) continue;
+
+            *len = received;
+            return overflow ? HAL_ERROR_RPC_PACKET_OVERFLOW : HAL_OK;
+        }
+
+        if (c == ESC)
+        {
+            escaped = 1;
+            continue;
+        }
+
+        if (escaped)
+        {
+            escaped = 0;
+            if (c == ESC_END) c = END;
+            else if (c == ESC_ESC) c = ESC;
+        }
+
+        if (received >= maxlen) overflow = 1;
+        else buf[received++] = c;
+    }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef SLIP_PACKET_H
+#define SLIP_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hal.h>
+
+// SLIP framing for the RPC transports. The serial port and the mux daemon's
+// socket carry the same packets, so both use these. The byte values come
+// from libhal's slip_internal.h
+
+// encode buf as one packet with an END on each side. The END in front
+// flushes out anything that came before on the line. *packet is malloc'd
+hal_error_t slip_packet_encode(const uint8_t *buf, size_t len, uint8_t **packet, size_t *packet_len);
+
+// reads the next byte from the transport
+typedef hal_error_t (*slip_read_byte_t)(void *context, uint8_t *c);
+
+// read one packet, skipping empty ones. A packet larger than maxlen is read
+// to its end, so the next one starts in the right place, and returns
+// HAL_ERROR_RPC_PACKET_OVERFLOW
+hal_error_t slip_packet_decode(slip_read_byte_t read_byte, void *context,
+                               uint8_t *buf, size_t *len, size_t maxlen);
+
+#endif
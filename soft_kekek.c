@@ -0,0 +1,469 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <hal.h>
+
+#include "bundle_writer.h"
+#include "cryptech_device.h"
+#include "dks_arena.h"
+#include "soft_kekek.h"
+
+// the AlgorithmIdentifier of the EncryptedPrivateKeyInfo: id-aes256-wrap-pad,
+// 2.16.840.1.101.3.4.1.48, without parameters
+static const uint8_t aes_key_wrap_algorithm[] = { 0x30, 0x0B, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x01, 0x30 };
+
+#define AES_KEY_WRAP_MAGIC  0xA65959A6
+
+// AES key wrap -----------------------------------------------------------
+static int aes_ecb_init(EVP_CIPHER_CTX **ctx, const uint8_t *kek, size_t kek_len, int encrypt)
+{
+    const EVP_CIPHER *cipher = (kek_len == 16) ? EVP_aes_128_ecb() :
+                               (kek_len == 24) ? EVP_aes_192_ecb() :
+                               (kek_len == 32) ? EVP_aes_256_ecb() : NULL;
+    if (cipher == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *ctx = EVP_CIPHER_CTX_new();
+    if (*ctx == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    // EVP uses AES-NI when the CPU has it
+    if (EVP_CipherInit_ex(*ctx, cipher, NULL, kek, NULL, encrypt) != 1)
+    {
+        EVP_CIPHER_CTX_free(*ctx);
+        return HAL_ERROR_IMPOSSIBLE;
+    }
+    EVP_CIPHER_CTX_set_padding(*ctx, 0);
+
+    return HAL_OK;
+}
+
+// one AES block in place
+static int aes_block(EVP_CIPHER_CTX *ctx, uint8_t *block)
+{
+    int len;
+
+    return (EVP_CipherUpdate(ctx, block, &len, block, 16) == 1 && len == 16) ? HAL_OK : HAL_ERROR_IMPOSSIBLE;
+}
+
+static void xor_counter(uint8_t *a, uint64_t t)
+{
+    for (int k = 0; k < 8; ++k) a[k] ^= (uint8_t)(t >> (56 - 8 * k));
+}
+
+int aes_key_wrap_pad(const uint8_t *kek, size_t kek_len, const uint8_t *in, size_t in_len,
+                     uint8_t *out, size_t *out_len)
+{
+    if (kek == NULL || in == NULL || out == NULL || out_len == NULL || in_len == 0 || in_len > 0xFFFFFFFF)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    EVP_CIPHER_CTX *ctx;
+    int rval = aes_ecb_init(&ctx, kek, kek_len, 1);
+    if (rval != HAL_OK) return rval;
+
+    size_t n = (in_len + 7) / 8;
+    uint8_t *r = out + 8;
+    uint8_t a[8] = { 0xA6, 0x59, 0x59, 0xA6, (uint8_t)(in_len >> 24), (uint8_t)(in_len >> 16),
+                     (uint8_t)(in_len >> 8), (uint8_t)in_len };
+    uint8_t block[16];
+
+    // RFC 5649 section 4.1
+    memset(r, 0, n * 8);
+    memmove(r, in, in_len);
+
+    if (n == 1)
+    {
+        memcpy(block, a, 8);
+        memcpy(block + 8, r, 8);
+        if ((rval = aes_block(ctx, block)) == HAL_OK) memcpy(out, block, 16);
+    }
+    else
+    {
+        // RFC 3394 section 2.2.1
+        for (uint64_t j = 0; j <= 5 && rval == HAL_OK; ++j)
+        {
+            for (size_t i = 1; i <= n && rval == HAL_OK; ++i)
+            {
+                memcpy(block, a, 8);
+                memcpy(block + 8, r + (i - 1) * 8, 8);
+                rval = aes_block(ctx, block);
+
+                memcpy(a, block, 8);
+                xor_counter(a, n * j + i);
+                memcpy(r + (i - 1) * 8, block + 8, 8);
+            }
+        }
+        memcpy(out, a, 8);
+    }
+
+    OPENSSL_cleanse(block, sizeof(block));
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (rval != HAL_OK) OPENSSL_cleanse(out, (n + 1) * 8);
+    else *out_len = (n + 1) * 8;
+
+    return rval;
+}
+
+int aes_key_unwrap_pad(const uint8_t *kek, size_t kek_len, const uint8_t *in, size_t in_len,
+                       uint8_t *out, size_t *out_len)
+{
+    if (kek == NULL || in == NULL || out == NULL || out_len == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (in_len < 16 || in_len % 8 != 0) return HAL_ERROR_KEYWRAP_BAD_LENGTH;
+
+    EVP_CIPHER_CTX *ctx;
+    int rval = aes_ecb_init(&ctx, kek, kek_len, 0);
+    if (rval != HAL_OK) return rval;
+
+    size_t n = in_len / 8 - 1;
+    uint8_t *r = out;
+    uint8_t a[8];
+    uint8_t block[16];
+
+    // RFC 5649 section 4.2
+    if (n == 1)
+    {
+        memcpy(block, in, 16);
+        if ((rval = aes_block(ctx, block)) == HAL_OK)
+        {
+            memcpy(a, block, 8);
+            memcpy(r, block + 8, 8);
+        }
+    }
+    else
+    {
+        memcpy(a, in, 8);
+        memmove(r, in + 8, n * 8);
+
+        // RFC 3394 section 2.2.2
+        for (uint64_t j = 6; j-- > 0 && rval == HAL_OK; )
+        {
+            for (size_t i = n; i >= 1 && rval == HAL_OK; --i)
+            {
+                memcpy(block, a, 8);
+                xor_counter(block, n * j + i);
+                memcpy(block + 8, r + (i - 1) * 8, 8);
+                rval = aes_block(ctx, block);
+
+                memcpy(a, block, 8);
+                memcpy(r + (i - 1) * 8, block + 8, 8);
+            }
+        }
+    }
+
+    OPENSSL_cleanse(block, sizeof(block));
+    EVP_CIPHER_CTX_free(ctx);
+
+    size_t m = ((size_t)a[4] << 24) | ((size_t)a[5] << 16) | ((size_t)a[6] << 8) | a[7];
+
+    if (rval == HAL_OK)
+    {
+        uint32_t magic = ((uint32_t)a[0] << 24) | ((uint32_t)a[1] << 16) | ((uint32_t)a[2] << 8) | a[3];
+
+        // a wrong key fails here
+        if (magic != AES_KEY_WRAP_MAGIC) rval = HAL_ERROR_KEYWRAP_BAD_MAGIC;
+        else if (m <= 8 * (n - 1) || m > 8 * n) rval = HAL_ERROR_KEYWRAP_BAD_LENGTH;
+        else
+        {
+            for (size_t i = m; i < 8 * n; ++i)
+            {
+                if (r[i] != 0) rval = HAL_ERROR_KEYWRAP_BAD_PADDING;
+            }
+        }
+    }
+
+    if (rval != HAL_OK) OPENSSL_cleanse(out, n * 8);
+    else *out_len = m;
+
+    return rval;
+}
+
+// EncryptedPrivateKeyInfo ------------------------------------------------
+static size_t der_header(uint8_t *p, uint8_t tag, size_t len)
+{
+    p[0] = tag;
+    if (len < 0x80)
+    {
+        p[1] = (uint8_t)len;
+        return 2;
+    }
+
+    size_t count = 0;
+    for (size_t l = len; l > 0; l >>= 8) ++count;
+
+    p[1] = 0x80 | (uint8_t)count;
+    for (size_t i = 0; i < count; ++i) p[2 + i] = (uint8_t)(len >> (8 * (count - 1 - i)));
+
+    return 2 + count;
+}
+
+// step into the TLV at *p, which must have the tag
+static int der_enter(const uint8_t **p, const uint8_t *end, uint8_t tag, size_t *len)
+{
+    if (end - *p < 2 || (*p)[0] != tag) return HAL_ERROR_ASN1_PARSE_FAILED;
+
+    const uint8_t *q = *p + 2;
+    size_t l = (*p)[1];
+
+    if (l & 0x80)
+    {
+        size_t count = l & 0x7F;
+        if (count == 0 || count > 4 || (size_t)(end - q) < count) return HAL_ERROR_ASN1_PARSE_FAILED;
+
+        for (l = 0; count > 0; --count) l = (l << 8) | *q++;
+    }
+
+    if ((size_t)(end - q) < l) return HAL_ERROR_ASN1_PARSE_FAILED;
+
+    *p = q;
+    *len = l;
+
+    return HAL_OK;
+}
+
+uint8_t *encrypted_private_key_info_encode(const uint8_t *algorithm, size_t algorithm_len,
+                                           const uint8_t *data, size_t data_len, size_t *result_len)
+{
+    uint8_t header[8];
+    size_t octets_len = der_header(header, 0x04, data_len) + data_len;
+    size_t content_len = algorithm_len + octets_len;
+
+    uint8_t *result = malloc(content_len + sizeof(header));
+    if (result == NULL) return NULL;
+
+    uint8_t *p = result;
+    p += der_header(p, 0x30, content_len);
+    memcpy(p, algorithm, algorithm_len);
+    p += algorithm_len;
+    p += der_header(p, 0x04, data_len);
+    memcpy(p, data, data_len);
+    p += data_len;
+
+    *result_len = p - result;
+    return result;
+}
+
+int encrypted_private_key_info_parse(const uint8_t *der, size_t der_len,
+                                     const uint8_t **algorithm, size_t *algorithm_len,
+                                     const uint8_t **data, size_t *data_len)
+{
+    const uint8_t *p = der;
+    const uint8_t *end = der + der_len;
+    size_t len;
+    int rval;
+
+    if ((rval = der_enter(&p, end, 0x30, &len)) != HAL_OK) return rval;
+    end = p + len;
+
+    *algorithm = p;
+    if ((rval = der_enter(&p, end, 0x30, &len)) != HAL_OK) return rval;
+    p += len;
+    *algorithm_len = p - *algorithm;
+
+    if ((rval = der_enter(&p, end, 0x04, &len)) != HAL_OK) return rval;
+
+    *data = p;
+    *data_len = len;
+
+    return HAL_OK;
+}
+
+// Key pair ---------------------------------------------------------------
+static int derive_key(const char *passphrase, const uint8_t *salt, size_t salt_len, uint8_t *key)
+{
+    if (PKCS5_PBKDF2_HMAC(passphrase, (int)strlen(passphrase), salt, (int)salt_len, SOFT_KEKEK_ITERATIONS,
+                          EVP_sha256(), SOFT_KEKEK_KEY_LEN, key) != 1)
+    {
+        return HAL_ERROR_IMPOSSIBLE;
+    }
+
+    return HAL_OK;
+}
+
+int soft_kekek_setup_json(const char *passphrase, unsigned int key_bits, char **json_result)
+{
+    if (passphrase == NULL || json_result == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    *json_result = NULL;
+
+    int rval = HAL_ERROR_IMPOSSIBLE;
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    EVP_PKEY *pkey = EVP_PKEY_new();
+    PKCS8_PRIV_KEY_INFO *p8 = NULL;
+    uint8_t *spki = NULL, *key_der = NULL, *wrapped = NULL, *epki = NULL;
+    int spki_len = 0, key_der_len = 0;
+    size_t wrapped_len = 0, epki_len = 0;
+    uint8_t salt[SOFT_KEKEK_SALT_LEN];
+    uint8_t key[SOFT_KEKEK_KEY_LEN];
+    dks_arena_t arena;
+    int arena_ready = 0;
+
+    if (rsa == NULL || e == NULL || pkey == NULL)
+    {
+        rval = HAL_ERROR_ALLOCATION_FAILURE;
+        goto finished;
+    }
+
+    cryptech_report("Generating a %u bit RSA key pair.\r\n", key_bits);
+
+    if (BN_set_word(e, RSA_F4) != 1 ||
+        RSA_generate_key_ex(rsa, (int)key_bits, e, NULL) != 1 ||
+        EVP_PKEY_set1_RSA(pkey, rsa) != 1 ||
+        (p8 = EVP_PKEY2PKCS8(pkey)) == NULL ||
+        (key_der_len = i2d_PKCS8_PRIV_KEY_INFO(p8, &key_der)) <= 0 ||
+        (spki_len = i2d_RSA_PUBKEY(rsa, &spki)) <= 0)
+    {
+        goto finished;
+    }
+
+    if (RAND_bytes(salt, sizeof(salt)) != 1)
+    {
+        rval = HAL_ERROR_CSPRNG_BROKEN;
+        goto finished;
+    }
+
+    if ((rval = derive_key(passphrase, salt, sizeof(salt), key)) != HAL_OK) goto finished;
+
+    wrapped = malloc(key_der_len + 16);
+    if (wrapped == NULL)
+    {
+        rval = HAL_ERROR_ALLOCATION_FAILURE;
+        goto finished;
+    }
+
+    if ((rval = aes_key_wrap_pad(key, sizeof(key), key_der, key_der_len, wrapped, &wrapped_len)) != HAL_OK) goto finished;
+
+    epki = encrypted_private_key_info_encode(aes_key_wrap_algorithm, sizeof(aes_key_wrap_algorithm),
+                                             wrapped, wrapped_len, &epki_len);
+    if (epki == NULL || dks_arena_init(&arena, 16 * 1024) != HAL_OK)
+    {
+        rval = HAL_ERROR_ALLOCATION_FAILURE;
+        goto finished;
+    }
+    arena_ready = 1;
+
+    // the same fields as cryptech_backup
+    char *pkcs8_b64 = binary_to_split_b64(&arena, epki, epki_len);
+    char *pubkey_b64 = binary_to_split_b64(&arena, spki, spki_len);
+    char *salt_b64 = binary_to_split_b64(&arena, salt, sizeof(salt));
+    char *json = NULL;
+
+    if (pkcs8_b64 != NULL && pubkey_b64 != NULL && salt_b64 != NULL)
+    {
+        json = dks_arena_printf(&arena, "{\n    \"comment\": \"KEKEK software keypair\",\n"
+                                        "    \"kekek_pkcs8\": [\n%s\n    ],\n"
+                                        "    \"kekek_pubkey\": [\n%s\n    ],\n"
+                                        "    \"kekek_salt\": [\n%s\n    ]\n}\n",
+                                pkcs8_b64, pubkey_b64, salt_b64);
+    }
+
+    *json_result = (json != NULL) ? strdup(json) : NULL;
+    rval = (*json_result != NULL) ? HAL_OK : HAL_ERROR_ALLOCATION_FAILURE;
+
+finished:
+    OPENSSL_cleanse(key, sizeof(key));
+    if (key_der != NULL)
+    {
+        OPENSSL_cleanse(key_der, key_der_len);
+        OPENSSL_free(key_der);
+    }
+    free(wrapped);
+    free(epki);
+    OPENSSL_free(spki);
+    PKCS8_PRIV_KEY_INFO_free(p8);
+    EVP_PKEY_free(pkey);
+    BN_free(e);
+    RSA_free(rsa);
+    if (arena_ready) dks_arena_free(&arena);
+
+    return rval;
+}
+
+int soft_kekek_recover(const char *passphrase, const uint8_t *salt, size_t salt_len,
+                       const uint8_t *pkcs8, size_t pkcs8_len, uint8_t **key_der, size_t *key_der_len)
+{
+    if (passphrase == NULL || salt == NULL || pkcs8 == NULL || key_der == NULL || key_der_len == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    const uint8_t *algorithm, *wrapped;
+    size_t algorithm_len, wrapped_len;
+
+    int rval = encrypted_private_key_info_parse(pkcs8, pkcs8_len, &algorithm, &algorithm_len, &wrapped, &wrapped_len);
+    if (rval != HAL_OK) return rval;
+    if (algorithm_len != sizeof(aes_key_wrap_algorithm) ||
+        memcmp(algorithm, aes_key_wrap_algorithm, algorithm_len) != 0)
+    {
+        return HAL_ERROR_ASN1_PARSE_FAILED;
+    }
+    if (wrapped_len < 16) return HAL_ERROR_KEYWRAP_BAD_LENGTH;
+
+    uint8_t key[SOFT_KEKEK_KEY_LEN];
+    if ((rval = derive_key(passphrase, salt, salt_len, key)) != HAL_OK) return rval;
+
+    *key_der = malloc(wrapped_len - 8);
+    if (*key_der == NULL)
+    {
+        OPENSSL_cleanse(key, sizeof(key));
+        return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    rval = aes_key_unwrap_pad(key, sizeof(key), wrapped, wrapped_len, *key_der, key_der_len);
+    OPENSSL_cleanse(key, sizeof(key));
+
+    if (rval != HAL_OK)
+    {
+        free(*key_der);
+        *key_der = NULL;
+    }
+
+    return rval;
+}
+
+void soft_kekek_free(uint8_t *key_der, size_t key_der_len)
+{
+    if (key_der == NULL) return;
+
+    OPENSSL_cleanse(key_der, key_der_len);
+    free(key_der);
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef SOFT_KEKEK_H
+#define SOFT_KEKEK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hal.h>
+
+// A KEKEK made in software for when there's no second HSM, compatible with
+// the --soft-backup option of CrypTech's cryptech_backup. The RSA private
+// key is kept in the setup JSON as a PKCS #8 EncryptedPrivateKeyInfo. It's
+// wrapped with AES Key Wrap with Padding (RFC 5649) under a key derived
+// from a passphrase with PBKDF2-HMAC-SHA256.
+//
+// This is only as safe as the memory of the computer it runs on. The
+// private key is loaded into the HSM for the import and deleted after.
+#define SOFT_KEKEK_SALT_LEN         16
+#define SOFT_KEKEK_ITERATIONS       8000
+#define SOFT_KEKEK_KEY_LEN          32      // AES-256
+#define SOFT_KEKEK_DEFAULT_BITS     2048
+
+// make a key pair and return the setup JSON for it
+int soft_kekek_setup_json(const char *passphrase, unsigned int key_bits, char **json_result);
+
+// decrypt the private key from a setup JSON or export. The result is
+// PKCS #8 PrivateKeyInfo that must be freed with soft_kekek_free
+int soft_kekek_recover(const char *passphrase, const uint8_t *salt, size_t salt_len,
+                       const uint8_t *pkcs8, size_t pkcs8_len, uint8_t **key_der, size_t *key_der_len);
+// clears the key before freeing it
+void soft_kekek_free(uint8_t *key_der, size_t key_der_len);
+
+// PKCS #8 EncryptedPrivateKeyInfo. algorithm is the whole DER
+// AlgorithmIdentifier. The result of encode is malloced
+int encrypted_private_key_info_parse(const uint8_t *der, size_t der_len,
+                                     const uint8_t **algorithm, size_t *algorithm_len,
+                                     const uint8_t **data, size_t *data_len);
+uint8_t *encrypted_private_key_info_encode(const uint8_t *algorithm, size_t algorithm_len,
+                                           const uint8_t *data, size_t data_len, size_t *result_len);
+
+// RFC 5649. out needs in_len rounded up to 8, plus 8 bytes
+int aes_key_wrap_pad(const uint8_t *kek, size_t kek_len, const uint8_t *in, size_t in_len,
+                     uint8_t *out, size_t *out_len);
+// out needs in_len - 8 bytes
+int aes_key_unwrap_pad(const uint8_t *kek, size_t kek_len, const uint8_t *in, size_t in_len,
+                       uint8_t *out, size_t *out_len);
+
+#endif
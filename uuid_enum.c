@@ -0,0 +1,264 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+#include <hal_internal.h>
+
+#include "uuid_enum.h"
+
+// each UUID in a pkey_match reply is XDR opaque data: a length and 16 bytes
+#define UUID_ENUM_XDR_UUID_SIZE     (4 + sizeof(hal_uuid_t))
+
+// opcode, client, status, state and the UUID count
+#define UUID_ENUM_XDR_HEADER_SIZE   (5 * 4)
+
+#define UUID_ENUM_MAX_PAGE          ((HAL_RPC_MAX_PKT_SIZE - UUID_ENUM_XDR_HEADER_SIZE) / UUID_ENUM_XDR_UUID_SIZE)
+#define UUID_ENUM_MIN_PAGE          16
+
+// the device builds the reply on its stack, so paging starts small and only
+// grows after a full page comes back
+#define UUID_ENUM_FIRST_PAGE        64
+
+static uint32_t hash_uuid(const hal_uuid_t *uuid)
+{
+    // UUIDs are mostly random, but mix them anyway in case a device
+    // hands out sequential ones
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(hal_uuid_t); ++i)
+    {
+        h ^= uuid->uuid[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int compare_uuids(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(hal_uuid_t));
+}
+
+// find the slot holding the UUID or the empty slot where it belongs
+static uint32_t *find_slot(uint32_t *slots, unsigned int slot_count, const hal_uuid_t *uuids,
+                           const hal_uuid_t *uuid)
+{
+    unsigned int mask = slot_count - 1;
+    unsigned int i = hash_uuid(uuid) & mask;
+
+    while (slots[i] != 0 && memcmp(&uuids[slots[i] - 1], uuid, sizeof(hal_uuid_t)) != 0)
+    {
+        i = (i + 1) & mask;
+    }
+
+    return &slots[i];
+}
+
+// slots is zeroed, and replaces the current ones
+static void install_slots(uuid_enum_t *uuid_enum, uint32_t *slots, unsigned int slot_count)
+{
+    for (unsigned int i = 0; i < uuid_enum->count; ++i)
+    {
+        *find_slot(slots, slot_count, uuid_enum->uuids, &uuid_enum->uuids[i]) = i + 1;
+    }
+
+    free(uuid_enum->slots);
+    uuid_enum->slots = slots;
+    uuid_enum->slot_count = slot_count;
+}
+
+static int rebuild_slots(uuid_enum_t *uuid_enum, unsigned int slot_count)
+{
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    install_slots(uuid_enum, slots, slot_count);
+
+    return HAL_OK;
+}
+
+void uuid_enum_init(uuid_enum_t *uuid_enum)
+{
+    memset(uuid_enum, 0, sizeof(uuid_enum_t));
+}
+
+void uuid_enum_free(uuid_enum_t *uuid_enum)
+{
+    if (uuid_enum == NULL) return;
+
+    free(uuid_enum->uuids);
+    free(uuid_enum->slots);
+    uuid_enum_init(uuid_enum);
+}
+
+int uuid_enum_add(uuid_enum_t *uuid_enum, const hal_uuid_t *uuid)
+{
+    if (uuid_enum == NULL || uuid == NULL) return -HAL_ERROR_BAD_ARGUMENTS;
+
+    // keep the hash set at most half full
+    if ((uuid_enum->count + 1) * 2 > uuid_enum->slot_count)
+    {
+        unsigned int slot_count = (uuid_enum->slot_count == 0) ? 256 : uuid_enum->slot_count * 2;
+        if (rebuild_slots(uuid_enum, slot_count) != HAL_OK) return -HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    uint32_t *slot = find_slot(uuid_enum->slots, uuid_enum->slot_count, uuid_enum->uuids, uuid);
+    if (*slot != 0) return 0;
+
+    if (uuid_enum->count == uuid_enum->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (uuid_enum->capacity == 0) ? 128 : uuid_enum->capacity * 2;
+        hal_uuid_t *new_uuids = realloc(uuid_enum->uuids, new_capacity * sizeof(hal_uuid_t));
+        if (new_uuids == NULL) return -HAL_ERROR_ALLOCATION_FAILURE;
+
+        uuid_enum->uuids = new_uuids;
+        uuid_enum->capacity = new_capacity;
+    }
+
+    memcpy(&uuid_enum->uuids[uuid_enum->count], uuid, sizeof(hal_uuid_t));
+    *slot = ++uuid_enum->count;
+
+    return 1;
+}
+
+int uuid_enum_contains(const uuid_enum_t *uuid_enum, const hal_uuid_t *uuid)
+{
+    if (uuid_enum == NULL || uuid_enum->slots == NULL || uuid == NULL) return 0;
+
+    return *find_slot(uuid_enum->slots, uuid_enum->slot_count, uuid_enum->uuids, uuid) != 0;
+}
+
+hal_error_t uuid_enum_sort(uuid_enum_t *uuid_enum)
+{
+    // the slots point at the old positions, so new ones are needed. They're
+    // allocated first, so a failure leaves the enum as it was
+    uint32_t *slots = NULL;
+    if (uuid_enum->slot_count > 0)
+    {
+        slots = calloc(uuid_enum->slot_count, sizeof(uint32_t));
+        if (slots == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+    }
+
+    qsort(uuid_enum->uuids, uuid_enum->count, sizeof(hal_uuid_t), compare_uuids);
+
+    if (slots != NULL) install_slots(uuid_enum, slots, uuid_enum->slot_count);
+
+    return HAL_OK;
+}
+
+hal_error_t uuid_enum_copy(uuid_enum_t *dest, const uuid_enum_t *src)
+{
+    if (dest == NULL || src == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    for (unsigned int i = 0; i < src->count; ++i)
+    {
+        int r = uuid_enum_add(dest, &src->uuids[i]);
+        if (r < 0) return -r;
+    }
+
+    return HAL_OK;
+}
+
+hal_error_t uuid_enum_match(uuid_enum_t *uuid_enum,
+                            const hal_client_handle_t client,
+                            const hal_session_handle_t session,
+                            const hal_key_type_t type,
+                            const hal_curve_name_t curve,
+                            const hal_key_flags_t mask,
+                            const hal_key_flags_t flags,
+                            const hal_pkey_attribute_t *attributes,
+                            const unsigned attributes_len)
+{
+    if (uuid_enum == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    hal_uuid_t *page = malloc(UUID_ENUM_MAX_PAGE * sizeof(hal_uuid_t));
+    if (page == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    unsigned page_size = UUID_ENUM_FIRST_PAGE;
+    unsigned page_limit = UUID_ENUM_MAX_PAGE;
+    unsigned n = 0, state = 0;
+    hal_uuid_t previous_uuid;
+    memset(&previous_uuid, 0, sizeof(previous_uuid));
+
+    hal_error_t err = HAL_OK;
+
+    while (1)
+    {
+        unsigned state_before = state;
+
+        // the device may not be able to build a reply this large, so
+        // try again with a smaller page
+        while ((err = hal_rpc_pkey_match(client, session, type, curve, mask, flags,
+                                         attributes, attributes_len,
+                                         &state, page, &n, page_size, &previous_uuid)) != HAL_OK &&
+               page_size > UUID_ENUM_MIN_PAGE &&
+               (err == HAL_ERROR_RPC_PACKET_OVERFLOW || err == HAL_ERROR_ALLOCATION_FAILURE ||
+                err == HAL_ERROR_RESULT_TOO_LONG))
+        {
+            page_size /= 2;
+            page_limit = page_size;
+            state = state_before;
+        }
+        if (err != HAL_OK) break;
+
+        int added = 0;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            int r = uuid_enum_add(uuid_enum, &page[i]);
+            if (r < 0)
+            {
+                err = -r;
+                goto finished;
+            }
+            added += r;
+        }
+
+        // a page without anything new means the device has wrapped around
+        if (n > 0 && added == 0) break;
+
+        // save the last uuid for more searches
+        if (n > 0) memcpy(&previous_uuid, &page[n - 1], sizeof(hal_uuid_t));
+
+        // a short page is the last one
+        if (n < page_size) break;
+
+        // never grow past a size the device has already refused
+        if (page_size * 2 <= page_limit) page_size *= 2;
+    }
+
+    if (err == HAL_OK) err = uuid_enum_sort(uuid_enum);
+
+finished:
+    free(page);
+
+    return err;
+}
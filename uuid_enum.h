@@ -0,0 +1,75 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef UUID_ENUM_H
+#define UUID_ENUM_H
+
+#include <stdint.h>
+
+#include <hal.h>
+
+// Enumerates the keys on a device with hal_rpc_pkey_match(). Pages start
+// small and grow toward the largest RPC reply while the device keeps up,
+// duplicates are removed with an open-addressing hash set, and the result
+// is sorted by UUID so callers always see the same order no matter how the
+// device paged its answers.
+typedef struct
+{
+    hal_uuid_t *uuids;
+    unsigned int count;
+    unsigned int capacity;
+
+    // hash set slots hold an index into uuids plus one. zero marks an empty slot
+    uint32_t *slots;
+    unsigned int slot_count;
+} uuid_enum_t;
+
+void uuid_enum_init(uuid_enum_t *uuid_enum);
+void uuid_enum_free(uuid_enum_t *uuid_enum);
+
+hal_error_t uuid_enum_match(uuid_enum_t *uuid_enum,
+                            const hal_client_handle_t client,
+                            const hal_session_handle_t session,
+                            const hal_key_type_t type,
+                            const hal_curve_name_t curve,
+                            const hal_key_flags_t mask,
+                            const hal_key_flags_t flags,
+                            const hal_pkey_attribute_t *attributes,
+                            const unsigned attributes_len);
+
+// returns 1 if the UUID was added, 0 if it was already in the set
+int uuid_enum_add(uuid_enum_t *uuid_enum, const hal_uuid_t *uuid);
+int uuid_enum_contains(const uuid_enum_t *uuid_enum, const hal_uuid_t *uuid);
+// fails when the hash set can't be rebuilt. The enum is then left unsorted
+hal_error_t uuid_enum_sort(uuid_enum_t *uuid_enum);
+// dest must be empty
+hal_error_t uuid_enum_copy(uuid_enum_t *dest, const uuid_enum_t *src);
+
+#endif
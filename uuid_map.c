@@ -0,0 +1,207 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "uuid_map.h"
+
+static int compare_entries(const void *a, const void *b)
+{
+    return memcmp(&((const uuid_map_entry_t *)a)->source,
+                  &((const uuid_map_entry_t *)b)->source,
+                  sizeof(hal_uuid_t));
+}
+
+void uuid_map_builder_init(uuid_map_builder_t *builder)
+{
+    builder->entries = NULL;
+    builder->count = 0;
+    builder->capacity = 0;
+}
+
+int uuid_map_builder_add(uuid_map_builder_t *builder, const hal_uuid_t *source, const hal_uuid_t *destination,
+                         uint32_t key_type, uint32_t flags)
+{
+    if (builder == NULL || source == NULL || destination == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    if (builder->count == builder->capacity)
+    {
+        // grow the buffer
+        unsigned int new_capacity = (builder->capacity == 0) ? 64 : builder->capacity * 2;
+        uuid_map_entry_t *new_entries = realloc(builder->entries, new_capacity * sizeof(uuid_map_entry_t));
+        if (new_entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        builder->entries = new_entries;
+        builder->capacity = new_capacity;
+    }
+
+    uuid_map_entry_t *entry = &builder->entries[builder->count++];
+    memcpy(&entry->source, source, sizeof(hal_uuid_t));
+    memcpy(&entry->destination, destination, sizeof(hal_uuid_t));
+    entry->key_type = htole32(key_type);
+    entry->flags = htole32(flags);
+
+    return HAL_OK;
+}
+
+int uuid_map_builder_merge(uuid_map_builder_t *builder, const uuid_map_builder_t *src)
+{
+    if (builder == NULL || src == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+    if (src->count == 0) return HAL_OK;
+
+    if (builder->count + src->count > builder->capacity)
+    {
+        unsigned int new_capacity = (builder->capacity == 0) ? 64 : builder->capacity;
+        while (new_capacity < builder->count + src->count) new_capacity *= 2;
+
+        uuid_map_entry_t *new_entries = realloc(builder->entries, new_capacity * sizeof(uuid_map_entry_t));
+        if (new_entries == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+        builder->entries = new_entries;
+        builder->capacity = new_capacity;
+    }
+
+    // the entries are already in file order
+    memcpy(&builder->entries[builder->count], src->entries, src->count * sizeof(uuid_map_entry_t));
+    builder->count += src->count;
+
+    return HAL_OK;
+}
+
+int uuid_map_builder_save(uuid_map_builder_t *builder, const char *path)
+{
+    if (builder == NULL || path == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    qsort(builder->entries, builder->count, sizeof(uuid_map_entry_t), compare_entries);
+
+    uuid_map_header_t header;
+    memcpy(header.magic, UUID_MAP_MAGIC, sizeof(header.magic));
+    header.version = htole32(UUID_MAP_VERSION);
+    header.count = htole32(builder->count);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return HAL_ERROR_IO_OS_ERROR;
+
+    int rval = HAL_OK;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        (builder->count > 0 &&
+         fwrite(builder->entries, sizeof(uuid_map_entry_t), builder->count, fp) != builder->count))
+    {
+        rval = HAL_ERROR_IO_OS_ERROR;
+    }
+
+    if (fclose(fp) != 0) rval = HAL_ERROR_IO_OS_ERROR;
+
+    return rval;
+}
+
+void uuid_map_builder_free(uuid_map_builder_t *builder)
+{
+    if (builder == NULL) return;
+
+    free(builder->entries);
+    uuid_map_builder_init(builder);
+}
+
+int uuid_map_open(const char *path, uuid_map_t *map)
+{
+    if (path == NULL || map == NULL) return HAL_ERROR_BAD_ARGUMENTS;
+
+    memset(map, 0, sizeof(uuid_map_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return HAL_ERROR_IO_OS_ERROR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (size_t)st.st_size < sizeof(uuid_map_header_t))
+    {
+        close(fd);
+        return HAL_ERROR_IO_BAD_COUNT;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+
+    if (data == MAP_FAILED) return HAL_ERROR_IO_OS_ERROR;
+
+    const uuid_map_header_t *header = (const uuid_map_header_t *)data;
+    uint32_t count = le32toh(header->count);
+
+    if (memcmp(header->magic, UUID_MAP_MAGIC, sizeof(header->magic)) != 0 ||
+        le32toh(header->version) != UUID_MAP_VERSION ||
+        (st.st_size - sizeof(uuid_map_header_t)) / sizeof(uuid_map_entry_t) < count)
+    {
+        munmap(data, st.st_size);
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    map->map = data;
+    map->map_len = st.st_size;
+    map->entries = (const uuid_map_entry_t *)((const uint8_t *)data + sizeof(uuid_map_header_t));
+    map->count = count;
+
+    return HAL_OK;
+}
+
+const uuid_map_entry_t *uuid_map_lookup(const uuid_map_t *map, const hal_uuid_t *source)
+{
+    if (map == NULL || map->entries == NULL || source == NULL) return NULL;
+
+    // the entries are sorted by source UUID and the source field is first
+    return bsearch(source, map->entries, map->count, sizeof(uuid_map_entry_t), compare_entries);
+}
+
+uint32_t uuid_map_entry_key_type(const uuid_map_entry_t *entry)
+{
+    return le32toh(entry->key_type);
+}
+
+uint32_t uuid_map_entry_flags(const uuid_map_entry_t *entry)
+{
+    return le32toh(entry->flags);
+}
+
+void uuid_map_close(uuid_map_t *map)
+{
+    if (map == NULL) return;
+
+    if (map->map != NULL) munmap(map->map, map->map_len);
+
+    memset(map, 0, sizeof(uuid_map_t));
+}
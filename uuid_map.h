@@ -0,0 +1,92 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef UUID_MAP_H
+#define UUID_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <hal.h>
+
+// A UUID map records which UUID each imported key received on the
+// destination device. The file is a uuid_map_header_t followed by 'count'
+// uuid_map_entry_t records sorted by source UUID, so it can be mapped into
+// memory and searched without parsing. Integers are stored little endian.
+#define UUID_MAP_MAGIC      "DKSUMAP1"
+#define UUID_MAP_VERSION    1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} uuid_map_header_t;
+
+typedef struct
+{
+    hal_uuid_t source;
+    hal_uuid_t destination;
+    uint32_t key_type;
+    uint32_t flags;
+} uuid_map_entry_t;
+
+// used while importing to collect the mapping before it is sorted and saved
+typedef struct
+{
+    uuid_map_entry_t *entries;
+    unsigned int count;
+    unsigned int capacity;
+} uuid_map_builder_t;
+
+// a read-only, memory mapped UUID map
+typedef struct
+{
+    void *map;
+    size_t map_len;
+    const uuid_map_entry_t *entries;
+    uint32_t count;
+} uuid_map_t;
+
+void uuid_map_builder_init(uuid_map_builder_t *builder);
+int uuid_map_builder_add(uuid_map_builder_t *builder, const hal_uuid_t *source, const hal_uuid_t *destination,
+                         uint32_t key_type, uint32_t flags);
+// add every entry of src
+int uuid_map_builder_merge(uuid_map_builder_t *builder, const uuid_map_builder_t *src);
+int uuid_map_builder_save(uuid_map_builder_t *builder, const char *path);
+void uuid_map_builder_free(uuid_map_builder_t *builder);
+
+int uuid_map_open(const char *path, uuid_map_t *map);
+const uuid_map_entry_t *uuid_map_lookup(const uuid_map_t *map, const hal_uuid_t *source);
+uint32_t uuid_map_entry_key_type(const uuid_map_entry_t *entry);
+uint32_t uuid_map_entry_flags(const uuid_map_entry_t *entry);
+void uuid_map_close(uuid_map_t *map);
+
+#endif
@@ -0,0 +1,279 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "cryptech_device.h"
+#include "device_pair.h"
+#include "key_tree.h"
+#include "verify.h"
+
+// The parent asks the child about its tree with requests. The child starts
+// by sending its key count and root hash, and stops when the parent closes
+// the pipe.
+#define VERIFY_OP_CHILDREN  1   // reply: the hashes of the node's two children
+#define VERIFY_OP_BUCKET    2   // reply: a uint32_t count, then the bucket's key_tree_entry_t
+
+// a device can't hold this many keys
+#define VERIFY_BUCKET_MAX   (1024 * 1024)
+
+typedef struct
+{
+    uint32_t op;
+    uint32_t level;
+    uint32_t index;
+} verify_request_t;
+
+typedef struct
+{
+    key_tree_t tree;
+    device_pair_t *pair;
+    verify_result_t *result;
+} verify_t;
+
+// Internal Functions --------------------------------------------------
+// runs in the child process on the backup device
+static int verify_backup(uint32_t handle, int from_parent, int to_parent, void *context)
+{
+    (void)context;
+
+    key_tree_t tree;
+    key_tree_init(&tree);
+
+    int rval = cryptech_key_tree(handle, &tree);
+    if (rval == HAL_OK)
+    {
+        uint32_t count = tree.count;
+        if ((rval = device_pair_write(to_parent, &count, sizeof(count))) == HAL_OK)
+        {
+            rval = device_pair_write(to_parent, key_tree_node(&tree, 0, 0), KEY_TREE_HASH_LEN);
+        }
+    }
+
+    while (rval == HAL_OK)
+    {
+        verify_request_t request;
+
+        // the parent is done
+        if (device_pair_read(from_parent, &request, sizeof(request)) != HAL_OK) break;
+
+        if (request.op == VERIFY_OP_CHILDREN)
+        {
+            const uint8_t *left = key_tree_node(&tree, request.level + 1, 2 * request.index);
+            const uint8_t *right = key_tree_node(&tree, request.level + 1, 2 * request.index + 1);
+
+            if (left == NULL || right == NULL) rval = HAL_ERROR_BAD_ARGUMENTS;
+            else if ((rval = device_pair_write(to_parent, left, KEY_TREE_HASH_LEN)) == HAL_OK)
+            {
+                rval = device_pair_write(to_parent, right, KEY_TREE_HASH_LEN);
+            }
+        }
+        else if (request.op == VERIFY_OP_BUCKET)
+        {
+            unsigned int count;
+            const key_tree_entry_t *entries = key_tree_bucket(&tree, request.index, &count);
+
+            uint32_t count32 = count;
+            if (entries == NULL) rval = HAL_ERROR_BAD_ARGUMENTS;
+            else if ((rval = device_pair_write(to_parent, &count32, sizeof(count32))) == HAL_OK)
+            {
+                rval = device_pair_write(to_parent, entries, count * sizeof(key_tree_entry_t));
+            }
+        }
+        else
+        {
+            rval = HAL_ERROR_BAD_ARGUMENTS;
+        }
+    }
+
+    key_tree_free(&tree);
+
+    return rval;
+}
+
+static int verify_request(verify_t *verify, uint32_t op, unsigned int level, unsigned int index)
+{
+    verify_request_t request = { op, level, index };
+
+    return device_pair_write(verify->pair->to_child, &request, sizeof(request));
+}
+
+static void print_key(const char *what, const key_tree_entry_t *entry)
+{
+    char uuid_buffer[40];
+
+    cryptech_report("%s: %s\r\n", what, uuid_to_string(entry->uuid, uuid_buffer));
+}
+
+// compare the keys in a bucket whose hashes differ
+static int verify_bucket(verify_t *verify, unsigned int index)
+{
+    int rval = verify_request(verify, VERIFY_OP_BUCKET, KEY_TREE_DEPTH, index);
+    if (rval != HAL_OK) return rval;
+
+    uint32_t backup_count;
+    rval = device_pair_read(verify->pair->from_child, &backup_count, sizeof(backup_count));
+    if (rval != HAL_OK) return rval;
+    if (backup_count > VERIFY_BUCKET_MAX) return HAL_ERROR_BAD_ARGUMENTS;
+
+    key_tree_entry_t *backup = malloc((backup_count > 0 ? backup_count : 1) * sizeof(key_tree_entry_t));
+    if (backup == NULL) return HAL_ERROR_ALLOCATION_FAILURE;
+
+    rval = device_pair_read(verify->pair->from_child, backup, backup_count * sizeof(key_tree_entry_t));
+    if (rval != HAL_OK)
+    {
+        free(backup);
+        return rval;
+    }
+
+    unsigned int primary_count;
+    const key_tree_entry_t *primary = key_tree_bucket(&verify->tree, index, &primary_count);
+
+    // both are sorted by identity
+    verify_result_t *result = verify->result;
+    unsigned int p = 0, b = 0;
+
+    while (p < primary_count || b < backup_count)
+    {
+        int order;
+        if (p == primary_count) order = 1;
+        else if (b == backup_count) order = -1;
+        else order = memcmp(primary[p].identity, backup[b].identity, KEY_FINGERPRINT_LEN);
+
+        if (order < 0)
+        {
+            print_key("Missing on the backup", &primary[p++]);
+            ++result->missing;
+        }
+        else if (order > 0)
+        {
+            print_key("Only on the backup", &backup[b++]);
+            ++result->extra;
+        }
+        else
+        {
+            if (memcmp(primary[p].fingerprint, backup[b].fingerprint, KEY_FINGERPRINT_LEN) != 0)
+            {
+                char uuid_buffer[40];
+                cryptech_report("Flags or attributes differ: %s", uuid_to_string(primary[p].uuid, uuid_buffer));
+                cryptech_report(" on the backup: %s\r\n", uuid_to_string(backup[b].uuid, uuid_buffer));
+                ++result->changed;
+            }
+            ++p;
+            ++b;
+        }
+    }
+
+    free(backup);
+
+    return HAL_OK;
+}
+
+// compare the children of a node whose hashes differ
+static int verify_subtree(verify_t *verify, unsigned int level, unsigned int index)
+{
+    if (level == KEY_TREE_DEPTH) return verify_bucket(verify, index);
+
+    uint8_t backup[2][KEY_TREE_HASH_LEN];
+
+    int rval = verify_request(verify, VERIFY_OP_CHILDREN, level, index);
+    if (rval == HAL_OK) rval = device_pair_read(verify->pair->from_child, backup, sizeof(backup));
+
+    for (unsigned int i = 0; i < 2 && rval == HAL_OK; ++i)
+    {
+        const uint8_t *primary = key_tree_node(&verify->tree, level + 1, 2 * index + i);
+        ++verify->result->comparisons;
+
+        if (memcmp(primary, backup[i], KEY_TREE_HASH_LEN) != 0)
+        {
+            rval = verify_subtree(verify, level + 1, 2 * index + i);
+        }
+    }
+
+    return rval;
+}
+
+// Function Implementations --------------------------------------------
+int cryptech_verify(const verify_options_t *options, verify_result_t *result)
+{
+    if (options == NULL || options->primary_pin == NULL || options->backup_pin == NULL || result == NULL)
+    {
+        return HAL_ERROR_BAD_ARGUMENTS;
+    }
+
+    memset(result, 0, sizeof(verify_result_t));
+
+    device_pair_t pair;
+    int rval = device_pair_start(&pair, options->backup_device, options->backup_pin, verify_backup, NULL);
+    if (rval != HAL_OK) return rval;
+
+    verify_t verify;
+    key_tree_init(&verify.tree);
+    verify.pair = &pair;
+    verify.result = result;
+
+    // both devices are read at the same time
+    uint32_t handle = get_random_handle();
+    rval = device_pair_connect(options->primary_device, options->primary_pin, handle);
+    if (rval != HAL_OK)
+    {
+        cryptech_report("Unable to log into the primary CrypTech device.\r\n");
+    }
+    else
+    {
+        rval = cryptech_key_tree(handle, &verify.tree);
+        close_cryptech_device(handle);
+    }
+
+    uint32_t backup_count;
+    uint8_t backup_root[KEY_TREE_HASH_LEN];
+
+    if (rval == HAL_OK &&
+        (rval = device_pair_read(pair.from_child, &backup_count, sizeof(backup_count))) == HAL_OK &&
+        (rval = device_pair_read(pair.from_child, backup_root, sizeof(backup_root))) == HAL_OK)
+    {
+        result->primary_keys = verify.tree.count;
+        result->backup_keys = backup_count;
+        result->comparisons = 1;
+
+        if (memcmp(key_tree_node(&verify.tree, 0, 0), backup_root, KEY_TREE_HASH_LEN) != 0)
+        {
+            rval = verify_subtree(&verify, 0, 0);
+        }
+    }
+
+    key_tree_free(&verify.tree);
+
+    return device_pair_finish(&pair, rval);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2019  Diamond Key Security, NFP
+// Copyright (c) 2019  Diamond Key Security, NFP
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// - Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// - Neither the name of the Diamond Key Security nor the names of its contributors may
+//   be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+
+#include "key_tree.h"
+
+// Checks that a backup device holds the same keys as its primary. Both
+// devices fingerprint their keys from the public key, the flags and the
+// attributes that applications change, so no private key material is read.
+// The trees are compared from the root down, and only subtrees whose hashes
+// differ are visited.
+typedef struct
+{
+    // the serial devices, like CRYPTECH_RPC_CLIENT_SERIAL_DEVICE. NULL uses
+    // the one in the environment
+    const char *primary_device;
+    const char *backup_device;
+
+    // 'wheel' PINs
+    char *primary_pin;
+    char *backup_pin;
+} verify_options_t;
+
+typedef struct
+{
+    unsigned int primary_keys;
+    unsigned int backup_keys;
+
+    unsigned int missing;   // on the primary only
+    unsigned int extra;     // on the backup only
+    unsigned int changed;   // the same public key with different flags or attributes
+
+    unsigned int comparisons;   // tree hashes compared
+} verify_result_t;
+
+// the backup device is read in a child process. Call this before the
+// device has been opened in this process
+int cryptech_verify(const verify_options_t *options, verify_result_t *result);
+
+#endif